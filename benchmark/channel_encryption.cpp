@@ -0,0 +1,195 @@
+#include "channel_encryption.hpp"
+#include "utils.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <sodium.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using shared_key_t = ChannelEncryption<std::string>::shared_key_t;
+
+// What `encrypt` and `write_response` did before encrypting into buffers
+std::string old_encrypt_base64(const std::string& plaintext,
+                               const shared_key_t& sharedKey) {
+    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
+    const int ivLength = EVP_CIPHER_iv_length(cipher);
+    unsigned char iv[16];
+    RAND_bytes(iv, ivLength);
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, cipher, NULL, sharedKey.data(), iv);
+
+    int len;
+    size_t ciphertext_len = 0;
+    const int blockSize = EVP_CIPHER_CTX_block_size(ctx);
+    std::string output;
+    output.resize(plaintext.size() + blockSize);
+    auto o = reinterpret_cast<unsigned char*>(&output[0]);
+    EVP_EncryptUpdate(ctx, o, &len,
+                      reinterpret_cast<const unsigned char*>(plaintext.data()),
+                      plaintext.size());
+    ciphertext_len += len;
+    EVP_EncryptFinal_ex(ctx, o + len, &len);
+    ciphertext_len += len;
+    output.resize(ciphertext_len);
+    output.insert(output.begin(), iv, iv + ivLength);
+    EVP_CIPHER_CTX_free(ctx);
+
+    return util::base64_encode(output);
+}
+
+// Nanoseconds per call of `f`
+template <typename F>
+double ns_per_call(F&& f) {
+    constexpr auto RUN_TIME = std::chrono::milliseconds(300);
+    size_t calls = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    while (elapsed < RUN_TIME) {
+        for (int i = 0; i < 100; ++i) {
+            f();
+        }
+        calls += 100;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+}
+
+// Decrypt a request and encrypt its response as `process_client_req` and
+// `write_response` do, for `client_count` clients each reusing their
+// ephemeral key, and print how many such requests are handled per second
+void requests_per_second(const std::string& what, size_t cache_capacity,
+                         size_t client_count) {
+    std::vector<uint8_t> private_key(crypto_scalarmult_SCALARBYTES);
+    randombytes_buf(private_key.data(), private_key.size());
+    ChannelEncryption<std::string> channel(private_key, cache_capacity);
+
+    std::vector<uint8_t> server_pubkey(crypto_scalarmult_BYTES);
+    crypto_scalarmult_base(server_pubkey.data(), private_key.data());
+
+    // Bodies are encrypted by clients with the key they share with us
+    struct client_t {
+        std::string pubkey;
+        std::string body;
+    };
+    const std::string request(200, 'r');
+    std::vector<client_t> clients;
+    for (size_t i = 0; i < client_count; ++i) {
+        std::vector<uint8_t> client_key(crypto_scalarmult_SCALARBYTES);
+        std::vector<uint8_t> client_pubkey(crypto_scalarmult_BYTES);
+        crypto_box_keypair(client_pubkey.data(), client_key.data());
+        ChannelEncryption<std::string> client(client_key, 0);
+        clients.push_back(
+            {util::as_hex(client_pubkey),
+             client.encrypt(request, util::as_hex(server_pubkey))});
+    }
+
+    std::mt19937_64 rng(42);
+    constexpr auto RUN_TIME = std::chrono::milliseconds(500);
+    size_t requests = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    while (elapsed < RUN_TIME) {
+        for (int i = 0; i < 100; ++i) {
+            const auto& client = clients[rng() % clients.size()];
+            const auto key = channel.get_shared_key(client.pubkey);
+            const auto plaintext = channel.decrypt(client.body, key);
+            BOOST_REQUIRE_EQUAL(plaintext.size(), request.size());
+            channel.encrypt(plaintext, key);
+        }
+        requests += 100;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+
+    const auto stats = channel.get_cache_stats();
+    std::cout << what << ", requests per second: "
+              << static_cast<size_t>(requests /
+                                     std::chrono::duration<double>(elapsed)
+                                         .count())
+              << ", hit rate: "
+              << static_cast<double>(stats.hits) / (stats.hits + stats.misses)
+              << std::endl;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(channel_encryption_bench)
+
+/// 200 byte client requests from clients reusing their ephemeral keys
+BOOST_AUTO_TEST_CASE(client_requests_by_cache) {
+    for (size_t clients : {100, 10000}) {
+        const auto count = std::to_string(clients) + " clients";
+        requests_per_second(count + ", without cache", 0, clients);
+        requests_per_second(count + ", with cache",
+                            SharedSecretCache::DEFAULT_CAPACITY, clients);
+    }
+}
+
+/// Encrypted and encoded client responses, the response body reused as
+/// `write_response` does
+BOOST_AUTO_TEST_CASE(response_encryption_by_method) {
+    shared_key_t key;
+    randombytes_buf(key.data(), key.size());
+
+    for (size_t len : {200, 4 * 1024, 256 * 1024}) {
+        const std::string body(len, 'b');
+        std::string response;
+        const double old_ns = ns_per_call(
+            [&] { response = old_encrypt_base64(body, key); });
+        const double fused_ns = ns_per_call([&] {
+            ChannelEncryption<std::string>::encrypt_base64(body, key,
+                                                           response);
+        });
+        std::cout << len << " bytes, ns per response, old: " << old_ns
+                  << ", fused: " << fused_ns << std::endl;
+    }
+}
+
+/// A client request decrypted and its response encrypted in each mode, as
+/// `process_client_req` and `write_response` do
+BOOST_AUTO_TEST_CASE(client_requests_by_channel_mode) {
+    using channel_t = ChannelEncryption<std::string>;
+    shared_key_t key;
+    randombytes_buf(key.data(), key.size());
+
+    for (size_t len : {200, 4 * 1024, 256 * 1024}) {
+        const std::string body(len, 'b');
+        std::string plaintext, response;
+
+        std::string aes_request;
+        channel_t::encrypt_base64(body, key, aes_request);
+        const double aes_ns = ns_per_call([&] {
+            const std::string decoded = util::base64_decode(aes_request);
+            plaintext.resize(channel_t::decrypted_size_bound(decoded.size()));
+            plaintext.resize(channel_t::decrypt(
+                reinterpret_cast<const uint8_t*>(decoded.data()),
+                decoded.size(), key,
+                reinterpret_cast<uint8_t*>(&plaintext[0])));
+            channel_t::encrypt_base64(plaintext, key, response);
+        });
+        const size_t aes_size = response.size();
+
+        std::string xchacha_request;
+        channel_t::encrypt_xchacha20(body, key, xchacha_request);
+        const double xchacha_ns = ns_per_call([&] {
+            channel_t::decrypt_xchacha20(xchacha_request, key, plaintext);
+            channel_t::encrypt_xchacha20(plaintext, key, response);
+        });
+
+        std::cout << len << " bytes, ns per request, aes-cbc: " << aes_ns
+                  << ", xchacha20-poly1305: " << xchacha_ns
+                  << ", response bytes, aes-cbc: " << aes_size
+                  << ", xchacha20-poly1305: " << response.size() << std::endl;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,195 @@
+#include "encoding.hpp"
+#include "utils.hpp"
+
+#include <boost/beast/core/detail/base64.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+using util::SimdLevel;
+
+namespace {
+
+// The implementations the codecs replaced
+
+std::string old_as_hex(const std::string& bytes) {
+    constexpr std::array<char, 16> lut{{'0', '1', '2', '3', '4', '5', '6',
+                                        '7', '8', '9', 'a', 'b', 'c', 'd',
+                                        'e', 'f'}};
+    std::string hex;
+    hex.reserve(bytes.size() * 2);
+    for (const char c : bytes) {
+        hex += lut[(c & 0xf0) >> 4];
+        hex += lut[c & 0x0f];
+    }
+    return hex;
+}
+
+uint8_t old_hex_to_nibble(char ch) {
+    return (ch >= '0' && ch <= '9')   ? ch - '0'
+           : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10
+           : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+                                      : 0;
+}
+
+std::string old_hex_to_bytes(const std::string& hex) {
+    std::string result;
+    result.reserve(hex.size() / 2);
+    for (size_t i = 0, end = hex.size() & ~1; i < end; i += 2)
+        result.push_back(old_hex_to_nibble(hex[i]) << 4 |
+                         old_hex_to_nibble(hex[i + 1]));
+    return result;
+}
+
+std::string beast_base64_encode(const std::string& bytes) {
+    namespace base64 = boost::beast::detail::base64;
+    std::string dest(base64::encoded_size(bytes.size()), '\0');
+    dest.resize(base64::encode(&dest[0], bytes.data(), bytes.size()));
+    return dest;
+}
+
+std::string beast_base64_decode(const std::string& str) {
+    namespace base64 = boost::beast::detail::base64;
+    std::string dest(base64::decoded_size(str.size()), '\0');
+    dest.resize(base64::decode(&dest[0], str.data(), str.size()).first);
+    return dest;
+}
+
+bool old_base32z_decode(const std::string& str, std::array<uint8_t, 32>& value) {
+    static const std::unordered_map<char, uint8_t> reverse = {
+        {'y', 0},  {'b', 1},  {'n', 2},  {'d', 3},  {'r', 4},  {'f', 5},
+        {'g', 6},  {'8', 7},  {'e', 8},  {'j', 9},  {'k', 10}, {'m', 11},
+        {'c', 12}, {'p', 13}, {'q', 14}, {'x', 15}, {'o', 16}, {'t', 17},
+        {'1', 18}, {'u', 19}, {'w', 20}, {'i', 21}, {'s', 22}, {'z', 23},
+        {'a', 24}, {'3', 25}, {'4', 26}, {'5', 27}, {'h', 28}, {'7', 29},
+        {'6', 30}, {'9', 31}};
+    int tmp = 0, bits = 0;
+    size_t ret = 0;
+    for (size_t i = 0; i < 56; i++) {
+        char ch = str[i];
+        if (!ch) {
+            return ret == value.size();
+        }
+        const auto it = reverse.find(ch);
+        if (it == reverse.end())
+            return false;
+        tmp |= it->second;
+        bits += 5;
+        if (bits >= 8) {
+            if (ret >= value.size())
+                return false;
+            value[ret] = tmp >> (bits - 8);
+            bits -= 8;
+            ret++;
+        }
+        tmp <<= 5;
+    }
+    return true;
+}
+
+// Nanoseconds per call of `f`, which returns something to keep it from
+// being optimised out
+template <typename F>
+double ns_per_call(F&& f) {
+    constexpr auto RUN_TIME = std::chrono::milliseconds(300);
+    size_t calls = 0, sink = 0;
+    const auto start = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::steady_clock::duration::zero();
+    while (elapsed < RUN_TIME) {
+        for (int i = 0; i < 100; ++i) {
+            sink += f();
+        }
+        calls += 100;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    volatile size_t keep = sink;
+    (void)keep;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / calls;
+}
+
+// Time `codec` at every level the CPU supports against `old`
+template <typename Old, typename New>
+void compare(const std::string& what, Old&& old, New&& codec) {
+    std::cout << what << ", ns per call, old: " << ns_per_call(old);
+    for (auto level : {SimdLevel::Scalar, SimdLevel::SSSE3, SimdLevel::AVX2}) {
+        if (util::set_simd_level(level) != level) {
+            continue;
+        }
+        static const char* names[] = {"scalar", "ssse3", "avx2"};
+        std::cout << ", " << names[static_cast<int>(level)] << ": "
+                  << ns_per_call(codec);
+    }
+    util::set_simd_level(SimdLevel::AVX2);
+    std::cout << std::endl;
+}
+
+std::string random_bytes(size_t len) {
+    std::mt19937_64 rng(42);
+    std::string bytes(len, '\0');
+    for (auto& c : bytes) {
+        c = static_cast<char>(rng());
+    }
+    return bytes;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(encoding_bench)
+
+/// Message hashes and bodies as hex
+BOOST_AUTO_TEST_CASE(hex_by_implementation) {
+    for (size_t len : {64, 64 * 1024}) {
+        const std::string bytes = random_bytes(len);
+        const std::string hex = util::as_hex(bytes);
+        const auto size = std::to_string(len);
+
+        compare(
+            "encode " + size + " bytes",
+            [&] { return old_as_hex(bytes).size(); },
+            [&] { return util::as_hex(bytes).size(); });
+        compare(
+            "decode " + size + " bytes",
+            [&] { return old_hex_to_bytes(hex).size(); },
+            [&] { return util::hex_to_bytes(hex).size(); });
+    }
+}
+
+/// Signatures and encrypted client bodies
+BOOST_AUTO_TEST_CASE(base64_by_implementation) {
+    for (size_t len : {64, 64 * 1024}) {
+        const std::string bytes = random_bytes(len);
+        const std::string base64 = util::base64_encode(bytes);
+        const auto size = std::to_string(len);
+
+        compare(
+            "encode " + size + " bytes",
+            [&] { return beast_base64_encode(bytes).size(); },
+            [&] { return util::base64_encode(bytes).size(); });
+        compare(
+            "decode " + size + " bytes",
+            [&] { return beast_base64_decode(base64).size(); },
+            [&] { return util::base64_decode(base64).size(); });
+    }
+}
+
+/// Snode pubkeys of signed requests
+BOOST_AUTO_TEST_CASE(base32z_decode_by_implementation) {
+    std::array<uint8_t, 32> key;
+    const std::string bytes = random_bytes(key.size());
+    std::copy(bytes.begin(), bytes.end(), key.begin());
+    char buf[64] = {0};
+    const std::string base32z = util::base32z_encode(key, buf);
+
+    compare(
+        "decode pubkey",
+        [&] { return old_base32z_decode(base32z, key) + key[0]; },
+        [&] { return util::base32z_decode(base32z, key) + key[0]; });
+}
+
+BOOST_AUTO_TEST_SUITE_END()
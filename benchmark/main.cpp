@@ -0,0 +1,23 @@
+#define BOOST_TEST_ALTERNATIVE_INIT_API
+#include <boost/test/included/unit_test.hpp>
+
+#include <chrono>
+
+#include <sodium.h>
+
+#include "spdlog/sinks/stdout_color_sinks.h"
+#include "spdlog/spdlog.h"
+
+bool init_unit_test() {
+    // Selects the fastest implementations the CPU supports, as the server does
+    if (sodium_init() != 0) {
+        return false;
+    }
+
+    auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
+    auto logger =
+        std::make_shared<spdlog::logger>("arqma_logger", console_sink);
+    spdlog::register_logger(logger);
+    spdlog::flush_every(std::chrono::seconds(1));
+    return true;
+}
@@ -0,0 +1,1310 @@
+#include "AsyncDatabase.hpp"
+#include "Database.hpp"
+#include "GroupCommitter.hpp"
+#include "RetrieveCache.hpp"
+#include "arqma_common.h"
+#include "serialization.h"
+#include "utils.hpp"
+
+#include "sqlite3.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+using arqma::storage::Item;
+
+using namespace arqma;
+
+namespace {
+
+struct StorageRAIIFixture {
+    StorageRAIIFixture() { remove_files(); }
+    ~StorageRAIIFixture() { remove_files(); }
+
+    static void remove_files() {
+        boost::filesystem::remove("storage.db");
+        boost::filesystem::remove("storage.db-wal");
+        boost::filesystem::remove("storage.db-shm");
+        for (int i = 1; i < 8; ++i) {
+            const auto path = "storage-" + std::to_string(i) + ".db";
+            for (const char* suffix : {"", "-wal", "-shm"}) {
+                boost::filesystem::remove(path + suffix);
+            }
+        }
+    }
+};
+
+std::string make_pubkey(size_t i) {
+    std::string pk = std::to_string(i);
+    pk.insert(0, 64 - pk.size(), '0');
+    return pk;
+}
+
+std::vector<Item> make_items(size_t num_owners, size_t per_owner,
+                             size_t first_hash = 0) {
+    const uint64_t ttl = 3600 * 1000;
+    const uint64_t timestamp = util::get_time_ms();
+    const std::string data(200, 'x');
+
+    std::vector<Item> items;
+    items.reserve(num_owners * per_owner);
+    for (size_t i = 0; i < per_owner; ++i) {
+        for (size_t owner = 0; owner < num_owners; ++owner) {
+            const auto hash = "hash" + std::to_string(first_hash++);
+            items.push_back({hash, make_pubkey(owner), timestamp, ttl,
+                             timestamp + ttl, "nonce", data});
+        }
+    }
+    return items;
+}
+
+constexpr auto RUN_TIME = std::chrono::seconds(2);
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(storage_bench)
+
+/// Client retrieves on N threads while another thread keeps storing
+BOOST_AUTO_TEST_CASE(retrieve_throughput_by_reader_count) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_owners = 1000;
+    constexpr size_t per_owner = 50;
+
+    {
+        Database storage(".");
+        storage.bulk_store(make_items(num_owners, per_owner));
+    }
+
+    size_t next_hash = num_owners * per_owner;
+
+    for (size_t num_readers : {1, 2, 4, 8}) {
+        boost::asio::io_context ioc;
+        Database storage(".", num_readers);
+
+        std::atomic<bool> done{false};
+        std::atomic<uint64_t> retrieves{0};
+        std::atomic<uint64_t> stores{0};
+
+        std::thread writer([&]() {
+            const uint64_t ttl = 3600 * 1000;
+            const std::string data(200, 'x');
+            while (!done) {
+                const auto hash = "hash" + std::to_string(next_hash++);
+                storage.store(hash, make_pubkey(next_hash % num_owners), data,
+                              ttl, util::get_time_ms(), "nonce");
+                stores++;
+            }
+        });
+
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_readers; ++t) {
+            threads.emplace_back([&, t]() {
+                std::mt19937_64 rng(t);
+                std::vector<Item> items;
+                while (!done) {
+                    items.clear();
+                    const auto owner =
+                        util::uniform_distribution_portable(rng, num_owners);
+                    storage.retrieve(make_pubkey(owner), items, "", 10);
+                    retrieves++;
+                }
+            });
+        }
+
+        std::this_thread::sleep_for(RUN_TIME);
+        done = true;
+        writer.join();
+        for (auto& t : threads) {
+            t.join();
+        }
+
+        const double secs =
+            std::chrono::duration<double>(RUN_TIME).count();
+        std::cout << "readers: " << num_readers
+                  << ", retrieves/s: " << retrieves / secs
+                  << ", concurrent stores/s: " << stores / secs << std::endl;
+    }
+}
+
+/// Per-message transactions vs group commit for a stream of single stores
+BOOST_AUTO_TEST_CASE(store_throughput_with_group_commit) {
+    constexpr size_t num_items = 20000;
+    const auto items = make_items(100, num_items / 100);
+
+    {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& item : items) {
+            storage.store(item.hash, item.pub_key, item.data, item.ttl,
+                          item.timestamp, item.nonce);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "individual stores/s: " << num_items / elapsed.count()
+                  << std::endl;
+    }
+
+    for (size_t batch_size : {16, 64, 256}) {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+        GroupCommitter committer(ioc, storage, batch_size);
+
+        size_t committed = 0;
+        const auto start = std::chrono::steady_clock::now();
+        for (auto item : items) {
+            committer.store(std::move(item), [&](CommitResult res) {
+                committed += (res == CommitResult::STORED);
+            });
+        }
+        committer.flush();
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        BOOST_CHECK_EQUAL(committed, num_items);
+        std::cout << "batch size: " << batch_size
+                  << ", group committed stores/s: "
+                  << num_items / elapsed.count() << std::endl;
+    }
+}
+
+/// Batched stores (as from the group committer or a push batch) and
+/// individual stores from several threads, spread over N shards
+BOOST_AUTO_TEST_CASE(store_throughput_by_shard_count) {
+    constexpr size_t num_items = 100000;
+    constexpr size_t batch_size = 256;
+    constexpr size_t num_threads = 4;
+    const auto items = make_items(1000, num_items / 1000);
+
+    for (size_t num_shards : {1, 2, 4, 8}) {
+        double batched, individual;
+        {
+            StorageRAIIFixture fixture;
+            Database storage(".", Database::DEFAULT_READER_COUNT,
+                             num_shards);
+
+            std::vector<bool> inserted;
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < num_items; i += batch_size) {
+                const std::vector<Item> batch(
+                    items.begin() + i,
+                    items.begin() + std::min(num_items, i + batch_size));
+                storage.store_batch(batch, inserted);
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            batched = num_items / elapsed.count();
+        }
+        {
+            StorageRAIIFixture fixture;
+            boost::asio::io_context ioc;
+            Database storage(".", Database::DEFAULT_READER_COUNT,
+                             num_shards);
+
+            const size_t per_thread = num_items / 10 / num_threads;
+            std::vector<std::thread> threads;
+            const auto start = std::chrono::steady_clock::now();
+            for (size_t t = 0; t < num_threads; ++t) {
+                threads.emplace_back([&, t]() {
+                    for (size_t i = t * per_thread; i < (t + 1) * per_thread;
+                         ++i) {
+                        const auto& item = items[i];
+                        storage.store(item.hash, item.pub_key, item.data,
+                                      item.ttl, item.timestamp, item.nonce);
+                    }
+                });
+            }
+            for (auto& t : threads) {
+                t.join();
+            }
+            const std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            individual = per_thread * num_threads / elapsed.count();
+        }
+
+        std::cout << "shards: " << num_shards
+                  << ", batched stores/s: " << batched << ", stores/s from "
+                  << num_threads << " threads: " << individual << std::endl;
+    }
+}
+
+/// The same workload under every storage profile: push batches, single
+/// stores, then client retrieves on 4 threads while another thread stores
+BOOST_AUTO_TEST_CASE(store_and_retrieve_throughput_by_profile) {
+    constexpr size_t num_owners = 1000;
+    constexpr size_t num_items = 100000;
+    constexpr size_t batch_size = 1000;
+    constexpr size_t num_single = 5000;
+    constexpr size_t num_readers = 4;
+    const auto items = make_items(num_owners, num_items / num_owners);
+    const auto singles =
+        make_items(num_owners, num_single / num_owners, num_items);
+
+    for (const auto& profile :
+         {StorageProfile::durable(), StorageProfile::balanced(),
+          StorageProfile::throughput()}) {
+        StorageRAIIFixture fixture;
+        Database storage(".", Database::DEFAULT_READER_COUNT, 1,
+                         profile);
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_items; i += batch_size) {
+            storage.bulk_store(std::vector<Item>(
+                items.begin() + i, items.begin() + i + batch_size));
+        }
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        const double batched = num_items / elapsed.count();
+
+        start = std::chrono::steady_clock::now();
+        for (const auto& item : singles) {
+            storage.store(item.hash, item.pub_key, item.data, item.ttl,
+                          item.timestamp, item.nonce);
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        const double single = num_single / elapsed.count();
+
+        std::atomic<bool> done{false};
+        std::atomic<uint64_t> retrieves{0};
+        std::atomic<uint64_t> stores{0};
+        std::thread writer([&]() {
+            for (size_t round = 0; !done; ++round) {
+                const size_t next = round * 100 % num_items;
+                std::vector<Item> batch(items.begin() + next,
+                                        items.begin() + next + 100);
+                for (auto& item : batch) {
+                    item.hash += "-" + std::to_string(round);
+                }
+                storage.bulk_store(batch);
+                stores += batch.size();
+            }
+        });
+        std::vector<std::thread> readers;
+        for (size_t t = 0; t < num_readers; ++t) {
+            readers.emplace_back([&, t]() {
+                std::mt19937_64 rng(t);
+                RetrieveBuffer buffer;
+                while (!done) {
+                    buffer.clear();
+                    const auto owner =
+                        util::uniform_distribution_portable(rng, num_owners);
+                    storage.retrieve(make_pubkey(owner), buffer, "", 100);
+                    retrieves++;
+                }
+            });
+        }
+        std::this_thread::sleep_for(RUN_TIME);
+        done = true;
+        writer.join();
+        for (auto& t : readers) {
+            t.join();
+        }
+        const double secs = std::chrono::duration<double>(RUN_TIME).count();
+
+        std::cout << profile.name << ": batched stores/s: " << batched
+                  << ", single stores/s: " << single
+                  << ", retrieves/s: " << retrieves / secs
+                  << " with concurrent stores/s: " << stores / secs
+                  << ", WAL size: "
+                  << boost::filesystem::file_size("storage.db-wal") / 1024
+                  << " KiB" << std::endl;
+    }
+}
+
+/// Push batches as received from swarm members: random hex hashes, owners
+/// interleaved, optionally repeating part of what is already stored
+BOOST_AUTO_TEST_CASE(bulk_store_throughput_by_batch_size) {
+    constexpr size_t num_items = 50000;
+    constexpr size_t num_owners = 1000;
+
+    std::mt19937_64 rng(42);
+    const auto random_hex = [&rng](size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(len, '0');
+        for (auto& c : hex) {
+            c = digits[rng() % 16];
+        }
+        return hex;
+    };
+
+    std::vector<std::string> owners;
+    for (size_t i = 0; i < num_owners; ++i) {
+        owners.push_back("05" + random_hex(64));
+    }
+    const uint64_t ttl = 3600 * 1000;
+    const uint64_t timestamp = util::get_time_ms();
+    const std::string data(200, 'x');
+    std::vector<Item> items;
+    for (size_t i = 0; i < num_items; ++i) {
+        items.push_back({random_hex(128), owners[i % num_owners], timestamp,
+                         ttl, timestamp + ttl, "nonce", data});
+    }
+
+    for (size_t batch_size : {100, 1000, 10000}) {
+        StorageRAIIFixture fixture;
+        Database storage(".");
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_items; i += batch_size) {
+            storage.bulk_store(std::vector<Item>(
+                items.begin() + i,
+                items.begin() + std::min(num_items, i + batch_size)));
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "batch size: " << batch_size
+                  << ", bulk stores/s: " << num_items / elapsed.count()
+                  << std::endl;
+    }
+
+    // Half of every batch is already stored, and we want to know which
+    // messages were new
+    {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+        storage.bulk_store(std::vector<Item>(items.begin(),
+                                             items.begin() + num_items / 2));
+
+        constexpr size_t batch_size = 1000;
+        size_t new_items = 0;
+        std::vector<bool> inserted;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_items / 2; i += batch_size / 2) {
+            std::vector<Item> batch;
+            for (size_t j = i; j < i + batch_size / 2; ++j) {
+                batch.push_back(items[j]);
+                batch.push_back(items[num_items / 2 + j]);
+            }
+            storage.store_batch(batch, inserted);
+            new_items += std::count(inserted.begin(), inserted.end(), true);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        BOOST_CHECK_EQUAL(new_items, num_items / 2);
+        std::cout << "batch size: " << batch_size
+                  << ", half duplicates, stores/s: "
+                  << num_items / elapsed.count() << std::endl;
+    }
+
+    {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+
+        constexpr size_t num_singles = 5000;
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_singles; ++i) {
+            const auto& item = items[i];
+            storage.store(item.hash, item.pub_key, item.data, item.ttl,
+                          item.timestamp, item.nonce);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "individual stores/s: " << num_singles / elapsed.count()
+                  << std::endl;
+    }
+}
+
+/// Push batches during a bootstrap flood, when most of what arrives is
+/// stored already
+BOOST_AUTO_TEST_CASE(store_throughput_by_duplicate_share) {
+    constexpr size_t num_stored = 100000;
+    constexpr size_t batch_size = 1000;
+
+    std::mt19937_64 rng(42);
+    const auto random_hex = [&rng](size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(len, '0');
+        for (auto& c : hex) {
+            c = digits[rng() % 16];
+        }
+        return hex;
+    };
+    std::vector<std::string> owners;
+    for (size_t i = 0; i < 1000; ++i) {
+        owners.push_back("05" + random_hex(64));
+    }
+    const uint64_t ttl = 3600 * 1000;
+    const uint64_t timestamp = util::get_time_ms();
+    const auto make_item = [&](size_t i) {
+        return Item{random_hex(128), owners[i % owners.size()], timestamp,
+                    ttl,             timestamp + ttl,           "",
+                    std::string(200, 'x')};
+    };
+
+    std::vector<Item> stored;
+    for (size_t i = 0; i < num_stored; ++i) {
+        stored.push_back(make_item(i));
+    }
+
+    for (size_t percent : {0, 50, 90, 100}) {
+        StorageRAIIFixture fixture;
+        Database storage(".");
+        storage.bulk_store(stored);
+
+        std::vector<std::vector<Item>> batches;
+        size_t next_stored = 0;
+        for (size_t b = 0; b < num_stored / batch_size / 2; ++b) {
+            std::vector<Item> batch;
+            for (size_t i = 0; i < batch_size; ++i) {
+                batch.push_back(i * 100 < percent * batch_size
+                                    ? stored[next_stored++ % num_stored]
+                                    : make_item(i));
+            }
+            batches.push_back(std::move(batch));
+        }
+
+        std::vector<bool> inserted;
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto& batch : batches) {
+            storage.store_batch(batch, inserted);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << percent << "% duplicates, stores/s: "
+                  << batches.size() * batch_size / elapsed.count()
+                  << std::endl;
+    }
+}
+
+/// A push batch received from a peer, parsed into messages that are copied
+/// twice (as `process_push_batch` used to) vs parsed into views of the body
+/// and stored from there, with large messages to make the copies show
+BOOST_AUTO_TEST_CASE(push_batch_ingest_by_parser) {
+    constexpr size_t num_batches = 20;
+    constexpr size_t per_batch = 200;
+
+    std::vector<std::string> bodies;
+    for (size_t b = 0; b < 2 * num_batches; ++b) {
+        auto items = make_items(per_batch, 1, b * per_batch);
+        for (auto& item : items) {
+            item.data.assign(2000, 'x');
+        }
+        bodies.push_back(serialize_messages(items).front());
+    }
+
+    StorageRAIIFixture fixture;
+    Database storage(".");
+
+    std::chrono::duration<double, std::milli> copy_parse{0}, copy_total{0};
+    std::chrono::duration<double, std::milli> view_parse{0}, view_total{0};
+    for (size_t b = 0; b < num_batches; ++b) {
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<storage::ItemView> views;
+            std::string keys;
+            deserialize_messages(bodies[2 * b + 1], views, keys);
+            view_parse += std::chrono::steady_clock::now() - start;
+            storage.bulk_store(views);
+        }
+        view_total += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        {
+            const auto messages = deserialize_messages(bodies[2 * b]);
+            std::vector<Item> items;
+            items.reserve(messages.size());
+            for (const auto& m : messages) {
+                items.push_back({m.hash, m.pub_key, m.timestamp, m.ttl,
+                                 m.timestamp + m.ttl, m.nonce, m.data});
+            }
+            copy_parse += std::chrono::steady_clock::now() - start;
+            storage.bulk_store(items);
+        }
+        copy_total += std::chrono::steady_clock::now() - start;
+    }
+
+    std::cout << "ms per batch of " << per_batch
+              << " messages, parse / parse and store, copying: "
+              << copy_parse.count() / num_batches << " / "
+              << copy_total.count() / num_batches
+              << ", views: " << view_parse.count() / num_batches << " / "
+              << view_total.count() / num_batches << std::endl;
+}
+
+/// Bytes sent to a peer for a typical relay batch and the time to serialize
+/// and parse it, in each wire format
+BOOST_AUTO_TEST_CASE(relay_batch_size_by_wire_format) {
+    constexpr size_t num_batches = 200;
+    constexpr size_t per_batch = 100;
+
+    std::mt19937_64 rng(42);
+    auto items = make_items(per_batch, 1);
+    for (auto& item : items) {
+        std::string hash(128, '0');
+        for (auto& c : hash) {
+            c = "0123456789abcdef"[rng() % 16];
+        }
+        item.hash = std::move(hash);
+        item.nonce.clear();
+    }
+
+    for (auto format : {WireFormat::V1, WireFormat::V2}) {
+        size_t bytes = 0;
+        std::chrono::duration<double, std::micro> serialize{0}, parse{0};
+        for (size_t b = 0; b < num_batches; ++b) {
+            auto start = std::chrono::steady_clock::now();
+            const auto batches = serialize_messages(items, format);
+            serialize += std::chrono::steady_clock::now() - start;
+
+            start = std::chrono::steady_clock::now();
+            std::vector<storage::ItemView> views;
+            std::string keys;
+            for (const auto& batch : batches) {
+                bytes += batch.size();
+                deserialize_messages(batch, views, keys);
+            }
+            parse += std::chrono::steady_clock::now() - start;
+        }
+
+        std::cout << "v" << int(format) << ", batch of " << per_batch
+                  << " messages: " << bytes / num_batches
+                  << " bytes, us to serialize / parse: "
+                  << serialize.count() / num_batches << " / "
+                  << parse.count() / num_batches << std::endl;
+    }
+}
+
+/// Relayed messages serialized into batches that are then hashed for their
+/// signatures vs hashed as they are serialized
+BOOST_AUTO_TEST_CASE(relay_batch_preparation_by_method) {
+    constexpr size_t num_rounds = 20;
+    const auto items = make_items(10000, 1);
+
+    std::chrono::duration<double, std::milli> separate{0}, streaming{0};
+    size_t num_batches = 0;
+    for (size_t r = 0; r < num_rounds; ++r) {
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::string> batches = serialize_messages(items);
+            std::vector<hash> hashes;
+            for (const auto& batch : batches) {
+                hashes.push_back(hash_data(batch));
+            }
+            num_batches = batches.size();
+        }
+        separate += std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        {
+            std::vector<std::string> batches;
+            std::vector<hash> hashes;
+            BatchSerializer serializer;
+            for (const auto& item : items) {
+                serializer.add(item);
+                if (serializer.full()) {
+                    batches.emplace_back();
+                    hashes.push_back(serializer.finish(batches.back()));
+                }
+            }
+            if (!serializer.empty()) {
+                batches.emplace_back();
+                hashes.push_back(serializer.finish(batches.back()));
+            }
+        }
+        streaming += std::chrono::steady_clock::now() - start;
+    }
+
+    std::cout << "ms to serialize and hash " << items.size()
+              << " messages into " << num_batches
+              << " batches, separately: " << separate.count() / num_rounds
+              << ", streaming: " << streaming.count() / num_rounds
+              << std::endl;
+}
+
+/// Time for a new swarm member to get all our messages: pushed in batches
+/// as read by a scan vs a snapshot file loaded in one go (storage work and
+/// bytes to send only, the network is left out)
+BOOST_AUTO_TEST_CASE(replica_transfer_by_method) {
+    StorageRAIIFixture fixture;
+    const std::string replica_dir = "replica";
+    const std::string snapshot = "snapshot.db";
+
+    constexpr size_t num_items = 200000;
+    std::mt19937_64 rng(42);
+    const auto random_hex = [&rng](size_t len) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex(len, '0');
+        for (auto& c : hex) {
+            c = digits[rng() % 16];
+        }
+        return hex;
+    };
+    std::vector<std::string> owners;
+    for (size_t i = 0; i < 1000; ++i) {
+        owners.push_back(random_hex(get_user_pubkey_size()));
+    }
+
+    Database source(".");
+    {
+        const uint64_t ttl = 3600 * 1000;
+        const uint64_t timestamp = util::get_time_ms();
+        std::vector<Item> items;
+        for (size_t i = 0; i < num_items; ++i) {
+            items.push_back({random_hex(128), owners[i % owners.size()],
+                             timestamp, ttl, timestamp + ttl, "",
+                             std::string(200, 'x')});
+        }
+        source.bulk_store(items);
+    }
+
+    const auto fresh_replica = [&]() {
+        boost::filesystem::remove_all(replica_dir);
+        boost::filesystem::create_directory(replica_dir);
+        return std::make_unique<Database>(replica_dir);
+    };
+
+    {
+        auto replica = fresh_replica();
+        // Size of the push batches (as serialized by `serialize_message`)
+        uint64_t bytes = 0;
+        const auto start = std::chrono::steady_clock::now();
+        auto cursor = source.scan();
+        std::vector<Item> chunk;
+        while (cursor.next(chunk) && !chunk.empty()) {
+            for (const auto& item : chunk) {
+                bytes += item.pub_key.size() + item.hash.size() +
+                         item.data.size() + item.nonce.size() +
+                         5 * sizeof(uint64_t);
+            }
+            replica->bulk_store(chunk);
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "push batches: " << elapsed.count() << " s, "
+                  << bytes / (1024 * 1024) << " MiB to send" << std::endl;
+    }
+
+    {
+        auto replica = fresh_replica();
+        uint64_t exported, imported;
+        const auto start = std::chrono::steady_clock::now();
+        BOOST_REQUIRE(source.export_snapshot(snapshot, exported));
+        const auto exported_at = std::chrono::steady_clock::now();
+        BOOST_REQUIRE(replica->import_snapshot(snapshot, imported));
+        const auto end = std::chrono::steady_clock::now();
+
+        BOOST_CHECK_EQUAL(imported, num_items);
+        std::cout << "snapshot: "
+                  << std::chrono::duration<double>(end - start).count()
+                  << " s (export "
+                  << std::chrono::duration<double>(exported_at - start).count()
+                  << " s), "
+                  << boost::filesystem::file_size(snapshot) / (1024 * 1024)
+                  << " MiB to send" << std::endl;
+    }
+
+    boost::filesystem::remove(snapshot);
+    boost::filesystem::remove_all(replica_dir);
+}
+
+/// Cost of picking a random message for a storage test as the store grows
+BOOST_AUTO_TEST_CASE(random_selection_by_table_size) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_owners = 1000;
+    constexpr size_t num_samples = 10000;
+
+    Database storage(".");
+    std::mt19937_64 rng(42);
+
+    size_t total = 0;
+    for (size_t per_owner : {10, 90, 900}) {
+        storage.bulk_store(make_items(num_owners, per_owner, total));
+        total += num_owners * per_owner;
+
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_samples; ++i) {
+            Item item;
+            storage.retrieve_random(rng, item);
+        }
+        const std::chrono::duration<double, std::micro> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << "messages: " << total
+                  << ", us per random selection: "
+                  << elapsed.count() / num_samples << std::endl;
+    }
+}
+
+/// Store latency while a large expiry backlog is being worked through
+BOOST_AUTO_TEST_CASE(store_latency_during_expiry) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_expired = 200000;
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+
+    {
+        auto items = make_items(1000, num_expired / 1000);
+        for (auto& item : items) {
+            item.ttl = 0;
+            item.expiration_timestamp = item.timestamp;
+        }
+        storage.bulk_store(items);
+    }
+    AsyncDatabase async_storage(ioc, storage);
+
+    std::atomic<bool> done{false};
+    std::thread cleaner([&]() {
+        while (!done) {
+            ioc.run_for(std::chrono::milliseconds(10));
+        }
+    });
+
+    const auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> worst{0};
+    size_t stores = 0;
+    size_t next_hash = num_expired;
+    const std::string data(200, 'x');
+    while (storage.get_expiry_stats().total_expired < num_expired) {
+        const auto before = std::chrono::steady_clock::now();
+        storage.store("hash" + std::to_string(next_hash++), make_pubkey(0),
+                      data, 3600 * 1000, util::get_time_ms(), "nonce");
+        worst = std::max<std::chrono::duration<double, std::milli>>(
+            worst, std::chrono::steady_clock::now() - before);
+        stores++;
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    done = true;
+    cleaner.join();
+
+    std::cout << "expired " << num_expired << " in " << elapsed.count()
+              << " s, concurrent stores: " << stores
+              << ", worst store latency: " << worst.count() << " ms"
+              << std::endl;
+}
+
+/// How late messages are deleted after they expire, and how long the
+/// cleanup handlers hold up the thread they run on, next to live messages
+BOOST_AUTO_TEST_CASE(expiry_delay_by_table_size) {
+    constexpr size_t num_expiring = 10000;
+    const uint64_t ttl = 1500;
+
+    for (size_t num_live : {0, 100000, 400000}) {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+
+        storage.bulk_store(make_items(1000, num_live / 1000));
+        auto items = make_items(1000, num_expiring / 1000, num_live);
+        const uint64_t now = util::get_time_ms();
+        for (auto& item : items) {
+            item.timestamp = now;
+            item.ttl = ttl;
+            item.expiration_timestamp = now + ttl;
+        }
+        storage.bulk_store(items);
+        AsyncDatabase async_storage(ioc, storage);
+
+        // Every handler that runs on `ioc` is a cleanup timer or its
+        // completion; the cleanup itself runs on a storage thread
+        std::chrono::duration<double, std::milli> busy{0}, worst{0};
+        while (storage.get_expiry_stats().total_expired < num_expiring) {
+            const auto before = std::chrono::steady_clock::now();
+            const bool ran = ioc.run_one_for(std::chrono::milliseconds(10));
+            const auto spent = std::chrono::steady_clock::now() - before;
+            if (ran) {
+                busy += spent;
+                worst = std::max<std::chrono::duration<double, std::milli>>(
+                    worst, spent);
+            }
+        }
+        const double late_ms = util::get_time_ms() - (now + ttl);
+
+        std::cout << "live messages: " << num_live
+                  << ", deleted after expiry: " << late_ms
+                  << " ms, time in cleanup handlers: " << busy.count()
+                  << " ms, longest: " << worst.count() << " ms" << std::endl;
+    }
+}
+
+/// Longest gap between the runs of a 1 ms timer on the network thread while
+/// push batches of about 500 KB are stored, on that thread or through
+/// `AsyncDatabase`
+BOOST_AUTO_TEST_CASE(io_thread_stalls_during_push_batches) {
+    constexpr size_t num_batches = 20;
+    constexpr size_t batch_messages = 2500;
+
+    for (const bool async : {false, true}) {
+        StorageRAIIFixture fixture;
+        boost::asio::io_context ioc;
+        Database storage(".");
+        AsyncDatabase async_storage(ioc, storage);
+
+        std::vector<std::vector<Item>> batches;
+        for (size_t i = 0; i < num_batches; ++i) {
+            batches.push_back(make_items(batch_messages, 1, i * batch_messages));
+        }
+
+        // A batch arrives every tick until all have
+        size_t submitted = 0;
+        size_t stored = 0;
+        const auto submit = [&]() {
+            auto batch = std::move(batches[submitted++]);
+            if (async) {
+                async_storage.bulk_store(
+                    std::move(batch),
+                    [&](bool, std::vector<Item>) { stored++; });
+            } else {
+                storage.bulk_store(batch);
+                stored++;
+            }
+        };
+
+        boost::asio::steady_timer timer(ioc);
+        std::chrono::duration<double, std::milli> worst{0};
+        auto last = std::chrono::steady_clock::now();
+        std::function<void()> tick = [&]() {
+            timer.expires_after(std::chrono::milliseconds(1));
+            timer.async_wait([&](const boost::system::error_code&) {
+                const auto now = std::chrono::steady_clock::now();
+                worst = std::max<std::chrono::duration<double, std::milli>>(
+                    worst, now - last);
+                last = now;
+                if (submitted < num_batches) {
+                    submit();
+                }
+                if (stored < num_batches) {
+                    tick();
+                }
+            });
+        };
+        tick();
+
+        const auto start = std::chrono::steady_clock::now();
+        while (stored < num_batches) {
+            ioc.run_one();
+        }
+        const std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+
+        std::cout << (async ? "async" : "on the io thread")
+                  << ": stored in " << elapsed.count()
+                  << " s, longest stall: " << worst.count() << " ms"
+                  << std::endl;
+    }
+}
+
+/// Latency of client retrieves (all messages and those after `lastHash`)
+/// as the number of stored messages grows
+BOOST_AUTO_TEST_CASE(retrieve_latency_by_table_size) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_owners = 10000;
+    constexpr size_t num_samples = 20000;
+
+    Database storage(".");
+    std::mt19937_64 rng(42);
+
+    size_t total = 0;
+    size_t per_owner_total = 0;
+    for (size_t per_owner : {10, 90}) {
+        storage.bulk_store(make_items(num_owners, per_owner, total));
+        total += num_owners * per_owner;
+        per_owner_total += per_owner;
+
+        std::chrono::duration<double, std::micro> all{0};
+        std::chrono::duration<double, std::micro> after_last{0};
+        size_t retrieved = 0;
+        for (size_t i = 0; i < num_samples; ++i) {
+            const auto owner =
+                util::uniform_distribution_portable(rng, num_owners);
+            const auto pk = make_pubkey(owner);
+            // A message halfway through this owner's messages
+            const auto last_hash =
+                "hash" +
+                std::to_string((per_owner_total / 2) * num_owners + owner);
+
+            std::vector<Item> items;
+            auto start = std::chrono::steady_clock::now();
+            storage.retrieve(pk, items, "", 100);
+            all += std::chrono::steady_clock::now() - start;
+            retrieved += items.size();
+
+            items.clear();
+            start = std::chrono::steady_clock::now();
+            storage.retrieve(pk, items, last_hash, 100);
+            after_last += std::chrono::steady_clock::now() - start;
+            retrieved += items.size();
+        }
+
+        std::cout << "messages: " << total
+                  << ", us per retrieve: " << all.count() / num_samples
+                  << ", us per retrieve after lastHash: "
+                  << after_last.count() / num_samples
+                  << ", messages per retrieve: "
+                  << retrieved / (2.0 * num_samples) << std::endl;
+    }
+}
+
+/// Client retrieves into a fresh vector of `Item`s vs a reused buffer
+BOOST_AUTO_TEST_CASE(retrieve_latency_by_result_container) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_owners = 1000;
+    constexpr size_t per_owner = 100;
+    constexpr size_t num_samples = 20000;
+
+    Database storage(".");
+    storage.bulk_store(make_items(num_owners, per_owner));
+
+    for (int num_results : {10, 100}) {
+        std::mt19937_64 rng(42);
+        std::chrono::duration<double, std::micro> vector_time{0};
+        std::chrono::duration<double, std::micro> buffer_time{0};
+        RetrieveBuffer buffer;
+
+        for (size_t i = 0; i < num_samples; ++i) {
+            const auto pk = make_pubkey(
+                util::uniform_distribution_portable(rng, num_owners));
+
+            auto start = std::chrono::steady_clock::now();
+            {
+                std::vector<Item> items;
+                storage.retrieve(pk, items, "", num_results);
+            }
+            vector_time += std::chrono::steady_clock::now() - start;
+
+            start = std::chrono::steady_clock::now();
+            buffer.clear();
+            storage.retrieve(pk, buffer, "", num_results);
+            buffer_time += std::chrono::steady_clock::now() - start;
+        }
+
+        std::cout << "messages per retrieve: " << num_results
+                  << ", us per retrieve into vector: "
+                  << vector_time.count() / num_samples
+                  << ", into reused buffer: "
+                  << buffer_time.count() / num_samples << std::endl;
+    }
+}
+
+/// A client polling several inboxes: one retrieve per pubkey vs a single
+/// `retrieve_many`, both for polls that find nothing new and for first polls
+BOOST_AUTO_TEST_CASE(poll_latency_by_batch_size) {
+    constexpr size_t num_owners = 1000;
+    constexpr size_t per_owner = 20;
+    constexpr size_t num_samples = 2000;
+
+    for (size_t num_shards : {1, 4}) {
+        StorageRAIIFixture fixture;
+        Database storage(".", Database::DEFAULT_READER_COUNT,
+                         num_shards);
+        storage.bulk_store(make_items(num_owners, per_owner));
+
+        for (bool up_to_date : {true, false}) {
+            for (size_t batch_size : {1, 8, 32}) {
+                std::mt19937_64 rng(42);
+                std::chrono::duration<double, std::micro> single_time{0};
+                std::chrono::duration<double, std::micro> batch_time{0};
+                RetrieveBuffer buffer;
+                std::vector<std::pair<size_t, size_t>> ranges;
+                std::vector<Database::RetrieveRequest> requests;
+
+                for (size_t i = 0; i < num_samples; ++i) {
+                    requests.clear();
+                    for (size_t j = 0; j < batch_size; ++j) {
+                        const size_t owner =
+                            util::uniform_distribution_portable(rng,
+                                                                num_owners);
+                        // The newest message of the owner
+                        const auto last_hash =
+                            up_to_date
+                                ? "hash" + std::to_string((per_owner - 1) *
+                                                              num_owners +
+                                                          owner)
+                                : std::string();
+                        requests.push_back({make_pubkey(owner), last_hash});
+                    }
+
+                    auto start = std::chrono::steady_clock::now();
+                    buffer.clear();
+                    for (const auto& request : requests) {
+                        storage.retrieve(request.pub_key, buffer,
+                                         request.last_hash);
+                    }
+                    single_time += std::chrono::steady_clock::now() - start;
+
+                    start = std::chrono::steady_clock::now();
+                    buffer.clear();
+                    storage.retrieve_many(requests, buffer, ranges);
+                    batch_time += std::chrono::steady_clock::now() - start;
+                }
+
+                std::cout << "shards: " << num_shards << ", "
+                          << (up_to_date ? "empty" : "full")
+                          << " polls per batch: " << batch_size
+                          << ", us per batch as single retrieves: "
+                          << single_time.count() / num_samples
+                          << ", as retrieve_many: "
+                          << batch_time.count() / num_samples << std::endl;
+            }
+        }
+    }
+}
+
+/// Whole-database read as used by bootstrap: one vector vs a chunked cursor
+BOOST_AUTO_TEST_CASE(full_scan_by_chunk_size) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_messages = 500000;
+
+    Database storage(".");
+    storage.bulk_store(make_items(1000, num_messages / 1000));
+
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<Item> items;
+        storage.retrieve("", items, "");
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        BOOST_CHECK_EQUAL(items.size(), num_messages);
+        std::cout << "all at once: " << elapsed.count() << " ms, "
+                  << items.size() << " items held" << std::endl;
+    }
+
+    for (size_t chunk_size : {100, 1000, 10000}) {
+        const auto start = std::chrono::steady_clock::now();
+        auto cursor = storage.scan(chunk_size);
+        std::vector<Item> chunk;
+        size_t total = 0;
+        while (cursor.next(chunk) && !chunk.empty()) {
+            total += chunk.size();
+        }
+        const std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        BOOST_CHECK_EQUAL(total, num_messages);
+        std::cout << "chunks of " << chunk_size << ": " << elapsed.count()
+                  << " ms, " << chunk_size << " items held" << std::endl;
+    }
+}
+
+namespace {
+
+std::string hex_key(std::mt19937_64& rng, size_t num_bytes, bool upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    std::string key;
+    for (size_t i = 0; i < 2 * num_bytes; ++i) {
+        key += digits[rng() % 16];
+    }
+    return key;
+}
+
+struct Key {
+    int type;
+    std::string bytes;
+};
+
+// Read a key column the way it was stored, so that lookups bind it as is
+std::vector<Key> read_keys(sqlite3* db, const char* query) {
+    std::vector<Key> keys;
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, query, -1, &stmt, nullptr);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const auto data = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+        keys.push_back({sqlite3_column_type(stmt, 0),
+                        std::string(data, sqlite3_column_bytes(stmt, 0))});
+    }
+    sqlite3_finalize(stmt);
+    return keys;
+}
+
+// Page cache hit rate of random point lookups through `query`
+double cache_hit_rate(sqlite3* db, const char* query,
+                      const std::vector<Key>& keys, size_t num_lookups) {
+    std::mt19937_64 rng(42);
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2(db, query, -1, &stmt, nullptr);
+
+    int cur, hi;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &cur, &hi, 1);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &cur, &hi, 1);
+
+    for (size_t i = 0; i < num_lookups; ++i) {
+        const auto& key = keys[rng() % keys.size()];
+        if (key.type == SQLITE_BLOB) {
+            sqlite3_bind_blob(stmt, 1, key.bytes.data(), key.bytes.size(),
+                              SQLITE_STATIC);
+        } else {
+            sqlite3_bind_text(stmt, 1, key.bytes.data(), key.bytes.size(),
+                              SQLITE_STATIC);
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+        }
+        sqlite3_reset(stmt);
+    }
+    sqlite3_finalize(stmt);
+
+    int hits, misses;
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_HIT, &hits, &hi, 0);
+    sqlite3_db_status(db, SQLITE_DBSTATUS_CACHE_MISS, &misses, &hi, 0);
+    return hits / double(hits + misses);
+}
+
+} // namespace
+
+/// Hex keys stored as text (uppercase, which is never converted) vs as the
+/// binary they encode: database size, page cache hit rate and throughput
+BOOST_AUTO_TEST_CASE(footprint_by_key_encoding) {
+
+    constexpr size_t num_owners = 10000;
+    constexpr size_t num_messages = 300000;
+    constexpr size_t num_samples = 20000;
+
+    for (bool text_keys : {true, false}) {
+        StorageRAIIFixture fixture;
+        std::mt19937_64 rng(42);
+
+        std::vector<std::string> owners;
+        for (size_t i = 0; i < num_owners; ++i) {
+            owners.push_back(hex_key(rng, 32, text_keys));
+        }
+
+        const uint64_t ttl = 3600 * 1000;
+        const uint64_t timestamp = util::get_time_ms();
+        const std::string data(200, 'x');
+        std::vector<Item> items;
+        for (size_t i = 0; i < num_messages; ++i) {
+            items.push_back({hex_key(rng, 64, text_keys),
+                             owners[i % num_owners], timestamp, ttl,
+                             timestamp + ttl, "nonce", data});
+        }
+
+        double stores_per_sec, retrieves_per_sec;
+        {
+            Database storage(".");
+
+            constexpr size_t batch_size = 256;
+            std::vector<bool> inserted;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < items.size(); i += batch_size) {
+                const std::vector<Item> batch(
+                    items.begin() + i,
+                    items.begin() + std::min(i + batch_size, items.size()));
+                storage.store_batch(batch, inserted);
+            }
+            std::chrono::duration<double> elapsed =
+                std::chrono::steady_clock::now() - start;
+            stores_per_sec = num_messages / elapsed.count();
+
+            start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < num_samples; ++i) {
+                const auto& item = items[rng() % items.size()];
+                std::vector<Item> res;
+                storage.retrieve(item.pub_key, res, item.hash, 10);
+            }
+            elapsed = std::chrono::steady_clock::now() - start;
+            retrieves_per_sec = num_samples / elapsed.count();
+        }
+
+        sqlite3* db;
+        sqlite3_open("./storage.db", &db);
+        const auto hashes = read_keys(db, "SELECT `Hash` FROM `Messages`;");
+        const auto hash_hit_rate = cache_hit_rate(
+            db, "SELECT `Seq` FROM `Messages` WHERE `Hash` = ?;", hashes,
+            num_samples);
+        const auto owner_hit_rate = cache_hit_rate(
+            db,
+            "SELECT `Seq` FROM `Messages` WHERE `Owner` = ? ORDER BY `Seq` "
+            "LIMIT 10;",
+            read_keys(db, "SELECT `Owner` FROM `OwnerTotals`;"), num_samples);
+        sqlite3_close(db);
+
+        std::cout << (text_keys ? "text" : "binary") << " keys: database "
+                  << boost::filesystem::file_size("storage.db") / (1 << 20)
+                  << " MiB, stores/s: " << stores_per_sec
+                  << ", retrieves/s: " << retrieves_per_sec
+                  << ", cache hit rate (by hash): " << hash_hit_rate
+                  << ", (by owner): " << owner_hit_rate << std::endl;
+    }
+}
+
+/// An up-to-date client polling for new messages: database vs hot cache
+BOOST_AUTO_TEST_CASE(empty_poll_latency_with_retrieve_cache) {
+    StorageRAIIFixture fixture;
+
+    constexpr size_t num_owners = 10000;
+    constexpr size_t per_owner = 10;
+    constexpr size_t num_samples = 100000;
+
+    Database storage(".");
+    const auto items = make_items(num_owners, per_owner);
+    storage.bulk_store(items);
+
+    // `make_items` stores owners round robin, so these are the newest
+    const auto newest_hash = [&](size_t owner) -> const std::string& {
+        return items[(per_owner - 1) * num_owners + owner].hash;
+    };
+
+    RetrieveCache cache;
+    for (size_t owner = 0; owner < num_owners; ++owner) {
+        std::vector<Item> newest;
+        storage.retrieve(make_pubkey(owner), newest, "");
+        cache.fill(make_pubkey(owner), std::move(newest), true,
+                   cache.version());
+    }
+
+    std::mt19937_64 rng(42);
+    std::vector<size_t> owners;
+    for (size_t i = 0; i < num_samples; ++i) {
+        owners.push_back(util::uniform_distribution_portable(rng, num_owners));
+    }
+    std::vector<std::string> pubkeys;
+    for (size_t owner = 0; owner < num_owners; ++owner) {
+        pubkeys.push_back(make_pubkey(owner));
+    }
+
+    RetrieveBuffer buffer;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto owner : owners) {
+        buffer.clear();
+        storage.retrieve(pubkeys[owner], buffer, newest_hash(owner), 10);
+    }
+    const std::chrono::duration<double, std::micro> db_time =
+        std::chrono::steady_clock::now() - start;
+
+    size_t hits = 0;
+    const auto now = util::get_time_ms();
+    start = std::chrono::steady_clock::now();
+    for (const auto owner : owners) {
+        buffer.clear();
+        hits += cache.retrieve(pubkeys[owner], newest_hash(owner), 10, now,
+                               buffer);
+    }
+    const std::chrono::duration<double, std::micro> cache_time =
+        std::chrono::steady_clock::now() - start;
+
+    BOOST_CHECK_EQUAL(hits, num_samples);
+    std::cout << "us per empty poll, database: "
+              << db_time.count() / num_samples
+              << ", cache: " << cache_time.count() / num_samples
+              << ", cache size: " << cache.get_stats().bytes / (1 << 20)
+              << " MiB for " << num_owners << " owners" << std::endl;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
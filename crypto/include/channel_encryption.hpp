@@ -1,21 +1,92 @@
 #pragma once
 
+#include "shared_secret_cache.hpp"
+
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 
+/// How a client request and its response are encrypted, chosen by the client
+enum class ChannelMode {
+    /// AES-256-CBC, bodies base64 encoded
+    AesCbc,
+    /// XChaCha20-Poly1305, raw binary bodies
+    XChaCha20,
+};
+
 template <typename T>
 class ChannelEncryption {
   public:
-    ChannelEncryption(const std::vector<uint8_t>& private_key);
+    using shared_key_t = SharedSecretCache::secret_t;
+
+    ChannelEncryption(const std::vector<uint8_t>& private_key,
+                      size_t cache_capacity = SharedSecretCache::DEFAULT_CAPACITY);
     ~ChannelEncryption() = default;
 
+    /// Key shared with the client's (hex) ephemeral `pubKey` for `mode`,
+    /// derived once and then taken from the cache for as long as the client
+    /// keeps using it. Throws if `pubKey` is invalid.
+    ///
+    /// AES-CBC uses the X25519 shared secret as is. XChaCha20-Poly1305 uses
+    /// the BLAKE2b hash of the secret, the client's then our pubkey and
+    /// "xchacha20-poly1305", so that no key is shared between the modes.
+    shared_key_t get_shared_key(const std::string& pubKey,
+                                ChannelMode mode = ChannelMode::AesCbc) const;
+
+    /// Size of `len` bytes encrypted, IV included
+    static size_t encrypted_size(size_t len);
+
+    /// Upper bound of the size of `len` encrypted bytes decrypted
+    static size_t decrypted_size_bound(size_t len);
+
+    /// Write the IV followed by the encryption of `plainText` to `out`,
+    /// which must hold `encrypted_size(len)` bytes. Returns the size written.
+    static size_t encrypt(const uint8_t* plainText, size_t len,
+                          const shared_key_t& sharedKey, uint8_t* out);
+
+    /// Decrypt the IV and ciphertext `cipherText` into `out`, which must
+    /// hold `decrypted_size_bound(len)` bytes. Returns the size written.
+    static size_t decrypt(const uint8_t* cipherText, size_t len,
+                          const shared_key_t& sharedKey, uint8_t* out);
+
+    /// Replace `out` with the base64 of `plainText` encrypted, encoding each
+    /// chunk as it is encrypted
+    static void encrypt_base64(std::string_view plainText,
+                               const shared_key_t& sharedKey,
+                               std::string& out);
+
+    /// Replace `out` with a random nonce followed by `plainText` encrypted
+    /// and authenticated with XChaCha20-Poly1305
+    static void encrypt_xchacha20(std::string_view plainText,
+                                  const shared_key_t& sharedKey,
+                                  std::string& out);
+
+    /// Replace `out` with the decryption of the nonce and ciphertext
+    /// `cipherText`. Throws if it doesn't authenticate.
+    static void decrypt_xchacha20(std::string_view cipherText,
+                                  const shared_key_t& sharedKey,
+                                  std::string& out);
+
+    T encrypt(const T& plainText, const shared_key_t& sharedKey) const;
+
+    T decrypt(const T& cipherText, const shared_key_t& sharedKey) const;
+
     T encrypt(const T& plainText, const std::string& pubKey) const;
 
     T decrypt(const T& cipherText, const std::string& pubKey) const;
 
+    /// Combined stats of the caches of every mode
+    SharedSecretCache::Stats get_cache_stats() const;
+
   private:
-    std::vector<uint8_t>
-    calculateSharedSecret(const std::vector<uint8_t>& pubKey) const;
+    shared_key_t
+    calculateSharedSecret(const SharedSecretCache::pubkey_t& pubKey) const;
+    shared_key_t
+    deriveXChaCha20Key(const SharedSecretCache::pubkey_t& pubKey) const;
     const std::vector<uint8_t> private_key_;
+    SharedSecretCache::pubkey_t public_key_;
+    mutable SharedSecretCache cache_;
+    mutable SharedSecretCache xchacha20_cache_;
 };
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+/// Keys shared with recently seen client ephemeral pubkeys, so that clients
+/// reusing a pubkey across requests don't cost a scalar multiplication each
+/// time. Evicted least recently used first once `capacity` are held, and
+/// zeroed when evicted. Thread safe.
+class SharedSecretCache {
+  public:
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+    using pubkey_t = std::array<uint8_t, 32>;
+    using secret_t = std::array<uint8_t, 32>;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t size = 0;
+    };
+
+    // Nothing is cached with a capacity of 0
+    explicit SharedSecretCache(size_t capacity = DEFAULT_CAPACITY);
+    ~SharedSecretCache();
+
+    SharedSecretCache(const SharedSecretCache&) = delete;
+    SharedSecretCache& operator=(const SharedSecretCache&) = delete;
+
+    /// Set `secret` to the one shared with `pubkey` and return true if it
+    /// is cached, counting a hit or a miss
+    bool get(const pubkey_t& pubkey, secret_t& secret);
+
+    void put(const pubkey_t& pubkey, const secret_t& secret);
+
+    Stats get_stats() const;
+
+  private:
+    struct Entry {
+        pubkey_t pubkey;
+        secret_t secret;
+    };
+
+    struct PubkeyHash {
+        size_t operator()(const pubkey_t& pubkey) const;
+    };
+
+    using entry_list_t = std::list<Entry>;
+
+    // Must be called with `mutex_` held
+    void erase(entry_list_t::iterator it);
+
+    const size_t capacity_;
+    mutable std::mutex mutex_;
+    // Most recently used first
+    entry_list_t entries_;
+    std::unordered_map<pubkey_t, entry_list_t::iterator, PubkeyHash>
+        by_pubkey_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
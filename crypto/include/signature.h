@@ -2,7 +2,10 @@
 
 #include "arqmad_key.h"
 
+#include <sodium/crypto_generichash.h>
+
 #include <array>
+#include <string_view>
 
 namespace arqma {
 
@@ -18,6 +21,21 @@ struct signature {
 
 hash hash_data(const std::string& data);
 
+/// Same hash as `hash_data` of everything passed to `update`, for data that
+/// is produced piece by piece
+class incremental_hasher {
+  public:
+    incremental_hasher();
+
+    void update(std::string_view data);
+
+    // Return the hash and start over
+    hash finish();
+
+  private:
+    crypto_generichash_state state_;
+};
+
 signature generate_signature(const hash& prefix_hash,
                              const arqmad_key_pair_t& key_pair);
 
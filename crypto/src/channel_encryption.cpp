@@ -1,30 +1,60 @@
 #include "channel_encryption.hpp"
+#include "encoding.hpp"
+#include "utils.hpp"
 
-#include <boost/algorithm/hex.hpp>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <sodium.h>
 
+#include <algorithm>
+#include <cassert>
+#include <cstring>
 #include <exception>
 #include <string>
 
-std::vector<uint8_t> hexToBytes(const std::string& hex) {
-    std::vector<uint8_t> temp;
-    boost::algorithm::unhex(hex, std::back_inserter(temp));
-    return temp;
+namespace {
+
+// AES-256-CBC
+constexpr size_t IV_SIZE = 16;
+constexpr size_t BLOCK_SIZE = 16;
+
+// Plaintext encrypted at a time by `encrypt_base64`
+constexpr size_t BASE64_CHUNK_SIZE = 3 * 1024;
+
+// Cipher context reused by every encryption and decryption on the thread,
+// rather than allocating one per call
+EVP_CIPHER_CTX* thread_cipher_ctx() {
+    struct ctx_holder_t {
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        ~ctx_holder_t() { EVP_CIPHER_CTX_free(ctx); }
+    };
+    thread_local ctx_holder_t holder;
+    if (!holder.ctx) {
+        throw std::runtime_error("Could not allocate cipher context");
+    }
+    return holder.ctx;
 }
 
-template <typename T>
-ChannelEncryption<T>::ChannelEncryption(const std::vector<uint8_t>& private_key)
-    : private_key_(private_key) {}
+} // namespace
 
 template <typename T>
-std::vector<uint8_t> ChannelEncryption<T>::calculateSharedSecret(
-    const std::vector<uint8_t>& pubKey) const {
-    std::vector<uint8_t> sharedSecret(crypto_scalarmult_BYTES);
-    if (pubKey.size() != crypto_scalarmult_curve25519_BYTES) {
-        throw std::runtime_error("Bad pubKey size");
+ChannelEncryption<T>::ChannelEncryption(const std::vector<uint8_t>& private_key,
+                                        size_t cache_capacity)
+    : private_key_(private_key), cache_(cache_capacity),
+      xchacha20_cache_(cache_capacity) {
+    if (private_key_.size() != crypto_scalarmult_SCALARBYTES ||
+        crypto_scalarmult_base(public_key_.data(), private_key_.data()) != 0) {
+        throw std::runtime_error("Bad channel encryption private key");
     }
+}
+
+template <typename T>
+typename ChannelEncryption<T>::shared_key_t
+ChannelEncryption<T>::calculateSharedSecret(
+    const SharedSecretCache::pubkey_t& pubKey) const {
+    shared_key_t sharedSecret;
+    static_assert(sizeof(sharedSecret) == crypto_scalarmult_BYTES,
+                  "Wrong shared secret size");
     if (crypto_scalarmult(sharedSecret.data(), this->private_key_.data(),
                           pubKey.data()) != 0) {
         throw std::runtime_error(
@@ -33,108 +63,250 @@ std::vector<uint8_t> ChannelEncryption<T>::calculateSharedSecret(
     return sharedSecret;
 }
 
+template <typename T>
+typename ChannelEncryption<T>::shared_key_t
+ChannelEncryption<T>::deriveXChaCha20Key(
+    const SharedSecretCache::pubkey_t& pubKey) const {
+    static constexpr char context[] = "xchacha20-poly1305";
+
+    shared_key_t sharedSecret = calculateSharedSecret(pubKey);
+    shared_key_t key;
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, NULL, 0, key.size());
+    crypto_generichash_update(&state, sharedSecret.data(), sharedSecret.size());
+    crypto_generichash_update(&state, pubKey.data(), pubKey.size());
+    crypto_generichash_update(&state, public_key_.data(), public_key_.size());
+    crypto_generichash_update(
+        &state, reinterpret_cast<const unsigned char*>(context),
+        sizeof(context) - 1);
+    crypto_generichash_final(&state, key.data(), key.size());
+    sodium_memzero(sharedSecret.data(), sharedSecret.size());
+    sodium_memzero(&state, sizeof(state));
+    return key;
+}
+
+template <typename T>
+SharedSecretCache::Stats ChannelEncryption<T>::get_cache_stats() const {
+    auto stats = cache_.get_stats();
+    const auto xchacha20 = xchacha20_cache_.get_stats();
+    stats.hits += xchacha20.hits;
+    stats.misses += xchacha20.misses;
+    stats.size += xchacha20.size;
+    return stats;
+}
+
+template <typename T>
+typename ChannelEncryption<T>::shared_key_t
+ChannelEncryption<T>::get_shared_key(const std::string& pubKey,
+                                     ChannelMode mode) const {
+    SharedSecretCache::pubkey_t pubKeyBytes;
+    if (pubKey.size() != 2 * pubKeyBytes.size()) {
+        throw std::runtime_error("Bad pubKey size");
+    }
+    if (!util::hex_decode(pubKey.data(), pubKey.size(), pubKeyBytes.data())) {
+        throw std::runtime_error("Bad pubKey");
+    }
+
+    const bool xchacha20 = mode == ChannelMode::XChaCha20;
+    SharedSecretCache& cache = xchacha20 ? xchacha20_cache_ : cache_;
+    shared_key_t sharedKey;
+    if (!cache.get(pubKeyBytes, sharedKey)) {
+        sharedKey = xchacha20 ? deriveXChaCha20Key(pubKeyBytes)
+                              : calculateSharedSecret(pubKeyBytes);
+        cache.put(pubKeyBytes, sharedKey);
+    }
+    return sharedKey;
+}
+
 template <typename T>
 T ChannelEncryption<T>::encrypt(const T& plaintext,
                                 const std::string& pubKey) const {
-    const std::vector<uint8_t> pubKeyBytes = hexToBytes(pubKey);
-    const std::vector<uint8_t> sharedKey = calculateSharedSecret(pubKeyBytes);
+    return encrypt(plaintext, get_shared_key(pubKey));
+}
+
+template <typename T>
+T ChannelEncryption<T>::decrypt(const T& ciphertextAndIV,
+                                const std::string& pubKey) const {
+    return decrypt(ciphertextAndIV, get_shared_key(pubKey));
+}
 
-    // Initialise cipher
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-    const int ivLength = EVP_CIPHER_iv_length(cipher);
+template <typename T>
+size_t ChannelEncryption<T>::encrypted_size(size_t len) {
+    // Padding always adds between 1 and a whole block
+    return IV_SIZE + (len / BLOCK_SIZE + 1) * BLOCK_SIZE;
+}
+
+template <typename T>
+size_t ChannelEncryption<T>::decrypted_size_bound(size_t len) {
+    return len > IV_SIZE ? len - IV_SIZE : 0;
+}
 
+template <typename T>
+size_t ChannelEncryption<T>::encrypt(const uint8_t* plaintext, size_t len,
+                                     const shared_key_t& sharedKey,
+                                     uint8_t* out) {
     // Generate IV
-    unsigned char iv[ivLength];
-    if (RAND_bytes(iv, ivLength) != 1) {
+    if (RAND_bytes(out, IV_SIZE) != 1) {
         throw std::runtime_error("Could not generate IV");
     }
 
-    // Initialise cipher context
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (EVP_EncryptInit_ex(ctx, cipher, NULL, sharedKey.data(), iv) <= 0) {
+    EVP_CIPHER_CTX* ctx = thread_cipher_ctx();
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, sharedKey.data(),
+                           out) <= 0) {
         throw std::runtime_error("Could not initialise encryption context");
     }
 
-    int len;
-    size_t ciphertext_len = 0;
-    auto p = reinterpret_cast<const unsigned char*>(plaintext.data());
-    const size_t plaintext_len = plaintext.size();
-
-    // Add some padding of 'blockSize' as upper limit
-    const int blockSize = EVP_CIPHER_CTX_block_size(ctx);
-    T output;
-    output.resize(plaintext_len + blockSize);
-    auto o = reinterpret_cast<unsigned char*>(&output[0]);
-
-    // Encrypt every full blocks
-    if (EVP_EncryptUpdate(ctx, o, &len, p, plaintext_len) <= 0) {
+    int updateLen, finalLen;
+    uint8_t* o = out + IV_SIZE;
+    if (EVP_EncryptUpdate(ctx, o, &updateLen, plaintext, len) <= 0) {
         throw std::runtime_error("Could not encrypt plaintext");
     }
-    ciphertext_len += len;
-
-    // Encrypt any remaining partial blocks
-    if (EVP_EncryptFinal_ex(ctx, o + len, &len) <= 0) {
+    if (EVP_EncryptFinal_ex(ctx, o + updateLen, &finalLen) <= 0) {
         throw std::runtime_error("Could not finalise encryption");
     }
-    ciphertext_len += len;
 
-    // Remove excess padding
-    output.resize(ciphertext_len);
+    return IV_SIZE + updateLen + finalLen;
+}
 
-    // Insert iv at the start
-    output.insert(output.begin(), iv, iv + ivLength);
+template <typename T>
+size_t ChannelEncryption<T>::decrypt(const uint8_t* ciphertextAndIV,
+                                     size_t len,
+                                     const shared_key_t& sharedKey,
+                                     uint8_t* out) {
+    if (len < IV_SIZE + BLOCK_SIZE || len % BLOCK_SIZE != 0) {
+        throw std::runtime_error("Bad ciphertext size");
+    }
 
-    EVP_CIPHER_CTX_free(ctx);
+    EVP_CIPHER_CTX* ctx = thread_cipher_ctx();
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, sharedKey.data(),
+                           ciphertextAndIV) <= 0) {
+        throw std::runtime_error("Could not initialise decryption context");
+    }
 
-    return output;
+    int updateLen, finalLen;
+    if (EVP_DecryptUpdate(ctx, out, &updateLen, ciphertextAndIV + IV_SIZE,
+                          len - IV_SIZE) <= 0) {
+        throw std::runtime_error("Could not decrypt ciphertext");
+    }
+    if (EVP_DecryptFinal_ex(ctx, out + updateLen, &finalLen) <= 0) {
+        throw std::runtime_error("Could not finalise decryption");
+    }
+
+    return updateLen + finalLen;
 }
 
 template <typename T>
-T ChannelEncryption<T>::decrypt(const T& ciphertextAndIV,
-                                const std::string& pubKey) const {
-    const std::vector<uint8_t> pubKeyBytes = hexToBytes(pubKey);
-    const std::vector<uint8_t> sharedKey = calculateSharedSecret(pubKeyBytes);
+void ChannelEncryption<T>::encrypt_base64(std::string_view plaintext,
+                                          const shared_key_t& sharedKey,
+                                          std::string& out) {
+    out.resize(util::base64_encoded_size(encrypted_size(plaintext.size())));
+    char* o = &out[0];
+
+    // Encrypted bytes not encoded yet, fewer than 3 between chunks as only
+    // whole groups of 3 are encoded before the end
+    uint8_t buf[BASE64_CHUNK_SIZE + 2 * BLOCK_SIZE];
+    size_t pending = IV_SIZE;
+
+    if (RAND_bytes(buf, IV_SIZE) != 1) {
+        throw std::runtime_error("Could not generate IV");
+    }
 
-    // Initialise cipher
-    const EVP_CIPHER* cipher = EVP_aes_256_cbc();
-    const int ivLength = EVP_CIPHER_iv_length(cipher);
+    EVP_CIPHER_CTX* ctx = thread_cipher_ctx();
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, sharedKey.data(),
+                           buf) <= 0) {
+        throw std::runtime_error("Could not initialise encryption context");
+    }
 
-    auto inPtr = reinterpret_cast<const unsigned char*>(&ciphertextAndIV[0]);
+    auto p = reinterpret_cast<const uint8_t*>(plaintext.data());
+    size_t remaining = plaintext.size();
+    while (remaining > 0) {
+        const size_t chunk = std::min(remaining, BASE64_CHUNK_SIZE);
+        int len;
+        if (EVP_EncryptUpdate(ctx, buf + pending, &len, p, chunk) <= 0) {
+            throw std::runtime_error("Could not encrypt plaintext");
+        }
+        p += chunk;
+        remaining -= chunk;
+        pending += len;
 
-    // Initialise cipher context
-    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
-    if (EVP_DecryptInit_ex(ctx, cipher, NULL, sharedKey.data(), inPtr) <= 0) {
-        throw std::runtime_error("Could not initialise decryption context");
+        const size_t whole = pending / 3 * 3;
+        o += util::base64_encode(buf, whole, o);
+        std::memmove(buf, buf + whole, pending - whole);
+        pending -= whole;
     }
 
     int len;
-    size_t plaintextLength = 0;
-    const size_t ciphertextLength = ciphertextAndIV.size() - ivLength;
+    if (EVP_EncryptFinal_ex(ctx, buf + pending, &len) <= 0) {
+        throw std::runtime_error("Could not finalise encryption");
+    }
+    pending += len;
+    o += util::base64_encode(buf, pending, o);
 
-    // Add some padding of 'blockSize' as upper limit
-    const int blockSize = EVP_CIPHER_CTX_block_size(ctx);
-    T output;
-    output.resize(ciphertextLength + blockSize);
+    assert(static_cast<size_t>(o - out.data()) == out.size());
+}
+
+template <typename T>
+void ChannelEncryption<T>::encrypt_xchacha20(std::string_view plaintext,
+                                             const shared_key_t& sharedKey,
+                                             std::string& out) {
+    static_assert(std::tuple_size<shared_key_t>::value ==
+                      crypto_aead_xchacha20poly1305_ietf_KEYBYTES,
+                  "Wrong shared key size");
 
-    auto outPtr = reinterpret_cast<unsigned char*>(&output[0]);
+    out.resize(crypto_aead_xchacha20poly1305_ietf_NPUBBYTES +
+               plaintext.size() + crypto_aead_xchacha20poly1305_ietf_ABYTES);
+    auto nonce = reinterpret_cast<unsigned char*>(&out[0]);
+    randombytes_buf(nonce, crypto_aead_xchacha20poly1305_ietf_NPUBBYTES);
 
-    // Decrypt every full blocks
-    if (EVP_DecryptUpdate(ctx, outPtr, &len, inPtr + ivLength,
-                          ciphertextLength) <= 0) {
-        throw std::runtime_error("Could not initialise decryption context");
+    unsigned long long ciphertextLength;
+    crypto_aead_xchacha20poly1305_ietf_encrypt(
+        nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES, &ciphertextLength,
+        reinterpret_cast<const unsigned char*>(plaintext.data()),
+        plaintext.size(), NULL, 0, NULL, nonce, sharedKey.data());
+}
+
+template <typename T>
+void ChannelEncryption<T>::decrypt_xchacha20(std::string_view ciphertext,
+                                             const shared_key_t& sharedKey,
+                                             std::string& out) {
+    constexpr size_t overhead = crypto_aead_xchacha20poly1305_ietf_NPUBBYTES +
+                                crypto_aead_xchacha20poly1305_ietf_ABYTES;
+    if (ciphertext.size() < overhead) {
+        throw std::runtime_error("Bad ciphertext size");
     }
-    plaintextLength += len;
 
-    // Decrypt any remaining partial blocks
-    if (EVP_DecryptFinal_ex(ctx, outPtr + len, &len) <= 0) {
-        throw std::runtime_error("Could not finalise decryption");
+    auto nonce = reinterpret_cast<const unsigned char*>(ciphertext.data());
+    out.resize(ciphertext.size() - overhead);
+    unsigned long long plaintextLength;
+    if (crypto_aead_xchacha20poly1305_ietf_decrypt(
+            reinterpret_cast<unsigned char*>(&out[0]), &plaintextLength, NULL,
+            nonce + crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+            ciphertext.size() - crypto_aead_xchacha20poly1305_ietf_NPUBBYTES,
+            NULL, 0, nonce, sharedKey.data()) != 0) {
+        throw std::runtime_error("Could not authenticate ciphertext");
     }
-    plaintextLength += len;
+}
 
-    // Remove excess bytes
-    output.resize(plaintextLength);
+template <typename T>
+T ChannelEncryption<T>::encrypt(const T& plaintext,
+                                const shared_key_t& sharedKey) const {
+    T output;
+    output.resize(encrypted_size(plaintext.size()));
+    output.resize(encrypt(reinterpret_cast<const uint8_t*>(plaintext.data()),
+                          plaintext.size(), sharedKey,
+                          reinterpret_cast<uint8_t*>(&output[0])));
+    return output;
+}
 
-    EVP_CIPHER_CTX_free(ctx);
+template <typename T>
+T ChannelEncryption<T>::decrypt(const T& ciphertextAndIV,
+                                const shared_key_t& sharedKey) const {
+    T output;
+    output.resize(decrypted_size_bound(ciphertextAndIV.size()));
+    output.resize(
+        decrypt(reinterpret_cast<const uint8_t*>(ciphertextAndIV.data()),
+                ciphertextAndIV.size(), sharedKey,
+                reinterpret_cast<uint8_t*>(&output[0])));
     return output;
 }
 
@@ -0,0 +1,68 @@
+#include "shared_secret_cache.hpp"
+
+#include <sodium/utils.h>
+
+#include <string_view>
+
+SharedSecretCache::SharedSecretCache(size_t capacity) : capacity_(capacity) {}
+
+SharedSecretCache::~SharedSecretCache() {
+    for (auto& entry : entries_) {
+        sodium_memzero(entry.secret.data(), entry.secret.size());
+    }
+}
+
+size_t SharedSecretCache::PubkeyHash::operator()(const pubkey_t& pubkey) const {
+    return std::hash<std::string_view>{}(std::string_view(
+        reinterpret_cast<const char*>(pubkey.data()), pubkey.size()));
+}
+
+bool SharedSecretCache::get(const pubkey_t& pubkey, secret_t& secret) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const auto it = by_pubkey_.find(pubkey);
+    if (it == by_pubkey_.end()) {
+        misses_++;
+        return false;
+    }
+    hits_++;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    secret = it->second->secret;
+    return true;
+}
+
+void SharedSecretCache::put(const pubkey_t& pubkey, const secret_t& secret) {
+    if (capacity_ == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    const auto it = by_pubkey_.find(pubkey);
+    if (it != by_pubkey_.end()) {
+        // Derived concurrently by another request
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+    if (entries_.size() >= capacity_) {
+        erase(std::prev(entries_.end()));
+    }
+    entries_.push_front({pubkey, secret});
+    by_pubkey_.emplace(pubkey, entries_.begin());
+}
+
+SharedSecretCache::Stats SharedSecretCache::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Stats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.size = entries_.size();
+    return stats;
+}
+
+void SharedSecretCache::erase(entry_list_t::iterator it) {
+    by_pubkey_.erase(it->pubkey);
+    sodium_memzero(it->secret.data(), it->secret.size());
+    entries_.erase(it);
+}
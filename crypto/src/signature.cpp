@@ -52,6 +52,23 @@ hash hash_data(const std::string& data) {
     return hash;
 }
 
+incremental_hasher::incremental_hasher() {
+    crypto_generichash_init(&state_, nullptr, 0, HASH_SIZE);
+}
+
+void incremental_hasher::update(std::string_view data) {
+    crypto_generichash_update(
+        &state_, reinterpret_cast<const unsigned char*>(data.data()),
+        data.size());
+}
+
+hash incremental_hasher::finish() {
+    hash hash{{0}};
+    crypto_generichash_final(&state_, hash.data(), hash.size());
+    crypto_generichash_init(&state_, nullptr, 0, HASH_SIZE);
+    return hash;
+}
+
 signature generate_signature(const hash& prefix_hash,
                              const arqmad_key_pair_t& key_pair) {
     ge_p3 tmp3;
@@ -22,6 +22,8 @@ void command_line_parser::parse_args(int argc, char* argv[]) {
     desc_.add_options()
         ("data-dir", po::value(&options_.data_dir), "Path to persistent data (defaults to ~/.arqma/storage)")
         ("config-file", po::value(&config_file), "Path to custom config file (defaults to `storage-server.conf' inside --data-dir)")
+        ("db-shards", po::value(&options_.db_shards), "Number of database files to spread messages over (changing it moves the stored messages on startup)")
+        ("db-profile", po::value(&options_.db_profile), "Database tuning: `durable' (fsync every write, the default), `balanced' (fsync in the background, might lose the last writes on power loss) or `throughput' (never fsync, most memory)")
         ("log-level", po::value(&options_.log_level), "Log verbosity level, see Log Levels below for accepted values")
         ("arqmad-rpc-ip", po::value(&options_.arqmad_rpc_ip), "RPC IP on which the local Arqma daemon is listening (commonly localhost)")
         ("arqmad-rpc-port", po::value(&options_.arqmad_rpc_port), "RPC port on which the local Arqma daemon is listening")
@@ -16,6 +16,8 @@ struct command_line_options {
     std::string ip;
     std::string log_level = "info";
     std::string data_dir;
+    size_t db_shards = 1;
+    std::string db_profile = "durable";
     std::string arqmad_key; // test only
     std::string arqmad_x25519_key; // test only
     std::string arqmad_ed25519_key; // test only
@@ -12,6 +12,7 @@
 #include "signature.h"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <ctime>
 #include <functional>
@@ -32,6 +33,10 @@ namespace sp = std::placeholders; // for std::placeholders:: code shorten
 /// +===========================================
 
 static constexpr auto ARQMA_EPHEMKEY_HEADER = "X-Arqma-EphemKey";
+// `ChannelMode` of a client request and its response, AES-CBC if absent
+static constexpr auto ARQMA_CHANNEL_MODE_HEADER = "X-Arqma-Channel-Mode";
+static constexpr auto CHANNEL_MODE_AES_CBC = "aes-cbc";
+static constexpr auto CHANNEL_MODE_XCHACHA20 = "xchacha20-poly1305";
 
 using arqma::storage::Item;
 
@@ -41,13 +46,23 @@ namespace arqma {
 
 constexpr auto TEST_RETRY_PERIOD = std::chrono::milliseconds(50);
 
-// Note: on the client side the limit is different
-// as it is not encrypted/encoded there yet.
-// The choice is somewhat arbitrary but it roughly
-// corresponds to the client-side limit of 2000 chars
-// of unencrypted message body in our experiments
-// (rounded up)
-constexpr size_t MAX_MESSAGE_BODY = 3100;
+// SHA512 over the fields that identify a client message, hex encoded
+static std::string compute_message_hash(const std::string& timestamp,
+                                        const std::string& ttl,
+                                        const std::string& pub_key,
+                                        const std::string& data) {
+    SHA512_CTX ctx;
+    SHA512_Init(&ctx);
+    SHA512_Update(&ctx, timestamp.data(), timestamp.size());
+    SHA512_Update(&ctx, ttl.data(), ttl.size());
+    SHA512_Update(&ctx, pub_key.data(), pub_key.size());
+    SHA512_Update(&ctx, data.data(), data.size());
+
+    std::array<unsigned char, SHA512_DIGEST_LENGTH> digest;
+    SHA512_Final(digest.data(), &ctx);
+
+    return util::as_hex(digest);
+}
 
 void make_http_request(boost::asio::io_context& ioc,
                        const std::string& sn_address, uint16_t port,
@@ -399,10 +414,24 @@ void connection_t::process_storage_test_req(uint64_t height,
 
     ARQMA_LOG(trace, "Performing storage test, attempt: {}", repetition_count_);
 
-    std::string answer;
+    // The message is looked up on a storage thread
+    delay_response_ = true;
+
+    service_node_.process_storage_test_req(
+        height, tester_pk, msg_hash,
+        [self = shared_from_this(), height, tester_pk,
+         msg_hash](MessageTestStatus status, std::string answer) {
+            self->on_storage_test_processed(height, tester_pk, msg_hash,
+                                            status, answer);
+        });
+}
+
+void connection_t::on_storage_test_processed(uint64_t height,
+                                             const std::string& tester_pk,
+                                             const std::string& msg_hash,
+                                             MessageTestStatus status,
+                                             const std::string& answer) {
 
-    const MessageTestStatus status = service_node_.process_storage_test_req(
-        height, tester_pk, msg_hash, answer);
     const auto elapsed_time =
         std::chrono::steady_clock::now() - start_timestamp_;
     if (status == MessageTestStatus::SUCCESS) {
@@ -411,7 +440,6 @@ void connection_t::process_storage_test_req(uint64_t height,
             repetition_count_,
             std::chrono::duration_cast<std::chrono::milliseconds>(elapsed_time)
                 .count());
-        delay_response_ = true;
 
         nlohmann::json json_res;
         json_res["status"] = "OK";
@@ -422,7 +450,6 @@ void connection_t::process_storage_test_req(uint64_t height,
         response_.result(http::status::ok);
         this->write_response();
     } else if (status == MessageTestStatus::RETRY && elapsed_time < 1min) {
-        delay_response_ = true;
         repetition_count_++;
 
         repeat_timer_.expires_after(TEST_RETRY_PERIOD);
@@ -444,6 +471,7 @@ void connection_t::process_storage_test_req(uint64_t height,
         json_res["status"] = "wrong request";
         this->body_stream_ << json_res.dump();
         response_.result(http::status::ok);
+        this->write_response();
     } else {
         ARQMA_LOG(error, "Failed storage test, tried {} times.",
                   repetition_count_);
@@ -451,6 +479,7 @@ void connection_t::process_storage_test_req(uint64_t height,
         json_res["status"] = "other";
         this->body_stream_ << json_res.dump();
         response_.result(http::status::ok);
+        this->write_response();
     }
 }
 
@@ -474,15 +503,67 @@ void connection_t::process_blockchain_test_req(uint64_t,
 
 void connection_t::process_swarm_req(boost::string_view target) {
 
-    if (!validate_snode_request() && (target != "/swarms/ping_test/v1")) {
+    const bool validated = validate_snode_request();
+    if (!validated && (target != "/swarms/ping_test/v1")) {
         return;
     }
 
     response_.set(ARQMA_SNODE_SIGNATURE_HEADER, security_.get_cert_signature());
 
+    // Only trusted from known senders. Newer formats than we know of are of
+    // no use to us, and senders without the header (or with one we can't
+    // read) only know v1, which also covers peers that have downgraded.
+    if (validated) {
+        WireFormat format = WireFormat::V1;
+        const auto format_it = request_.find(ARQMA_WIRE_FORMAT_HEADER);
+        if (format_it != request_.end()) {
+            const auto value = std::min<unsigned long>(
+                std::strtoul(format_it->value().to_string().c_str(), nullptr,
+                             10),
+                static_cast<unsigned long>(LATEST_WIRE_FORMAT));
+            if (value >= static_cast<unsigned long>(WireFormat::V1)) {
+                format = static_cast<WireFormat>(value);
+            }
+        }
+        service_node_.record_wire_format(
+            header_[ARQMA_SENDER_SNODE_PUBKEY_HEADER], format);
+    }
+
     if (target == "/swarms/push_batch/v1") {
       response_.result(http::status::ok);
-      service_node_.process_push_batch(request_.body());
+      service_node_.process_push_batch(std::move(request_.body()));
+    } else if (target == "/swarms/snapshot/v1") {
+        response_.result(http::status::bad_request);
+        if (!parse_header(ARQMA_SNAPSHOT_ID_HEADER,
+                          ARQMA_SNAPSHOT_OFFSET_HEADER,
+                          ARQMA_SNAPSHOT_SIZE_HEADER)) {
+            body_stream_ << "missing snapshot headers\n";
+            return;
+        }
+
+        uint64_t id, offset, size;
+        try {
+            id = std::stoull(header_[ARQMA_SNAPSHOT_ID_HEADER]);
+            offset = std::stoull(header_[ARQMA_SNAPSHOT_OFFSET_HEADER]);
+            size = std::stoull(header_[ARQMA_SNAPSHOT_SIZE_HEADER]);
+        } catch (const std::exception&) {
+            body_stream_ << "invalid snapshot headers\n";
+            return;
+        }
+
+        // The last chunk is only acknowledged once the snapshot has been
+        // imported
+        delay_response_ = true;
+        service_node_.process_snapshot_chunk(
+            header_[ARQMA_SENDER_SNODE_PUBKEY_HEADER], id, offset, size,
+            request_.body(), [self = shared_from_this()](bool accepted) {
+                if (accepted) {
+                    self->response_.result(http::status::ok);
+                } else {
+                    self->body_stream_ << "could not accept snapshot chunk\n";
+                }
+                self->write_response();
+            });
     } else if (target == "/swarms/storage_test/v1") {
         response_.result(http::status::bad_request);
         ARQMA_LOG(debug, "Got storage test request");
@@ -572,9 +653,15 @@ void connection_t::process_swarm_req(boost::string_view target) {
         std::vector<message_t> messages = deserialize_messages(request_.body());
         assert(messages.size() == 1);
 
-        service_node_.process_push(messages.front());
-
-        response_.result(http::status::ok);
+        // Acknowledge the push only once it is durable on our side
+        delay_response_ = true;
+        service_node_.process_push(
+            messages.front(), [self = shared_from_this()](bool committed) {
+                self->response_.result(
+                    committed ? http::status::ok
+                              : http::status::internal_server_error);
+                self->write_response();
+            });
     }
 }
 
@@ -631,6 +718,8 @@ void connection_t::process_request() {
             this->process_swarm_req(target);
         } else if (target == "/swarms/push_batch/v1") {
             this->process_swarm_req(target);
+        } else if (target == "/swarms/snapshot/v1") {
+            this->process_swarm_req(target);
         } else if (target == "/swarms/storage_test/v1") {
 
             this->process_swarm_req(target);
@@ -703,9 +792,20 @@ void connection_t::write_response() {
     if (it != header_.end()) {
         const std::string& ephemKey = it->second;
         try {
-            auto body = channel_cipher_.encrypt(body_stream_.str(), ephemKey);
-            response_.body() = boost::beast::detail::base64_encode(body);
-            response_.set(http::field::content_type, "text/plain");
+            if (!channel_key_) {
+                channel_key_ =
+                    channel_cipher_.get_shared_key(ephemKey, channel_mode_);
+            }
+            if (channel_mode_ == ChannelMode::XChaCha20) {
+                ChannelEncryption<std::string>::encrypt_xchacha20(
+                    body_stream_.str(), *channel_key_, response_.body());
+                response_.set(http::field::content_type,
+                              "application/octet-stream");
+            } else {
+                ChannelEncryption<std::string>::encrypt_base64(
+                    body_stream_.str(), *channel_key_, response_.body());
+                response_.set(http::field::content_type, "text/plain");
+            }
         } catch (const std::exception& e) {
             response_.result(http::status::internal_server_error);
             response_.set(http::field::content_type, "text/plain");
@@ -804,10 +904,10 @@ void connection_t::process_store(const json& params) {
         return;
     }
 
-    if (data.size() > MAX_MESSAGE_BODY) {
+    if (data.size() > util::MAX_MESSAGE_BODY) {
         response_.result(http::status::bad_request);
         body_stream_ << "Message body exceeds maximum allowed length of "
-                     << MAX_MESSAGE_BODY << "\n";
+                     << util::MAX_MESSAGE_BODY << "\n";
         ARQMA_LOG(debug, "Message body too long: {}", data.size());
         return;
     }
@@ -837,6 +937,40 @@ void connection_t::process_store(const json& params) {
         ARQMA_LOG(debug, "Forbidden. Invalid Timestamp: {}", timestamp);
         return;
     }
+
+    const std::string msg_hash =
+        compute_message_hash(timestamp, ttl, pk.str(), data);
+
+    const message_t msg{pk.str(), data, msg_hash, ttlInt, timestampInt};
+
+    // Respond once the message has been committed to the database
+    delay_response_ = true;
+
+    const bool accepted = service_node_.process_store(
+        msg, [self = shared_from_this(), msg_hash](bool committed) {
+            if (committed) {
+                json res_body;
+                res_body["hash"] = msg_hash;
+                self->response_.result(http::status::ok);
+                self->body_stream_ << res_body.dump();
+            } else {
+                self->response_.result(http::status::internal_server_error);
+                self->response_.set(http::field::content_type, "text/plain");
+                self->body_stream_ << "Failed to store the message\n";
+            }
+            self->write_response();
+        });
+
+    if (!accepted) {
+        delay_response_ = false;
+        response_.result(http::status::service_unavailable);
+        response_.set(http::field::content_type, "text/plain");
+        body_stream_ << "Service node is initializing\n";
+        ARQMA_LOG(warn, "Service node is initializing");
+        return;
+    }
+
+    ARQMA_LOG(trace, "Queued message for storage: {}", msg_hash);
 }
 
 void connection_t::process_snodes_by_pk(const json& params) {
@@ -872,30 +1006,34 @@ void connection_t::process_snodes_by_pk(const json& params) {
 
 void connection_t::process_retrieve_all() {
 
-    std::vector<Item> all_entries;
-
-    bool res = service_node_.get_all_messages(all_entries);
+    // The messages are read on a storage thread
+    delay_response_ = true;
 
-    if (!res) {
-        this->body_stream_ << "could not retrieve all entries\n";
-        response_.result(http::status::internal_server_error);
-        return;
-    }
+    service_node_.get_all_messages([self = shared_from_this()](
+                                       bool res, std::vector<Item> all_entries) {
+        if (!res) {
+            self->body_stream_ << "could not retrieve all entries\n";
+            self->response_.result(http::status::internal_server_error);
+            self->write_response();
+            return;
+        }
 
-    json messages = json::array();
+        json messages = json::array();
 
-    for (auto& entry : all_entries) {
-        json item;
-        item["data"] = entry.data;
-        item["pk"] = entry.pub_key;
-        messages.push_back(item);
-    }
+        for (auto& entry : all_entries) {
+            json item;
+            item["data"] = entry.data;
+            item["pk"] = entry.pub_key;
+            messages.push_back(item);
+        }
 
-    json res_body;
-    res_body["messages"] = messages;
+        json res_body;
+        res_body["messages"] = messages;
 
-    body_stream_ << res_body.dump();
-    response_.result(http::status::ok);
+        self->body_stream_ << res_body.dump();
+        self->response_.result(http::status::ok);
+        self->write_response();
+    });
 }
 
 void connection_t::handle_wrong_swarm(const user_pubkey_t& pubKey) {
@@ -914,26 +1052,145 @@ void connection_t::handle_wrong_swarm(const user_pubkey_t& pubKey) {
 
 constexpr auto LONG_POLL_TIMEOUT = std::chrono::milliseconds(20000);
 
-template <typename T>
-void connection_t::respond_with_messages(const std::vector<T>& items) {
+// Length of the well-formed UTF-8 sequence at the start of `str`, or 0 if
+// it is ill-formed, in which case `bad` is set to the length of its maximal
+// ill-formed prefix (at least 1)
+static size_t utf8_sequence_length(std::string_view str, size_t& bad) {
+
+    const auto lead = static_cast<unsigned char>(str[0]);
+    size_t len;
+    // Allowed range of the second byte, which rules out overlong forms,
+    // surrogates and code points past U+10FFFF
+    unsigned char lo = 0x80, hi = 0xbf;
+    if (lead >= 0xc2 && lead <= 0xdf) {
+        len = 2;
+    } else if (lead >= 0xe0 && lead <= 0xef) {
+        len = 3;
+        if (lead == 0xe0) {
+            lo = 0xa0;
+        } else if (lead == 0xed) {
+            hi = 0x9f;
+        }
+    } else if (lead >= 0xf0 && lead <= 0xf4) {
+        len = 4;
+        if (lead == 0xf0) {
+            lo = 0x90;
+        } else if (lead == 0xf4) {
+            hi = 0x8f;
+        }
+    } else {
+        bad = 1;
+        return 0;
+    }
 
-    json res_body;
-    json messages = json::array();
+    for (size_t i = 1; i < len; ++i) {
+        const auto c =
+            i < str.size() ? static_cast<unsigned char>(str[i]) : 0;
+        if (c < lo || c > hi) {
+            bad = i;
+            return 0;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return len;
+}
+
+// Append `str` as a JSON string literal, escaped the same way as
+// `json::dump` does with `error_handler_t::replace`. Messages pushed by
+// other nodes are stored as they were received, so they might not be valid
+// UTF-8; ill-formed sequences become U+FFFD to keep the response valid.
+static void write_json_string(std::ostream& os, std::string_view str) {
+
+    static constexpr char hex[] = "0123456789abcdef";
+    static constexpr char replacement[] = "\xef\xbf\xbd";
+
+    os.put('"');
+    size_t clean_from = 0;
+    for (size_t i = 0; i < str.size();) {
+        const auto c = static_cast<unsigned char>(str[i]);
+        if (c >= 0x80) {
+            size_t bad = 0;
+            const size_t len = utf8_sequence_length(str.substr(i), bad);
+            if (len != 0) {
+                i += len;
+                continue;
+            }
+            os.write(str.data() + clean_from, i - clean_from);
+            os.write(replacement, sizeof(replacement) - 1);
+            i += bad;
+            clean_from = i;
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            ++i;
+            continue;
+        }
+        os.write(str.data() + clean_from, i - clean_from);
+        clean_from = ++i;
+        switch (c) {
+        case '"':
+            os << "\\\"";
+            break;
+        case '\\':
+            os << "\\\\";
+            break;
+        case '\b':
+            os << "\\b";
+            break;
+        case '\f':
+            os << "\\f";
+            break;
+        case '\n':
+            os << "\\n";
+            break;
+        case '\r':
+            os << "\\r";
+            break;
+        case '\t':
+            os << "\\t";
+            break;
+        default:
+            os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        }
+    }
+    os.write(str.data() + clean_from, str.size() - clean_from);
+    os.put('"');
+}
+
+template <typename It>
+void connection_t::write_messages(It begin, It end) {
+
+    // Written directly rather than through a `json` object to avoid copying
+    // every message; the output is identical to what `json::dump` produces
+    body_stream_.put('[');
 
-    for (const auto& item : items) {
-        json message;
-        message["hash"] = item.hash;
+    for (It it = begin; it != end; ++it) {
+        if (it != begin) {
+            body_stream_.put(',');
+        }
+        const auto& item = *it;
+        body_stream_ << "{\"data\":";
+        write_json_string(body_stream_, item.data);
         /// TODO: calculate expiration time once only?
-        message["expiration"] = item.timestamp + item.ttl;
-        message["data"] = item.data;
-        messages.push_back(message);
+        body_stream_ << ",\"expiration\":" << item.timestamp + item.ttl
+                     << ",\"hash\":";
+        write_json_string(body_stream_, item.hash);
+        body_stream_.put('}');
     }
 
-    res_body["messages"] = messages;
+    body_stream_.put(']');
+}
+
+template <typename Messages>
+void connection_t::respond_with_messages(const Messages& items) {
+
+    body_stream_ << "{\"messages\":";
+    write_messages(items.begin(), items.end());
+    body_stream_.put('}');
 
     response_.result(http::status::ok);
     response_.set(http::field::content_type, "application/json");
-    body_stream_ << res_body.dump();
 
     this->write_response();
 }
@@ -941,14 +1198,23 @@ void connection_t::respond_with_messages(const std::vector<T>& items) {
 void connection_t::poll_db(const std::string& pk,
                            const std::string& last_hash) {
 
-    std::vector<Item> items;
+    service_node_.retrieve(pk, last_hash,
+                           [self = shared_from_this(),
+                            pk](bool success, const RetrieveBuffer& items) {
+                               self->on_db_polled(pk, success, items);
+                           });
+}
+
+void connection_t::on_db_polled(const std::string& pk, bool success,
+                                const RetrieveBuffer& items) {
 
-    if (!service_node_.retrieve(pk, last_hash, items)) {
+    if (!success) {
         response_.result(http::status::internal_server_error);
         response_.set(http::field::content_type, "text/plain");
         ARQMA_LOG(critical,
                   "Internal Server Error. Could not retrieve messages for {}",
                   obfuscate_pubkey(pk));
+        this->write_response();
         return;
     }
 
@@ -987,7 +1253,7 @@ void connection_t::poll_db(const std::string& pk,
                 ARQMA_LOG(trace, "Notification timer expired");
                 // If we are here, the notification timer expired
                 // with no messages ready
-                respond_with_messages<Item>({});
+                respond_with_messages(std::vector<message_t>{});
             }
 
             service_node_.remove_listener(pk, self.get());
@@ -1040,6 +1306,115 @@ void connection_t::process_retrieve(const json& params) {
     poll_db(pk.str(), last_hash);
 }
 
+// Most pubkeys a single `retrieve_batch` may ask for
+constexpr size_t MAX_RETRIEVE_BATCH_SIZE = 64;
+
+void connection_t::process_retrieve_batch(const json& params) {
+
+    const auto requests_it = params.find("requests");
+    if (requests_it == params.end() || !requests_it->is_array()) {
+        response_.result(http::status::bad_request);
+        body_stream_ << "invalid json: no `requests` field\n";
+        ARQMA_LOG(debug, "Bad client request: no `requests` field");
+        return;
+    }
+
+    if (requests_it->empty() ||
+        requests_it->size() > MAX_RETRIEVE_BATCH_SIZE) {
+        response_.result(http::status::bad_request);
+        body_stream_ << fmt::format("Batch must hold 1 to {} requests\n",
+                                    MAX_RETRIEVE_BATCH_SIZE);
+        ARQMA_LOG(debug, "Bad client request: batch of {} requests",
+                  requests_it->size());
+        return;
+    }
+
+    std::vector<Database::RetrieveRequest> requests;
+    requests.reserve(requests_it->size());
+
+    for (const auto& request : *requests_it) {
+
+        service_node_.all_stats_.bump_retrieve_requests();
+
+        constexpr const char* fields[] = {"pubKey", "lastHash"};
+
+        for (const auto& field : fields) {
+            if (!request.is_object() || !request.contains(field) ||
+                !request[field].is_string()) {
+                response_.result(http::status::bad_request);
+                body_stream_ << fmt::format(
+                    "invalid json: no `{}` field in a request\n", field);
+                ARQMA_LOG(debug, "Bad client request: no `{}` field", field);
+                return;
+            }
+        }
+
+        bool success;
+        const auto pk = user_pubkey_t::create(
+            request["pubKey"].get<std::string>(), success);
+
+        if (!success) {
+            response_.result(http::status::bad_request);
+            body_stream_ << fmt::format("PubKey must be {} characters long\n",
+                                        get_user_pubkey_size());
+            ARQMA_LOG(debug, "Pubkey must be {} characters long ",
+                      get_user_pubkey_size());
+            return;
+        }
+
+        // A batch can only be answered by a single swarm, so clients polling
+        // pubkeys of different swarms need to send a batch to each
+        if (!service_node_.is_pubkey_for_us(pk)) {
+            handle_wrong_swarm(pk);
+            return;
+        }
+
+        requests.push_back({pk.str(), request["lastHash"].get<std::string>()});
+    }
+
+    delay_response_ = true;
+
+    service_node_.retrieve_batch(
+        std::move(requests),
+        [self = shared_from_this()](
+            bool success, const RetrieveBuffer& items,
+            const std::vector<std::pair<size_t, size_t>>& ranges) {
+            self->on_batch_retrieved(success, items, ranges);
+        });
+}
+
+void connection_t::on_batch_retrieved(
+    bool success, const RetrieveBuffer& items,
+    const std::vector<std::pair<size_t, size_t>>& ranges) {
+
+    if (!success) {
+        response_.result(http::status::internal_server_error);
+        response_.set(http::field::content_type, "text/plain");
+        ARQMA_LOG(critical, "Internal Server Error. Could not retrieve "
+                            "messages for a batch");
+        this->write_response();
+        return;
+    }
+
+    // One entry per request, in the order they were sent
+    body_stream_ << "{\"results\":[";
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (i > 0) {
+            body_stream_.put(',');
+        }
+        body_stream_ << "{\"messages\":";
+        write_messages(RetrieveBuffer::const_iterator(&items, ranges[i].first),
+                       RetrieveBuffer::const_iterator(&items, ranges[i].second));
+        body_stream_.put('}');
+    }
+    body_stream_ << "]}";
+
+    response_.result(http::status::ok);
+    response_.set(http::field::content_type, "application/json");
+
+    this->write_response();
+}
+
 void connection_t::process_client_req() {
     std::string plain_text = request_.body();
     const std::string client_ip =
@@ -1057,11 +1432,30 @@ void connection_t::process_client_req() {
         return;
     }
 
+    const auto mode_it = request_.find(ARQMA_CHANNEL_MODE_HEADER);
+    if (mode_it != request_.end()) {
+        const auto mode = mode_it->value();
+        if (mode == CHANNEL_MODE_XCHACHA20) {
+            channel_mode_ = ChannelMode::XChaCha20;
+        } else if (mode != CHANNEL_MODE_AES_CBC) {
+            response_.result(http::status::bad_request);
+            body_stream_ << "Unknown channel mode: " << mode << "\n";
+            ARQMA_LOG(debug, "Bad client request: unknown channel mode");
+            return;
+        }
+    }
+
     try {
-        const std::string decoded =
-            boost::beast::detail::base64_decode(plain_text);
-        plain_text =
-            channel_cipher_.decrypt(decoded, header_[ARQMA_EPHEMKEY_HEADER]);
+        channel_key_ = channel_cipher_.get_shared_key(
+            header_[ARQMA_EPHEMKEY_HEADER], channel_mode_);
+        if (channel_mode_ == ChannelMode::XChaCha20) {
+            // Raw binary body
+            ChannelEncryption<std::string>::decrypt_xchacha20(
+                request_.body(), *channel_key_, plain_text);
+        } else {
+            const std::string decoded = util::base64_decode(plain_text);
+            plain_text = channel_cipher_.decrypt(decoded, *channel_key_);
+        }
     } catch (const std::exception& e) {
         response_.result(http::status::bad_request);
         response_.set(http::field::content_type, "text/plain");
@@ -1102,6 +1496,8 @@ void connection_t::process_client_req() {
         process_store(*params_it);
     } else if (method_name == "retrieve") {
         process_retrieve(*params_it);
+    } else if (method_name == "retrieve_batch") {
+        process_retrieve_batch(*params_it);
     } else if (method_name == "get_snodes_for_pubkey") {
         process_snodes_by_pk(*params_it);
     } else {
@@ -1161,8 +1557,25 @@ void connection_t::on_shutdown(boost::system::error_code ec) {
 }
 
 void connection_t::on_get_stats() {
-    this->body_stream_ << service_node_.get_stats();
-    this->response_.result(http::status::ok);
+
+    // The database's stats are read on a storage thread
+    delay_response_ = true;
+
+    service_node_.get_stats([self = shared_from_this()](std::string json_str) {
+        auto stats = json::parse(json_str);
+
+        const auto cache = self->channel_cipher_.get_cache_stats();
+        const uint64_t lookups = cache.hits + cache.misses;
+        stats["channel_key_cache_hits"] = cache.hits;
+        stats["channel_key_cache_misses"] = cache.misses;
+        stats["channel_key_cache_size"] = cache.size;
+        stats["channel_key_cache_hit_rate"] =
+            lookups ? static_cast<double>(cache.hits) / lookups : 0.0;
+
+        self->body_stream_ << stats.dump(4);
+        self->response_.result(http::status::ok);
+        self->write_response();
+    });
 }
 
 void connection_t::on_get_logs() {
@@ -16,12 +16,18 @@
 
 #include "swarm.h"
 #include "arqmad_key.h"
+#include "channel_encryption.hpp"
 
 constexpr auto ARQMA_SENDER_SNODE_PUBKEY_HEADER = "X-Arqma-Snode-PubKey";
 constexpr auto ARQMA_SNODE_SIGNATURE_HEADER = "X-Arqma-Snode-Signature";
-
-template <typename T>
-class ChannelEncryption;
+// Which snapshot a chunk sent to /swarms/snapshot/v1 belongs to, where in
+// it the chunk goes and how large the whole snapshot is
+constexpr auto ARQMA_SNAPSHOT_ID_HEADER = "X-Arqma-Snapshot-Id";
+constexpr auto ARQMA_SNAPSHOT_OFFSET_HEADER = "X-Arqma-Snapshot-Offset";
+constexpr auto ARQMA_SNAPSHOT_SIZE_HEADER = "X-Arqma-Snapshot-Size";
+// Newest message encoding (a `WireFormat`) the sender of a snode request
+// understands, absent for senders that only know v1
+constexpr auto ARQMA_WIRE_FORMAT_HEADER = "X-Arqma-Wire-Format";
 
 class RateLimiter;
 
@@ -34,6 +40,8 @@ using response_t = http::response<http::string_body>;
 namespace arqma {
 struct message_t;
 struct Security;
+class RetrieveBuffer;
+enum class MessageTestStatus;
 
 namespace storage {
 struct Item;
@@ -163,6 +171,12 @@ class connection_t : public std::enable_shared_from_this<connection_t> {
 
     ChannelEncryption<std::string>& channel_cipher_;
 
+    // Key shared with the client's ephemeral pubkey, derived once when
+    // decrypting the request and reused to encrypt the response
+    boost::optional<SharedSecretCache::secret_t> channel_key_;
+
+    ChannelMode channel_mode_ = ChannelMode::AesCbc;
+
     RateLimiter& rate_limiter_;
 
     // The timer for repeating an action within one connection
@@ -229,6 +243,10 @@ class connection_t : public std::enable_shared_from_this<connection_t> {
     /// Check the database for new data, reschedule if empty
     void poll_db(const std::string& pk, const std::string& last_hash);
 
+    /// Respond with the messages found by `poll_db`, or wait for new ones
+    void on_db_polled(const std::string& pk, bool success,
+                      const RetrieveBuffer& items);
+
     /// Determine what needs to be done with the request message
     /// (synchronously).
     void process_request();
@@ -239,12 +257,26 @@ class connection_t : public std::enable_shared_from_this<connection_t> {
 
     void process_retrieve(const nlohmann::json& params);
 
+    /// Retrieve for every `{pubKey, lastHash}` in `params["requests"]`,
+    /// answering with the messages for each, in order, in one response
+    void process_retrieve_batch(const nlohmann::json& params);
+
+    void on_batch_retrieved(
+        bool success, const RetrieveBuffer& items,
+        const std::vector<std::pair<size_t, size_t>>& ranges);
+
     void process_snodes_by_pk(const nlohmann::json& params);
 
     void process_retrieve_all();
 
-    template <typename T>
-    void respond_with_messages(const std::vector<T>& messages);
+    /// `Messages` is any range of items with `hash`, `timestamp`, `ttl`
+    /// and `data` (`Item`, `message_t` or a `RetrieveBuffer`)
+    template <typename Messages>
+    void respond_with_messages(const Messages& messages);
+
+    /// Write the items from `begin` to `end` as a JSON array of messages
+    template <typename It>
+    void write_messages(It begin, It end);
 
     /// Asynchronously transmit the response message.
     void write_response();
@@ -262,6 +294,12 @@ class connection_t : public std::enable_shared_from_this<connection_t> {
                                   const std::string& tester_addr,
                                   const std::string& msg_hash);
 
+    void on_storage_test_processed(uint64_t height,
+                                   const std::string& tester_addr,
+                                   const std::string& msg_hash,
+                                   MessageTestStatus status,
+                                   const std::string& answer);
+
     void process_blockchain_test_req(uint64_t height,
                                      const std::string& tester_pk,
                                      bc_test_params_t params);
@@ -101,8 +101,17 @@ int main(int argc, char* argv[]) {
         exit(EXIT_INVALID_PORT);
     }
 
+    arqma::StorageProfile db_profile;
+    try {
+        db_profile = arqma::StorageProfile::from_name(options.db_profile);
+    } catch (const std::exception&) {
+        ARQMA_LOG(error, "Incorrect database profile: {}", options.db_profile);
+        return EXIT_FAILURE;
+    }
+
     ARQMA_LOG(info, "Setting log level to {}", options.log_level);
     ARQMA_LOG(info, "Setting database location to {}", options.data_dir);
+    ARQMA_LOG(info, "Setting database profile to {}", db_profile.name);
     ARQMA_LOG(info, "Setting Arqmad RPC to {}:{}", options.arqmad_rpc_ip, options.arqmad_rpc_port);
     ARQMA_LOG(info, "Listening at address {} port {}", options.ip, options.port);
 
@@ -159,7 +168,8 @@ int main(int argc, char* argv[]) {
         arqma::arqmad_key_pair_t arqmad_key_pair_x25519{private_key_x25519, public_key_x25519};
 
         arqma::ServiceNode service_node(ioc, worker_ioc, options.port, arqmad_key_pair, arqmad_key_pair_x25519,
-                                        options.data_dir, arqmad_client, options.force_start);
+                                        options.data_dir, options.db_shards, db_profile, arqmad_client,
+                                        options.force_start);
         RateLimiter rate_limiter;
 
         arqma::Security security(arqmad_key_pair, options.data_dir);
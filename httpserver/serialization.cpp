@@ -4,22 +4,17 @@
 #include "Item.hpp"
 #include "arqma_logger.h"
 #include "service_node.h"
+#include "utils.hpp"
 
 #include <boost/endian/conversion.hpp>
 #include <boost/format.hpp>
 
+#include <cstring>
+
 using arqma::storage::Item;
 
 namespace arqma {
 
-template <typename T>
-static T deserialize_integer(std::string::const_iterator& it) {
-
-    const auto b1 = reinterpret_cast<const T&>(*it);
-    it += sizeof(T);
-    return boost::endian::little_to_native(b1);
-}
-
 template <typename T>
 static void serialize_integer(std::string& buf, T a) {
     boost::endian::native_to_little_inplace(a);
@@ -34,8 +29,93 @@ static void serialize(std::string& buf, const std::string& str) {
     buf += str;
 }
 
+// Flags of a v2 message, telling how its fields are encoded
+constexpr uint8_t V2_BINARY_PUBKEY = 1 << 0;
+constexpr uint8_t V2_BINARY_HASH = 1 << 1;
+constexpr uint8_t V2_HAS_DATA = 1 << 2;
+constexpr uint8_t V2_HAS_NONCE = 1 << 3;
+
+// LEB128: 7 bits at a time, least significant first
+static void serialize_varint(std::string& buf, uint64_t value) {
+    while (value >= 0x80) {
+        buf.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    buf.push_back(static_cast<char>(value));
+}
+
+static void serialize_varint_string(std::string& buf, std::string_view str) {
+    serialize_varint(buf, str.size());
+    buf.append(str.data(), str.size());
+}
+
+// Write `key` as the bytes it encodes, with their number, if it is
+// lowercase hex (so that encoding the bytes again gives back the key).
+// Return false and leave `buf` as it was otherwise.
+static bool serialize_hex(std::string& buf, std::string_view key) {
+
+    if (key.empty() || key.size() % 2 != 0) {
+        return false;
+    }
+    const size_t start = buf.size();
+    serialize_varint(buf, key.size() / 2);
+    const size_t bytes_start = buf.size();
+    buf.resize(bytes_start + key.size() / 2);
+    if (!util::hex_decode(key.data(), key.size(),
+                          reinterpret_cast<uint8_t*>(&buf[bytes_start]),
+                          true)) {
+        buf.resize(start);
+        return false;
+    }
+    return true;
+}
+
+template <typename T>
+static void serialize_message_v2(std::string& res, const T& msg) {
+
+    // Keys, integers and lengths take at most their size in binary plus 10
+    // bytes each
+    res.reserve(res.size() + 1 + msg.pub_key.size() + msg.hash.size() +
+                msg.data.size() + msg.nonce.size() + 6 * 10);
+
+    // Set once the keys are written
+    const size_t flags_pos = res.size();
+    res.push_back(0);
+
+    uint8_t flags = 0;
+    if (serialize_hex(res, msg.pub_key)) {
+        flags |= V2_BINARY_PUBKEY;
+    } else {
+        serialize_varint_string(res, msg.pub_key);
+    }
+    if (serialize_hex(res, msg.hash)) {
+        flags |= V2_BINARY_HASH;
+    } else {
+        serialize_varint_string(res, msg.hash);
+    }
+    serialize_varint(res, msg.ttl);
+    serialize_varint(res, msg.timestamp);
+    if (!msg.data.empty()) {
+        flags |= V2_HAS_DATA;
+        serialize_varint_string(res, msg.data);
+    }
+    if (!msg.nonce.empty()) {
+        flags |= V2_HAS_NONCE;
+        serialize_varint_string(res, msg.nonce);
+    }
+    res[flags_pos] = static_cast<char>(flags);
+}
+
 template <typename T>
-void serialize_message(std::string& res, const T& msg) {
+void serialize_message(std::string& res, const T& msg, WireFormat format) {
+
+    if (format == WireFormat::V2) {
+        if (res.empty()) {
+            res.push_back(static_cast<char>(WireFormat::V2));
+        }
+        serialize_message_v2(res, msg);
+        return;
+    }
 
     /// TODO: use binary / base64 representation for pk
     res += msg.pub_key;
@@ -48,21 +128,22 @@ void serialize_message(std::string& res, const T& msg) {
     ARQMA_LOG(trace, "serialized message: {}", msg.data);
 }
 
-template void serialize_message(std::string& res, const message_t& msg);
-template void serialize_message(std::string& res, const Item& msg);
+template void serialize_message(std::string& res, const message_t& msg,
+                                WireFormat format);
+template void serialize_message(std::string& res, const Item& msg,
+                                WireFormat format);
 
 template <typename T>
-std::vector<std::string> serialize_messages(const std::vector<T>& msgs) {
+std::vector<std::string> serialize_messages(const std::vector<T>& msgs,
+                                            WireFormat format) {
 
     std::vector<std::string> res;
 
     std::string buf;
 
-    constexpr size_t BATCH_SIZE = 500000;
-
     for (const auto& msg : msgs) {
-        serialize_message(buf, msg);
-        if (buf.size() > BATCH_SIZE) {
+        serialize_message(buf, msg, format);
+        if (buf.size() > SERIALIZATION_BATCH_SIZE) {
             res.push_back(std::move(buf));
             buf.clear();
         }
@@ -76,116 +157,277 @@ std::vector<std::string> serialize_messages(const std::vector<T>& msgs) {
 }
 
 template std::vector<std::string>
-serialize_messages(const std::vector<message_t>& msgs);
+serialize_messages(const std::vector<message_t>& msgs, WireFormat format);
 
 template std::vector<std::string>
-serialize_messages(const std::vector<Item>& msgs);
+serialize_messages(const std::vector<Item>& msgs, WireFormat format);
 
-struct string_view {
+BatchSerializer::BatchSerializer(WireFormat format) : format_(format) {}
 
-    std::string::const_iterator it;
-    const std::string::const_iterator it_end;
+// Small enough to stay in L1/L2 cache between being written and hashed
+constexpr size_t HASH_CHUNK_SIZE = 16 * 1024;
 
-    string_view(const std::string& data)
-        : it(data.begin()), it_end(data.end()) {}
+template <typename T>
+void BatchSerializer::add(const T& msg) {
+    serialize_message(buf_, msg, format_);
+    if (buf_.size() - hashed_ >= HASH_CHUNK_SIZE) {
+        hash_tail();
+    }
+}
 
-    size_t size() { return it_end - it; }
+template void BatchSerializer::add(const message_t& msg);
+template void BatchSerializer::add(const Item& msg);
 
-    bool empty() { return it_end <= it; }
-};
+void BatchSerializer::hash_tail() {
+    hasher_.update(std::string_view(buf_).substr(hashed_));
+    hashed_ = buf_.size();
+}
 
-static boost::optional<std::string> deserialize_string(string_view& slice,
-                                                       size_t len) {
+hash BatchSerializer::finish(std::string& body) {
+    hash_tail();
+    body = std::move(buf_);
+    buf_.clear();
+    hashed_ = 0;
+    return hasher_.finish();
+}
 
-    if (slice.size() < len) {
-        return boost::none;
-    }
+// The `deserialize_*` functions read from the front of `in` and advance it
+// past what they read, if they could read it
 
-    const auto res = std::string(slice.it, slice.it + len);
-    slice.it += len;
+template <typename T>
+static bool deserialize_integer(std::string_view& in, T& value) {
 
-    return res;
+    if (in.size() < sizeof(T)) {
+        return false;
+    }
+    // The body has no alignment guarantees
+    std::memcpy(&value, in.data(), sizeof(T));
+    boost::endian::little_to_native_inplace(value);
+    in.remove_prefix(sizeof(T));
+    return true;
 }
 
-static boost::optional<std::string> deserialize_string(string_view& slice) {
+static bool deserialize_string(std::string_view& in, size_t len,
+                               std::string_view& str) {
 
-    if (slice.size() < sizeof(size_t))
-        return boost::none;
+    if (in.size() < len) {
+        return false;
+    }
+    str = in.substr(0, len);
+    in.remove_prefix(len);
+    return true;
+}
 
-    const auto len =
-        deserialize_integer<size_t>(slice.it); // already increments `it`!
+static bool deserialize_string(std::string_view& in, std::string_view& str) {
 
-    return deserialize_string(slice, len);
+    size_t len;
+    std::string_view rest = in;
+    if (!deserialize_integer(rest, len) ||
+        !deserialize_string(rest, len, str)) {
+        return false;
+    }
+    in = rest;
+    return true;
 }
 
-static boost::optional<uint64_t> deserialize_uint64(string_view& slice) {
+static bool deserialize_varint(std::string_view& in, uint64_t& value) {
 
-    if (slice.size() < sizeof(uint64_t))
-        return boost::none;
+    value = 0;
+    for (size_t i = 0; i < in.size() && i < 10; ++i) {
+        const auto byte = static_cast<uint8_t>(in[i]);
+        value |= uint64_t(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            in.remove_prefix(i + 1);
+            return true;
+        }
+    }
+    return false;
+}
 
-    const auto res = deserialize_integer<uint64_t>(slice.it);
+static bool deserialize_varint_string(std::string_view& in,
+                                      std::string_view& str) {
 
-    return res;
+    uint64_t len;
+    std::string_view rest = in;
+    if (!deserialize_varint(rest, len) ||
+        !deserialize_string(rest, len, str)) {
+        return false;
+    }
+    in = rest;
+    return true;
 }
 
-std::vector<message_t> deserialize_messages(const std::string& blob) {
+static bool deserialize_messages_v1(std::string_view blob,
+                                    std::vector<storage::ItemView>& messages) {
 
-    ARQMA_LOG(trace, "=== Deserializing ===");
-
-    std::vector<message_t> result;
+    while (!blob.empty()) {
 
-    string_view slice{blob};
+        storage::ItemView msg;
 
-    while (!slice.empty()) {
-
-        /// Deserialize PK
-        auto pk = deserialize_string(slice, arqma::get_user_pubkey_size());
-        if (!pk) {
+        if (!deserialize_string(blob, arqma::get_user_pubkey_size(),
+                                msg.pub_key)) {
             ARQMA_LOG(debug, "Could not deserialize pk");
-            return {};
+            return false;
         }
 
-        /// Deserialize Hash
-        auto hash = deserialize_string(slice);
-        if (!hash) {
+        if (!deserialize_string(blob, msg.hash)) {
             ARQMA_LOG(debug, "Could not deserialize hash");
-            return {};
+            return false;
         }
 
-        /// Deserialize Data
-        auto data = deserialize_string(slice);
-        if (!data) {
+        if (!deserialize_string(blob, msg.data)) {
             ARQMA_LOG(debug, "Could not deserialize data");
-            return {};
+            return false;
         }
 
-        /// Deserialize TTL
-        auto ttl = deserialize_uint64(slice);
-        if (!ttl) {
+        if (!deserialize_integer(blob, msg.ttl)) {
             ARQMA_LOG(debug, "Could not deserialize ttl");
-            return {};
+            return false;
         }
 
-        /// Deserialize Timestamp
-        auto timestamp = deserialize_uint64(slice);
-        if (!timestamp) {
+        if (!deserialize_integer(blob, msg.timestamp)) {
             ARQMA_LOG(debug, "Could not deserialize timestamp");
-            return {};
+            return false;
+        }
+
+        // Still sent, but not used any more
+        std::string_view unused_nonce;
+        if (!deserialize_string(blob, unused_nonce)) {
+            ARQMA_LOG(debug, "Could not deserialize nonce");
+            return false;
+        }
+
+        msg.expiration_timestamp = msg.timestamp + msg.ttl;
+        messages.push_back(msg);
+    }
+
+    return true;
+}
+
+// Read a key, appending the hex encoding of a binary one to `keys` and
+// setting `hex_key` to where it went there
+static bool deserialize_key(std::string_view& in, bool binary,
+                            std::string& keys, std::string_view& key,
+                            std::pair<size_t, size_t>& hex_key) {
+
+    if (!deserialize_varint_string(in, key)) {
+        return false;
+    }
+    if (binary) {
+        hex_key = {keys.size(), 2 * key.size()};
+        keys.resize(keys.size() + 2 * key.size());
+        util::hex_encode(reinterpret_cast<const uint8_t*>(key.data()),
+                         key.size(), &keys[hex_key.first]);
+    }
+    return true;
+}
+
+static bool deserialize_messages_v2(std::string_view blob,
+                                    std::vector<storage::ItemView>& messages,
+                                    std::string& keys) {
+
+    // `keys` may move while it is filled, so the views into it are only
+    // made at the end
+    struct hex_keys_t {
+        size_t message;
+        std::pair<size_t, size_t> pub_key{0, 0};
+        std::pair<size_t, size_t> hash{0, 0};
+    };
+    std::vector<hex_keys_t> hex_keys;
+
+    while (!blob.empty()) {
+
+        storage::ItemView msg;
+
+        const auto flags = static_cast<uint8_t>(blob.front());
+        blob.remove_prefix(1);
+
+        hex_keys_t hex{messages.size()};
+        if (!deserialize_key(blob, flags & V2_BINARY_PUBKEY, keys, msg.pub_key,
+                             hex.pub_key)) {
+            ARQMA_LOG(debug, "Could not deserialize pk");
+            return false;
+        }
+
+        if (!deserialize_key(blob, flags & V2_BINARY_HASH, keys, msg.hash,
+                             hex.hash)) {
+            ARQMA_LOG(debug, "Could not deserialize hash");
+            return false;
         }
 
-        /// Deserialize Nonce
-        auto unused_nonce = deserialize_string(slice);
+        if (!deserialize_varint(blob, msg.ttl) ||
+            !deserialize_varint(blob, msg.timestamp)) {
+            ARQMA_LOG(debug, "Could not deserialize ttl or timestamp");
+            return false;
+        }
 
+        if ((flags & V2_HAS_DATA) && !deserialize_varint_string(blob, msg.data)) {
+            ARQMA_LOG(debug, "Could not deserialize data");
+            return false;
+        }
 
-        ARQMA_LOG(trace, "Deserialized data: {}", *data);
+        if ((flags & V2_HAS_NONCE) &&
+            !deserialize_varint_string(blob, msg.nonce)) {
+            ARQMA_LOG(debug, "Could not deserialize nonce");
+            return false;
+        }
 
-        ARQMA_LOG(trace, "pk: {}, msg: {}", *pk, *data);
+        msg.expiration_timestamp = msg.timestamp + msg.ttl;
+        messages.push_back(msg);
+        if (flags & (V2_BINARY_PUBKEY | V2_BINARY_HASH)) {
+            hex_keys.push_back(hex);
+        }
+    }
 
-        result.push_back({*pk, *data, *hash, *ttl, *timestamp});
+    const std::string_view all_keys = keys;
+    for (const auto& hex : hex_keys) {
+        auto& msg = messages[hex.message];
+        if (hex.pub_key.second) {
+            msg.pub_key = all_keys.substr(hex.pub_key.first, hex.pub_key.second);
+        }
+        if (hex.hash.second) {
+            msg.hash = all_keys.substr(hex.hash.first, hex.hash.second);
+        }
     }
 
+    return true;
+}
+
+bool deserialize_messages(std::string_view blob,
+                          std::vector<storage::ItemView>& messages,
+                          std::string& keys) {
+
+    ARQMA_LOG(trace, "=== Deserializing ===");
+
+    messages.clear();
+    keys.clear();
+
+    const bool v2 =
+        !blob.empty() && blob.front() == static_cast<char>(WireFormat::V2);
+    const bool success =
+        v2 ? deserialize_messages_v2(blob.substr(1), messages, keys)
+           : deserialize_messages_v1(blob, messages);
+
     ARQMA_LOG(trace, "=== END ===");
 
+    return success;
+}
+
+std::vector<message_t> deserialize_messages(const std::string& blob) {
+
+    std::vector<storage::ItemView> views;
+    std::string keys;
+    if (!deserialize_messages(blob, views, keys)) {
+        return {};
+    }
+
+    std::vector<message_t> result;
+    result.reserve(views.size());
+    for (const auto& view : views) {
+        result.emplace_back(std::string(view.pub_key), std::string(view.data),
+                            std::string(view.hash), view.ttl, view.timestamp);
+        result.back().nonce = std::string(view.nonce);
+    }
     return result;
 }
 
@@ -1,22 +1,85 @@
 #pragma once
 
+#include "signature.h"
+
+#include <stdint.h>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace arqma {
 
 namespace storage {
 struct Item;
-}
+struct ItemView;
+} // namespace storage
 
 struct message_t;
 
+// Serialized messages are split into push batches of about this many bytes
+constexpr size_t SERIALIZATION_BATCH_SIZE = 500000;
+
+/// How messages are encoded in batches sent to other snodes. A v1 batch is
+/// just its messages, with lengths as 8-byte integers and keys as hex. A v2
+/// batch starts with its version byte (which a v1 batch can't start with, as
+/// it starts with a hex pubkey) followed by messages with varint lengths and
+/// integers, keys in binary and empty fields left out. Peers are only sent
+/// v2 once they have announced that they understand it.
+enum class WireFormat : uint8_t { V1 = 1, V2 = 2 };
+
+constexpr WireFormat LATEST_WIRE_FORMAT = WireFormat::V2;
+
+// Append `msg` to the batch in `buf`, which in v2 starts with a header
+// written if `buf` is empty
 template <typename T>
-void serialize_message(std::string& buf, const T& msg);
+void serialize_message(std::string& buf, const T& msg,
+                       WireFormat format = WireFormat::V1);
 
 template <typename T>
-std::vector<std::string> serialize_messages(const std::vector<T>& msgs);
+std::vector<std::string>
+serialize_messages(const std::vector<T>& msgs,
+                   WireFormat format = WireFormat::V1);
+
+/// Serializes messages into one batch at a time, hashing the bytes as they
+/// are written, so that a batch is ready to be signed and sent as it is
+/// finished without going over it again
+class BatchSerializer {
+  public:
+    explicit BatchSerializer(WireFormat format = WireFormat::V1);
+
+    template <typename T>
+    void add(const T& msg);
+
+    // Whether the batch has reached `SERIALIZATION_BATCH_SIZE`
+    bool full() const { return buf_.size() > SERIALIZATION_BATCH_SIZE; }
 
+    bool empty() const { return buf_.empty(); }
+
+    WireFormat format() const { return format_; }
+
+    // Move the batch into `body`, return its hash and start the next one
+    hash finish(std::string& body);
+
+  private:
+    // Hash what was written since `hashed_` bytes
+    void hash_tail();
+
+    WireFormat format_;
+    std::string buf_;
+    incremental_hasher hasher_;
+    // Bytes of `buf_` hashed so far: hashing a few messages at a time costs
+    // less than one at a time while they are still in cache
+    size_t hashed_ = 0;
+};
+
+// Batches of either format
 std::vector<message_t> deserialize_messages(const std::string& blob);
 
+// Same without copying anything: `messages` are set to views into `blob`,
+// valid for as long as it is, and into `keys`, which holds the hex encodings
+// of keys sent in binary. Return false if `blob` is malformed.
+bool deserialize_messages(std::string_view blob,
+                          std::vector<storage::ItemView>& messages,
+                          std::string& keys);
+
 } // namespace arqma
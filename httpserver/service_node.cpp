@@ -1,6 +1,7 @@
 #include "service_node.h"
 
 #include "Database.hpp"
+#include "GroupCommitter.hpp"
 #include "Item.hpp"
 #include "arqma_common.h"
 #include "arqma_logger.h"
@@ -17,10 +18,16 @@
 
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <mutex>
+#include <random>
+
+#include <boost/filesystem.hpp>
 
 using json = nlohmann::json;
 using arqma::storage::Item;
+using arqma::storage::ItemView;
 using namespace std::chrono_literals;
 namespace sp = std::placeholders;
 
@@ -35,6 +42,16 @@ constexpr std::array<std::chrono::seconds, 8> RETRY_INTERVALS = {
 
 constexpr std::chrono::milliseconds RELAY_INTERVAL = 350ms;
 
+// Snapshots are sent in chunks of this size, which keeps every request well
+// under the body size the receiving end accepts
+constexpr uint64_t SNAPSHOT_CHUNK_SIZE = 512 * 1024;
+// A snapshot that hasn't made progress for this long is abandoned, which
+// is checked for this often
+constexpr std::chrono::minutes SNAPSHOT_RECEIVE_TIMEOUT = 10min;
+constexpr std::chrono::minutes SNAPSHOT_SWEEP_INTERVAL = 1min;
+// Larger snapshots are refused; their senders push all messages instead
+constexpr uint64_t SNAPSHOT_MAX_SIZE = 4ull * 1024 * 1024 * 1024;
+
 static void make_sn_request(boost::asio::io_context& ioc, const sn_record_t& sn,
                             const std::shared_ptr<request_t>& req,
                             http_callback_t&& cb) {
@@ -119,11 +136,43 @@ static std::shared_ptr<request_t> make_push_all_request(std::string&& data) {
   return make_post_request("/swarms/push_batch/v1", std::move(data));
 }
 
+/// A snapshot of our database being sent to new swarm members, removed
+/// once the last transfer is done with it
+struct outgoing_snapshot_t {
+    std::string path;
+    uint64_t id = 0;
+    uint64_t size = 0;
+    // Open for as long as any transfer is, and read on the storage threads
+    // by all of them
+    std::ifstream file;
+    std::mutex file_mutex;
+    // Peers still being sent the snapshot (only used on `ioc_`)
+    size_t unfinished = 0;
+    // Peers that couldn't take it, all pushed our messages at once when
+    // the last transfer is over
+    std::vector<sn_record_t> failed;
+
+    ~outgoing_snapshot_t() {
+        file.close();
+        std::remove(path.c_str());
+    }
+};
+
+/// The next chunk of an outgoing snapshot, read and signed on a storage
+/// thread
+struct snapshot_chunk_t {
+    bool success = false;
+    std::string data;
+    signature sig;
+};
+
 ServiceNode::ServiceNode(boost::asio::io_context& ioc, boost::asio::io_context& worker_ioc, uint16_t port,
                          const arqmad_key_pair_t& arqmad_key_pair, const arqma::arqmad_key_pair_t& key_pair_x25519,
-                         const std::string& db_location, ArqmadClient& arqmad_client, const bool force_start)
-  : ioc_(ioc), worker_ioc_(worker_ioc), db_(std::make_unique<Database>(ioc, db_location)), swarm_update_timer_(ioc),
-    arqmad_ping_timer_(ioc), stats_cleanup_timer_(ioc), check_version_timer_(worker_ioc),
+                         const std::string& db_location, size_t db_shards, const StorageProfile& db_profile,
+                         ArqmadClient& arqmad_client, const bool force_start)
+  : ioc_(ioc), worker_ioc_(worker_ioc), db_location_(db_location),
+    db_(std::make_unique<Database>(db_location, Database::DEFAULT_READER_COUNT, db_shards, db_profile)), swarm_update_timer_(ioc),
+    arqmad_ping_timer_(ioc), stats_cleanup_timer_(ioc), cache_expiry_timer_(ioc), snapshot_sweep_timer_(ioc), check_version_timer_(worker_ioc),
     peer_ping_timer_(ioc), relay_timer_(ioc), arqmad_key_pair_(arqmad_key_pair), arqmad_key_pair_x25519_(key_pair_x25519),
     arqmad_client_(arqmad_client), force_start_(force_start) {
 
@@ -143,6 +192,9 @@ ServiceNode::ServiceNode(boost::asio::io_context& ioc, boost::asio::io_context&
   ARQMA_LOG(info, "Read our snode address: {}", our_address_);
   swarm_ = std::make_unique<Swarm>(our_address_);
 
+  async_db_ = std::make_unique<AsyncDatabase>(ioc, *db_);
+  committer_ = std::make_unique<GroupCommitter>(ioc, *async_db_);
+
   ARQMA_LOG(info, "Requesting initial swarm state");
 
 #ifndef INTEGRATION_TEST
@@ -155,6 +207,8 @@ ServiceNode::ServiceNode(boost::asio::io_context& ioc, boost::asio::io_context&
   swarm_timer_tick();
   arqmad_ping_timer_tick();
   cleanup_timer_tick();
+  cache_expiry_timer_tick();
+  snapshot_sweep_timer_tick();
 
   ping_peers_tick();
 
@@ -310,7 +364,14 @@ bool ServiceNode::snode_ready(boost::optional<std::string&> reason) {
     return ready || force_start_;
 }
 
-ServiceNode::~ServiceNode() { worker_ioc_.stop(); };
+ServiceNode::~ServiceNode() {
+    // Don't lose stores that are still waiting for their batch
+    committer_->flush();
+    for (const auto& kv : incoming_snapshots_) {
+        std::remove(kv.second.path.c_str());
+    }
+    worker_ioc_.stop();
+};
 
 void ServiceNode::relay_data_reliable(const std::shared_ptr<request_t>& req,
                                       const sn_record_t& sn) const {
@@ -410,25 +471,8 @@ void ServiceNode::notify_listeners(const std::string& pk,
     }
 }
 
-void ServiceNode::reset_listeners() {
-
-    /// It is probably not worth it to try to
-    /// determine which connections needn't
-    /// be reset (most of them will need to be),
-    /// so we just reset all connections for
-    /// simplicity
-    for (auto& entry : pk_to_listeners) {
-        for (auto& c : entry.second) {
-            /// notify with no messages
-            c->notify(boost::none);
-        }
-    }
-
-    pk_to_listeners.clear();
-}
-
-/// do this asynchronously on a different thread? (on the same thread?)
-bool ServiceNode::process_store(const message_t& msg) {
+bool ServiceNode::process_store(const message_t& msg,
+                                std::function<void(bool)>&& on_committed) {
 
     /// only accept a message if we are in a swarm
     if (!swarm_) {
@@ -440,39 +484,74 @@ bool ServiceNode::process_store(const message_t& msg) {
     all_stats_.bump_store_requests();
 
     /// store in the database
-    this->save_if_new(msg);
+    this->save_if_new(msg, std::move(on_committed));
 
     this->relay_buffer_.push_back(msg);
 
     return true;
 }
 
-void ServiceNode::process_push(const message_t& msg)
+void ServiceNode::process_push(const message_t& msg,
+                               std::function<void(bool)>&& on_committed)
 {
-  save_if_new(msg);
+  save_if_new(msg, std::move(on_committed));
 }
 
-void ServiceNode::save_if_new(const message_t& msg) {
-
-    if (db_->store(msg.hash, msg.pub_key, msg.data, msg.ttl, msg.timestamp, msg.nonce)) {
-        notify_listeners(msg.pub_key, msg);
-        ARQMA_LOG(trace, "saved message: {}", msg.data);
-    }
+void ServiceNode::save_if_new(const message_t& msg,
+                              std::function<void(bool)>&& on_committed) {
+
+    Item item{msg.hash, msg.pub_key, msg.timestamp, msg.ttl,
+              msg.timestamp + msg.ttl, msg.nonce, msg.data};
+
+    committer_->store(
+        std::move(item),
+        [this, msg, on_committed = std::move(on_committed)](
+            CommitResult result) {
+            if (result == CommitResult::STORED) {
+                retrieve_cache_.add({msg.hash, msg.pub_key, msg.timestamp,
+                                     msg.ttl, msg.timestamp + msg.ttl,
+                                     msg.nonce, msg.data});
+                notify_listeners(msg.pub_key, msg);
+                ARQMA_LOG(trace, "saved message: {}", msg.data);
+            }
+            if (on_committed) {
+                on_committed(result != CommitResult::FAILED);
+            }
+        });
 }
 
-void ServiceNode::save_bulk(const std::vector<Item>& items) {
+void ServiceNode::save_bulk(std::shared_ptr<const void> owner,
+                            std::vector<ItemView>&& items) {
 
-    if (!db_->bulk_store(items)) {
-        ARQMA_LOG(error, "failed to save batch to the database");
-        return;
-    }
+    const size_t count = items.size();
 
-    ARQMA_LOG(trace, "saved messages count: {}", items.size());
+    async_db_->bulk_store(
+        std::move(items), std::move(owner),
+        [this, count](bool success, std::vector<ItemView> new_items) {
+            // Shards that did commit have stored their part of the batch,
+            // which still needs to reach the cache and the listeners
+            if (!success) {
+                ARQMA_LOG(error, "failed to save batch to the database");
+            }
 
-    // For batches, it is not trivial to get the list of saved (new)
-    // messages, so we are only going to "notify" clients with no data
-    // effectively resetting the connection.
-    reset_listeners();
+            ARQMA_LOG(trace, "saved messages count: {}, new: {}", count,
+                      new_items.size());
+
+            // Same as for a single store, but only for the messages we
+            // didn't have yet
+            for (const auto& view : new_items) {
+                const Item item(std::string(view.hash),
+                                std::string(view.pub_key), view.timestamp,
+                                view.ttl, view.expiration_timestamp,
+                                std::string(view.nonce),
+                                std::string(view.data));
+                message_t msg(item.pub_key, item.data, item.hash, item.ttl,
+                              item.timestamp);
+                msg.nonce = item.nonce;
+                retrieve_cache_.add(item);
+                notify_listeners(msg.pub_key, msg);
+            }
+        });
 }
 
 void ServiceNode::on_bootstrap_update(const block_update_t& bu) {
@@ -631,6 +710,39 @@ void ServiceNode::cleanup_timer_tick() {
         std::bind(&ServiceNode::cleanup_timer_tick, this));
 }
 
+void ServiceNode::cache_expiry_timer_tick() {
+
+    const uint64_t now_ms = util::get_time_ms();
+    retrieve_cache_.remove_expired(now_ms);
+
+    // Right after the next tick begins, when the database expires the same
+    // messages
+    const uint64_t tick_ms = ExpiryWheel<std::string>::DEFAULT_TICK_MS;
+    cache_expiry_timer_.expires_after(
+        std::chrono::milliseconds(tick_ms - now_ms % tick_ms));
+    cache_expiry_timer_.async_wait(
+        std::bind(&ServiceNode::cache_expiry_timer_tick, this));
+}
+
+void ServiceNode::snapshot_sweep_timer_tick() {
+
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = incoming_snapshots_.begin();
+         it != incoming_snapshots_.end();) {
+        if (now - it->second.last_chunk > SNAPSHOT_RECEIVE_TIMEOUT) {
+            ARQMA_LOG(debug, "Abandoning a snapshot from {}", it->first);
+            std::remove(it->second.path.c_str());
+            it = incoming_snapshots_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    snapshot_sweep_timer_.expires_after(SNAPSHOT_SWEEP_INTERVAL);
+    snapshot_sweep_timer_.async_wait(
+        std::bind(&ServiceNode::snapshot_sweep_timer_tick, this));
+}
+
 void ServiceNode::ping_peers_tick() {
     this->peer_ping_timer_.expires_after(PING_PEERS_INTERVAL);
     this->peer_ping_timer_.async_wait(
@@ -736,17 +848,6 @@ void ServiceNode::arqmad_ping_timer_tick() {
         std::bind(&ServiceNode::arqmad_ping_timer_tick, this));
 }
 
-static std::vector<std::shared_ptr<request_t>> make_batch_requests(std::vector<std::string>&& data)
-{
-  std::vector<std::shared_ptr<request_t>> result;
-  result.reserve(data.size());
-
-  std::transform(std::make_move_iterator(data.begin()),
-                 std::make_move_iterator(data.end()),
-                 std::back_inserter(result), make_push_all_request);
-  return result;
-}
-
 void ServiceNode::perform_blockchain_test(
     bc_test_params_t test_params,
     std::function<void(blockchain_test_answer_t)>&& cb) const {
@@ -802,6 +903,31 @@ void ServiceNode::attach_signature(std::shared_ptr<request_t>& request,
 void ServiceNode::attach_pubkey(std::shared_ptr<request_t>& request) const {
     request->set(ARQMA_SENDER_SNODE_PUBKEY_HEADER,
                  our_address_.pub_key_base32z());
+    // Sent along with every signed request, so that peers learn what they
+    // can push to us
+    request->set(ARQMA_WIRE_FORMAT_HEADER,
+                 std::to_string(static_cast<int>(LATEST_WIRE_FORMAT)));
+}
+
+void ServiceNode::record_wire_format(const std::string& pubkey_b32z,
+                                     WireFormat format) {
+    peer_wire_formats_[pubkey_b32z] = format;
+}
+
+WireFormat
+ServiceNode::wire_format_for(const std::vector<sn_record_t>& snodes) const {
+
+    // Batches are shared by all of `snodes`, so they have to be in a format
+    // every one of them understands
+    WireFormat format = LATEST_WIRE_FORMAT;
+    for (const auto& sn : snodes) {
+        const auto it = peer_wire_formats_.find(sn.pub_key_base32z());
+        if (it == peer_wire_formats_.end()) {
+            return WireFormat::V1;
+        }
+        format = std::min(format, it->second);
+    }
+    return format;
 }
 
 void abort_if_integration_test() {
@@ -1073,9 +1199,10 @@ bool ServiceNode::derive_tester_testee(uint64_t blk_height, sn_record_t& tester,
     return true;
 }
 
-MessageTestStatus ServiceNode::process_storage_test_req(
+void ServiceNode::process_storage_test_req(
     uint64_t blk_height, const std::string& tester_pk,
-    const std::string& msg_hash, std::string& answer) {
+    const std::string& msg_hash,
+    std::function<void(MessageTestStatus, std::string)>&& on_done) {
 
     // 1. Check height, retry if we are behind
     std::string block_hash;
@@ -1083,7 +1210,8 @@ MessageTestStatus ServiceNode::process_storage_test_req(
     if (blk_height > block_height_) {
         ARQMA_LOG(debug, "Our blockchain is behind, height: {}, requested: {}",
                   block_height_, blk_height);
-        return MessageTestStatus::RETRY;
+        on_done(MessageTestStatus::RETRY, "");
+        return;
     }
 
     // 2. Check tester/testee pair
@@ -1095,57 +1223,48 @@ MessageTestStatus ServiceNode::process_storage_test_req(
         if (testee != our_address_) {
             ARQMA_LOG(error, "We are NOT the testee for height: {}",
                       blk_height);
-            return MessageTestStatus::WRONG_REQ;
+            on_done(MessageTestStatus::WRONG_REQ, "");
+            return;
         }
 
         if (tester.pub_key_base32z() != tester_pk) {
             ARQMA_LOG(debug, "Wrong tester: {}, expected: {}", tester_pk,
                       tester.sn_address());
             abort_if_integration_test();
-            return MessageTestStatus::WRONG_REQ;
+            on_done(MessageTestStatus::WRONG_REQ, "");
+            return;
         } else {
             ARQMA_LOG(trace, "Tester is valid: {}", tester_pk);
         }
     }
 
     // 3. If for a current/past block, try to respond right away
-    Item item;
-    if (!db_->retrieve_by_hash(msg_hash, item)) {
-        return MessageTestStatus::RETRY;
-    }
-
-    answer = item.data;
-    return MessageTestStatus::SUCCESS;
+    async_db_->retrieve_by_hash(
+        msg_hash, [on_done = std::move(on_done)](bool found, Item item) {
+            if (!found) {
+                on_done(MessageTestStatus::RETRY, "");
+                return;
+            }
+            on_done(MessageTestStatus::SUCCESS, std::move(item.data));
+        });
 }
 
-bool ServiceNode::select_random_message(Item& item) {
-
-    uint64_t message_count;
-    if (!db_->get_message_count(message_count)) {
-        ARQMA_LOG(error, "Could not count messages in the database");
-        return false;
-    }
-
-    ARQMA_LOG(debug, "total messages: {}", message_count);
-
-    if (message_count == 0) {
-        ARQMA_LOG(debug, "No messages in the database to initiate a peer test");
-        return false;
-    }
+void ServiceNode::select_random_message(
+    std::function<void(bool, Item)>&& on_selected) {
 
     // SNodes don't have to agree on this, rather they should use different
     // messages
     const uint64_t seed =
         std::chrono::high_resolution_clock::now().time_since_epoch().count();
-    std::mt19937_64 mt(seed);
-    const auto msg_idx = util::uniform_distribution_portable(mt, message_count);
 
-    if (!db_->retrieve_by_index(msg_idx, item)) {
-        ARQMA_LOG(error, "Could not retrieve message by index: {}", msg_idx);
-        return false;
-    }
-
-    return true;
+    async_db_->retrieve_random(
+        seed, [on_selected = std::move(on_selected)](bool found, Item item) {
+            if (!found) {
+                ARQMA_LOG(debug, "No messages in the database to initiate a "
+                                 "peer test");
+            }
+            on_selected(found, std::move(item));
+        });
 }
 
 void ServiceNode::initiate_peer_test() {
@@ -1178,16 +1297,18 @@ void ServiceNode::initiate_peer_test() {
     /// 2. Storage Testing
     {
         // 2.1. Select a message
-        Item item;
-        if (!this->select_random_message(item)) {
-            ARQMA_LOG(debug, "Could not select a message for testing");
-        } else {
-            ARQMA_LOG(trace, "Selected random message: {}, {}", item.hash,
-                      item.data);
+        this->select_random_message(
+            [this, testee, test_height](bool found, Item item) {
+                if (!found) {
+                    ARQMA_LOG(debug, "Could not select a message for testing");
+                    return;
+                }
+                ARQMA_LOG(trace, "Selected random message: {}, {}",
+                          item.hash, item.data);
 
-            // 2.2. Initiate testing request
-            send_storage_test_req(testee, test_height, item);
-        }
+                // 2.2. Initiate testing request
+                send_storage_test_req(testee, test_height, item);
+            });
     }
 
     // Note: might consider choosing a different tester/testee pair for
@@ -1229,10 +1350,373 @@ void ServiceNode::initiate_peer_test() {
 
 void ServiceNode::bootstrap_peers(const std::vector<sn_record_t>& peers) const {
 
-    std::vector<Item> all_entries;
-    get_all_messages(all_entries);
+    // Writing the snapshot takes a while, but only reads from the database
+    std::mt19937_64 rng{std::random_device{}()};
+    const uint64_t id = rng();
+    const std::string path =
+        db_location_ + "/snapshot-" + std::to_string(id) + ".db";
+
+    async_db_->read(
+        [path, id](Database& db) {
+            uint64_t exported = 0;
+            auto snapshot = std::make_shared<outgoing_snapshot_t>();
+            snapshot->path = path;
+            snapshot->id = id;
+            if (!db.export_snapshot(path, exported)) {
+                ARQMA_LOG(error, "Could not write a snapshot");
+                return std::make_pair(std::shared_ptr<outgoing_snapshot_t>(),
+                                      exported);
+            }
+            if (exported == 0) {
+                return std::make_pair(snapshot, exported);
+            }
+
+            boost::system::error_code ec;
+            snapshot->size = boost::filesystem::file_size(path, ec);
+            if (!ec) {
+                snapshot->file.open(path, std::ios::binary);
+            }
+            if (ec || !snapshot->file) {
+                ARQMA_LOG(error, "Could not open snapshot {}", path);
+                return std::make_pair(std::shared_ptr<outgoing_snapshot_t>(),
+                                      exported);
+            }
+            return std::make_pair(snapshot, exported);
+        },
+        [this, peers](std::pair<std::shared_ptr<outgoing_snapshot_t>,
+                                uint64_t> res) {
+            const auto& snapshot = res.first;
+            if (!snapshot) {
+                ARQMA_LOG(error, "Pushing all messages to new peers instead "
+                                 "of a snapshot");
+                relay_all_messages([peers](const Item&) { return &peers; });
+                return;
+            }
+
+            if (res.second == 0) {
+                return;
+            }
+
+            ARQMA_LOG(info, "Sending a snapshot of {} messages ({} bytes) to "
+                            "{} new peers",
+                      res.second, snapshot->size, peers.size());
+
+            snapshot->unfinished = peers.size();
+            for (const auto& sn : peers) {
+                send_snapshot_chunk(snapshot, sn, 0);
+            }
+        });
+}
+
+void ServiceNode::send_snapshot_chunk(
+    const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+    const sn_record_t& sn, uint64_t offset) const {
+
+    async_db_->read(
+        [this, snapshot, offset](Database&) {
+            snapshot_chunk_t chunk;
+            chunk.data.resize(
+                std::min(SNAPSHOT_CHUNK_SIZE, snapshot->size - offset));
+            {
+                // Shared by the transfers to every peer
+                std::lock_guard<std::mutex> lock(snapshot->file_mutex);
+                snapshot->file.clear();
+                snapshot->file.seekg(offset);
+                snapshot->file.read(&chunk.data[0], chunk.data.size());
+                chunk.success = static_cast<bool>(snapshot->file);
+            }
+            if (chunk.success) {
+                chunk.sig =
+                    generate_signature(hash_data(chunk.data), arqmad_key_pair_);
+            }
+            return chunk;
+        },
+        [this, snapshot, sn, offset](snapshot_chunk_t chunk) {
+            if (!chunk.success) {
+                ARQMA_LOG(error, "Could not read snapshot {}, pushing all "
+                                 "messages to {} instead",
+                          snapshot->path, sn);
+                finish_snapshot_transfer(snapshot, sn, false);
+                return;
+            }
+            send_snapshot_request(snapshot, sn, offset, std::move(chunk.data),
+                                  chunk.sig);
+        });
+}
+
+void ServiceNode::send_snapshot_request(
+    const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+    const sn_record_t& sn, uint64_t offset, std::string&& chunk,
+    const signature& sig) const {
+
+    auto req = make_post_request("/swarms/snapshot/v1", std::move(chunk));
+    req->set(ARQMA_SNAPSHOT_ID_HEADER, std::to_string(snapshot->id));
+    req->set(ARQMA_SNAPSHOT_OFFSET_HEADER, std::to_string(offset));
+    req->set(ARQMA_SNAPSHOT_SIZE_HEADER, std::to_string(snapshot->size));
+    attach_signature(req, sig);
+
+    const uint64_t next = offset + req->body().size();
+    make_sn_request(ioc_, sn, req, [this, snapshot, sn,
+                                    next](sn_response_t&& res) {
+        if (res.error_code != SNodeError::NO_ERROR) {
+            // Older versions don't know about snapshots, and transfers are
+            // not resumed; either way the peer still gets everything
+            ARQMA_LOG(debug, "Could not send a snapshot to {}, pushing all "
+                             "messages instead",
+                      sn);
+            finish_snapshot_transfer(snapshot, sn, false);
+            return;
+        }
+
+        if (next < snapshot->size) {
+            send_snapshot_chunk(snapshot, sn, next);
+        } else {
+            ARQMA_LOG(debug, "Sent a snapshot to {}", sn);
+            finish_snapshot_transfer(snapshot, sn, true);
+        }
+    });
+}
+
+void ServiceNode::finish_snapshot_transfer(
+    const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+    const sn_record_t& sn, bool sent) const {
+
+    if (!sent) {
+        snapshot->failed.push_back(sn);
+    }
+
+    if (--snapshot->unfinished > 0 || snapshot->failed.empty()) {
+        return;
+    }
+
+    // A single scan of the database for all of them, as for peers that
+    // can't take snapshots at all
+    relay_all_messages(
+        [peers = std::move(snapshot->failed)](const Item&) { return &peers; });
+}
+
+void ServiceNode::process_snapshot_chunk(
+    const std::string& sender, uint64_t id, uint64_t offset, uint64_t size,
+    const std::string& chunk, std::function<void(bool)>&& on_done) {
+
+    // Only the nodes we'd bootstrap from get to write to our disk
+    const bool from_member =
+        swarm_ && swarm_->is_valid() &&
+        std::any_of(swarm_->other_nodes().begin(),
+                    swarm_->other_nodes().end(), [&](const sn_record_t& sn) {
+                        return sn.pub_key_base32z() == sender;
+                    });
+    if (!from_member) {
+        ARQMA_LOG(debug, "Ignoring a snapshot from {}, not in our swarm",
+                  sender);
+        on_done(false);
+        return;
+    }
+
+    if (size > SNAPSHOT_MAX_SIZE || chunk.empty() || offset > size ||
+        chunk.size() > size - offset) {
+        on_done(false);
+        return;
+    }
+
+    auto it = incoming_snapshots_.find(sender);
+    if (offset == 0) {
+        if (it != incoming_snapshots_.end()) {
+            ARQMA_LOG(debug, "Replacing the snapshot {} was sending", sender);
+            std::remove(it->second.path.c_str());
+            incoming_snapshots_.erase(it);
+        }
+        incoming_snapshot_t snapshot;
+        snapshot.id = id;
+        snapshot.path = db_location_ + "/incoming-snapshot-" +
+                        std::to_string(incoming_snapshot_count_++) + ".db";
+        snapshot.size = size;
+        it = incoming_snapshots_.emplace(sender, std::move(snapshot)).first;
+    }
+
+    if (it == incoming_snapshots_.end() || it->second.id != id ||
+        it->second.size != size || it->second.received != offset) {
+        on_done(false);
+        return;
+    }
+
+    auto& snapshot = it->second;
+    if (snapshot.writing) {
+        // The previous chunk isn't written yet, so this is a duplicate
+        on_done(false);
+        return;
+    }
+    snapshot.writing = true;
+
+    // `chunk` is the request body, kept alive with the request by `on_done`
+    // until the write is over
+    const auto file = snapshot.file;
+    const std::string path = snapshot.path;
+    const bool last = offset + chunk.size() == size;
+    async_db_->read(
+        [file, path, offset, last, data = &chunk](Database&) {
+            if (offset == 0) {
+                file->open(path, std::ios::binary | std::ios::trunc);
+            }
+            file->write(data->data(), data->size());
+            if (last) {
+                file->close();
+            }
+            return static_cast<bool>(*file);
+        },
+        [this, sender, file, path, last, written = chunk.size(),
+         on_done = std::move(on_done)](bool success) mutable {
+            auto it = incoming_snapshots_.find(sender);
+            if (it == incoming_snapshots_.end() || it->second.file != file) {
+                // Abandoned or replaced meanwhile, and the file might have
+                // been created after it was removed
+                std::remove(path.c_str());
+                on_done(false);
+                return;
+            }
+
+            auto& snapshot = it->second;
+            if (!success) {
+                ARQMA_LOG(error, "Could not write snapshot {}", path);
+                std::remove(path.c_str());
+                incoming_snapshots_.erase(it);
+                on_done(false);
+                return;
+            }
+
+            snapshot.writing = false;
+            snapshot.received += written;
+            snapshot.last_chunk = std::chrono::steady_clock::now();
+
+            if (!last) {
+                on_done(true);
+                return;
+            }
+
+            ARQMA_LOG(debug, "Received a snapshot of {} bytes from {}",
+                      snapshot.size, sender);
+            incoming_snapshots_.erase(it);
+            // The sender falls back to pushing all messages if this fails
+            import_snapshot(path, std::move(on_done));
+        });
+}
+
+void ServiceNode::import_snapshot(const std::string& path,
+                                  std::function<void(bool)>&& on_done) {
+
+    async_db_->write(
+        [path](Database& db) {
+            uint64_t imported = 0;
+            const bool success = db.import_snapshot(path, imported);
+            return std::make_pair(success, imported);
+        },
+        [this, path, on_done = std::move(on_done)](
+            std::pair<bool, uint64_t> res) {
+            std::remove(path.c_str());
+            if (!res.first) {
+                ARQMA_LOG(error, "Could not import snapshot {}", path);
+                on_done(false);
+                return;
+            }
+
+            ARQMA_LOG(info, "Imported {} new messages from a snapshot",
+                      res.second);
+
+            // We don't know whose messages were new
+            retrieve_cache_.clear();
+            on_done(true);
+        });
+}
+
+void ServiceNode::relay_batch(BatchSerializer& batch,
+                              const std::vector<sn_record_t>& snodes) const {
+
+    // Already hashed while it was serialized
+    std::string data;
+    const auto sig = generate_signature(batch.finish(data), arqmad_key_pair_);
+
+    auto req = make_push_all_request(std::move(data));
+    attach_signature(req, sig);
+
+    for (const sn_record_t& sn : snodes) {
+        relay_data_reliable(req, sn);
+    }
+}
 
-    relay_messages(all_entries, peers);
+struct ServiceNode::relay_all_state_t {
+    std::function<const std::vector<sn_record_t>*(const Item&)> destination;
+    Database::Cursor cursor;
+    // Messages being serialized per destination, relayed once a batch is
+    // full
+    std::unordered_map<const std::vector<sn_record_t>*, BatchSerializer>
+        pending;
+    size_t total = 0;
+    size_t batches = 0;
+};
+
+void ServiceNode::relay_all_messages(
+    std::function<const std::vector<sn_record_t>*(const Item&)>&&
+        destination) const {
+
+    relay_next_chunk(std::make_shared<relay_all_state_t>(
+        relay_all_state_t{std::move(destination), db_->scan()}));
+}
+
+void ServiceNode::relay_next_chunk(
+    const std::shared_ptr<relay_all_state_t>& state) const {
+
+    // The cursor is only used by one chunk's read at a time
+    async_db_->read(
+        [state](Database&) {
+            std::vector<Item> chunk;
+            const bool success = state->cursor.next(chunk);
+            return std::make_pair(success, std::move(chunk));
+        },
+        [this, state](std::pair<bool, std::vector<Item>> res) {
+            const auto& chunk = res.second;
+            if (!res.first) {
+                // Whatever was relayed so far is still valid, the rest is
+                // lost
+                ARQMA_LOG(error,
+                          "Could not retrieve entries from the database");
+            }
+
+            for (const auto& entry : chunk) {
+                const auto* snodes = state->destination(entry);
+                if (!snodes) {
+                    continue;
+                }
+
+                auto it = state->pending.find(snodes);
+                if (it == state->pending.end()) {
+                    it = state->pending
+                             .emplace(snodes, wire_format_for(*snodes))
+                             .first;
+                }
+                auto& batch = it->second;
+                batch.add(entry);
+                if (batch.full()) {
+                    relay_batch(batch, *snodes);
+                    state->batches++;
+                }
+            }
+            state->total += chunk.size();
+
+            if (res.first && !chunk.empty()) {
+                relay_next_chunk(state);
+                return;
+            }
+
+            for (auto& kv : state->pending) {
+                if (!kv.second.empty()) {
+                    relay_batch(kv.second, *kv.first);
+                    state->batches++;
+                }
+            }
+
+            ARQMA_LOG(debug, "Relayed {} messages in {} batches",
+                      state->total, state->batches);
+        });
 }
 
 template <typename T>
@@ -1264,13 +1748,8 @@ void ServiceNode::bootstrap_swarms(
         ARQMA_LOG(info, "Bootstrapping swarms: {}", vec_to_string(swarms));
     }
 
-    const auto& all_swarms = swarm_->all_valid_swarms();
-
-    std::vector<Item> all_entries;
-    if (!get_all_messages(all_entries)) {
-        ARQMA_LOG(error, "Could not retrieve entries from the database");
-        return;
-    }
+    // Copied, as the swarms might change while messages are being relayed
+    std::vector<SwarmInfo> all_swarms = swarm_->all_valid_swarms();
 
     std::unordered_map<swarm_id_t, size_t> swarm_id_to_idx;
     for (auto i = 0u; i < all_swarms.size(); ++i) {
@@ -1280,12 +1759,10 @@ void ServiceNode::bootstrap_swarms(
     /// See what pubkeys we have
     std::unordered_map<std::string, swarm_id_t> cache;
 
-    ARQMA_LOG(debug, "We have {} messages", all_entries.size());
-
-    std::unordered_map<swarm_id_t, std::vector<Item>> to_relay;
-
-    for (auto& entry : all_entries) {
-
+    relay_all_messages([all_swarms = std::move(all_swarms), swarms,
+                        swarm_id_to_idx = std::move(swarm_id_to_idx),
+                        cache = std::move(cache)](const Item& entry) mutable
+                       -> const std::vector<sn_record_t>* {
         swarm_id_t swarm_id;
         const auto it = cache.find(entry.pub_key);
         if (it == cache.end()) {
@@ -1295,7 +1772,7 @@ void ServiceNode::bootstrap_swarms(
             if (!success) {
                 ARQMA_LOG(error, "Invalid pubkey in a message while "
                                  "bootstrapping other nodes");
-                continue;
+                return nullptr;
             }
 
             swarm_id = get_swarm_by_pk(all_swarms, pk);
@@ -1312,62 +1789,229 @@ void ServiceNode::bootstrap_swarms(
             }
         }
 
-        if (relevant || swarms.empty()) {
-
-            to_relay[swarm_id].emplace_back(std::move(entry));
+        if (!relevant && !swarms.empty()) {
+            return nullptr;
         }
-    }
 
-    ARQMA_LOG(trace, "Bootstrapping {} swarms", to_relay.size());
-
-    for (const auto& kv : to_relay) {
-        const uint64_t swarm_id = kv.first;
         /// what if not found?
         const size_t idx = swarm_id_to_idx[swarm_id];
-
-        relay_messages(kv.second, all_swarms[idx].snodes);
-    }
+        return &all_swarms[idx].snodes;
+    });
 }
 
 template <typename Message>
 void ServiceNode::relay_messages(const std::vector<Message>& messages,
                                  const std::vector<sn_record_t>& snodes) const {
-    std::vector<std::string> data = serialize_messages(messages);
+    // Every batch is sent as soon as it is full rather than all at the end
+    size_t batches = 0;
+    BatchSerializer batch(wire_format_for(snodes));
+    for (const auto& message : messages) {
+        batch.add(message);
+        if (batch.full()) {
+            relay_batch(batch, snodes);
+            batches++;
+        }
+    }
+    if (!batch.empty()) {
+        relay_batch(batch, snodes);
+        batches++;
+    }
+
+    ARQMA_LOG(debug, "Serialised batches: {}", batches);
+}
+
+void ServiceNode::salvage_data() const {
+
+    /// This is very similar to ServiceNode::bootstrap_swarms, so just reuse it
+    bootstrap_swarms({});
+}
 
-    std::vector<signature> signatures;
-    signatures.reserve(data.size());
-    for (const auto& d : data) {
-        const auto hash = hash_data(d);
-        signatures.push_back(generate_signature(hash, arqmad_key_pair_));
+namespace {
+
+// What a client poll that missed the retrieve cache found in the database
+struct db_poll_result_t {
+    bool success = false;
+    RetrieveBuffer items;
+    // The message at `last_hash`, if it belongs to the pubkey polled for
+    boost::optional<Item> last;
+};
+
+// Same for a batch of polls: the messages found for `misses[i]` are
+// `items[ranges[i].first]` up to `items[ranges[i].second]`
+struct db_batch_result_t {
+    bool success = false;
+    RetrieveBuffer items;
+    std::vector<std::pair<size_t, size_t>> ranges;
+    std::vector<boost::optional<Item>> last;
+};
+
+// Look up the message at `last_hash` if `found` messages after it are all
+// there are, so that the cache can be filled with the result of the poll
+boost::optional<Item> find_last(Database& db, const std::string& pubKey,
+                                const std::string& last_hash, size_t found,
+                                size_t limit) {
+    Item last;
+    if (found < limit && !last_hash.empty() &&
+        db.retrieve_by_hash(last_hash, last) && last.pub_key == pubKey) {
+        return last;
     }
+    return boost::none;
+}
 
-    std::vector<std::shared_ptr<request_t>> batches =
-        make_batch_requests(std::move(data));
+// Fill the cache with what a poll found in the database, if that is
+// everything after `last_hash`
+void fill_cache(RetrieveCache& cache, const std::string& pubKey,
+                const std::string& last_hash, const RetrieveBuffer& items,
+                size_t begin, size_t end, boost::optional<Item>& last,
+                size_t limit, uint64_t version) {
 
-    assert(batches.size() == signatures.size());
-    for (size_t i = 0; i < batches.size(); ++i) {
-        attach_signature(batches[i], signatures[i]);
+    if (end - begin >= limit || (!last_hash.empty() && !last)) {
+        return;
     }
 
-    ARQMA_LOG(debug, "Serialised batches: {}", data.size());
-    for (const sn_record_t& sn : snodes) {
-        for (const std::shared_ptr<request_t>& batch : batches) {
-            relay_data_reliable(batch, sn);
-        }
+    std::vector<Item> newest;
+    if (last) {
+        newest.push_back(std::move(*last));
     }
+    for (size_t i = begin; i < end; ++i) {
+        const auto view = items[i];
+        newest.push_back({std::string(view.hash), std::string(view.pub_key),
+                          view.timestamp, view.ttl, view.expiration_timestamp,
+                          std::string(view.nonce), std::string(view.data)});
+    }
+    cache.fill(pubKey, std::move(newest), last_hash.empty(), version);
 }
 
-void ServiceNode::salvage_data() const {
+} // namespace
 
-    /// This is very similar to ServiceNode::bootstrap_swarms, so just reuse it
-    bootstrap_swarms({});
+void ServiceNode::retrieve(
+    const std::string& pubKey, const std::string& last_hash,
+    std::function<void(bool, const RetrieveBuffer&)>&& on_done) {
+
+    constexpr size_t limit = CLIENT_RETRIEVE_MESSAGE_LIMIT;
+
+    // Reused by every poll answered from the cache, so that those don't
+    // allocate at all
+    thread_local RetrieveBuffer cached;
+    cached.clear();
+
+    if (retrieve_cache_.retrieve(pubKey, last_hash, limit,
+                                 util::get_time_ms(), cached)) {
+        on_done(true, cached);
+        return;
+    }
+
+    const auto version = retrieve_cache_.version();
+
+    async_db_->read(
+        [pubKey, last_hash](Database& db) {
+            db_poll_result_t res;
+            res.success = db.retrieve(pubKey, res.items, last_hash, limit);
+            if (res.success) {
+                res.last =
+                    find_last(db, pubKey, last_hash, res.items.size(), limit);
+            }
+            return res;
+        },
+        [this, pubKey, last_hash, version,
+         on_done = std::move(on_done)](db_poll_result_t res) {
+            if (res.success) {
+                fill_cache(retrieve_cache_, pubKey, last_hash, res.items, 0,
+                           res.items.size(), res.last, limit, version);
+            }
+
+            on_done(res.success, res.items);
+        });
 }
 
-bool ServiceNode::retrieve(const std::string& pubKey,
-                           const std::string& last_hash,
-                           std::vector<Item>& items) {
-    return db_->retrieve(pubKey, items, last_hash,
-                         CLIENT_RETRIEVE_MESSAGE_LIMIT);
+void ServiceNode::retrieve_batch(
+    std::vector<Database::RetrieveRequest>&& requests,
+    std::function<void(bool, const RetrieveBuffer&,
+                       const std::vector<std::pair<size_t, size_t>>&)>&&
+        on_done) {
+
+    constexpr size_t limit = CLIENT_RETRIEVE_MESSAGE_LIMIT;
+    const uint64_t now = util::get_time_ms();
+
+    // Answer what we can from the cache and read the rest from the
+    // database, all in one go
+    RetrieveBuffer cached;
+    std::vector<std::pair<size_t, size_t>> ranges(requests.size());
+    std::vector<Database::RetrieveRequest> misses;
+    // Where each miss came from in `requests`
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < requests.size(); ++i) {
+        const size_t begin = cached.size();
+        if (retrieve_cache_.retrieve(requests[i].pub_key,
+                                     requests[i].last_hash, limit, now,
+                                     cached)) {
+            ranges[i] = {begin, cached.size()};
+        } else {
+            misses.push_back(std::move(requests[i]));
+            positions.push_back(i);
+        }
+    }
+
+    if (misses.empty()) {
+        on_done(true, cached, ranges);
+        return;
+    }
+
+    const auto version = retrieve_cache_.version();
+
+    async_db_->read(
+        [misses](Database& db) {
+            db_batch_result_t res;
+            res.success =
+                db.retrieve_many(misses, res.items, res.ranges, limit);
+            if (res.success) {
+                for (size_t i = 0; i < misses.size(); ++i) {
+                    const auto& range = res.ranges[i];
+                    res.last.push_back(find_last(db, misses[i].pub_key,
+                                                 misses[i].last_hash,
+                                                 range.second - range.first,
+                                                 limit));
+                }
+            }
+            return res;
+        },
+        [this, misses, positions, version, ranges = std::move(ranges),
+         cached = std::move(cached),
+         on_done = std::move(on_done)](db_batch_result_t res) mutable {
+            if (!res.success) {
+                on_done(false, res.items, ranges);
+                return;
+            }
+
+            for (size_t i = 0; i < misses.size(); ++i) {
+                const auto& range = res.ranges[i];
+                fill_cache(retrieve_cache_, misses[i].pub_key,
+                           misses[i].last_hash, res.items, range.first,
+                           range.second, res.last[i], limit, version);
+                ranges[positions[i]] = range;
+            }
+
+            // Move the cached messages behind those read, so that a single
+            // buffer holds them all
+            const size_t offset = res.items.size();
+            for (const auto view : cached) {
+                res.items.append(view.hash, view.pub_key, view.timestamp,
+                                 view.ttl, view.expiration_timestamp,
+                                 view.nonce, view.data);
+            }
+            size_t next_miss = 0;
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                if (next_miss < positions.size() &&
+                    positions[next_miss] == i) {
+                    next_miss++;
+                } else {
+                    ranges[i].first += offset;
+                    ranges[i].second += offset;
+                }
+            }
+
+            on_done(true, res.items, ranges);
+        });
 }
 
 static void to_json(nlohmann::json& j, const test_result_t& val) {
@@ -1406,63 +2050,131 @@ static nlohmann::json to_json(const all_stats_t& stats) {
     return json;
 }
 
-std::string ServiceNode::get_stats() const {
-
-    auto val = to_json(all_stats_);
-
-    val["version"] = STORAGE_SERVER_VERSION_STRING;
-    val["height"] = block_height_;
-    val["target_height"] = target_height_;
-
-    uint64_t total_stored;
-    if (db_->get_message_count(total_stored)) {
-        val["total_stored"] = total_stored;
-    }
-
-    val["connections_in"] = get_net_stats().connections_in;
-    val["http_connections_out"] = get_net_stats().http_connections_out;
-    val["https_connections_out"] = get_net_stats().https_connections_out;
-    val["open_socket_count"] = get_net_stats().open_fds.size();
+namespace {
+
+// The stats `get_stats` reads from the database
+struct db_stats_t {
+    bool has_usage = false;
+    Database::Usage usage;
+    Database::ExpiryStats expiry;
+    Database::DuplicateStats duplicates;
+};
+
+} // namespace
+
+void ServiceNode::get_stats(
+    std::function<void(std::string stats)>&& on_done) const {
+
+    async_db_->read(
+        [](Database& db) {
+            db_stats_t stats;
+            stats.has_usage = db.get_usage(stats.usage);
+            stats.expiry = db.get_expiry_stats();
+            stats.duplicates = db.get_duplicate_stats();
+            return stats;
+        },
+        [this, on_done = std::move(on_done)](const db_stats_t& db_stats) {
+            auto val = to_json(all_stats_);
+
+            val["version"] = STORAGE_SERVER_VERSION_STRING;
+            val["height"] = block_height_;
+            val["target_height"] = target_height_;
+
+            if (db_stats.has_usage) {
+                val["total_stored"] = db_stats.usage.messages;
+                val["total_stored_bytes"] = db_stats.usage.bytes;
+                val["total_owners"] = db_stats.usage.owners;
+            }
 
-    /// we want pretty (indented) json, but might change that in the future
-    constexpr bool PRETTY = true;
-    constexpr int indent = PRETTY ? 4 : 0;
-    return val.dump(indent);
+            const auto& expiry = db_stats.expiry;
+            val["total_expired"] = expiry.total_expired;
+            val["expired_per_sec"] = expiry.expired_per_sec;
+            val["expiry_backlog"] = expiry.backlog;
+
+            const auto& duplicates = db_stats.duplicates;
+            val["duplicates_checked"] = duplicates.checked;
+            val["duplicates_rejected"] = duplicates.rejected;
+            val["duplicate_filter_false_positives"] =
+                duplicates.false_positives;
+            val["duplicate_rejection_rate"] =
+                duplicates.checked == 0
+                    ? 0.0
+                    : double(duplicates.rejected) / duplicates.checked;
+            // Of the messages that were not stored yet, how many the filter
+            // let through to a lookup anyway
+            const uint64_t not_stored =
+                duplicates.checked - duplicates.rejected;
+            val["duplicate_filter_fp_rate"] =
+                not_stored == 0
+                    ? 0.0
+                    : double(duplicates.false_positives) / not_stored;
+
+            const auto cache = retrieve_cache_.get_stats();
+            val["retrieve_cache_hits"] = cache.hits;
+            val["retrieve_cache_misses"] = cache.misses;
+            val["retrieve_cache_owners"] = cache.owners;
+            val["retrieve_cache_messages"] = cache.messages;
+            val["retrieve_cache_bytes"] = cache.bytes;
+
+            val["connections_in"] = get_net_stats().connections_in;
+            val["http_connections_out"] = get_net_stats().http_connections_out;
+            val["https_connections_out"] =
+                get_net_stats().https_connections_out;
+            val["open_socket_count"] = get_net_stats().open_fds.size();
+
+            /// we want pretty (indented) json, but might change that in the
+            /// future
+            constexpr bool PRETTY = true;
+            constexpr int indent = PRETTY ? 4 : 0;
+            on_done(val.dump(indent));
+        });
 }
 
-bool ServiceNode::get_all_messages(std::vector<Item>& all_entries) const {
+void ServiceNode::get_all_messages(
+    std::function<void(bool success, std::vector<Item> items)>&& on_done)
+    const {
 
     ARQMA_LOG(trace, "Get all messages");
 
-    return db_->retrieve("", all_entries, "");
+    async_db_->read(
+        [](Database& db) {
+            std::vector<Item> items;
+            const bool success = db.retrieve("", items, "");
+            return std::make_pair(success, std::move(items));
+        },
+        [on_done = std::move(on_done)](std::pair<bool, std::vector<Item>> res) {
+            on_done(res.first, std::move(res.second));
+        });
 }
 
-void ServiceNode::process_push_batch(const std::string& blob) {
+void ServiceNode::process_push_batch(std::string&& blob) {
     // Note: we only receive batches on bootstrap (new swarm/new snode)
 
     if (blob.empty())
         return;
 
-    std::vector<message_t> messages = deserialize_messages(blob);
-
-    ARQMA_LOG(trace, "Saving all: begin");
+    // The messages are bound to the insert statements straight from the
+    // body and the keys decoded from it, so those have to live until they
+    // are stored
+    struct push_batch_t {
+        std::string body;
+        std::string keys;
+    };
+    auto batch = std::make_shared<push_batch_t>();
+    batch->body = std::move(blob);
 
-    ARQMA_LOG(debug, "Got {} messages from peers, size: {}", messages.size(),
-              blob.size());
+    std::vector<ItemView> items;
+    if (!deserialize_messages(batch->body, items, batch->keys)) {
+        ARQMA_LOG(debug, "Could not deserialize a push batch");
+        return;
+    }
 
-    std::vector<Item> items;
-    items.reserve(messages.size());
+    ARQMA_LOG(trace, "Saving all: begin");
 
-    // TODO: avoid copying m.data
-    // Promoting message_t to Item:
-    std::transform(messages.begin(), messages.end(), std::back_inserter(items),
-                   [](const message_t& m) {
-                       return Item{m.hash, m.pub_key,           m.timestamp,
-                                   m.ttl,  m.timestamp + m.ttl, m.nonce,
-                                   m.data};
-                   });
+    ARQMA_LOG(debug, "Got {} messages from peers, size: {}", items.size(),
+              batch->body.size());
 
-    save_bulk(items);
+    save_bulk(std::move(batch), std::move(items));
 
     ARQMA_LOG(trace, "Saving all: end");
 }
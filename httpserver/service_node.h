@@ -1,9 +1,13 @@
 #pragma once
 
+#include <AsyncDatabase.hpp>
 #include <Database.hpp>
+#include <GroupCommitter.hpp>
+#include <RetrieveCache.hpp>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <unordered_map>
 
@@ -16,6 +20,7 @@
 #include "arqma_common.h"
 #include "arqmad_key.h"
 #include "reachability_testing.h"
+#include "serialization.h"
 #include "stats.h"
 #include "swarm.h"
 
@@ -51,6 +56,8 @@ class Swarm;
 
 struct signature;
 
+struct outgoing_snapshot_t;
+
 /// Represents failed attempt at communicating with a SNode
 /// (currently only for single messages)
 class FailedRequestHandler
@@ -97,7 +104,14 @@ class ServiceNode {
     const ArqmadClient& arqmad_client_;
     std::string block_hash_;
     std::unique_ptr<Swarm> swarm_;
+    const std::string db_location_;
     std::unique_ptr<Database> db_;
+    // Runs all database work off the thread running `ioc_`
+    std::unique_ptr<AsyncDatabase> async_db_;
+    // Batches client stores and pushes into a transaction each
+    std::unique_ptr<GroupCommitter> committer_;
+    // Answers most client polls without going to the database
+    RetrieveCache retrieve_cache_;
 
     sn_record_t our_address_;
 
@@ -107,6 +121,8 @@ class ServiceNode {
     boost::asio::steady_timer swarm_update_timer_;
     boost::asio::steady_timer arqmad_ping_timer_;
     boost::asio::steady_timer stats_cleanup_timer_;
+    boost::asio::steady_timer cache_expiry_timer_;
+    boost::asio::steady_timer snapshot_sweep_timer_;
     boost::asio::steady_timer peer_ping_timer_;
     boost::asio::steady_timer relay_timer_;
 
@@ -121,10 +137,40 @@ class ServiceNode {
     reachability_records_t reach_records_;
 
     std::vector<message_t> relay_buffer_;
-    void save_if_new(const message_t& msg);
 
-    // Save items to the database, notifying listeners as necessary
-    void save_bulk(const std::vector<storage::Item>& items);
+    /// A snapshot being received from another node, written to `path` as
+    /// the chunks come in (in order), on a storage thread
+    struct incoming_snapshot_t {
+        uint64_t id;
+        std::string path;
+        uint64_t size;
+        uint64_t received = 0;
+        std::chrono::steady_clock::time_point last_chunk;
+        // Open from the first chunk to the last, and shared with the write
+        // in progress (if any)
+        std::shared_ptr<std::ofstream> file =
+            std::make_shared<std::ofstream>();
+        bool writing = false;
+    };
+
+    // By sender pubkey; a new snapshot from the same sender replaces the
+    // one it was sending
+    std::unordered_map<std::string, incoming_snapshot_t> incoming_snapshots_;
+    uint64_t incoming_snapshot_count_ = 0;
+
+    // Newest message encoding each peer (by base32z pubkey) has told us it
+    // understands; v1 for peers not in here
+    std::unordered_map<std::string, WireFormat> peer_wire_formats_;
+
+    // Queue `msg` for the next group commit; once committed, notify
+    // listeners if it was new and report whether the commit succeeded
+    void save_if_new(const message_t& msg,
+                     std::function<void(bool)>&& on_committed);
+
+    // Save items to the database, notifying listeners as necessary. The
+    // items are views into strings `owner` keeps alive.
+    void save_bulk(std::shared_ptr<const void> owner,
+                   std::vector<storage::ItemView>&& items);
 
     /// request swarm info from the blockchain
     void update_swarms();
@@ -135,8 +181,35 @@ class ServiceNode {
 
     void bootstrap_data();
 
+    /// Send a snapshot of our database to new members of our swarm (or
+    /// push all our messages to those that can't take snapshots)
     void bootstrap_peers(const std::vector<sn_record_t>& peers) const;
 
+    /// Send the chunk of `snapshot` at `offset` to `sn`, and the following
+    /// ones once it is accepted. Chunks are read on a storage thread.
+    void send_snapshot_chunk(
+        const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+        const sn_record_t& sn, uint64_t offset) const;
+
+    /// Send `chunk`, the part of `snapshot` at `offset` signed with `sig`,
+    /// to `sn`, then go on with the next one
+    void send_snapshot_request(
+        const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+        const sn_record_t& sn, uint64_t offset, std::string&& chunk,
+        const signature& sig) const;
+
+    /// Record that the transfer of `snapshot` to `sn` is over, and once
+    /// all of them are, push all our messages to the peers that weren't
+    /// `sent` it
+    void finish_snapshot_transfer(
+        const std::shared_ptr<outgoing_snapshot_t>& snapshot,
+        const sn_record_t& sn, bool sent) const;
+
+    /// Import the snapshot in `path` once it is complete, then report
+    /// whether that succeeded
+    void import_snapshot(const std::string& path,
+                         std::function<void(bool)>&& on_done);
+
     void bootstrap_swarms(const std::vector<swarm_id_t>& swarms) const;
 
     /// Distribute all our data to where it belongs
@@ -157,11 +230,38 @@ class ServiceNode {
     void relay_messages(const std::vector<Message>& messages,
                         const std::vector<sn_record_t>& snodes) const;
 
+    /// Newest message encoding all of `snodes` have told us they understand
+    WireFormat wire_format_for(const std::vector<sn_record_t>& snodes) const;
+
+    /// Finish the batch `batch` is writing and push it to `snodes`
+    void relay_batch(BatchSerializer& batch,
+                     const std::vector<sn_record_t>& snodes) const;
+
+    /// Stream the whole database in chunks read on a storage thread,
+    /// pushing every message to the snodes `destination` returns for it
+    /// (none if it returns nullptr). `destination` is kept until the last
+    /// chunk is relayed, so what it returns may point into its own state.
+    void relay_all_messages(
+        std::function<const std::vector<sn_record_t>*(const storage::Item&)>&&
+            destination) const;
+
+    struct relay_all_state_t;
+
+    /// Read the next chunk of a `relay_all_messages` scan and relay it
+    void relay_next_chunk(const std::shared_ptr<relay_all_state_t>& state) const;
+
     /// Request swarm structure from the deamon and reset the timer
     void swarm_timer_tick();
 
     void cleanup_timer_tick();
 
+    /// Drop expired messages from the retrieve cache every tick of its
+    /// expiry wheel
+    void cache_expiry_timer_tick();
+
+    /// Abandon snapshots that stopped making progress
+    void snapshot_sweep_timer_tick();
+
     void ping_peers_tick();
 
     void relay_buffered_messages();
@@ -201,8 +301,10 @@ class ServiceNode {
     /// Check if it is our turn to test and initiate peer test if so
     void initiate_peer_test();
 
-    // Select a random message from our database, return false on error
-    bool select_random_message(storage::Item& item);
+    // Pick a message to test a peer with, `on_selected` is passed false if
+    // there are none
+    void select_random_message(
+        std::function<void(bool, storage::Item)>&& on_selected);
 
     void test_reachability(const sn_record_t& sn);
 
@@ -211,7 +313,8 @@ class ServiceNode {
                 boost::asio::io_context& worker_ioc, uint16_t port,
                 const arqma::arqmad_key_pair_t& key_pair,
                 const arqma::arqmad_key_pair_t& key_pair_x25519,
-                const std::string& db_location, ArqmadClient& arqmad_client,
+                const std::string& db_location, size_t db_shards,
+                const StorageProfile& db_profile, ArqmadClient& arqmad_client,
                 const bool force_start);
 
     ~ServiceNode();
@@ -231,29 +334,41 @@ class ServiceNode {
     // Notify listeners of a new message for pk
     void notify_listeners(const std::string& pk, const message_t& msg);
 
-    // Send "empty" responses to all listeners effectively resetting their
-    // connections
-    void reset_listeners();
-
-    /// Process message received from a client, return false if not in a swarm
-    bool process_store(const message_t& msg);
+    /// Process message received from a client, return false if not in a
+    /// swarm; `on_committed` is called once the message is in the database
+    bool process_store(const message_t& msg,
+                       std::function<void(bool)>&& on_committed);
 
     /// Process message relayed from another SN from our swarm
-    void process_push(const message_t& msg);
-
-    /// Process incoming blob of messages: add to DB if new
-    void process_push_batch(const std::string& blob);
+    void process_push(const message_t& msg,
+                      std::function<void(bool)>&& on_committed);
+
+    /// Process incoming blob of messages: add to DB if new. The messages
+    /// are stored straight from `blob`, without copying them out of it.
+    void process_push_batch(std::string&& blob);
+
+    /// Process a chunk of a snapshot of `size` bytes sent by `sender`, a
+    /// member of our swarm. `on_done` gets false if the chunk doesn't
+    /// follow the chunks received so far, or if it was the last one and
+    /// the snapshot couldn't be imported (only called once it was).
+    /// Chunks are written on a storage thread, so `chunk` must stay valid
+    /// until `on_done` is called.
+    void process_snapshot_chunk(const std::string& sender, uint64_t id,
+                                uint64_t offset, uint64_t size,
+                                const std::string& chunk,
+                                std::function<void(bool)>&& on_done);
 
     /// request blockchain test from a peer
     void perform_blockchain_test(
         bc_test_params_t params,
         std::function<void(blockchain_test_answer_t)>&& cb) const;
 
-    // Attempt to find an answer (message body) to the storage test
-    MessageTestStatus process_storage_test_req(uint64_t blk_height,
-                                               const std::string& tester_addr,
-                                               const std::string& msg_hash,
-                                               std::string& answer);
+    // Attempt to find an answer (message body) to the storage test, which
+    // is passed to `on_done` along with the outcome
+    void process_storage_test_req(
+        uint64_t blk_height, const std::string& tester_addr,
+        const std::string& msg_hash,
+        std::function<void(MessageTestStatus, std::string)>&& on_done);
 
     bool is_pubkey_for_us(const user_pubkey_t& pk) const;
 
@@ -261,13 +376,35 @@ class ServiceNode {
 
     bool is_snode_address_known(const std::string&);
 
-    /// return all messages for a particular PK (in JSON)
-    bool get_all_messages(std::vector<storage::Item>& all_entries) const;
-
-    bool retrieve(const std::string& pubKey, const std::string& last_hash,
-                  std::vector<storage::Item>& items);
-
-    std::string get_stats() const;
+    /// Remember the message encoding a peer told us it understands
+    void record_wire_format(const std::string& pubkey_b32z, WireFormat format);
+
+    /// Read every message on a storage thread and pass them to `on_done`
+    void get_all_messages(
+        std::function<void(bool success, std::vector<storage::Item> items)>&&
+            on_done) const;
+
+    /// Look up the messages for `pubKey` received after `last_hash` and pass
+    /// them to `on_done`, right away if they are cached, otherwise once read
+    /// on a storage thread. `items` is only valid during the call.
+    void retrieve(
+        const std::string& pubKey, const std::string& last_hash,
+        std::function<void(bool success, const RetrieveBuffer& items)>&&
+            on_done);
+
+    /// Same as `retrieve` for several pubkeys at once, with the polls that
+    /// miss the cache read from the database together. The messages for
+    /// `requests[i]` are `items[ranges[i].first]` up to (excluding)
+    /// `items[ranges[i].second]`.
+    void retrieve_batch(
+        std::vector<Database::RetrieveRequest>&& requests,
+        std::function<void(
+            bool success, const RetrieveBuffer& items,
+            const std::vector<std::pair<size_t, size_t>>& ranges)>&& on_done);
+
+    /// Pass the stats (as JSON) to `on_done` once the database's have been
+    /// read on a storage thread
+    void get_stats(std::function<void(std::string stats)>&& on_done) const;
 };
 
 } // namespace arqma
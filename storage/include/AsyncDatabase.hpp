@@ -0,0 +1,96 @@
+#pragma once
+
+#include "Database.hpp"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace arqma {
+
+/// Runs database work on threads of its own, so that slow queries and disk
+/// I/O never hold up the thread running `ioc`, and invokes completion
+/// handlers on `ioc`. Writes run one at a time in the order they were
+/// submitted, and so do their handlers; reads run concurrently with writes
+/// and each other. Expired messages are deleted as writes too, on a timer
+/// on `ioc` started on construction. Destroying it waits for the submitted
+/// work to finish, handlers that haven't run by then are dropped.
+class AsyncDatabase {
+  public:
+    static constexpr size_t DEFAULT_THREAD_COUNT =
+        Database::DEFAULT_READER_COUNT;
+
+    AsyncDatabase(boost::asio::io_context& ioc, Database& db,
+                  size_t num_threads = DEFAULT_THREAD_COUNT);
+    ~AsyncDatabase();
+
+    /// Call `work(db)` on a storage thread, then `on_done` with its result
+    /// on `ioc`
+    template <typename Work, typename Handler>
+    void read(Work&& work, Handler&& on_done) {
+        boost::asio::post(pool_, make_job(std::forward<Work>(work),
+                                          std::forward<Handler>(on_done)));
+    }
+
+    /// Same as `read`, but only after every previously submitted write
+    template <typename Work, typename Handler>
+    void write(Work&& work, Handler&& on_done) {
+        boost::asio::post(writes_, make_job(std::forward<Work>(work),
+                                            std::forward<Handler>(on_done)));
+    }
+
+    void store_batch(std::vector<storage::Item>&& items,
+                     std::function<void(bool, std::vector<bool>)>&& on_done);
+
+    /// Like `store_batch`, but hands back the messages that were new, which
+    /// after a failure are those of the shards that did commit
+    void bulk_store(
+        std::vector<storage::Item>&& items,
+        std::function<void(bool, std::vector<storage::Item>)>&& on_done);
+
+    /// Same for messages that are views into `owner`, which is kept alive
+    /// until `on_done` has returned
+    void bulk_store(
+        std::vector<storage::ItemView>&& items,
+        std::shared_ptr<const void> owner,
+        std::function<void(bool, std::vector<storage::ItemView>)>&& on_done);
+
+    void retrieve_by_hash(const std::string& msg_hash,
+                          std::function<void(bool, storage::Item)>&& on_done);
+
+    void retrieve_random(uint64_t seed,
+                         std::function<void(bool, storage::Item)>&& on_done);
+
+  private:
+    // Delete expired messages after `delay`, and keep doing so as often as
+    // the database asks
+    void schedule_cleanup(std::chrono::milliseconds delay);
+
+    template <typename Work, typename Handler>
+    auto make_job(Work&& work, Handler&& on_done) {
+        // Keeps `ioc.run()` from returning while the work is in flight
+        return [this, work = std::forward<Work>(work),
+                on_done = std::forward<Handler>(on_done),
+                guard = boost::asio::make_work_guard(ioc_)]() mutable {
+            auto result = work(db_);
+            boost::asio::post(
+                ioc_, [on_done = std::move(on_done),
+                       result = std::move(result)]() mutable {
+                    on_done(std::move(result));
+                });
+        };
+    }
+
+    boost::asio::io_context& ioc_;
+    Database& db_;
+    boost::asio::thread_pool pool_;
+    boost::asio::strand<boost::asio::thread_pool::executor_type> writes_;
+    boost::asio::steady_timer cleanup_timer_;
+    // Expires with this, for cleanup handlers still queued on `ioc`
+    std::shared_ptr<bool> alive_ = std::make_shared<bool>(true);
+};
+
+} // namespace arqma
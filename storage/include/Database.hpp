@@ -1,10 +1,18 @@
 #pragma once
 
+#include "DuplicateFilter.hpp"
 #include "Item.hpp"
+#include "RetrieveBuffer.hpp"
 #include "arqma_common.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <random>
 #include <stdint.h>
 #include <string>
 #include <vector>
@@ -17,9 +25,57 @@ class Timer;
 
 namespace arqma {
 
+class Shard;
+
+/// How the sqlite files are tuned, trading durability and memory for speed.
+/// Every profile uses WAL, so that readers never wait for the writer.
+struct StorageProfile {
+    std::string name;
+    // `PRAGMA synchronous` of the writer: FULL survives power loss, NORMAL
+    // might lose the last commits on power loss (but not on a crash of this
+    // process), OFF might corrupt the files on power loss
+    std::string synchronous;
+    // Page cache of each shard's writer, in KiB. Readers keep sqlite's
+    // default and rely on `mmap_size` and the OS page cache instead.
+    int64_t cache_size_kib;
+    // Bytes of each file read through a memory map (0 for none), shared by
+    // all connections to it
+    int64_t mmap_size;
+    // Keep the temporary tables and indices of large sorts in memory
+    bool temp_store_memory;
+    // How often to checkpoint the WAL into the database file on a thread
+    // of its own. Zero leaves it to the commit that grows the WAL past 1000
+    // pages, holding up the writer while it copies them.
+    std::chrono::milliseconds checkpoint_interval;
+
+    // sqlite's defaults besides WAL: fsync on every commit, small cache.
+    // The default, as stores are only acknowledged once committed.
+    static StorageProfile durable();
+    // Fsync only on checkpoints, in the background; larger cache and mmap
+    static StorageProfile balanced();
+    // No fsync at all, everything as large as reasonable
+    static StorageProfile throughput();
+
+    // One of the above by name, throws std::runtime_error if unknown
+    static StorageProfile from_name(const std::string& name);
+};
+
+/// Message storage. Messages are spread over one or more sqlite files
+/// (shards) by owner pubkey, so that all messages for a pubkey live in the
+/// same shard and each shard has a writer of its own. Calls for a single
+/// owner go to its shard, the rest are fanned out over all of them.
 class Database {
   public:
-    Database(boost::asio::io_context& ioc, const std::string& db_path);
+    // Number of read-only connections opened alongside each shard's writer
+    static constexpr size_t DEFAULT_READER_COUNT = 4;
+
+    // Opens (or creates) `num_shards` files in `db_path`, moving messages
+    // around if they were last opened with a different shard count.
+    // Expired messages are only deleted by `clean_up_expired`, which
+    // `AsyncDatabase` calls on a timer.
+    Database(const std::string& db_path,
+             size_t num_readers = DEFAULT_READER_COUNT, size_t num_shards = 1,
+             const StorageProfile& profile = StorageProfile::durable());
     ~Database();
 
     enum class DuplicateHandling { IGNORE, FAIL };
@@ -29,39 +85,174 @@ class Database {
                const std::string& nonce,
                DuplicateHandling behaviour = DuplicateHandling::FAIL);
 
+    // Same as `store_batch` for when it doesn't matter which messages were
+    // new. Messages are inserted many rows per statement, grouped by owner.
     bool bulk_store(const std::vector<storage::Item>& items);
 
+    // Store all `items`, one transaction per shard, with the shards written
+    // in parallel. Return false if a transaction could not be committed.
+    // Either way `inserted[i]` tells whether `items[i]` was new and has been
+    // stored, so that after a failure it still marks the messages of the
+    // shards that did commit. Messages the duplicate filter knows about are
+    // looked up first, and those found never get to the writers.
+    bool store_batch(const std::vector<storage::Item>& items,
+                     std::vector<bool>& inserted);
+
+    // Same as the above for messages whose strings live elsewhere, such as
+    // in a received request, which are bound to the insert statements
+    // without being copied
+    bool bulk_store(const std::vector<storage::ItemView>& items);
+    bool store_batch(const std::vector<storage::ItemView>& items,
+                     std::vector<bool>& inserted);
+
+    // An empty `key` gets the messages of all shards, one shard after the
+    // other
     bool retrieve(const std::string& key, std::vector<storage::Item>& items,
                   const std::string& lastHash, int num_results = -1);
 
+    // Same as above, but appends the messages to `buffer` without creating
+    // an `Item` per message. Reusing the buffer avoids most allocations.
+    bool retrieve(const std::string& key, RetrieveBuffer& buffer,
+                  const std::string& lastHash, int num_results = -1);
+
+    struct RetrieveRequest {
+        std::string pub_key;
+        std::string last_hash;
+    };
+
+    // `retrieve` for each of `requests` (which must have non-empty keys),
+    // appending to `buffer`: the messages for `requests[i]` are those from
+    // `buffer[ranges[i].first]` up to `buffer[ranges[i].second]`. The
+    // requests for a shard all run on one read connection in one
+    // transaction, so they see the same state of it.
+    bool retrieve_many(const std::vector<RetrieveRequest>& requests,
+                       RetrieveBuffer& buffer,
+                       std::vector<std::pair<size_t, size_t>>& ranges,
+                       int num_results = -1);
+
+    /// Walks over all messages, shard by shard in the order they were
+    /// stored, a bounded chunk at a time, so that whole-database scans use
+    /// constant memory. Messages stored after the cursor was created may or
+    /// may not be seen.
+    class Cursor {
+        Database& db_;
+        size_t chunk_size_;
+        size_t shard_ = 0;
+        int64_t last_seq_ = 0;
+
+        Cursor(Database& db, size_t chunk_size);
+        friend class Database;
+
+      public:
+        // Replace the contents of `chunk` with up to `chunk_size` following
+        // messages (none once the end is reached), return false on error
+        bool next(std::vector<storage::Item>& chunk);
+    };
+
+    static constexpr size_t DEFAULT_SCAN_CHUNK_SIZE = 1000;
+
+    Cursor scan(size_t chunk_size = DEFAULT_SCAN_CHUNK_SIZE);
+
+    // Write every unexpired message to a new standalone sqlite file at
+    // `path` for sending to another node, and set `exported` to their
+    // number. Every shard is copied in a single statement, so the copy of
+    // any owner's messages is consistent.
+    bool export_snapshot(const std::string& path, uint64_t& exported);
+
+    // Store the messages of a file written by `export_snapshot` (on any
+    // node, with any number of shards), ignoring those we have already,
+    // those that expired since and those no client could have stored, and
+    // set `imported` to the number of new ones. Files with any other schema
+    // are rejected.
+    bool import_snapshot(const std::string& path, uint64_t& imported);
+
+    struct Usage {
+        uint64_t messages = 0;
+        // Sum of the message bodies' sizes
+        uint64_t bytes = 0;
+        // Number of distinct pubkeys with at least one message
+        uint64_t owners = 0;
+    };
+
     // Return the total number of messages stored
     bool get_message_count(uint64_t& count);
 
-    // Get message by `index` (must be smaller than the result of
-    // `get_message_count`).
-    bool retrieve_by_index(uint64_t index, storage::Item& item);
+    // Totals over all stored messages. These are maintained on every insert
+    // and expiry, so reading them is O(1).
+    bool get_usage(Usage& usage);
+
+    // Same as `get_usage` restricted to the messages for `pubkey`
+    bool get_owner_usage(const std::string& pubkey, Usage& usage);
+
+    // Pick a message uniformly at random in O(log n), return false if
+    // there are no messages
+    bool retrieve_random(std::mt19937_64& rng, storage::Item& item);
+
+    struct ExpiryStats {
+        uint64_t total_expired = 0;
+        // Rate over the last completed cleanup period
+        double expired_per_sec = 0;
+        // Expired messages still waiting to be deleted
+        uint64_t backlog = 0;
+    };
+
+    ExpiryStats get_expiry_stats() const;
+
+    // Delete expired messages, spending at most a small time budget per
+    // shard so that other writes aren't held up for long, and return how
+    // soon to call again. Not to be called concurrently with itself.
+    std::chrono::milliseconds clean_up_expired();
+
+    struct DuplicateStats {
+        // Messages passed to `store_batch` or `bulk_store`
+        uint64_t checked = 0;
+        // Of those, found to be stored already without an insert attempt
+        uint64_t rejected = 0;
+        // Reported by the filter, but not stored after all
+        uint64_t false_positives = 0;
+    };
+
+    DuplicateStats get_duplicate_stats() const;
 
     // Get message by `msg_hash`, return true if found
     bool retrieve_by_hash(const std::string& msg_hash, storage::Item& item);
 
+    size_t get_shard_count() const { return shards_.size(); }
+
   private:
-    sqlite3_stmt* prepare_statement(const std::string& query);
-    void open_and_prepare(const std::string& db_path);
-    void perform_cleanup();
+    size_t shard_index(std::string_view pubkey) const;
+    Shard& shard_for(const std::string& pubkey);
+    // Move the messages of every shard in `shards_` that belong elsewhere to
+    // the first `num_shards` shards
+    void rebalance(size_t num_shards);
+    // Run `tasks`, all but one on `pool_`, and wait for them to finish.
+    // Return false if any of them did, or threw.
+    bool run_in_parallel(const std::vector<std::function<bool()>>& tasks);
+
+    // `store_batch`, setting `inserted` only if given
+    bool store_items(const std::vector<storage::ItemView>& items,
+                     std::vector<bool>* inserted);
+    // Same, without looking for duplicates first
+    bool store_in_shards(const std::vector<storage::ItemView>& items,
+                         std::vector<bool>* inserted);
+    // Set `fresh` to the positions of the messages in `items` that are not
+    // stored already, as far as the duplicate filter and a lookup of the
+    // ones it reports can tell
+    void find_fresh(const std::vector<storage::ItemView>& items,
+                    std::vector<size_t>& fresh);
+    // Fill the duplicate filter with everything stored
+    void rebuild_filter();
 
   private:
-    sqlite3* db;
-    sqlite3_stmt* save_stmt;
-    sqlite3_stmt* save_or_ignore_stmt;
-    sqlite3_stmt* get_all_for_pk_stmt;
-    sqlite3_stmt* get_all_stmt;
-    sqlite3_stmt* get_stmt;
-    sqlite3_stmt* get_row_count_stmt;
-    sqlite3_stmt* get_by_index_stmt;
-    sqlite3_stmt* get_by_hash_stmt;
-    sqlite3_stmt* delete_expired_stmt;
-
-    boost::asio::steady_timer cleanup_timer_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // Only used with more than one shard
+    std::unique_ptr<boost::asio::thread_pool> pool_;
+
+    DuplicateFilter filter_;
+    std::mutex filter_mutex_;
+    std::atomic<uint64_t> duplicates_checked_{0};
+    std::atomic<uint64_t> duplicates_rejected_{0};
+    std::atomic<uint64_t> filter_false_positives_{0};
 };
 
-} // namespace arqma
\ No newline at end of file
+} // namespace arqma
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <stdint.h>
+#include <string_view>
+#include <vector>
+
+namespace arqma {
+
+/// Remembers the hashes of stored messages until they expire, to tell
+/// cheaply whether an incoming message might be stored already. A message
+/// that was added and hasn't expired is always reported (no false
+/// negatives), but so are some that weren't added, so a positive answer
+/// has to be confirmed. Hashes are kept in one Bloom filter per window of
+/// expiry times; a copy of a message expires at the same time as the
+/// original, so only its window needs to be looked at, and a window is
+/// dropped as a whole once everything in it has expired. Not thread safe.
+class DuplicateFilter {
+  public:
+    // Messages live for at most 4 days, so there are about 25 windows
+    static constexpr uint64_t DEFAULT_WINDOW_MS = 4 * 60 * 60 * 1000;
+    // 1 MiB per window, about 1% false positives with 870k messages in it
+    static constexpr size_t DEFAULT_BITS_PER_WINDOW = size_t(1) << 23;
+
+    explicit DuplicateFilter(
+        size_t bits_per_window = DEFAULT_BITS_PER_WINDOW,
+        uint64_t window_ms = DEFAULT_WINDOW_MS);
+
+    void add(std::string_view hash, uint64_t expires_ms);
+
+    /// Whether a message with `hash` expiring at `expires_ms` might have
+    /// been added
+    bool maybe_contains(std::string_view hash, uint64_t expires_ms) const;
+
+    /// Drop the windows of messages expired by `now_ms`
+    void remove_expired(uint64_t now_ms);
+
+    void clear();
+
+    size_t window_count() const { return windows_.size(); }
+
+  private:
+    static constexpr int NUM_HASHES = 7;
+
+    // Positions of `hash` in a window's bits
+    void bit_positions(std::string_view hash,
+                       size_t (&positions)[NUM_HASHES]) const;
+
+    // Rounded up to a power of two
+    const size_t bits_per_window_;
+    const uint64_t window_ms_;
+    // Bits of every window with messages, by expiry time / `window_ms_`
+    std::map<uint64_t, std::vector<uint64_t>> windows_;
+};
+
+} // namespace arqma
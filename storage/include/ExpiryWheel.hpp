@@ -0,0 +1,155 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace arqma {
+
+/// Hierarchical timing wheel: knows which values expire in every tick, so
+/// that expiring them costs time proportional to their number rather than to
+/// everything held. Values are never reported before their expiry time, and
+/// at most one tick after it. The first level has a slot per tick, each
+/// further level a slot per full turn of the level below; a value waits in
+/// the level its remaining time falls into and moves down as the wheels
+/// turn. Not thread safe.
+template <typename T>
+class ExpiryWheel {
+  public:
+    static constexpr uint64_t DEFAULT_TICK_MS = 1000;
+
+    // Nothing expiring before `now_ms` is looked for
+    explicit ExpiryWheel(uint64_t now_ms, uint64_t tick_ms = DEFAULT_TICK_MS)
+        : tick_ms_(tick_ms), current_tick_(now_ms / tick_ms) {}
+
+    /// Report `value` once `expires_ms` has passed (on the next `advance`
+    /// if it has already)
+    void add(T value, uint64_t expires_ms) {
+        place({std::move(value), expires_ms});
+        size_++;
+    }
+
+    /// Move everything expired by `now_ms` to the end of `due`
+    void advance(uint64_t now_ms, std::vector<T>& due) {
+        for (auto& entry : overdue_) {
+            due.push_back(std::move(entry.value));
+        }
+        size_ -= overdue_.size();
+        overdue_.clear();
+
+        const uint64_t now_tick = now_ms / tick_ms_;
+        if (now_tick > current_tick_ &&
+            (size_ == 0 || now_tick - current_tick_ >= span(LEVELS))) {
+            // Nothing to turn the wheels for, or too far to do it tick by
+            // tick
+            jump_to(now_tick);
+        }
+        while (current_tick_ <= now_tick) {
+            // Once a level's turn is complete, spread the next slot of the
+            // level above over it
+            for (int level = 1; level < LEVELS; ++level) {
+                if (current_tick_ % span(level) != 0) {
+                    break;
+                }
+                auto& slot = slots_[level][slot_index(current_tick_, level)];
+                std::vector<Entry> entries;
+                entries.swap(slot);
+                for (auto& entry : entries) {
+                    place(std::move(entry));
+                }
+            }
+
+            auto& slot = slots_[0][slot_index(current_tick_, 0)];
+            for (auto& entry : slot) {
+                due.push_back(std::move(entry.value));
+            }
+            size_ -= slot.size();
+            slot.clear();
+            current_tick_++;
+        }
+    }
+
+    void clear() {
+        overdue_.clear();
+        for (auto& level : slots_) {
+            for (auto& slot : level) {
+                slot.clear();
+            }
+        }
+        size_ = 0;
+    }
+
+    size_t size() const { return size_; }
+
+  private:
+    // 64 slots per level, 4 levels: about 194 days with 1 second ticks
+    static constexpr int SLOT_BITS = 6;
+    static constexpr uint64_t SLOTS = uint64_t(1) << SLOT_BITS;
+    static constexpr int LEVELS = 4;
+
+    struct Entry {
+        T value;
+        uint64_t expires_ms;
+    };
+
+    // Ticks covered by a turn of the levels below `level`
+    static uint64_t span(int level) {
+        return uint64_t(1) << (SLOT_BITS * level);
+    }
+
+    static size_t slot_index(uint64_t tick, int level) {
+        return (tick >> (SLOT_BITS * level)) & (SLOTS - 1);
+    }
+
+    // Make `tick` the current one, placing everything held again
+    void jump_to(uint64_t tick) {
+        std::vector<Entry> entries;
+        for (auto& level : slots_) {
+            for (auto& slot : level) {
+                for (auto& entry : slot) {
+                    entries.push_back(std::move(entry));
+                }
+                slot.clear();
+            }
+        }
+        current_tick_ = tick;
+        for (auto& entry : entries) {
+            place(std::move(entry));
+        }
+    }
+
+    void place(Entry entry) {
+        // First tick by which the value has expired (rounded up, so that it
+        // is never reported early)
+        uint64_t tick = entry.expires_ms / tick_ms_ +
+                        (entry.expires_ms % tick_ms_ != 0);
+        if (tick < current_tick_) {
+            overdue_.push_back(std::move(entry));
+            return;
+        }
+
+        const uint64_t delta = tick - current_tick_;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= span(level + 1)) {
+            level++;
+        }
+        if (delta >= span(LEVELS)) {
+            // Beyond the last level: wait in its furthest slot and be
+            // placed again from there
+            tick = current_tick_ + span(LEVELS) - 1;
+        }
+
+        slots_[level][slot_index(tick, level)].push_back(std::move(entry));
+    }
+
+    const uint64_t tick_ms_;
+    // The next tick to expire
+    uint64_t current_tick_;
+    std::vector<Entry> slots_[LEVELS][SLOTS];
+    // Added after the tick they expire in was expired
+    std::vector<Entry> overdue_;
+    size_t size_ = 0;
+};
+
+} // namespace arqma
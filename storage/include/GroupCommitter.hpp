@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Item.hpp"
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+namespace arqma {
+
+class AsyncDatabase;
+class Database;
+
+enum class CommitResult { STORED, DUPLICATE, FAILED };
+
+/// Collects individual stores and writes them to the database in a single
+/// transaction once either `max_batch_size` messages are pending or
+/// `max_delay` has passed since the first of them arrived. Completion
+/// handlers are only invoked after the transaction holding their message
+/// has been committed. Not thread safe: meant to be used from the thread
+/// running `ioc`. With an `AsyncDatabase` the transaction runs on its storage
+/// threads and handlers are invoked later on `ioc`; with a `Database` it runs
+/// right away on the calling thread.
+class GroupCommitter {
+  public:
+    using completion_t = std::function<void(CommitResult)>;
+
+    static constexpr size_t DEFAULT_MAX_BATCH_SIZE = 256;
+    static constexpr std::chrono::milliseconds DEFAULT_MAX_DELAY{5};
+
+    GroupCommitter(boost::asio::io_context& ioc, Database& db,
+                   size_t max_batch_size = DEFAULT_MAX_BATCH_SIZE,
+                   std::chrono::milliseconds max_delay = DEFAULT_MAX_DELAY);
+
+    GroupCommitter(boost::asio::io_context& ioc, AsyncDatabase& db,
+                   size_t max_batch_size = DEFAULT_MAX_BATCH_SIZE,
+                   std::chrono::milliseconds max_delay = DEFAULT_MAX_DELAY);
+
+    /// Queue `item` for the next batch; `on_commit` might be invoked before
+    /// this function returns if the batch is full
+    void store(storage::Item item, completion_t&& on_commit);
+
+    /// Commit everything that is pending right away (or submit it, with an
+    /// `AsyncDatabase`)
+    void flush();
+
+    size_t pending() const { return pending_items_.size(); }
+
+  private:
+    // Exactly one of them is set
+    Database* db_ = nullptr;
+    AsyncDatabase* async_db_ = nullptr;
+    boost::asio::steady_timer flush_timer_;
+    const size_t max_batch_size_;
+    const std::chrono::milliseconds max_delay_;
+
+    std::vector<storage::Item> pending_items_;
+    std::vector<completion_t> pending_callbacks_;
+    // Bumped on every flush, so that a timer armed for an earlier batch
+    // doesn't flush the current one
+    uint64_t batch_ = 0;
+};
+
+} // namespace arqma
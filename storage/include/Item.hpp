@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <string_view>
 
 namespace arqma {
 namespace storage {
@@ -23,6 +24,24 @@ struct Item {
     std::string data;
 };
 
+/// Same as `Item`, but referring to strings owned by someone else
+/// (see `RetrieveBuffer`)
+struct ItemView {
+    std::string_view hash;
+    std::string_view pub_key;
+    uint64_t timestamp;
+    uint64_t ttl;
+    uint64_t expiration_timestamp;
+    std::string_view nonce;
+    std::string_view data;
+};
+
+// Valid for as long as `item` is not modified
+inline ItemView view_of(const Item& item) {
+    return {item.hash,  item.pub_key, item.timestamp, item.ttl,
+            item.expiration_timestamp, item.nonce, item.data};
+}
+
 } // namespace storage
 
 } // namespace arqma
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "Item.hpp"
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace arqma {
+
+/// Holds the messages returned by a retrieve. All of their strings are
+/// appended to a single arena, so once the buffer has grown to its working
+/// size, filling it again after `clear()` does not allocate. Views into the
+/// buffer are invalidated by any modification.
+class RetrieveBuffer {
+  public:
+    class const_iterator {
+        const RetrieveBuffer* buffer_;
+        size_t index_;
+
+      public:
+        const_iterator(const RetrieveBuffer* buffer, size_t index)
+            : buffer_(buffer), index_(index) {}
+
+        storage::ItemView operator*() const { return (*buffer_)[index_]; }
+        const_iterator& operator++() {
+            ++index_;
+            return *this;
+        }
+        bool operator!=(const const_iterator& other) const {
+            return index_ != other.index_;
+        }
+    };
+
+    void clear();
+
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+
+    storage::ItemView operator[](size_t index) const;
+
+    const_iterator begin() const { return {this, 0}; }
+    const_iterator end() const { return {this, entries_.size()}; }
+
+    void append(std::string_view hash, std::string_view pub_key,
+                uint64_t timestamp, uint64_t ttl, uint64_t expiration_timestamp,
+                std::string_view nonce, std::string_view data);
+
+  private:
+    // Offsets rather than pointers: the arena may move while it is filled
+    struct Span {
+        size_t offset;
+        size_t size;
+    };
+
+    struct Entry {
+        Span hash;
+        Span pub_key;
+        uint64_t timestamp;
+        uint64_t ttl;
+        uint64_t expiration_timestamp;
+        Span nonce;
+        Span data;
+    };
+
+    Span push(std::string_view str);
+    std::string_view view(Span span) const;
+
+    std::string arena_;
+    std::vector<Entry> entries_;
+};
+
+} // namespace arqma
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "ExpiryWheel.hpp"
+#include "Item.hpp"
+#include "RetrieveBuffer.hpp"
+
+#include <deque>
+#include <list>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace arqma {
+
+/// Newest messages of recently polled pubkeys, so that clients polling for
+/// new messages can be answered without a database query. For every cached
+/// owner it holds a run of the owner's newest messages in storage order (all
+/// of them if the entry is `complete`). Only messages known to be new are
+/// appended; whenever that can't be guaranteed the owner has to be
+/// invalidated. Entries are evicted least recently used first once the
+/// cache grows past `max_bytes`. Not thread safe.
+class RetrieveCache {
+  public:
+    static constexpr size_t DEFAULT_MAX_BYTES = 64 * 1024 * 1024;
+    static constexpr size_t MAX_MESSAGES_PER_OWNER = 64;
+    // Owners whose last write is remembered for `fill`
+    static constexpr size_t MAX_WRITTEN_OWNERS = 16 * 1024;
+
+    explicit RetrieveCache(size_t max_bytes = DEFAULT_MAX_BYTES);
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t owners = 0;
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+    };
+
+    /// Append up to `limit` messages for `owner` stored after `last_hash`
+    /// (after none if empty) to `items`, skipping those expired by `now_ms`.
+    /// Return false if the answer is not known exactly.
+    bool retrieve(const std::string& owner, const std::string& last_hash,
+                  size_t limit, uint64_t now_ms, RetrieveBuffer& items);
+
+    /// Changes whenever a message is added or an owner invalidated; take it
+    /// before reading from the database and pass it to `fill`
+    uint64_t version() const { return version_; }
+
+    /// Cache `messages`, which must be the newest messages of `owner` in
+    /// storage order (all of them if `complete`), as read from the database
+    /// at `version`. Ignored if `owner` was written to (or invalidated, or
+    /// the cache cleared) since; writes to other owners don't matter.
+    void fill(const std::string& owner, std::vector<storage::Item>&& messages,
+              bool complete, uint64_t version);
+
+    /// A new message was stored. Reads that ran concurrently with the store
+    /// may have cached it already, so it is only appended if it isn't there.
+    void add(const storage::Item& item);
+
+    /// Forget everything about `owner`
+    void invalidate(const std::string& owner);
+
+    /// Forget everything, for when messages were stored without knowing
+    /// whose
+    void clear();
+
+    /// Drop the messages expired by `now_ms`. Only the owners with such
+    /// messages are looked at, so it is cheap to call every tick of an
+    /// `ExpiryWheel`.
+    void remove_expired(uint64_t now_ms);
+
+    Stats get_stats() const;
+
+  private:
+    struct Entry {
+        std::string owner;
+        std::deque<storage::Item> messages;
+        bool complete;
+        size_t bytes = 0;
+        // When `expiry_wheel_` reports the owner next (no earlier than its
+        // first message expires)
+        uint64_t next_expiry = UINT64_MAX;
+    };
+
+    using entry_list_t = std::list<Entry>;
+
+    void push_message(Entry& entry, storage::Item item);
+    void remove_expired(Entry& entry, uint64_t now_ms);
+    // Have `entry` reported when its first message expires
+    void schedule_expiry(Entry& entry);
+    void erase(entry_list_t::iterator it);
+    void evict();
+    // Note that `owner` was written to, bumping `version_`
+    void written(const std::string& owner);
+
+    const size_t max_bytes_;
+    // Most recently used first
+    entry_list_t entries_;
+    std::unordered_map<std::string, entry_list_t::iterator> by_owner_;
+    // Owners by when their messages expire. Owners might be reported after
+    // they were evicted, or for an expiry since superseded; those reports
+    // are ignored.
+    ExpiryWheel<std::string> expiry_wheel_{0};
+    size_t bytes_ = 0;
+    size_t messages_ = 0;
+    uint64_t version_ = 0;
+    // The version at which each owner was last written to, for owners
+    // written to since `floor_`. Fills read before `floor_` are ignored, so
+    // that this can be emptied (raising `floor_`) when it grows too big.
+    std::unordered_map<std::string, uint64_t> written_at_;
+    uint64_t floor_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+} // namespace arqma
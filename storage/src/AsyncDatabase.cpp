@@ -0,0 +1,130 @@
+#include "AsyncDatabase.hpp"
+
+namespace arqma {
+
+using storage::Item;
+using storage::ItemView;
+
+constexpr size_t AsyncDatabase::DEFAULT_THREAD_COUNT;
+
+AsyncDatabase::AsyncDatabase(boost::asio::io_context& ioc, Database& db,
+                             size_t num_threads)
+    : ioc_(ioc), db_(db), pool_(num_threads),
+      writes_(boost::asio::make_strand(pool_.get_executor())),
+      cleanup_timer_(ioc) {
+    // Whatever expired while we were offline is removed in budgeted chunks
+    // like everything else rather than in one go before we can serve
+    schedule_cleanup(std::chrono::milliseconds(0));
+}
+
+AsyncDatabase::~AsyncDatabase() {
+    cleanup_timer_.cancel();
+    pool_.join();
+}
+
+void AsyncDatabase::schedule_cleanup(std::chrono::milliseconds delay) {
+    cleanup_timer_.expires_after(delay);
+    const std::weak_ptr<bool> alive = alive_;
+    cleanup_timer_.async_wait(
+        [this, alive](const boost::system::error_code& ec) {
+            if (ec == boost::asio::error::operation_aborted || !alive.lock()) {
+                return;
+            }
+            write([](Database& db) { return db.clean_up_expired(); },
+                  [this, alive](std::chrono::milliseconds next) {
+                      if (alive.lock()) {
+                          schedule_cleanup(next);
+                      }
+                  });
+        });
+}
+
+void AsyncDatabase::store_batch(
+    std::vector<Item>&& items,
+    std::function<void(bool, std::vector<bool>)>&& on_done) {
+
+    write(
+        [items = std::move(items)](Database& db) {
+            std::vector<bool> inserted;
+            const bool committed = db.store_batch(items, inserted);
+            return std::make_pair(committed, std::move(inserted));
+        },
+        [on_done = std::move(on_done)](std::pair<bool, std::vector<bool>> res) {
+            on_done(res.first, std::move(res.second));
+        });
+}
+
+void AsyncDatabase::bulk_store(
+    std::vector<Item>&& items,
+    std::function<void(bool, std::vector<Item>)>&& on_done) {
+
+    write(
+        [items = std::move(items)](Database& db) mutable {
+            std::vector<bool> inserted;
+            const bool committed = db.store_batch(items, inserted);
+            std::vector<Item> new_items;
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (inserted[i]) {
+                    new_items.push_back(std::move(items[i]));
+                }
+            }
+            return std::make_pair(committed, std::move(new_items));
+        },
+        [on_done = std::move(on_done)](std::pair<bool, std::vector<Item>> res) {
+            on_done(res.first, std::move(res.second));
+        });
+}
+
+void AsyncDatabase::bulk_store(
+    std::vector<ItemView>&& items, std::shared_ptr<const void> owner,
+    std::function<void(bool, std::vector<ItemView>)>&& on_done) {
+
+    write(
+        [items = std::move(items), owner](Database& db) {
+            std::vector<bool> inserted;
+            const bool committed = db.store_batch(items, inserted);
+            std::vector<ItemView> new_items;
+            for (size_t i = 0; i < items.size(); ++i) {
+                if (inserted[i]) {
+                    new_items.push_back(items[i]);
+                }
+            }
+            return std::make_pair(committed, std::move(new_items));
+        },
+        [owner, on_done = std::move(on_done)](
+            std::pair<bool, std::vector<ItemView>> res) {
+            on_done(res.first, std::move(res.second));
+        });
+}
+
+void AsyncDatabase::retrieve_by_hash(
+    const std::string& msg_hash,
+    std::function<void(bool, Item)>&& on_done) {
+
+    read(
+        [msg_hash](Database& db) {
+            Item item;
+            const bool found = db.retrieve_by_hash(msg_hash, item);
+            return std::make_pair(found, std::move(item));
+        },
+        [on_done = std::move(on_done)](std::pair<bool, Item> res) {
+            on_done(res.first, std::move(res.second));
+        });
+}
+
+void AsyncDatabase::retrieve_random(
+    uint64_t seed, std::function<void(bool, Item)>&& on_done) {
+
+    read(
+        [seed](Database& db) {
+            std::mt19937_64 rng(seed);
+            Item item;
+            const bool found = db.retrieve_random(rng, item);
+            return std::make_pair(found, std::move(item));
+        },
+        [on_done = std::move(on_done)](std::pair<bool, Item> res) {
+            on_done(res.first, std::move(res.second));
+        });
+}
+
+} // namespace arqma
@@ -1,388 +1,654 @@
 #include "Database.hpp"
+#include "Shard.hpp"
 #include "arqma_logger.h"
 #include "utils.hpp"
 
-#include "sqlite3.h"
+#include <algorithm>
+#include <cstdio>
 #include <exception>
 
 namespace arqma {
 using namespace storage;
 
-constexpr auto CLEANUP_PERIOD = std::chrono::seconds(10);
+// Messages moved per transaction when the shard count changes
+constexpr size_t REBALANCE_CHUNK_SIZE = 1000;
 
-Database::~Database() {
-    sqlite3_finalize(save_stmt);
-    sqlite3_finalize(save_or_ignore_stmt);
-    sqlite3_finalize(get_all_for_pk_stmt);
-    sqlite3_finalize(get_all_stmt);
-    sqlite3_finalize(get_stmt);
-    sqlite3_finalize(delete_expired_stmt);
-    sqlite3_close(db);
-    std::cerr << "~Database\n";
+static std::string shard_path(const std::string& db_path, size_t index) {
+    // The first shard keeps the name used before there were shards
+    if (index == 0) {
+        return db_path + "/storage.db";
+    }
+    return db_path + "/storage-" + std::to_string(index) + ".db";
 }
 
-Database::Database(boost::asio::io_context& ioc, const std::string& db_path)
-    : cleanup_timer_(ioc) {
-    open_and_prepare(db_path);
+// FNV-1a over the pubkey as given. Pubkeys are random enough already, but
+// hashing keeps the mapping independent of the key's format. This decides
+// where messages are stored, so it must never change.
+static uint64_t owner_hash(std::string_view pubkey) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char c : pubkey) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
 
-    perform_cleanup();
+StorageProfile StorageProfile::durable() {
+    return {"durable", "FULL", 2000, 0, false,
+            std::chrono::milliseconds(0)};
 }
 
-void Database::perform_cleanup() {
-    const auto now_ms = util::get_time_ms();
+StorageProfile StorageProfile::balanced() {
+    return {"balanced", "NORMAL", 32 * 1024, int64_t(256) << 20, true,
+            std::chrono::seconds(1)};
+}
 
-    sqlite3_bind_int64(delete_expired_stmt, 1, now_ms);
+StorageProfile StorageProfile::throughput() {
+    return {"throughput", "OFF", 128 * 1024, int64_t(1) << 30, true,
+            std::chrono::seconds(1)};
+}
 
-    int rc;
-    while (true) {
-        rc = sqlite3_step(delete_expired_stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else {
-            fprintf(stderr, "Can't delete expired messages: %s\n",
-                    sqlite3_errmsg(db));
+StorageProfile StorageProfile::from_name(const std::string& name) {
+    for (auto profile : {durable(), balanced(), throughput()}) {
+        if (profile.name == name) {
+            return profile;
+        }
+    }
+    throw std::runtime_error("unknown storage profile: " + name);
+}
+
+Database::Database(const std::string& db_path, size_t num_readers,
+                   size_t num_shards, const StorageProfile& profile) {
+
+    if (num_shards == 0) {
+        throw std::runtime_error("at least one shard is required");
+    }
+
+    shards_.push_back(
+        std::make_unique<Shard>(shard_path(db_path, 0), num_readers, profile));
+
+    // Open every file that might still hold messages
+    const size_t previous = shards_[0]->get_shard_count();
+    const size_t to_open = std::max(previous, num_shards);
+    for (size_t i = 1; i < to_open; ++i) {
+        shards_.push_back(
+            std::make_unique<Shard>(shard_path(db_path, i), num_readers, profile));
+    }
+
+    if (num_shards > 1) {
+        pool_ = std::make_unique<boost::asio::thread_pool>(num_shards);
+    }
+
+    if (previous != num_shards) {
+        Usage usage;
+        if (get_usage(usage) && usage.messages > 0) {
+            ARQMA_LOG(info, "Redistributing messages from {} to {} shards",
+                      previous, num_shards);
+        }
+        rebalance(num_shards);
+
+        // Only forget about the old layout once nothing is left behind, so
+        // that an interrupted run is simply resumed on the next start
+        shards_.resize(num_shards);
+        for (size_t i = num_shards; i < to_open; ++i) {
+            const std::string path = shard_path(db_path, i);
+            for (const char* suffix : {"", "-wal", "-shm"}) {
+                std::remove((path + suffix).c_str());
+            }
         }
+        shards_[0]->set_shard_count(num_shards);
     }
-    int reset_rc = sqlite3_reset(delete_expired_stmt);
-    // If the most recent call to sqlite3_step(S) for the prepared statement S
-    // indicated an error, then sqlite3_reset(S) returns an appropriate error
-    // code.
-    if (reset_rc != SQLITE_OK && reset_rc != rc) {
-        fprintf(stderr, "sql error: unexpected value from sqlite3_reset");
+
+    rebuild_filter();
+}
+
+Database::~Database() {
+    if (pool_) {
+        pool_->join();
     }
+    std::cerr << "~Database\n";
+}
 
-    cleanup_timer_.expires_after(CLEANUP_PERIOD);
-    cleanup_timer_.async_wait(std::bind(&Database::perform_cleanup, this));
+size_t Database::shard_index(std::string_view pubkey) const {
+    return owner_hash(pubkey) % shards_.size();
 }
 
-sqlite3_stmt* Database::prepare_statement(const std::string& query) {
-    const char* pzTest;
-    sqlite3_stmt* stmt;
-    int rc = sqlite3_prepare_v2(db, query.c_str(), query.length() + 1, &stmt,
-                                &pzTest);
-    if (rc != SQLITE_OK) {
-        printf("ERROR: sql error: %s", pzTest);
+Shard& Database::shard_for(const std::string& pubkey) {
+    return *shards_[shard_index(pubkey)];
+}
+
+void Database::rebalance(size_t num_shards) {
+
+    std::vector<Item> chunk;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        Shard& source = *shards_[i];
+        int64_t last_seq = 0;
+
+        while (true) {
+            if (!source.retrieve_chunk(last_seq, REBALANCE_CHUNK_SIZE,
+                                       chunk)) {
+                throw std::runtime_error("could not read a shard");
+            }
+            if (chunk.empty()) {
+                break;
+            }
+
+            std::vector<std::vector<ItemView>> moved(num_shards);
+            std::vector<std::string> hashes;
+            for (const auto& item : chunk) {
+                const size_t target = owner_hash(item.pub_key) % num_shards;
+                if (target != i) {
+                    hashes.push_back(item.hash);
+                    moved[target].push_back(view_of(item));
+                }
+            }
+
+            // Copies are stored before the originals are deleted, and
+            // storing a copy twice is a no-op
+            std::vector<bool> inserted;
+            for (size_t target = 0; target < num_shards; ++target) {
+                if (!moved[target].empty() &&
+                    !shards_[target]->store_batch(moved[target], inserted)) {
+                    throw std::runtime_error("could not move messages");
+                }
+            }
+            if (!hashes.empty() && !source.remove(hashes)) {
+                throw std::runtime_error("could not remove moved messages");
+            }
+        }
     }
-    return stmt;
 }
 
-void Database::open_and_prepare(const std::string& db_path) {
-    const std::string file_path = db_path + "/storage.db";
-    int rc = sqlite3_open_v2(file_path.c_str(), &db,
-                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
-                                 SQLITE_OPEN_FULLMUTEX,
-                             NULL);
+// Run `task`, counting an exception as a failure, as it must not escape
+// a pool thread or leave `run_in_parallel` while other tasks still run
+static bool run_task(const std::function<bool()>& task) {
+    try {
+        return task();
+    } catch (const std::exception& e) {
+        ARQMA_LOG(error, "Storage task failed: {}", e.what());
+    } catch (...) {
+        ARQMA_LOG(error, "Storage task failed");
+    }
+    return false;
+}
 
-    if (rc) {
-        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        // throw?
-        return;
+bool Database::run_in_parallel(
+    const std::vector<std::function<bool()>>& tasks) {
+
+    if (tasks.empty()) {
+        return true;
     }
 
-    const char* create_table_query =
-        "CREATE TABLE IF NOT EXISTS `Data`("
-        "    `Hash` VARCHAR(128) NOT NULL,"
-        "    `Owner` VARCHAR(256) NOT NULL,"
-        "    `TTL` INTEGER NOT NULL,"
-        "    `Timestamp` INTEGER NOT NULL,"
-        "    `TimeExpires` INTEGER NOT NULL,"
-        "    `Nonce` VARCHAR(128) NOT NULL,"
-        "    `Data` BLOB"
-        ");"
-        "CREATE UNIQUE INDEX IF NOT EXISTS `idx_data_hash` ON `Data` (`Hash`);"
-        "CREATE INDEX IF NOT EXISTS `idx_data_owner` on `Data` ('Owner');";
-
-    char* errMsg = nullptr;
-    rc = sqlite3_exec(db, create_table_query, nullptr, nullptr, &errMsg);
-    if (rc) {
-        if (errMsg) {
-            printf("%s\n", errMsg);
-            sqlite3_free(errMsg);
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t pending = tasks.size() - 1;
+    bool success = true;
+
+    const auto wait_for_pending = [&] {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return pending == 0; });
+    };
+
+    for (size_t i = 1; i < tasks.size(); ++i) {
+        try {
+            boost::asio::post(*pool_, [&, i]() {
+                const bool result = run_task(tasks[i]);
+                std::lock_guard<std::mutex> lock(mutex);
+                success = success && result;
+                if (--pending == 0) {
+                    cv.notify_one();
+                }
+            });
+        } catch (...) {
+            // Those posted already still refer to this frame
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending -= tasks.size() - i;
+            }
+            wait_for_pending();
+            throw;
         }
-        throw std::runtime_error("Can't create table");
-    }
-
-    save_stmt = prepare_statement(
-        "INSERT INTO Data "
-        "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data)"
-        "VALUES (?,?,?,?,?,?,?);");
-    if (!save_stmt)
-        throw std::runtime_error("could not prepare the save statement");
-
-    save_or_ignore_stmt = prepare_statement(
-        "INSERT OR IGNORE INTO Data "
-        "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data)"
-        "VALUES (?,?,?,?,?,?,?)");
-    if (!save_or_ignore_stmt)
-        throw std::runtime_error("could not prepare the bulk save statement");
-
-    get_all_for_pk_stmt = prepare_statement(
-        "SELECT * FROM Data WHERE `Owner` = ? ORDER BY rowid LIMIT ?;");
-    if (!get_all_for_pk_stmt)
-        throw std::runtime_error(
-            "could not prepare the get all for pk statement");
-
-    get_all_stmt = prepare_statement("SELECT * FROM Data ORDER BY rowid;");
-    if (!get_all_stmt)
-        throw std::runtime_error("could not prepare the get all statement");
-
-    get_stmt =
-        prepare_statement("SELECT * FROM `Data` WHERE `Owner` == ? AND rowid >"
-                          "COALESCE((SELECT `rowid` FROM `Data` WHERE `Hash` = "
-                          "?), 0) ORDER BY rowid LIMIT ?;");
-    if (!get_stmt)
-        throw std::runtime_error("could not prepare get statement");
-
-    get_row_count_stmt = prepare_statement("SELECT count(*) FROM `Data`;");
-    if (!get_row_count_stmt)
-        throw std::runtime_error("could not prepare row count statement");
-
-    get_by_index_stmt = prepare_statement("SELECT * FROM `Data` LIMIT ?, 1;");
-    if (!get_by_index_stmt)
-        throw std::runtime_error("could not prepare get by index statement");
-
-    get_by_hash_stmt =
-        prepare_statement("SELECT * FROM `Data` WHERE `Hash` = ?;");
-    if (!get_by_hash_stmt)
-        throw std::runtime_error("could not prepare get by hash statement");
-
-    delete_expired_stmt =
-        prepare_statement("DELETE FROM `Data` WHERE `TimeExpires` <= ?");
-    if (!delete_expired_stmt)
-        throw std::runtime_error(
-            "could not prepare 'delete expired' statement");
+    }
+
+    // The calling thread would only be waiting otherwise
+    const bool result = run_task(tasks[0]);
+
+    wait_for_pending();
+    return success && result;
 }
 
-bool Database::get_message_count(uint64_t& count) {
+bool Database::store(const std::string& hash, const std::string& pubKey,
+                     const std::string& bytes, uint64_t ttl,
+                     uint64_t timestamp, const std::string& nonce,
+                     DuplicateHandling duplicateHandling) {
+    if (!shard_for(pubKey).store(hash, pubKey, bytes, ttl, timestamp, nonce,
+                                 duplicateHandling)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    filter_.add(hash, timestamp + ttl);
+    return true;
+}
 
-    int rc;
-    bool success = false;
-    while (true) {
-        rc = sqlite3_step(get_row_count_stmt);
-        if (rc == SQLITE_BUSY) {
+void Database::rebuild_filter() {
+
+    std::lock_guard<std::mutex> lock(filter_mutex_);
+    filter_.clear();
+    for (auto& shard : shards_) {
+        const bool success = shard->for_each_hash(
+            [this](const std::string& hash, uint64_t expires) {
+                filter_.add(hash, expires);
+            });
+        if (!success) {
+            // Duplicates it doesn't know about are still ignored on insert
+            ARQMA_LOG(error, "Could not fill the duplicate filter");
+            return;
+        }
+    }
+}
+
+void Database::find_fresh(const std::vector<ItemView>& items,
+                          std::vector<size_t>& fresh) {
+
+    fresh.clear();
+    duplicates_checked_ += items.size();
+
+    std::vector<std::vector<size_t>> maybe(shards_.size());
+    bool any_maybe = false;
+    {
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        filter_.remove_expired(util::get_time_ms());
+        for (size_t i = 0; i < items.size(); ++i) {
+            const auto& item = items[i];
+            if (filter_.maybe_contains(item.hash, item.timestamp + item.ttl)) {
+                maybe[shard_index(item.pub_key)].push_back(i);
+                any_maybe = true;
+            } else {
+                fresh.push_back(i);
+            }
+        }
+    }
+
+    if (!any_maybe) {
+        return;
+    }
+
+    // A lookup on a read connection is cheaper than a failed insert, and
+    // it doesn't hold up the writer
+    std::vector<std::string_view> hashes;
+    std::vector<bool> found;
+    for (size_t s = 0; s < shards_.size(); ++s) {
+        if (maybe[s].empty()) {
             continue;
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else if (rc == SQLITE_ROW) {
-            count = sqlite3_column_int64(get_row_count_stmt, 0);
-            success = true;
-        } else {
-            ARQMA_LOG(critical, "Could not execute `count` db statement");
-            break;
+        }
+        hashes.clear();
+        for (const size_t i : maybe[s]) {
+            hashes.push_back(items[i].hash);
+        }
+        if (!shards_[s]->contains(hashes, found)) {
+            found.assign(hashes.size(), false);
+        }
+        for (size_t j = 0; j < found.size(); ++j) {
+            if (found[j]) {
+                duplicates_rejected_++;
+            } else {
+                filter_false_positives_++;
+                fresh.push_back(maybe[s][j]);
+            }
         }
     }
 
-    rc = sqlite3_reset(get_by_index_stmt);
-    if (rc != SQLITE_OK) {
-        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                  sqlite3_errmsg(db));
-        success = false;
+    // Keep every owner's messages in the order given
+    std::sort(fresh.begin(), fresh.end());
+}
+
+static std::vector<ItemView> views_of(const std::vector<Item>& items) {
+    std::vector<ItemView> views;
+    views.reserve(items.size());
+    for (const auto& item : items) {
+        views.push_back(view_of(item));
     }
+    return views;
+}
 
-    return success;
+bool Database::bulk_store(const std::vector<Item>& items) {
+    return store_items(views_of(items), nullptr);
 }
 
-/// Extract item from the result of a successfull select statement execution
-static Item extract_item(sqlite3_stmt* stmt) {
+bool Database::store_batch(const std::vector<Item>& items,
+                           std::vector<bool>& inserted) {
+    return store_items(views_of(items), &inserted);
+}
 
-    Item item;
+bool Database::bulk_store(const std::vector<ItemView>& items) {
+    return store_items(items, nullptr);
+}
 
-    // "If the SQL statement does not currently point to a valid row, or if the
-    // column index is out of range, the result is undefined"
-    item.hash = std::string((const char*)sqlite3_column_text(stmt, 0));
-    item.pub_key = std::string((const char*)sqlite3_column_text(stmt, 1));
-    item.ttl = sqlite3_column_int64(stmt, 2);
-    item.timestamp = sqlite3_column_int64(stmt, 3);
-    item.expiration_timestamp = sqlite3_column_int64(stmt, 4);
-    item.nonce = std::string((const char*)sqlite3_column_text(stmt, 5));
-    item.data = std::string((char*)sqlite3_column_blob(stmt, 6),
-                            sqlite3_column_bytes(stmt, 6));
-    return item;
+bool Database::store_batch(const std::vector<ItemView>& items,
+                           std::vector<bool>& inserted) {
+    return store_items(items, &inserted);
 }
 
-bool Database::retrieve_by_index(uint64_t index, Item& item) {
+bool Database::store_items(const std::vector<ItemView>& items,
+                           std::vector<bool>* inserted) {
 
-    sqlite3_bind_int64(get_by_index_stmt, 1, index);
+    std::vector<size_t> fresh;
+    find_fresh(items, fresh);
 
-    bool success = false;
-    int rc;
-    while (true) {
-        rc = sqlite3_step(get_by_index_stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_DONE) {
-            // Note that if the index is out of bounds, we will get here
-            // returning an empty Item
-            break;
-        } else if (rc == SQLITE_ROW) {
-            item = extract_item(get_by_index_stmt);
-            success = true;
-            break;
-        } else {
-            ARQMA_LOG(critical,
-                      "Could not execute `retrieve by index` db statement");
-            break;
+    std::vector<ItemView> fresh_items;
+    if (fresh.size() < items.size()) {
+        fresh_items.reserve(fresh.size());
+        for (const size_t i : fresh) {
+            fresh_items.push_back(items[i]);
         }
     }
+    const auto& to_store =
+        fresh.size() < items.size() ? fresh_items : items;
+
+    std::vector<bool> stored;
+    const bool success =
+        store_in_shards(to_store, inserted ? &stored : nullptr);
 
-    rc = sqlite3_reset(get_by_index_stmt);
-    if (rc != SQLITE_OK) {
-        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                  sqlite3_errmsg(db));
-        success = false;
+    if (inserted) {
+        inserted->assign(items.size(), false);
+        for (size_t j = 0; j < stored.size(); ++j) {
+            (*inserted)[fresh[j]] = stored[j];
+        }
+    }
+
+    if (success) {
+        // Also those ignored on insert, they are stored all the same
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        for (const auto& item : to_store) {
+            filter_.add(item.hash, item.timestamp + item.ttl);
+        }
+    } else if (inserted) {
+        // Shards that did commit still have their new messages
+        std::lock_guard<std::mutex> lock(filter_mutex_);
+        for (size_t j = 0; j < stored.size(); ++j) {
+            if (stored[j]) {
+                filter_.add(to_store[j].hash,
+                            to_store[j].timestamp + to_store[j].ttl);
+            }
+        }
     }
 
     return success;
 }
 
-bool Database::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+bool Database::store_in_shards(const std::vector<ItemView>& items,
+                               std::vector<bool>* inserted) {
 
-    sqlite3_bind_text(get_by_hash_stmt, 1, msg_hash.c_str(), -1, SQLITE_STATIC);
+    if (shards_.size() == 1) {
+        return inserted ? shards_[0]->store_batch(items, *inserted)
+                        : shards_[0]->bulk_store(items);
+    }
 
-    bool success = false;
-    int rc;
-    while (true) {
-        rc = sqlite3_step(get_by_hash_stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_DONE) {
-            break;
-        } else if (rc == SQLITE_ROW) {
-            item = extract_item(get_by_hash_stmt);
-            success = true;
-            break;
-        } else {
-            ARQMA_LOG(
-                critical,
-                "Could not execute `retrieve by hash` db statement, ec: {}",
-                rc);
-            break;
+    // Where each shard's items came from in `items`
+    std::vector<std::vector<size_t>> positions(shards_.size());
+    std::vector<std::vector<ItemView>> by_shard(shards_.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        const size_t index = shard_index(items[i].pub_key);
+        positions[index].push_back(i);
+        by_shard[index].push_back(items[i]);
+    }
+
+    std::vector<std::vector<bool>> shard_inserted(shards_.size());
+    std::vector<std::function<bool()>> tasks;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (!by_shard[i].empty()) {
+            tasks.push_back([this, i, inserted, &by_shard, &shard_inserted] {
+                return inserted ? shards_[i]->store_batch(by_shard[i],
+                                                          shard_inserted[i])
+                                : shards_[i]->bulk_store(by_shard[i]);
+            });
         }
     }
 
-    rc = sqlite3_reset(get_by_hash_stmt);
-    if (rc != SQLITE_OK) {
-        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                  sqlite3_errmsg(db));
-        success = false;
+    const bool success = run_in_parallel(tasks);
+
+    if (inserted) {
+        inserted->assign(items.size(), false);
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            for (size_t j = 0; j < shard_inserted[i].size(); ++j) {
+                (*inserted)[positions[i][j]] = shard_inserted[i][j];
+            }
+        }
     }
 
     return success;
 }
 
-bool Database::store(const std::string& hash, const std::string& pubKey,
-                     const std::string& bytes, uint64_t ttl, uint64_t timestamp,
-                     const std::string& nonce,
-                     DuplicateHandling duplicateHandling) {
+bool Database::retrieve(const std::string& pubKey, std::vector<Item>& items,
+                        const std::string& lastHash, int num_results) {
 
-    const auto exp_time = timestamp + ttl;
-
-    sqlite3_stmt* stmt = duplicateHandling == DuplicateHandling::IGNORE
-                             ? save_or_ignore_stmt
-                             : save_stmt;
-
-    // TODO: bind can return errors, handle them
-    sqlite3_bind_text(stmt, 1, hash.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, pubKey.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int64(stmt, 3, ttl);
-    sqlite3_bind_int64(stmt, 4, timestamp);
-    sqlite3_bind_int64(stmt, 5, exp_time);
-    sqlite3_bind_blob(stmt, 6, nonce.data(), nonce.size(), SQLITE_STATIC);
-    sqlite3_bind_blob(stmt, 7, bytes.data(), bytes.size(), SQLITE_STATIC);
-
-    bool result = false;
-    int rc;
-    while (true) {
-        rc = sqlite3_step(stmt);
-        if (rc == SQLITE_BUSY) {
-            continue;
-        } else if (rc == SQLITE_CONSTRAINT) {
-            break;
-        } else if (rc == SQLITE_DONE) {
-            result = true;
-            break;
-        } else {
-            ARQMA_LOG(critical,
-                      "Could not execute `store` db statement, ec: {}", rc);
-            break;
+    if (!pubKey.empty()) {
+        return shard_for(pubKey).retrieve(pubKey, items, lastHash,
+                                          num_results);
+    }
+
+    for (auto& shard : shards_) {
+        if (!shard->retrieve(pubKey, items, lastHash, num_results)) {
+            return false;
         }
     }
+    return true;
+}
 
-    rc = sqlite3_reset(stmt);
-    if (rc != SQLITE_OK && rc != SQLITE_CONSTRAINT) {
-        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                  sqlite3_errmsg(db));
+bool Database::retrieve(const std::string& pubKey, RetrieveBuffer& buffer,
+                        const std::string& lastHash, int num_results) {
+
+    if (!pubKey.empty()) {
+        return shard_for(pubKey).retrieve(pubKey, buffer, lastHash,
+                                          num_results);
+    }
+
+    for (auto& shard : shards_) {
+        if (!shard->retrieve(pubKey, buffer, lastHash, num_results)) {
+            return false;
+        }
     }
-    return result;
+    return true;
 }
 
-bool Database::bulk_store(const std::vector<Item>& items) {
-    char* errmsg = 0;
-    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
-        SQLITE_OK) {
-        return false;
+bool Database::retrieve_many(const std::vector<RetrieveRequest>& requests,
+                             RetrieveBuffer& buffer,
+                             std::vector<std::pair<size_t, size_t>>& ranges,
+                             int num_results) {
+
+    ranges.assign(requests.size(), {buffer.size(), buffer.size()});
+
+    std::vector<std::vector<size_t>> by_shard(shards_.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        by_shard[shard_index(requests[i].pub_key)].push_back(i);
     }
 
-    try {
-        for (const auto& item : items) {
-            store(item.hash, item.pub_key, item.data, item.ttl, item.timestamp,
-                  item.nonce, DuplicateHandling::IGNORE);
+    // One shard after the other, as they all append to `buffer`
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (!by_shard[i].empty() &&
+            !shards_[i]->retrieve_many(requests, by_shard[i], buffer, ranges,
+                                       num_results)) {
+            return false;
         }
-    } catch (...) {
-        fprintf(stderr, "Failed to store items during bulk operation");
     }
+    return true;
+}
 
-    if (sqlite3_exec(db, "END TRANSACTION;", NULL, NULL, &errmsg) != SQLITE_OK)
-        return false;
+Database::Cursor::Cursor(Database& db, size_t chunk_size)
+    : db_(db), chunk_size_(chunk_size) {}
 
+bool Database::Cursor::next(std::vector<Item>& chunk) {
+
+    while (shard_ < db_.shards_.size()) {
+        if (!db_.shards_[shard_]->retrieve_chunk(last_seq_, chunk_size_,
+                                                 chunk)) {
+            return false;
+        }
+        if (!chunk.empty()) {
+            return true;
+        }
+        shard_++;
+        last_seq_ = 0;
+    }
+
+    chunk.clear();
     return true;
 }
 
-bool Database::retrieve(const std::string& pubKey, std::vector<Item>& items,
-                        const std::string& lastHash, int num_results) {
+Database::Cursor Database::scan(size_t chunk_size) {
+    return Cursor(*this, chunk_size);
+}
+
+bool Database::export_snapshot(const std::string& path, uint64_t& exported) {
 
-    sqlite3_stmt* stmt;
-
-    if (pubKey.empty()) {
-        stmt = get_all_stmt;
-    } else if (lastHash.empty()) {
-        stmt = get_all_for_pk_stmt;
-        sqlite3_bind_text(stmt, 1, pubKey.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 2, num_results);
-    } else {
-        stmt = get_stmt;
-        sqlite3_bind_text(stmt, 1, pubKey.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, lastHash.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 3, num_results);
-    }
-
-    bool success = false;
-
-    while (true) {
-        int rc = sqlite3_step(stmt);
-        if (rc == SQLITE_DONE) {
-            success = true;
-            break;
-        } else if (rc == SQLITE_ROW) {
-            auto item = extract_item(stmt);
-            items.push_back(std::move(item));
-        } else {
-            ARQMA_LOG(critical,
-                      "Could not execute `retrieve` db statement, ec: {}", rc);
-            break;
+    exported = 0;
+    std::remove(path.c_str());
+    for (auto& shard : shards_) {
+        if (!shard->export_snapshot(path, exported)) {
+            std::remove(path.c_str());
+            return false;
         }
     }
+    return true;
+}
 
-    int rc = sqlite3_reset(stmt);
-    if (rc != SQLITE_OK) {
-        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
-                  sqlite3_errmsg(db));
-        success = false;
+bool Database::import_snapshot(const std::string& path, uint64_t& imported) {
+
+    imported = 0;
+    if (shards_.size() == 1) {
+        const bool success =
+            shards_[0]->import_snapshot(path, nullptr, imported);
+        rebuild_filter();
+        return success;
+    }
+
+    // Every shard picks its own owners out of the whole snapshot
+    std::vector<uint64_t> counts(shards_.size(), 0);
+    std::vector<std::function<bool()>> tasks;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        tasks.push_back([this, i, &path, &counts] {
+            return shards_[i]->import_snapshot(
+                path,
+                [this, i](const std::string& owner) {
+                    return shard_index(owner) == i;
+                },
+                counts[i]);
+        });
+    }
+
+    const bool success = run_in_parallel(tasks);
+    for (const uint64_t count : counts) {
+        imported += count;
     }
+    // Cheaper than adding the messages one by one while importing
+    rebuild_filter();
     return success;
 }
 
+bool Database::get_message_count(uint64_t& count) {
+
+    Usage usage;
+    if (!get_usage(usage)) {
+        return false;
+    }
+
+    count = usage.messages;
+    return true;
+}
+
+bool Database::get_usage(Usage& usage) {
+
+    usage = Usage{};
+    for (auto& shard : shards_) {
+        Usage shard_usage;
+        if (!shard->get_usage(shard_usage)) {
+            return false;
+        }
+        // An owner lives in exactly one shard, so owners add up too
+        usage.messages += shard_usage.messages;
+        usage.bytes += shard_usage.bytes;
+        usage.owners += shard_usage.owners;
+    }
+    return true;
+}
+
+bool Database::get_owner_usage(const std::string& pubkey, Usage& usage) {
+    return shard_for(pubkey).get_owner_usage(pubkey, usage);
+}
+
+bool Database::retrieve_random(std::mt19937_64& rng, Item& item) {
+
+    if (shards_.size() == 1) {
+        return shards_[0]->retrieve_random(rng, item);
+    }
+
+    // Pick the shard in proportion to its size, so that every message is
+    // still equally likely
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    for (auto& shard : shards_) {
+        Usage usage;
+        if (!shard->get_usage(usage)) {
+            return false;
+        }
+        counts.push_back(usage.messages);
+        total += usage.messages;
+    }
+
+    if (total == 0) {
+        return false;
+    }
+
+    uint64_t pick = util::uniform_distribution_portable(rng, total);
+    size_t index = 0;
+    while (pick >= counts[index]) {
+        pick -= counts[index];
+        index++;
+    }
+
+    return shards_[index]->retrieve_random(rng, item);
+}
+
+Database::ExpiryStats Database::get_expiry_stats() const {
+
+    ExpiryStats stats;
+    for (const auto& shard : shards_) {
+        const ExpiryStats shard_stats = shard->get_expiry_stats();
+        stats.total_expired += shard_stats.total_expired;
+        stats.expired_per_sec += shard_stats.expired_per_sec;
+        stats.backlog += shard_stats.backlog;
+    }
+    return stats;
+}
+
+std::chrono::milliseconds Database::clean_up_expired() {
+
+    auto next = std::chrono::milliseconds::max();
+    for (auto& shard : shards_) {
+        next = std::min(next, shard->clean_up_expired());
+    }
+    return next;
+}
+
+Database::DuplicateStats Database::get_duplicate_stats() const {
+
+    DuplicateStats stats;
+    stats.checked = duplicates_checked_;
+    stats.rejected = duplicates_rejected_;
+    stats.false_positives = filter_false_positives_;
+    return stats;
+}
+
+bool Database::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+
+    // The hash doesn't tell which shard the message is in
+    for (auto& shard : shards_) {
+        if (shard->retrieve_by_hash(msg_hash, item)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 } // namespace arqma
@@ -0,0 +1,71 @@
+#include "DuplicateFilter.hpp"
+
+#include <functional>
+
+namespace arqma {
+
+constexpr uint64_t DuplicateFilter::DEFAULT_WINDOW_MS;
+constexpr size_t DuplicateFilter::DEFAULT_BITS_PER_WINDOW;
+
+static size_t round_up_to_power_of_two(size_t n) {
+    size_t result = 64;
+    while (result < n) {
+        result *= 2;
+    }
+    return result;
+}
+
+DuplicateFilter::DuplicateFilter(size_t bits_per_window, uint64_t window_ms)
+    : bits_per_window_(round_up_to_power_of_two(bits_per_window)),
+      window_ms_(window_ms) {}
+
+void DuplicateFilter::bit_positions(std::string_view hash,
+                                    size_t (&positions)[NUM_HASHES]) const {
+    // Double hashing: the k positions are h1 + i * h2 for i < k, with h2
+    // odd so that they are all different
+    const uint64_t h1 = std::hash<std::string_view>()(hash);
+    const uint64_t h2 = ((h1 >> 32) | (h1 << 32)) * 0x9e3779b97f4a7c15 | 1;
+    for (int i = 0; i < NUM_HASHES; ++i) {
+        positions[i] = (h1 + i * h2) & (bits_per_window_ - 1);
+    }
+}
+
+void DuplicateFilter::add(std::string_view hash, uint64_t expires_ms) {
+    auto& bits = windows_[expires_ms / window_ms_];
+    if (bits.empty()) {
+        bits.resize(bits_per_window_ / 64);
+    }
+
+    size_t positions[NUM_HASHES];
+    bit_positions(hash, positions);
+    for (const size_t pos : positions) {
+        bits[pos / 64] |= uint64_t(1) << (pos % 64);
+    }
+}
+
+bool DuplicateFilter::maybe_contains(std::string_view hash,
+                                     uint64_t expires_ms) const {
+    const auto it = windows_.find(expires_ms / window_ms_);
+    if (it == windows_.end()) {
+        return false;
+    }
+
+    size_t positions[NUM_HASHES];
+    bit_positions(hash, positions);
+    for (const size_t pos : positions) {
+        if (!(it->second[pos / 64] & (uint64_t(1) << (pos % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DuplicateFilter::remove_expired(uint64_t now_ms) {
+    // A window is only done once its last millisecond has passed
+    const auto end = windows_.lower_bound(now_ms / window_ms_);
+    windows_.erase(windows_.begin(), end);
+}
+
+void DuplicateFilter::clear() { windows_.clear(); }
+
+} // namespace arqma
@@ -0,0 +1,104 @@
+#include "GroupCommitter.hpp"
+#include "AsyncDatabase.hpp"
+#include "Database.hpp"
+#include "arqma_logger.h"
+
+namespace arqma {
+
+constexpr size_t GroupCommitter::DEFAULT_MAX_BATCH_SIZE;
+constexpr std::chrono::milliseconds GroupCommitter::DEFAULT_MAX_DELAY;
+
+GroupCommitter::GroupCommitter(boost::asio::io_context& ioc, Database& db,
+                               size_t max_batch_size,
+                               std::chrono::milliseconds max_delay)
+    : db_(&db), flush_timer_(ioc), max_batch_size_(max_batch_size),
+      max_delay_(max_delay) {}
+
+GroupCommitter::GroupCommitter(boost::asio::io_context& ioc, AsyncDatabase& db,
+                               size_t max_batch_size,
+                               std::chrono::milliseconds max_delay)
+    : async_db_(&db), flush_timer_(ioc), max_batch_size_(max_batch_size),
+      max_delay_(max_delay) {}
+
+// Invoke the completion handlers of a batch once its outcome is known
+static void
+report_batch(const std::vector<GroupCommitter::completion_t>& callbacks,
+             bool committed, const std::vector<bool>& inserted) {
+
+    if (committed) {
+        ARQMA_LOG(trace, "Committed a batch of {} messages", callbacks.size());
+    } else {
+        ARQMA_LOG(error, "Failed to commit a batch of {} messages",
+                  callbacks.size());
+    }
+
+    for (size_t i = 0; i < callbacks.size(); ++i) {
+        if (!callbacks[i]) {
+            continue;
+        }
+        if (inserted[i]) {
+            // Even if the batch failed, its shard might have committed
+            callbacks[i](CommitResult::STORED);
+        } else {
+            callbacks[i](committed ? CommitResult::DUPLICATE
+                                   : CommitResult::FAILED);
+        }
+    }
+}
+
+void GroupCommitter::store(storage::Item item, completion_t&& on_commit) {
+
+    pending_items_.push_back(std::move(item));
+    pending_callbacks_.push_back(std::move(on_commit));
+
+    if (pending_items_.size() >= max_batch_size_) {
+        flush();
+        return;
+    }
+
+    if (pending_items_.size() == 1) {
+        // First message of a new batch starts the clock
+        flush_timer_.expires_after(max_delay_);
+        // Cancelling can't recall a handler that is already queued
+        flush_timer_.async_wait([this, batch = batch_](
+                                    const boost::system::error_code& ec) {
+            if (ec == boost::asio::error::operation_aborted ||
+                batch != batch_) {
+                return;
+            }
+            flush();
+        });
+    }
+}
+
+void GroupCommitter::flush() {
+
+    flush_timer_.cancel();
+
+    if (pending_items_.empty()) {
+        return;
+    }
+
+    // Completion handlers are allowed to queue more stores
+    std::vector<storage::Item> items;
+    std::vector<completion_t> callbacks;
+    items.swap(pending_items_);
+    callbacks.swap(pending_callbacks_);
+    batch_++;
+
+    if (async_db_) {
+        async_db_->store_batch(
+            std::move(items),
+            [callbacks = std::move(callbacks)](bool committed,
+                                               std::vector<bool> inserted) {
+                report_batch(callbacks, committed, inserted);
+            });
+        return;
+    }
+
+    std::vector<bool> inserted;
+    const bool committed = db_->store_batch(items, inserted);
+    report_batch(callbacks, committed, inserted);
+}
+
+} // namespace arqma
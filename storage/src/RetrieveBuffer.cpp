@@ -0,0 +1,47 @@
+#include "RetrieveBuffer.hpp"
+
+namespace arqma {
+
+void RetrieveBuffer::clear() {
+    // Keeps the capacity of both, which is the point of reusing a buffer
+    arena_.clear();
+    entries_.clear();
+}
+
+RetrieveBuffer::Span RetrieveBuffer::push(std::string_view str) {
+    const Span span{arena_.size(), str.size()};
+    arena_.append(str.data(), str.size());
+    return span;
+}
+
+std::string_view RetrieveBuffer::view(Span span) const {
+    return std::string_view(arena_.data() + span.offset, span.size);
+}
+
+void RetrieveBuffer::append(std::string_view hash, std::string_view pub_key,
+                            uint64_t timestamp, uint64_t ttl,
+                            uint64_t expiration_timestamp,
+                            std::string_view nonce, std::string_view data) {
+    Entry entry;
+    entry.hash = push(hash);
+    entry.pub_key = push(pub_key);
+    entry.timestamp = timestamp;
+    entry.ttl = ttl;
+    entry.expiration_timestamp = expiration_timestamp;
+    entry.nonce = push(nonce);
+    entry.data = push(data);
+    entries_.push_back(entry);
+}
+
+storage::ItemView RetrieveBuffer::operator[](size_t index) const {
+    const Entry& entry = entries_[index];
+    return {view(entry.hash),
+            view(entry.pub_key),
+            entry.timestamp,
+            entry.ttl,
+            entry.expiration_timestamp,
+            view(entry.nonce),
+            view(entry.data)};
+}
+
+} // namespace arqma
@@ -0,0 +1,247 @@
+#include "RetrieveCache.hpp"
+
+#include <algorithm>
+
+namespace arqma {
+
+using storage::Item;
+
+// Rough memory use, including the bookkeeping around the strings
+static size_t item_size(const Item& item) {
+    return sizeof(Item) + item.hash.size() + item.pub_key.size() +
+           item.nonce.size() + item.data.size();
+}
+
+static size_t entry_overhead(const std::string& owner) {
+    return 128 + 2 * owner.size();
+}
+
+RetrieveCache::RetrieveCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+bool RetrieveCache::retrieve(const std::string& owner,
+                             const std::string& last_hash, size_t limit,
+                             uint64_t now_ms, RetrieveBuffer& items) {
+
+    const auto it = by_owner_.find(owner);
+    if (it == by_owner_.end()) {
+        misses_++;
+        return false;
+    }
+
+    Entry& entry = *it->second;
+    remove_expired(entry, now_ms);
+
+    size_t start = 0;
+    if (last_hash.empty()) {
+        if (!entry.complete) {
+            misses_++;
+            return false;
+        }
+    } else {
+        // Clients almost always ask for what's after the newest message
+        const auto found = std::find_if(
+            entry.messages.rbegin(), entry.messages.rend(),
+            [&](const Item& item) { return item.hash == last_hash; });
+        if (found == entry.messages.rend()) {
+            misses_++;
+            return false;
+        }
+        start = entry.messages.rend() - found;
+    }
+
+    const size_t end = std::min(entry.messages.size(), start + limit);
+    for (size_t i = start; i < end; ++i) {
+        const Item& item = entry.messages[i];
+        items.append(item.hash, item.pub_key, item.timestamp, item.ttl,
+                     item.expiration_timestamp, item.nonce, item.data);
+    }
+
+    entries_.splice(entries_.begin(), entries_, it->second);
+    hits_++;
+    return true;
+}
+
+void RetrieveCache::fill(const std::string& owner,
+                         std::vector<Item>&& messages, bool complete,
+                         uint64_t version) {
+
+    // Something might have been stored for `owner` after `messages` were
+    // read
+    if (version < floor_) {
+        return;
+    }
+    const auto written = written_at_.find(owner);
+    if (written != written_at_.end() && written->second > version) {
+        return;
+    }
+
+    const auto it = by_owner_.find(owner);
+    if (it != by_owner_.end()) {
+        erase(it->second);
+    }
+
+    entries_.push_front(Entry{owner, {}, complete});
+    Entry& entry = entries_.front();
+    entry.bytes = entry_overhead(owner);
+    bytes_ += entry.bytes;
+    by_owner_.emplace(owner, entries_.begin());
+
+    for (auto& item : messages) {
+        push_message(entry, std::move(item));
+    }
+
+    evict();
+}
+
+void RetrieveCache::add(const Item& item) {
+
+    written(item.pub_key);
+
+    const auto it = by_owner_.find(item.pub_key);
+    if (it == by_owner_.end()) {
+        return;
+    }
+
+    // A read running concurrently with the store might have seen the
+    // message and filled the cache with it already
+    auto& messages = it->second->messages;
+    const auto same_hash = [&](const Item& cached) {
+        return cached.hash == item.hash;
+    };
+    if (std::any_of(messages.rbegin(), messages.rend(), same_hash)) {
+        return;
+    }
+
+    push_message(*it->second, item);
+    evict();
+}
+
+void RetrieveCache::invalidate(const std::string& owner) {
+
+    written(owner);
+
+    const auto it = by_owner_.find(owner);
+    if (it != by_owner_.end()) {
+        erase(it->second);
+    }
+}
+
+void RetrieveCache::clear() {
+
+    floor_ = ++version_;
+    written_at_.clear();
+
+    entries_.clear();
+    by_owner_.clear();
+    expiry_wheel_.clear();
+    bytes_ = 0;
+    messages_ = 0;
+}
+
+void RetrieveCache::remove_expired(uint64_t now_ms) {
+
+    std::vector<std::string> due;
+    expiry_wheel_.advance(now_ms, due);
+
+    for (const auto& owner : due) {
+        const auto it = by_owner_.find(owner);
+        if (it == by_owner_.end() || it->second->next_expiry > now_ms) {
+            continue;
+        }
+        Entry& entry = *it->second;
+        remove_expired(entry, now_ms);
+        entry.next_expiry = UINT64_MAX;
+        schedule_expiry(entry);
+    }
+}
+
+void RetrieveCache::schedule_expiry(Entry& entry) {
+
+    uint64_t first = UINT64_MAX;
+    for (const auto& item : entry.messages) {
+        first = std::min(first, item.expiration_timestamp);
+    }
+    if (first < entry.next_expiry) {
+        entry.next_expiry = first;
+        expiry_wheel_.add(entry.owner, first);
+    }
+}
+
+RetrieveCache::Stats RetrieveCache::get_stats() const {
+    Stats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.owners = entries_.size();
+    stats.messages = messages_;
+    stats.bytes = bytes_;
+    return stats;
+}
+
+void RetrieveCache::push_message(Entry& entry, Item item) {
+
+    const size_t size = item_size(item);
+    if (item.expiration_timestamp < entry.next_expiry) {
+        entry.next_expiry = item.expiration_timestamp;
+        expiry_wheel_.add(entry.owner, entry.next_expiry);
+    }
+    entry.messages.push_back(std::move(item));
+    entry.bytes += size;
+    bytes_ += size;
+    messages_++;
+
+    if (entry.messages.size() > MAX_MESSAGES_PER_OWNER) {
+        const size_t dropped = item_size(entry.messages.front());
+        entry.messages.pop_front();
+        entry.bytes -= dropped;
+        bytes_ -= dropped;
+        messages_--;
+        entry.complete = false;
+    }
+}
+
+void RetrieveCache::remove_expired(Entry& entry, uint64_t now_ms) {
+
+    // Expired messages are about to be deleted from the database too, and
+    // dropping some from the middle keeps the rest a valid answer
+    auto& messages = entry.messages;
+    const auto is_expired = [&](const Item& item) {
+        return item.expiration_timestamp <= now_ms;
+    };
+
+    for (const auto& item : messages) {
+        if (is_expired(item)) {
+            const size_t size = item_size(item);
+            entry.bytes -= size;
+            bytes_ -= size;
+            messages_--;
+        }
+    }
+
+    messages.erase(
+        std::remove_if(messages.begin(), messages.end(), is_expired),
+        messages.end());
+}
+
+void RetrieveCache::erase(entry_list_t::iterator it) {
+    bytes_ -= it->bytes;
+    messages_ -= it->messages.size();
+    by_owner_.erase(it->owner);
+    entries_.erase(it);
+}
+
+void RetrieveCache::written(const std::string& owner) {
+    if (written_at_.size() >= MAX_WRITTEN_OWNERS) {
+        // Fills read before now can't be told apart anymore
+        written_at_.clear();
+        floor_ = version_;
+    }
+    written_at_[owner] = ++version_;
+}
+
+void RetrieveCache::evict() {
+    while (bytes_ > max_bytes_ && !entries_.empty()) {
+        erase(std::prev(entries_.end()));
+    }
+}
+
+} // namespace arqma
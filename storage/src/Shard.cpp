@@ -0,0 +1,1820 @@
+#include "Shard.hpp"
+#include "arqma_common.h"
+#include "arqma_logger.h"
+#include "utils.hpp"
+
+#include "sqlite3.h"
+#include <algorithm>
+#include <exception>
+#include <numeric>
+
+namespace arqma {
+using namespace storage;
+
+// Shortest period `expired_per_sec_` is measured over
+constexpr auto EXPIRY_RATE_PERIOD = std::chrono::seconds(10);
+
+// Expired rows deleted per statement (and per write lock), by seq
+constexpr int EXPIRY_CHUNK_SIZE = 100;
+// Time a single cleanup tick may spend deleting before it yields
+constexpr auto EXPIRY_TIME_BUDGET = std::chrono::milliseconds(10);
+// How soon to resume when a tick ran out of budget
+constexpr auto EXPIRY_CATCHUP_DELAY = std::chrono::milliseconds(1);
+
+// How long a connection waits on a lock held by another connection
+constexpr int BUSY_TIMEOUT_MS = 5000;
+
+// Size of the WAL (in bytes, of 4 KiB pages) past which the writer
+// checkpoints itself even when checkpoints run in the background, and that
+// the file is truncated to when the writer starts over at its beginning
+constexpr int64_t WAL_SIZE_LIMIT = 64 << 20;
+
+// Random seq probes to make before falling back to a range lookup
+constexpr int RANDOM_PROBE_ATTEMPTS = 32;
+
+// Rows inserted per execution of the multi-row insert. A row takes 8 of the
+// at most 999 parameters sqlite allows per statement.
+constexpr size_t BULK_INSERT_ROWS = 64;
+
+// Stored in `PRAGMA user_version`. Version 1 stores hex keys as binary.
+constexpr int SCHEMA_VERSION = 1;
+
+// Column order expected by `extract_item`
+static const std::string ITEM_COLUMNS =
+    "`Hash`, `Owner`, `TTL`, `Timestamp`, `TimeExpires`, `Nonce`, `Data`";
+
+// Message hashes and owner pubkeys are hex, but stored as the bytes they
+// encode, which halves the size of the keys and their indexes. Keys that are
+// not lowercase hex are stored as text unchanged, which keeps the mapping
+// reversible (a blob never compares equal to a text value). Set `bytes` to
+// what `key` encodes and return true if it is one to store as bytes.
+static bool hex_key_to_bytes(std::string_view key, std::string& bytes) {
+    if (key.empty()) {
+        return false;
+    }
+    bytes.resize(key.size() / 2);
+    return util::hex_decode(key.data(), key.size(),
+                            reinterpret_cast<uint8_t*>(&bytes[0]), true);
+}
+
+static void bind_key(sqlite3_stmt* stmt, int index, std::string_view key) {
+    // sqlite copies it right away, so the scratch space can be reused
+    thread_local std::string bytes;
+    if (hex_key_to_bytes(key, bytes)) {
+        sqlite3_bind_blob(stmt, index, bytes.data(), bytes.size(),
+                          SQLITE_TRANSIENT);
+    } else {
+        // An empty view might not point anywhere, which would bind NULL
+        sqlite3_bind_text(stmt, index, key.empty() ? "" : key.data(),
+                          key.size(), SQLITE_STATIC);
+    }
+}
+
+// Same concern as above for the NOT NULL blob columns
+static void bind_blob(sqlite3_stmt* stmt, int index, std::string_view blob) {
+    if (blob.empty()) {
+        sqlite3_bind_zeroblob(stmt, index, 0);
+    } else {
+        sqlite3_bind_blob(stmt, index, blob.data(), blob.size(),
+                          SQLITE_STATIC);
+    }
+}
+
+// Inverse of `bind_key`: the key in column `col` as seen by the API, using
+// `scratch` for the hex encoding if needed
+static std::string_view column_key(sqlite3_stmt* stmt, int col,
+                                   std::string& scratch) {
+    const bool binary = sqlite3_column_type(stmt, col) == SQLITE_BLOB;
+    const auto data =
+        static_cast<const unsigned char*>(sqlite3_column_blob(stmt, col));
+    const size_t size = sqlite3_column_bytes(stmt, col);
+    if (!binary) {
+        return std::string_view(reinterpret_cast<const char*>(data), size);
+    }
+
+    scratch.resize(2 * size);
+    util::hex_encode(data, size, &scratch[0]);
+    return scratch;
+}
+
+// `key_to_blob(key)` in SQL, converts keys stored by older versions
+static void key_to_blob(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const auto text =
+        reinterpret_cast<const char*>(sqlite3_value_text(argv[0]));
+    const size_t len = sqlite3_value_bytes(argv[0]);
+    std::string bytes;
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT ||
+        !hex_key_to_bytes(std::string_view(text, len), bytes)) {
+        sqlite3_result_value(ctx, argv[0]);
+        return;
+    }
+    sqlite3_result_blob(ctx, bytes.data(), bytes.size(), SQLITE_TRANSIENT);
+}
+
+static bool table_exists(sqlite3* db, const char* name) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db,
+                           "SELECT 1 FROM `sqlite_master` WHERE `type` = "
+                           "'table' AND `name` = ?;",
+                           -1, &stmt, nullptr) != SQLITE_OK) {
+        throw std::runtime_error("could not look up a table");
+    }
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    const bool exists = sqlite3_step(stmt) == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return exists;
+}
+
+static int get_schema_version(sqlite3* db) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) !=
+        SQLITE_OK) {
+        throw std::runtime_error("could not read the schema version");
+    }
+    int version = 0;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return version;
+}
+
+// Columns of `Messages` (`Owner` and `Hash` hold keys, see `bind_key`).
+// Messages are keyed by (Owner, Seq), with Seq increasing in insertion
+// order, so that all messages for a pubkey are stored next to each other in
+// the order they were received and a retrieve is a single range read.
+static const std::string MESSAGES_COLUMNS =
+    "("
+    "    `Owner` BLOB NOT NULL,"
+    "    `Seq` INTEGER NOT NULL,"
+    "    `Hash` BLOB NOT NULL,"
+    "    `TTL` INTEGER NOT NULL,"
+    "    `Timestamp` INTEGER NOT NULL,"
+    "    `TimeExpires` INTEGER NOT NULL,"
+    "    `Nonce` VARCHAR(128) NOT NULL,"
+    "    `Data` BLOB,"
+    "    PRIMARY KEY (`Owner`, `Seq`)"
+    ") WITHOUT ROWID;";
+
+static const std::string MESSAGES_INDEXES =
+    "CREATE UNIQUE INDEX IF NOT EXISTS `idx_messages_hash` ON `Messages` "
+    "(`Hash`);"
+    "CREATE UNIQUE INDEX IF NOT EXISTS `idx_messages_seq` ON `Messages` "
+    "(`Seq`);"
+    "CREATE INDEX IF NOT EXISTS `idx_messages_expires` ON `Messages` "
+    "(`TimeExpires`);";
+
+// Columns of `Messages` in a snapshot file (see `Database::export_snapshot`).
+// Messages are to be stored in rowid order.
+static const std::string SNAPSHOT_COLUMNS =
+    "("
+    "    `Owner` BLOB NOT NULL,"
+    "    `Hash` BLOB NOT NULL,"
+    "    `TTL` INTEGER NOT NULL,"
+    "    `Timestamp` INTEGER NOT NULL,"
+    "    `TimeExpires` INTEGER NOT NULL,"
+    "    `Nonce` VARCHAR(128) NOT NULL,"
+    "    `Data` BLOB"
+    ");";
+
+static const std::string SNAPSHOT_COPY_COLUMNS =
+    "`Owner`, `Hash`, `TTL`, `Timestamp`, `TimeExpires`, `Nonce`, `Data`";
+
+// What `table_info` lists for them, in order
+static const std::string SNAPSHOT_COLUMN_NAMES =
+    "Owner,Hash,TTL,Timestamp,TimeExpires,Nonce,Data";
+
+// `accept_owner(owner)` in SQL, asks the filter passed as user data whether
+// to import the messages of `owner`
+static void accept_owner(sqlite3_context* ctx, int, sqlite3_value** argv) {
+    const auto& accept =
+        *static_cast<const std::function<bool(const std::string&)>*>(
+            sqlite3_user_data(ctx));
+    const auto data = static_cast<const char*>(sqlite3_value_blob(argv[0]));
+    const std::string owner(data, sqlite3_value_bytes(argv[0]));
+    sqlite3_result_int(ctx, accept(sqlite3_value_type(argv[0]) == SQLITE_BLOB
+                                       ? util::as_hex(owner)
+                                       : owner));
+}
+
+// Run `query`, logging what went wrong if it fails
+static bool exec_logged(sqlite3* conn, const std::string& query) {
+    char* errmsg = nullptr;
+    if (sqlite3_exec(conn, query.c_str(), nullptr, nullptr, &errmsg) !=
+        SQLITE_OK) {
+        ARQMA_LOG(error, "Could not execute `{}`: {}", query,
+                  errmsg ? errmsg : "");
+        sqlite3_free(errmsg);
+        return false;
+    }
+    return true;
+}
+
+// Attach the database file at `path` to `conn` as `name`. Read-only
+// attachments need `conn` to have been opened with SQLITE_OPEN_URI.
+static bool attach(sqlite3* conn, const std::string& path,
+                   const std::string& name, bool read_only = false) {
+    std::string file = path;
+    if (read_only) {
+        // Characters that mean something in a URI are escaped
+        file = "file:";
+        for (const char c : path) {
+            if (c == '%') {
+                file += "%25";
+            } else if (c == '?') {
+                file += "%3F";
+            } else if (c == '#') {
+                file += "%23";
+            } else {
+                file += c;
+            }
+        }
+        file += "?mode=ro";
+    }
+
+    sqlite3_stmt* stmt;
+    const std::string query = "ATTACH DATABASE ? AS `" + name + "`;";
+    if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) !=
+        SQLITE_OK) {
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, file.data(), file.size(), SQLITE_STATIC);
+    const int rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        ARQMA_LOG(error, "Could not attach {}: {}", path, sqlite3_errmsg(conn));
+        return false;
+    }
+    return true;
+}
+
+// Run `query`, which must return a single integer
+static bool query_int64(sqlite3* conn, const std::string& query,
+                        int64_t& result) {
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(conn, query.c_str(), -1, &stmt, nullptr) !=
+        SQLITE_OK) {
+        return false;
+    }
+    const bool success = sqlite3_step(stmt) == SQLITE_ROW;
+    if (success) {
+        result = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return success;
+}
+
+struct Shard::ReadConnection {
+    sqlite3* conn = nullptr;
+    sqlite3_stmt* get_all_for_pk_stmt = nullptr;
+    sqlite3_stmt* get_all_stmt = nullptr;
+    sqlite3_stmt* get_stmt = nullptr;
+    sqlite3_stmt* get_totals_stmt = nullptr;
+    sqlite3_stmt* get_owner_totals_stmt = nullptr;
+    sqlite3_stmt* get_seq_range_stmt = nullptr;
+    sqlite3_stmt* get_by_seq_stmt = nullptr;
+    sqlite3_stmt* get_next_by_seq_stmt = nullptr;
+    sqlite3_stmt* get_by_hash_stmt = nullptr;
+    sqlite3_stmt* exists_stmt = nullptr;
+    sqlite3_stmt* get_chunk_stmt = nullptr;
+
+    ~ReadConnection() {
+        sqlite3_finalize(get_all_for_pk_stmt);
+        sqlite3_finalize(get_all_stmt);
+        sqlite3_finalize(get_stmt);
+        sqlite3_finalize(get_totals_stmt);
+        sqlite3_finalize(get_owner_totals_stmt);
+        sqlite3_finalize(get_seq_range_stmt);
+        sqlite3_finalize(get_by_seq_stmt);
+        sqlite3_finalize(get_next_by_seq_stmt);
+        sqlite3_finalize(get_by_hash_stmt);
+        sqlite3_finalize(exists_stmt);
+        sqlite3_finalize(get_chunk_stmt);
+        sqlite3_close(conn);
+    }
+};
+
+Shard::ReaderLease::ReaderLease(Shard& db) : db_(db) {
+    std::unique_lock<std::mutex> lock(db_.readers_mutex_);
+    db_.readers_cv_.wait(lock, [this] { return !db_.idle_readers_.empty(); });
+    conn_ = db_.idle_readers_.back();
+    db_.idle_readers_.pop_back();
+}
+
+Shard::ReaderLease::~ReaderLease() {
+    {
+        std::lock_guard<std::mutex> lock(db_.readers_mutex_);
+        db_.idle_readers_.push_back(conn_);
+    }
+    db_.readers_cv_.notify_one();
+}
+
+Shard::~Shard() {
+    if (checkpointer_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(checkpoint_mutex_);
+            stop_checkpoints_ = true;
+        }
+        checkpoint_cv_.notify_one();
+        checkpointer_.join();
+    }
+    sqlite3_close(checkpoint_conn_);
+    readers_.clear();
+    sqlite3_finalize(save_stmt);
+    sqlite3_finalize(save_or_ignore_stmt);
+    sqlite3_finalize(bulk_insert_stmt);
+    sqlite3_finalize(inserted_seqs_stmt);
+    sqlite3_finalize(delete_seqs_stmt);
+    sqlite3_finalize(delete_by_hash_stmt);
+    sqlite3_close(db);
+}
+
+Shard::Shard(const std::string& file_path, size_t num_readers,
+             const StorageProfile& profile)
+    : file_path_(file_path), expiry_wheel_(util::get_time_ms()) {
+    open_and_prepare(file_path, num_readers, profile);
+    if (!add_to_expiry_wheel(0)) {
+        throw std::runtime_error("could not read expiry times");
+    }
+    if (profile.checkpoint_interval.count() > 0) {
+        start_checkpoints(profile);
+    }
+
+    expiry_period_start_ = std::chrono::steady_clock::now();
+}
+
+int Shard::delete_due_chunk() {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    // Unused parameters stay NULL, which matches nothing
+    const size_t count = std::min(due_.size(), size_t(EXPIRY_CHUNK_SIZE));
+    sqlite3_clear_bindings(delete_seqs_stmt);
+    for (size_t i = 0; i < count; ++i) {
+        sqlite3_bind_int64(delete_seqs_stmt, i + 1, due_[due_.size() - 1 - i]);
+    }
+
+    int deleted = -1;
+    int rc;
+    while (true) {
+        rc = sqlite3_step(delete_seqs_stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            deleted = sqlite3_changes(db);
+            due_.resize(due_.size() - count);
+            break;
+        } else {
+            fprintf(stderr, "Can't delete expired messages: %s\n",
+                    sqlite3_errmsg(db));
+            break;
+        }
+    }
+    int reset_rc = sqlite3_reset(delete_seqs_stmt);
+    // If the most recent call to sqlite3_step(S) for the prepared statement S
+    // indicated an error, then sqlite3_reset(S) returns an appropriate error
+    // code.
+    if (reset_rc != SQLITE_OK && reset_rc != rc) {
+        fprintf(stderr, "sql error: unexpected value from sqlite3_reset");
+    }
+
+    return deleted;
+}
+
+std::chrono::milliseconds Shard::clean_up_expired() {
+    const auto now_ms = util::get_time_ms();
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = start + EXPIRY_TIME_BUDGET;
+
+    {
+        std::lock_guard<std::mutex> lock(wheel_mutex_);
+        expiry_wheel_.advance(now_ms, due_);
+    }
+
+    // Delete in chunks, releasing the write lock in between, until there is
+    // nothing left to expire or this tick's budget is spent
+    bool failed = false;
+    uint64_t expired = 0;
+    while (!due_.empty()) {
+        const int deleted = delete_due_chunk();
+        if (deleted < 0) {
+            failed = true;
+            break;
+        }
+        expired += deleted;
+        if (std::chrono::steady_clock::now() >= deadline) {
+            break;
+        }
+    }
+
+    total_expired_ += expired;
+    expiry_period_expired_ += expired;
+    expiry_backlog_ = due_.size();
+
+    if (!due_.empty() && !failed) {
+        // Let other writes run before the next chunk
+        return EXPIRY_CATCHUP_DELAY;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const std::chrono::duration<double> elapsed = now - expiry_period_start_;
+    if (elapsed >= EXPIRY_RATE_PERIOD) {
+        expired_per_sec_ = expiry_period_expired_ / elapsed.count();
+        expiry_period_start_ = now;
+        expiry_period_expired_ = 0;
+    }
+
+    // Right after the next tick of the wheel begins
+    const uint64_t tick_ms = ExpiryWheel<int64_t>::DEFAULT_TICK_MS;
+    return std::chrono::milliseconds(tick_ms - now_ms % tick_ms);
+}
+
+Shard::ExpiryStats Shard::get_expiry_stats() const {
+    ExpiryStats stats;
+    stats.total_expired = total_expired_;
+    stats.expired_per_sec = expired_per_sec_;
+    stats.backlog = expiry_backlog_;
+    return stats;
+}
+
+void Shard::migrate_legacy_table() {
+
+    // Before messages were clustered by owner they lived in the rowid table
+    // `Data`. Move them over keeping their rowid as Seq, which preserves
+    // the insertion order.
+    if (!table_exists(db, "Data")) {
+        return;
+    }
+
+    ARQMA_LOG(info, "Migrating messages to the owner-clustered layout, this "
+                    "can take a while for large databases");
+
+    // The counters are left as they are: the rows don't change and dropping
+    // a table doesn't fire its delete triggers
+    const char* migrate_query =
+        "BEGIN;"
+        "INSERT INTO `Messages` "
+        "    (`Owner`, `Seq`, `Hash`, `TTL`, `Timestamp`, `TimeExpires`,"
+        "     `Nonce`, `Data`)"
+        "    SELECT `Owner`, rowid, `Hash`, `TTL`, `Timestamp`, `TimeExpires`,"
+        "        `Nonce`, `Data` FROM `Data` ORDER BY `Owner`, rowid;"
+        "DROP TABLE `Data`;"
+        "COMMIT;";
+
+    char* errMsg = nullptr;
+    const int rc = sqlite3_exec(db, migrate_query, nullptr, nullptr, &errMsg);
+    if (rc) {
+        if (errMsg) {
+            ARQMA_LOG(critical, "Migration failed: {}", errMsg);
+            sqlite3_free(errMsg);
+        }
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw std::runtime_error("could not migrate the legacy table");
+    }
+
+    ARQMA_LOG(info, "Migration done");
+}
+
+void Shard::migrate_to_binary_keys() {
+
+    if (get_schema_version(db) >= 1) {
+        return;
+    }
+
+    std::string migrate_query = "BEGIN;";
+
+    // Nothing to convert in a new database
+    sqlite3_stmt* stmt =
+        prepare_statement(db, "SELECT 1 FROM `Messages` LIMIT 1;");
+    if (!stmt)
+        throw std::runtime_error("could not look up messages");
+    const bool empty = sqlite3_step(stmt) != SQLITE_ROW;
+    sqlite3_finalize(stmt);
+
+    if (!empty) {
+        ARQMA_LOG(info, "Migrating message keys to binary, this can take "
+                        "a while for large databases");
+
+        // The table is rebuilt rather than updated in place, as every row
+        // moves when its primary key changes. Dropping `Messages` drops its
+        // indexes and triggers too; the counters' triggers are recreated
+        // right after.
+        migrate_query +=
+            "CREATE TABLE `MessagesBinary`" + MESSAGES_COLUMNS +
+            "INSERT INTO `MessagesBinary` "
+            "    (`Owner`, `Seq`, `Hash`, `TTL`, `Timestamp`, `TimeExpires`,"
+            "     `Nonce`, `Data`)"
+            "    SELECT key_to_blob(`Owner`), `Seq`, key_to_blob(`Hash`),"
+            "        `TTL`, `Timestamp`, `TimeExpires`, `Nonce`, `Data`"
+            "    FROM `Messages`;"
+            "DROP TABLE `Messages`;"
+            "ALTER TABLE `MessagesBinary` RENAME TO `Messages`;" +
+            MESSAGES_INDEXES;
+        if (table_exists(db, "OwnerTotals")) {
+            migrate_query +=
+                "UPDATE `OwnerTotals` SET `Owner` = key_to_blob(`Owner`);";
+        }
+    }
+
+    migrate_query += "PRAGMA user_version = " +
+                     std::to_string(SCHEMA_VERSION) + ";"
+                     "COMMIT;";
+
+    char* errMsg = nullptr;
+    const int rc =
+        sqlite3_exec(db, migrate_query.c_str(), nullptr, nullptr, &errMsg);
+    if (rc) {
+        if (errMsg) {
+            ARQMA_LOG(critical, "Migration failed: {}", errMsg);
+            sqlite3_free(errMsg);
+        }
+        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+        throw std::runtime_error("could not migrate to binary keys");
+    }
+
+    if (!empty) {
+        ARQMA_LOG(info, "Migration done");
+    }
+}
+
+int64_t Shard::get_next_seq() {
+
+    sqlite3_stmt* stmt = prepare_statement(
+        db, "SELECT coalesce(max(`Seq`), 0) + 1 FROM `Messages`;");
+    if (!stmt)
+        throw std::runtime_error("could not prepare next seq statement");
+
+    int64_t next_seq = 1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        next_seq = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    return next_seq;
+}
+
+sqlite3_stmt* Shard::prepare_statement(sqlite3* conn,
+                                       const std::string& query) {
+    const char* pzTest;
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(conn, query.c_str(), query.length() + 1,
+                                &stmt, &pzTest);
+    if (rc != SQLITE_OK) {
+        printf("ERROR: sql error: %s", pzTest);
+    }
+    return stmt;
+}
+
+void Shard::start_checkpoints(const StorageProfile& profile) {
+
+    if (sqlite3_open_v2(file_path_.c_str(), &checkpoint_conn_,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                        nullptr) != SQLITE_OK) {
+        ARQMA_LOG(critical, "Can't open checkpoint connection: {}",
+                  sqlite3_errmsg(checkpoint_conn_));
+        throw std::runtime_error("could not open the checkpoint connection");
+    }
+    sqlite3_busy_timeout(checkpoint_conn_, BUSY_TIMEOUT_MS);
+
+    // Checkpoints sync the database file as the writer's commits would
+    if (!exec_logged(checkpoint_conn_,
+                     "PRAGMA synchronous = " + profile.synchronous + ";")) {
+        throw std::runtime_error("could not configure checkpoints");
+    }
+
+    const auto interval = profile.checkpoint_interval;
+    checkpointer_ = std::thread([this, interval] { run_checkpoints(interval); });
+}
+
+void Shard::run_checkpoints(std::chrono::milliseconds interval) {
+
+    std::unique_lock<std::mutex> lock(checkpoint_mutex_);
+    while (!checkpoint_cv_.wait_for(lock, interval,
+                                    [this] { return stop_checkpoints_; })) {
+        // Copies what no reader still needs without waiting for anyone
+        const int rc = sqlite3_wal_checkpoint_v2(
+            checkpoint_conn_, nullptr, SQLITE_CHECKPOINT_PASSIVE, nullptr,
+            nullptr);
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY) {
+            ARQMA_LOG(error, "WAL checkpoint failed: {}",
+                      sqlite3_errmsg(checkpoint_conn_));
+        }
+    }
+}
+
+void Shard::open_and_prepare(const std::string& file_path,
+                             size_t num_readers,
+                             const StorageProfile& profile) {
+    // Every connection is only ever used by one thread at a time (the writer
+    // is guarded by `write_mutex_`, readers are leased), so sqlite's own
+    // per-connection mutex is not needed
+    // URIs are only used to attach snapshots read-only
+    int rc = sqlite3_open_v2(file_path.c_str(), &db,
+                             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                                 SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_URI,
+                             NULL);
+
+    if (rc) {
+        fprintf(stderr, "Can't open database: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        // throw?
+        return;
+    }
+
+    sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+
+    // Snapshots from other nodes get attached to this connection, so it
+    // shouldn't let a schema it didn't write run anything. Older sqlite
+    // versions lack these settings, `import_snapshot` only accepts a bare
+    // table either way.
+#ifdef SQLITE_DBCONFIG_DEFENSIVE
+    sqlite3_db_config(db, SQLITE_DBCONFIG_DEFENSIVE, 1, NULL);
+#endif
+#ifdef SQLITE_DBCONFIG_TRUSTED_SCHEMA
+    sqlite3_db_config(db, SQLITE_DBCONFIG_TRUSTED_SCHEMA, 0, NULL);
+#endif
+
+    // Only used to migrate from older schema versions
+    rc = sqlite3_create_function(db, "key_to_blob", 1,
+                                 SQLITE_UTF8 | SQLITE_DETERMINISTIC, nullptr,
+                                 key_to_blob, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        throw std::runtime_error("could not register key_to_blob");
+    }
+
+    // WAL lets readers proceed while a write transaction is in progress.
+    // With background checkpoints the writer still checkpoints itself once
+    // the WAL gets large: under steady writes some of it is always newer
+    // than the last checkpoint, and sqlite only starts over at the beginning
+    // of the WAL when a write transaction begins with all of it copied. The
+    // pages the checkpoint thread already copied are not copied again.
+    const std::string create_table_query =
+        "PRAGMA journal_mode = WAL;"
+        "PRAGMA synchronous = " + profile.synchronous + ";"
+        "PRAGMA cache_size = -" + std::to_string(profile.cache_size_kib) + ";"
+        "PRAGMA mmap_size = " + std::to_string(profile.mmap_size) + ";"
+        "PRAGMA temp_store = " +
+        (profile.temp_store_memory ? "MEMORY;" : "DEFAULT;") +
+        "PRAGMA wal_autocheckpoint = " +
+        (profile.checkpoint_interval.count() > 0
+             ? std::to_string(WAL_SIZE_LIMIT / 4096)
+             : "1000") + ";"
+        "PRAGMA journal_size_limit = " + std::to_string(WAL_SIZE_LIMIT) + ";"
+        "CREATE TABLE IF NOT EXISTS `Messages`" + MESSAGES_COLUMNS +
+        MESSAGES_INDEXES;
+
+    char* errMsg = nullptr;
+    rc = sqlite3_exec(db, create_table_query.c_str(), nullptr, nullptr,
+                      &errMsg);
+    if (rc) {
+        if (errMsg) {
+            printf("%s\n", errMsg);
+            sqlite3_free(errMsg);
+        }
+        throw std::runtime_error("Can't create table");
+    }
+
+    migrate_legacy_table();
+    migrate_to_binary_keys();
+
+    // Counters kept exact by triggers in the same transaction as every
+    // insert and delete, so reading them never touches `Messages`. They are
+    // seeded once, when upgrading a database that predates them.
+    const char* create_counters_query =
+        "BEGIN;"
+        "CREATE TABLE IF NOT EXISTS `Totals`("
+        "    `Id` INTEGER PRIMARY KEY CHECK (`Id` = 0),"
+        "    `Messages` INTEGER NOT NULL,"
+        "    `Bytes` INTEGER NOT NULL,"
+        "    `Owners` INTEGER NOT NULL"
+        ");"
+        "CREATE TABLE IF NOT EXISTS `OwnerTotals`("
+        "    `Owner` BLOB PRIMARY KEY,"
+        "    `Messages` INTEGER NOT NULL,"
+        "    `Bytes` INTEGER NOT NULL"
+        ") WITHOUT ROWID;"
+        "INSERT INTO `OwnerTotals` "
+        "    SELECT `Owner`, count(*), coalesce(sum(length(`Data`)), 0)"
+        "    FROM `Messages` WHERE NOT EXISTS (SELECT 1 FROM `Totals`)"
+        "    GROUP BY `Owner`;"
+        "INSERT OR IGNORE INTO `Totals` "
+        "    SELECT 0, count(*), coalesce(sum(length(`Data`)), 0),"
+        "        (SELECT count(*) FROM `OwnerTotals`)"
+        "    FROM `Messages` WHERE NOT EXISTS (SELECT 1 FROM `Totals`);"
+        "CREATE TRIGGER IF NOT EXISTS `count_insert` AFTER INSERT ON `Messages`"
+        "BEGIN"
+        "    UPDATE `Totals` SET `Messages` = `Messages` + 1,"
+        "        `Bytes` = `Bytes` + coalesce(length(NEW.`Data`), 0),"
+        "        `Owners` = `Owners` + NOT EXISTS (SELECT 1 FROM `OwnerTotals`"
+        "            WHERE `Owner` = NEW.`Owner`);"
+        "    INSERT INTO `OwnerTotals` VALUES"
+        "        (NEW.`Owner`, 1, coalesce(length(NEW.`Data`), 0))"
+        "        ON CONFLICT(`Owner`) DO UPDATE"
+        "        SET `Messages` = `Messages` + 1,"
+        "            `Bytes` = `Bytes` + excluded.`Bytes`;"
+        "END;"
+        "CREATE TRIGGER IF NOT EXISTS `count_delete` AFTER DELETE ON `Messages`"
+        "BEGIN"
+        "    UPDATE `Totals` SET `Messages` = `Messages` - 1,"
+        "        `Bytes` = `Bytes` - coalesce(length(OLD.`Data`), 0),"
+        "        `Owners` = `Owners` - (SELECT `Messages` = 1 FROM"
+        "            `OwnerTotals` WHERE `Owner` = OLD.`Owner`);"
+        "    UPDATE `OwnerTotals` SET `Messages` = `Messages` - 1,"
+        "        `Bytes` = `Bytes` - coalesce(length(OLD.`Data`), 0)"
+        "        WHERE `Owner` = OLD.`Owner`;"
+        "    DELETE FROM `OwnerTotals`"
+        "        WHERE `Owner` = OLD.`Owner` AND `Messages` = 0;"
+        "END;"
+        // How the messages are spread over shards, see `get_shard_count`
+        "CREATE TABLE IF NOT EXISTS `Layout`("
+        "    `Id` INTEGER PRIMARY KEY CHECK (`Id` = 0),"
+        "    `ShardCount` INTEGER NOT NULL"
+        ");"
+        "COMMIT;";
+
+    rc = sqlite3_exec(db, create_counters_query, nullptr, nullptr, &errMsg);
+    if (rc) {
+        if (errMsg) {
+            printf("%s\n", errMsg);
+            sqlite3_free(errMsg);
+        }
+        throw std::runtime_error("Can't create counters");
+    }
+
+    next_seq_ = get_next_seq();
+
+    save_stmt = prepare_statement(
+        db, "INSERT INTO Messages "
+            "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data, Seq)"
+            "VALUES (?,?,?,?,?,?,?,?);");
+    if (!save_stmt)
+        throw std::runtime_error("could not prepare the save statement");
+
+    save_or_ignore_stmt = prepare_statement(
+        db, "INSERT OR IGNORE INTO Messages "
+            "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data, Seq)"
+            "VALUES (?,?,?,?,?,?,?,?)");
+    if (!save_or_ignore_stmt)
+        throw std::runtime_error("could not prepare the bulk save statement");
+
+    std::string bulk_insert_query =
+        "INSERT OR IGNORE INTO Messages "
+        "(Hash, Owner, TTL, Timestamp, TimeExpires, Nonce, Data, Seq) VALUES ";
+    for (size_t i = 0; i < BULK_INSERT_ROWS; ++i) {
+        bulk_insert_query += i == 0 ? "(?,?,?,?,?,?,?,?)" : ",(?,?,?,?,?,?,?,?)";
+    }
+    bulk_insert_stmt = prepare_statement(db, bulk_insert_query + ";");
+    if (!bulk_insert_stmt)
+        throw std::runtime_error(
+            "could not prepare the multi-row insert statement");
+
+    inserted_seqs_stmt = prepare_statement(
+        db, "SELECT `Seq` FROM `Messages` WHERE `Seq` >= ? AND `Seq` < ?;");
+    if (!inserted_seqs_stmt)
+        throw std::runtime_error(
+            "could not prepare 'inserted seqs' statement");
+
+    std::string delete_seqs_query = "DELETE FROM `Messages` WHERE `Seq` IN (?";
+    for (int i = 1; i < EXPIRY_CHUNK_SIZE; ++i) {
+        delete_seqs_query += ",?";
+    }
+    delete_seqs_stmt = prepare_statement(db, delete_seqs_query + ");");
+    if (!delete_seqs_stmt)
+        throw std::runtime_error("could not prepare 'delete seqs' statement");
+
+    delete_by_hash_stmt =
+        prepare_statement(db, "DELETE FROM `Messages` WHERE `Hash` = ?;");
+    if (!delete_by_hash_stmt)
+        throw std::runtime_error(
+            "could not prepare 'delete by hash' statement");
+
+    if (num_readers == 0) {
+        throw std::runtime_error("at least one read connection is required");
+    }
+
+    for (size_t i = 0; i < num_readers; ++i) {
+        auto reader = std::make_unique<ReadConnection>();
+
+        rc = sqlite3_open_v2(file_path.c_str(), &reader->conn,
+                             SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL);
+        if (rc) {
+            ARQMA_LOG(critical, "Can't open read connection: {}",
+                      sqlite3_errmsg(reader->conn));
+            throw std::runtime_error("could not open a read connection");
+        }
+
+        sqlite3_busy_timeout(reader->conn, BUSY_TIMEOUT_MS);
+
+        sqlite3* conn = reader->conn;
+
+        if (!exec_logged(conn, "PRAGMA mmap_size = " +
+                                   std::to_string(profile.mmap_size) + ";")) {
+            throw std::runtime_error("could not configure a read connection");
+        }
+
+        reader->get_all_for_pk_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      " FROM `Messages` WHERE `Owner` = ? ORDER BY `Seq` "
+                      "LIMIT ?;");
+        if (!reader->get_all_for_pk_stmt)
+            throw std::runtime_error(
+                "could not prepare the get all for pk statement");
+
+        reader->get_all_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS + " FROM `Messages` ORDER BY `Seq`;");
+        if (!reader->get_all_stmt)
+            throw std::runtime_error(
+                "could not prepare the get all statement");
+
+        reader->get_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      " FROM `Messages` WHERE `Owner` = ? AND `Seq` > "
+                      "COALESCE((SELECT `Seq` FROM `Messages` WHERE `Hash` = "
+                      "?), 0) ORDER BY `Seq` LIMIT ?;");
+        if (!reader->get_stmt)
+            throw std::runtime_error("could not prepare get statement");
+
+        reader->get_totals_stmt = prepare_statement(
+            conn, "SELECT `Messages`, `Bytes`, `Owners` FROM `Totals`;");
+        if (!reader->get_totals_stmt)
+            throw std::runtime_error("could not prepare totals statement");
+
+        reader->get_owner_totals_stmt = prepare_statement(
+            conn, "SELECT `Messages`, `Bytes` FROM `OwnerTotals` "
+                  "WHERE `Owner` = ?;");
+        if (!reader->get_owner_totals_stmt)
+            throw std::runtime_error(
+                "could not prepare owner totals statement");
+
+        // Separate subqueries so that sqlite reads min/max straight from
+        // the ends of the index (it scans if both are in one select)
+        reader->get_seq_range_stmt = prepare_statement(
+            conn, "SELECT (SELECT min(`Seq`) FROM `Messages`), "
+                  "(SELECT max(`Seq`) FROM `Messages`);");
+        if (!reader->get_seq_range_stmt)
+            throw std::runtime_error("could not prepare seq range statement");
+
+        reader->get_by_seq_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      " FROM `Messages` WHERE `Seq` = ?;");
+        if (!reader->get_by_seq_stmt)
+            throw std::runtime_error(
+                "could not prepare get by seq statement");
+
+        reader->get_next_by_seq_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      " FROM `Messages` WHERE `Seq` >= ? ORDER BY `Seq` "
+                      "LIMIT 1;");
+        if (!reader->get_next_by_seq_stmt)
+            throw std::runtime_error(
+                "could not prepare get next by seq statement");
+
+        reader->get_by_hash_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      " FROM `Messages` WHERE `Hash` = ?;");
+        if (!reader->get_by_hash_stmt)
+            throw std::runtime_error(
+                "could not prepare get by hash statement");
+
+        // Answered from the hash index alone
+        reader->exists_stmt = prepare_statement(
+            conn, "SELECT 1 FROM `Messages` WHERE `Hash` = ?;");
+        if (!reader->exists_stmt)
+            throw std::runtime_error("could not prepare exists statement");
+
+        // Seq is appended after the item columns to resume from
+        reader->get_chunk_stmt = prepare_statement(
+            conn, "SELECT " + ITEM_COLUMNS +
+                      ", `Seq` FROM `Messages` WHERE `Seq` > ? ORDER BY "
+                      "`Seq` LIMIT ?;");
+        if (!reader->get_chunk_stmt)
+            throw std::runtime_error("could not prepare get chunk statement");
+
+        idle_readers_.push_back(reader.get());
+        readers_.push_back(std::move(reader));
+    }
+}
+
+bool Shard::get_usage(Usage& usage) {
+
+    ReaderLease reader(*this);
+    sqlite3_stmt* stmt = reader->get_totals_stmt;
+
+    int rc;
+    bool success = false;
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else if (rc == SQLITE_ROW) {
+            usage.messages = sqlite3_column_int64(stmt, 0);
+            usage.bytes = sqlite3_column_int64(stmt, 1);
+            usage.owners = sqlite3_column_int64(stmt, 2);
+            success = true;
+        } else {
+            ARQMA_LOG(critical, "Could not execute `totals` db statement");
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader->conn));
+        success = false;
+    }
+
+    return success;
+}
+
+bool Shard::get_owner_usage(const std::string& pubkey, Usage& usage) {
+
+    ReaderLease reader(*this);
+    sqlite3_stmt* stmt = reader->get_owner_totals_stmt;
+
+    bind_key(stmt, 1, pubkey);
+
+    // Owners without messages have no row
+    usage = Usage{};
+
+    int rc;
+    bool success = false;
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            success = true;
+            break;
+        } else if (rc == SQLITE_ROW) {
+            usage.messages = sqlite3_column_int64(stmt, 0);
+            usage.bytes = sqlite3_column_int64(stmt, 1);
+            usage.owners = usage.messages ? 1 : 0;
+        } else {
+            ARQMA_LOG(critical,
+                      "Could not execute `owner totals` db statement");
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader->conn));
+        success = false;
+    }
+
+    return success;
+}
+
+/// Extract item from the result of a successfull select statement execution
+static Item extract_item(sqlite3_stmt* stmt) {
+
+    Item item;
+
+    // "If the SQL statement does not currently point to a valid row, or if the
+    // column index is out of range, the result is undefined"
+    std::string scratch;
+    item.hash = std::string(column_key(stmt, 0, scratch));
+    item.pub_key = std::string(column_key(stmt, 1, scratch));
+    item.ttl = sqlite3_column_int64(stmt, 2);
+    item.timestamp = sqlite3_column_int64(stmt, 3);
+    item.expiration_timestamp = sqlite3_column_int64(stmt, 4);
+    item.nonce = std::string((const char*)sqlite3_column_text(stmt, 5));
+    item.data = std::string((char*)sqlite3_column_blob(stmt, 6),
+                            sqlite3_column_bytes(stmt, 6));
+    return item;
+}
+
+// Run a statement expected to yield at most one message
+static bool retrieve_one(sqlite3* conn, sqlite3_stmt* stmt, Item& item) {
+
+    bool found = false;
+    int rc;
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else if (rc == SQLITE_ROW) {
+            item = extract_item(stmt);
+            found = true;
+            break;
+        } else {
+            ARQMA_LOG(critical,
+                      "Could not execute `retrieve one` db statement, ec: {}",
+                      rc);
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(conn));
+        found = false;
+    }
+
+    return found;
+}
+
+bool Shard::retrieve_random(std::mt19937_64& rng, Item& item) {
+
+    ReaderLease reader(*this);
+    sqlite3_stmt* range_stmt = reader->get_seq_range_stmt;
+
+    bool has_rows = false;
+    int64_t min_seq = 0;
+    int64_t max_seq = 0;
+    int rc;
+    while (true) {
+        rc = sqlite3_step(range_stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else if (rc == SQLITE_ROW) {
+            // min/max are NULL on an empty table
+            if (sqlite3_column_type(range_stmt, 0) != SQLITE_NULL) {
+                min_seq = sqlite3_column_int64(range_stmt, 0);
+                max_seq = sqlite3_column_int64(range_stmt, 1);
+                has_rows = true;
+            }
+            break;
+        } else {
+            ARQMA_LOG(critical, "Could not execute `seq range` db statement");
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(range_stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader->conn));
+        return false;
+    }
+
+    if (!has_rows) {
+        return false;
+    }
+
+    const uint64_t span = max_seq - min_seq + 1;
+
+    // Every probe hits any live row with the same probability, so retrying
+    // on gaps (left by expired messages) keeps the choice uniform
+    for (int attempt = 0; attempt < RANDOM_PROBE_ATTEMPTS; ++attempt) {
+        const int64_t seq =
+            min_seq + util::uniform_distribution_portable(rng, span);
+
+        sqlite3_stmt* stmt = reader->get_by_seq_stmt;
+        sqlite3_bind_int64(stmt, 1, seq);
+        if (retrieve_one(reader->conn, stmt, item)) {
+            return true;
+        }
+    }
+
+    // The range is mostly gaps: settle for the first message after a
+    // random point, which favours messages that follow large gaps
+    const int64_t seq =
+        min_seq + util::uniform_distribution_portable(rng, span);
+
+    sqlite3_stmt* stmt = reader->get_next_by_seq_stmt;
+    sqlite3_bind_int64(stmt, 1, seq);
+    if (retrieve_one(reader->conn, stmt, item)) {
+        return true;
+    }
+
+    // Everything past `seq` has expired since we read the range
+    sqlite3_bind_int64(stmt, 1, min_seq);
+    return retrieve_one(reader->conn, stmt, item);
+}
+
+bool Shard::contains(const std::vector<std::string_view>& hashes,
+                     std::vector<bool>& found) {
+
+    ReaderLease reader(*this);
+    sqlite3_stmt* stmt = reader->exists_stmt;
+
+    found.assign(hashes.size(), false);
+    for (size_t i = 0; i < hashes.size(); ++i) {
+        bind_key(stmt, 1, hashes[i]);
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_BUSY) {
+        }
+        sqlite3_reset(stmt);
+        if (rc == SQLITE_ROW) {
+            found[i] = true;
+        } else if (rc != SQLITE_DONE) {
+            ARQMA_LOG(critical,
+                      "Could not execute `exists` db statement, ec: {}", rc);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Shard::for_each_hash(
+    const std::function<void(const std::string&, uint64_t)>& on_hash) {
+
+    ReaderLease reader(*this);
+
+    sqlite3_stmt* stmt = prepare_statement(
+        reader->conn, "SELECT `Hash`, `TimeExpires` FROM `Messages` WHERE "
+                      "`TimeExpires` > ?;");
+    if (!stmt) {
+        return false;
+    }
+    sqlite3_bind_int64(stmt, 1, util::get_time_ms());
+
+    std::string scratch;
+    std::string hash;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        hash.assign(column_key(stmt, 0, scratch));
+        on_hash(hash, sqlite3_column_int64(stmt, 1));
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        ARQMA_LOG(critical, "Could not read message hashes, ec: {}", rc);
+        return false;
+    }
+    return true;
+}
+
+bool Shard::retrieve_by_hash(const std::string& msg_hash, Item& item) {
+
+    ReaderLease reader(*this);
+    sqlite3_stmt* get_by_hash_stmt = reader->get_by_hash_stmt;
+
+    bind_key(get_by_hash_stmt, 1, msg_hash);
+
+    bool success = false;
+    int rc;
+    while (true) {
+        rc = sqlite3_step(get_by_hash_stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            break;
+        } else if (rc == SQLITE_ROW) {
+            item = extract_item(get_by_hash_stmt);
+            success = true;
+            break;
+        } else {
+            ARQMA_LOG(
+                critical,
+                "Could not execute `retrieve by hash` db statement, ec: {}",
+                rc);
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(get_by_hash_stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader->conn));
+        success = false;
+    }
+
+    return success;
+}
+
+// Bind the columns of one row of the insert statements, the first of them
+// to parameter `first`
+static void bind_message(sqlite3_stmt* stmt, int first,
+                         std::string_view hash, std::string_view pubKey,
+                         std::string_view bytes, uint64_t ttl,
+                         uint64_t timestamp, std::string_view nonce,
+                         int64_t seq) {
+    bind_key(stmt, first, hash);
+    bind_key(stmt, first + 1, pubKey);
+    sqlite3_bind_int64(stmt, first + 2, ttl);
+    sqlite3_bind_int64(stmt, first + 3, timestamp);
+    sqlite3_bind_int64(stmt, first + 4, timestamp + ttl);
+    bind_blob(stmt, first + 5, nonce);
+    bind_blob(stmt, first + 6, bytes);
+    sqlite3_bind_int64(stmt, first + 7, seq);
+}
+
+bool Shard::store(const std::string& hash, const std::string& pubKey,
+                  const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+                  const std::string& nonce,
+                  DuplicateHandling duplicateHandling) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    const int64_t seq = next_seq_;
+    if (!store_locked(hash, pubKey, bytes, ttl, timestamp, nonce,
+                      duplicateHandling)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> wheel_lock(wheel_mutex_);
+    expiry_wheel_.add(seq, timestamp + ttl);
+    return true;
+}
+
+bool Shard::add_to_expiry_wheel(int64_t first_seq) {
+
+    // All of them are read from the expiry index alone, without looking at
+    // the messages
+    sqlite3_stmt* stmt = prepare_statement(
+        db, "SELECT `Seq`, `TimeExpires` FROM `Messages`" +
+                std::string(first_seq > 0 ? " WHERE `Seq` >= ?;" : ";"));
+    if (!stmt) {
+        return false;
+    }
+    if (first_seq > 0) {
+        sqlite3_bind_int64(stmt, 1, first_seq);
+    }
+
+    int rc;
+    {
+        std::lock_guard<std::mutex> lock(wheel_mutex_);
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            expiry_wheel_.add(sqlite3_column_int64(stmt, 0),
+                              sqlite3_column_int64(stmt, 1));
+        }
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        ARQMA_LOG(critical, "Could not read expiry times: {}",
+                  sqlite3_errmsg(db));
+        return false;
+    }
+    return true;
+}
+
+bool Shard::store_locked(const std::string& hash, const std::string& pubKey,
+                         const std::string& bytes, uint64_t ttl,
+                         uint64_t timestamp, const std::string& nonce,
+                         DuplicateHandling duplicateHandling) {
+
+    sqlite3_stmt* stmt = duplicateHandling == DuplicateHandling::IGNORE
+                             ? save_or_ignore_stmt
+                             : save_stmt;
+
+    // TODO: bind can return errors, handle them
+    // Not reused if the insert fails, gaps are fine
+    bind_message(stmt, 1, hash, pubKey, bytes, ttl, timestamp, nonce,
+                 next_seq_++);
+
+    bool result = false;
+    int rc;
+    while (true) {
+        rc = sqlite3_step(stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_CONSTRAINT) {
+            break;
+        } else if (rc == SQLITE_DONE) {
+            result = true;
+            break;
+        } else {
+            ARQMA_LOG(critical,
+                      "Could not execute `store` db statement, ec: {}", rc);
+            break;
+        }
+    }
+
+    rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK && rc != SQLITE_CONSTRAINT) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(db));
+    }
+    return result;
+}
+
+bool Shard::insert_locked(const std::vector<ItemView>& items,
+                          std::vector<bool>& inserted,
+                          std::vector<int64_t>& seqs) {
+
+    // An owner's messages are next to each other in the table, so inserting
+    // them together touches far fewer pages than in arrival order. The sort
+    // is stable to keep every owner's messages in the order given.
+    std::vector<size_t> order(items.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return items[a].pub_key < items[b].pub_key;
+    });
+
+    inserted.assign(items.size(), false);
+    seqs.resize(items.size());
+
+    for (size_t pos = 0; pos < order.size();) {
+        // Full statements while we can, the rest one row at a time
+        const size_t rows =
+            order.size() - pos >= BULK_INSERT_ROWS ? BULK_INSERT_ROWS : 1;
+        sqlite3_stmt* stmt =
+            rows == BULK_INSERT_ROWS ? bulk_insert_stmt : save_or_ignore_stmt;
+
+        // Rows get consecutive seqs in `order`, whether they are new or not
+        const int64_t first_seq = next_seq_;
+        for (size_t i = 0; i < rows; ++i) {
+            const auto& item = items[order[pos + i]];
+            seqs[order[pos + i]] = next_seq_;
+            bind_message(stmt, 8 * i + 1, item.hash, item.pub_key, item.data,
+                         item.ttl, item.timestamp, item.nonce, next_seq_++);
+        }
+
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_BUSY) {
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_DONE) {
+            ARQMA_LOG(critical,
+                      "Could not execute `bulk insert` db statement, ec: {}",
+                      rc);
+            return false;
+        }
+
+        const size_t changes = sqlite3_changes(db);
+        if (changes == rows) {
+            for (size_t i = 0; i < rows; ++i) {
+                inserted[order[pos + i]] = true;
+            }
+        } else if (changes > 0) {
+            // Duplicates were skipped, only the new rows have their seq
+            sqlite3_bind_int64(inserted_seqs_stmt, 1, first_seq);
+            sqlite3_bind_int64(inserted_seqs_stmt, 2, next_seq_);
+            while ((rc = sqlite3_step(inserted_seqs_stmt)) == SQLITE_ROW) {
+                const int64_t seq = sqlite3_column_int64(inserted_seqs_stmt, 0);
+                inserted[order[pos + (seq - first_seq)]] = true;
+            }
+            sqlite3_reset(inserted_seqs_stmt);
+            if (rc != SQLITE_DONE) {
+                ARQMA_LOG(critical,
+                          "Could not execute `inserted seqs` db statement, "
+                          "ec: {}",
+                          rc);
+                return false;
+            }
+        }
+
+        pos += rows;
+    }
+
+    return true;
+}
+
+bool Shard::store_items(const std::vector<ItemView>& items,
+                        std::vector<bool>* inserted) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    char* errmsg = 0;
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
+        SQLITE_OK) {
+        ARQMA_LOG(critical, "Could not begin a transaction: {}", errmsg);
+        sqlite3_free(errmsg);
+        return false;
+    }
+
+    std::vector<bool> is_new;
+    std::vector<int64_t> seqs;
+    if (!insert_locked(items, is_new, seqs)) {
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        if (inserted) {
+            inserted->assign(items.size(), false);
+        }
+        return false;
+    }
+
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK) {
+        ARQMA_LOG(critical, "Could not commit a batch: {}", errmsg);
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        if (inserted) {
+            inserted->assign(items.size(), false);
+        }
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> wheel_lock(wheel_mutex_);
+        for (size_t i = 0; i < items.size(); ++i) {
+            if (is_new[i]) {
+                expiry_wheel_.add(seqs[i], items[i].timestamp + items[i].ttl);
+            }
+        }
+    }
+
+    if (inserted) {
+        *inserted = std::move(is_new);
+    }
+    return true;
+}
+
+bool Shard::bulk_store(const std::vector<ItemView>& items) {
+    return store_items(items, nullptr);
+}
+
+bool Shard::store_batch(const std::vector<ItemView>& items,
+                        std::vector<bool>& inserted) {
+    return store_items(items, &inserted);
+}
+
+bool Shard::export_snapshot(const std::string& path, uint64_t& exported) {
+
+    sqlite3* conn;
+    if (sqlite3_open_v2(path.c_str(), &conn,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                            SQLITE_OPEN_NOMUTEX,
+                        NULL) != SQLITE_OK) {
+        ARQMA_LOG(error, "Could not open snapshot {}: {}", path,
+                  sqlite3_errmsg(conn));
+        sqlite3_close(conn);
+        return false;
+    }
+    sqlite3_busy_timeout(conn, BUSY_TIMEOUT_MS);
+
+    // The file is thrown away if anything goes wrong, so it needn't survive
+    // a crash. Reading the shard in key order makes it a plain scan of the
+    // table, and it all happens in one statement, which sees the shard as
+    // it was when it started.
+    bool success =
+        exec_logged(conn, "PRAGMA journal_mode = OFF;"
+                          "PRAGMA synchronous = OFF;"
+                          "PRAGMA user_version = " +
+                              std::to_string(SCHEMA_VERSION) +
+                              ";"
+                              "CREATE TABLE IF NOT EXISTS `Messages`" +
+                              SNAPSHOT_COLUMNS) &&
+        attach(conn, file_path_, "shard");
+
+    if (success) {
+        success = exec_logged(
+            conn, "INSERT INTO `main`.`Messages` (" + SNAPSHOT_COPY_COLUMNS +
+                      ") SELECT " + SNAPSHOT_COPY_COLUMNS +
+                      " FROM `shard`.`Messages` WHERE `TimeExpires` > " +
+                      std::to_string(util::get_time_ms()) +
+                      " ORDER BY `Owner`, `Seq`;");
+        if (success) {
+            exported += sqlite3_changes(conn);
+        }
+        exec_logged(conn, "DETACH DATABASE `shard`;");
+    }
+
+    sqlite3_close(conn);
+    return success;
+}
+
+bool Shard::import_snapshot(
+    const std::string& path,
+    const std::function<bool(const std::string&)>& accept,
+    uint64_t& imported) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    // Snapshots come from other nodes, so nothing in them is trusted
+    if (!attach(db, path, "snapshot", true)) {
+        return false;
+    }
+
+    // Nothing but the table `export_snapshot` creates: no views, triggers or
+    // indexes that could run anything while it's read
+    int64_t version = 0;
+    int64_t valid = 0;
+    bool success =
+        query_int64(db, "PRAGMA snapshot.user_version;", version) &&
+        query_int64(db,
+                    "SELECT (SELECT count(*) FROM `snapshot`.`sqlite_master`)"
+                    " = 1 AND (SELECT count(*) FROM "
+                    "`snapshot`.`sqlite_master` WHERE `type` = 'table' AND "
+                    "`name` = 'Messages') = 1 AND (SELECT group_concat("
+                    "`name`, ',') FROM pragma_table_info('Messages', "
+                    "'snapshot')) = '" +
+                        SNAPSHOT_COLUMN_NAMES + "';",
+                    valid);
+    if (success && version != SCHEMA_VERSION) {
+        ARQMA_LOG(error, "Snapshot {} has unknown schema version {}", path,
+                  version);
+        success = false;
+    }
+    if (success && !valid) {
+        ARQMA_LOG(error, "Snapshot {} has an unexpected schema", path);
+        success = false;
+    }
+
+    if (success && accept) {
+        success = sqlite3_create_function(
+                      db, "accept_owner", 1, SQLITE_UTF8,
+                      const_cast<std::function<bool(const std::string&)>*>(
+                          &accept),
+                      accept_owner, nullptr, nullptr) == SQLITE_OK;
+    }
+
+    // Only messages a client could have stored, and that haven't expired:
+    // keys of other types or lengths could never be retrieved or matched
+    // against our own. They get the seqs following ours in snapshot order,
+    // which keeps every owner's messages in the order they were stored.
+    const uint64_t now = util::get_time_ms();
+    if (success && exec_logged(db, "BEGIN TRANSACTION;")) {
+        success = exec_logged(
+            db,
+            "INSERT OR IGNORE INTO `main`.`Messages` (" +
+                SNAPSHOT_COPY_COLUMNS + ", `Seq`) SELECT " +
+                SNAPSHOT_COPY_COLUMNS + ", " + std::to_string(next_seq_ - 1) +
+                " + row_number() OVER (ORDER BY rowid) FROM "
+                "`snapshot`.`Messages` WHERE typeof(`Owner`) = 'blob' AND "
+                "length(`Owner`) = " +
+                std::to_string(arqma::get_user_pubkey_size() / 2) +
+                " AND typeof(`Hash`) = 'blob' AND length(`Hash`) = " +
+                std::to_string(util::MESSAGE_HASH_SIZE) +
+                " AND length(CAST(`Data` AS BLOB)) <= " +
+                std::to_string(util::MAX_MESSAGE_BODY) +
+                " AND typeof(`TTL`) = 'integer' AND `TTL` BETWEEN " +
+                std::to_string(util::MIN_TTL_MS) + " AND " +
+                std::to_string(util::MAX_TTL_MS) +
+                " AND typeof(`Timestamp`) = 'integer' AND `Timestamp` <= " +
+                std::to_string(now + util::TIMESTAMP_TOLERANCE_MS) +
+                " AND `TimeExpires` = `Timestamp` + `TTL` AND `TimeExpires` > " +
+                std::to_string(now) +
+                (accept ? " AND accept_owner(`Owner`)" : "") +
+                " ORDER BY rowid;");
+        const int changes = sqlite3_changes(db);
+
+        if (success && exec_logged(db, "COMMIT;")) {
+            imported += changes;
+            const int64_t first_seq = next_seq_;
+            int64_t next_seq = 0;
+            success = query_int64(db,
+                                  "SELECT coalesce(max(`Seq`), 0) + 1 FROM "
+                                  "`main`.`Messages`;",
+                                  next_seq) &&
+                      add_to_expiry_wheel(first_seq);
+            next_seq_ = std::max(next_seq_, next_seq);
+        } else {
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+            success = false;
+        }
+    }
+
+    if (accept) {
+        sqlite3_create_function(db, "accept_owner", 1, SQLITE_UTF8, nullptr,
+                                nullptr, nullptr, nullptr);
+    }
+    exec_logged(db, "DETACH DATABASE `snapshot`;");
+    return success;
+}
+
+template <typename OnRow>
+bool Shard::retrieve_rows(const std::string& pubKey,
+                          const std::string& lastHash, int num_results,
+                          OnRow&& on_row) {
+
+    ReaderLease reader(*this);
+    return retrieve_rows(*reader, pubKey, lastHash, num_results,
+                         std::forward<OnRow>(on_row));
+}
+
+template <typename OnRow>
+bool Shard::retrieve_rows(ReadConnection& reader, const std::string& pubKey,
+                          const std::string& lastHash, int num_results,
+                          OnRow&& on_row) {
+
+    sqlite3_stmt* stmt;
+
+    if (pubKey.empty()) {
+        stmt = reader.get_all_stmt;
+    } else if (lastHash.empty()) {
+        stmt = reader.get_all_for_pk_stmt;
+        bind_key(stmt, 1, pubKey);
+        sqlite3_bind_int(stmt, 2, num_results);
+    } else {
+        stmt = reader.get_stmt;
+        bind_key(stmt, 1, pubKey);
+        bind_key(stmt, 2, lastHash);
+        sqlite3_bind_int(stmt, 3, num_results);
+    }
+
+    bool success = false;
+
+    while (true) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            success = true;
+            break;
+        } else if (rc == SQLITE_ROW) {
+            on_row(stmt);
+        } else {
+            ARQMA_LOG(critical,
+                      "Could not execute `retrieve` db statement, ec: {}", rc);
+            break;
+        }
+    }
+
+    int rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader.conn));
+        success = false;
+    }
+    return success;
+}
+
+bool Shard::retrieve(const std::string& pubKey, std::vector<Item>& items,
+                     const std::string& lastHash, int num_results) {
+
+    if (num_results > 0) {
+        items.reserve(items.size() + num_results);
+    }
+
+    return retrieve_rows(pubKey, lastHash, num_results, [&](sqlite3_stmt* stmt) {
+        items.push_back(extract_item(stmt));
+    });
+}
+
+bool Shard::retrieve_chunk(int64_t& last_seq, size_t chunk_size,
+                           std::vector<Item>& chunk) {
+
+    chunk.clear();
+
+    // A fresh lease (and read transaction) per chunk, so that a long scan
+    // neither ties up a reader nor keeps the WAL from being checkpointed
+    ReaderLease reader(*this);
+    sqlite3_stmt* stmt = reader->get_chunk_stmt;
+    sqlite3_bind_int64(stmt, 1, last_seq);
+    sqlite3_bind_int64(stmt, 2, chunk_size);
+
+    bool success = false;
+
+    while (true) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_BUSY) {
+            continue;
+        } else if (rc == SQLITE_DONE) {
+            success = true;
+            break;
+        } else if (rc == SQLITE_ROW) {
+            chunk.push_back(extract_item(stmt));
+            last_seq = sqlite3_column_int64(stmt, 7);
+        } else {
+            ARQMA_LOG(critical,
+                      "Could not execute `get chunk` db statement, ec: {}",
+                      rc);
+            break;
+        }
+    }
+
+    int rc = sqlite3_reset(stmt);
+    if (rc != SQLITE_OK) {
+        ARQMA_LOG(critical, "sqlite reset error: [{}], {}", rc,
+                  sqlite3_errmsg(reader->conn));
+        success = false;
+    }
+
+    if (!success) {
+        chunk.clear();
+    }
+    return success;
+}
+
+bool Shard::remove(const std::vector<std::string>& hashes) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    char* errmsg = 0;
+    if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &errmsg) !=
+        SQLITE_OK) {
+        ARQMA_LOG(critical, "Could not begin a transaction: {}", errmsg);
+        sqlite3_free(errmsg);
+        return false;
+    }
+
+    bool success = true;
+    for (const auto& hash : hashes) {
+        bind_key(delete_by_hash_stmt, 1, hash);
+        int rc;
+        while ((rc = sqlite3_step(delete_by_hash_stmt)) == SQLITE_BUSY) {
+        }
+        if (rc != SQLITE_DONE) {
+            ARQMA_LOG(critical,
+                      "Could not execute `delete by hash` db statement, ec: {}",
+                      rc);
+            success = false;
+        }
+        sqlite3_reset(delete_by_hash_stmt);
+        if (!success) {
+            break;
+        }
+    }
+
+    if (!success) {
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
+    }
+
+    if (sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg) != SQLITE_OK) {
+        ARQMA_LOG(critical, "Could not commit a removal: {}", errmsg);
+        sqlite3_free(errmsg);
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        return false;
+    }
+
+    return true;
+}
+
+size_t Shard::get_shard_count() {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    sqlite3_stmt* stmt =
+        prepare_statement(db, "SELECT `ShardCount` FROM `Layout`;");
+    if (!stmt) {
+        throw std::runtime_error("could not read the shard count");
+    }
+    size_t count = 1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        count = sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return count;
+}
+
+void Shard::set_shard_count(size_t count) {
+
+    std::lock_guard<std::mutex> lock(write_mutex_);
+
+    const std::string query =
+        "INSERT OR REPLACE INTO `Layout` VALUES (0, " + std::to_string(count) +
+        ");";
+    if (sqlite3_exec(db, query.c_str(), nullptr, nullptr, nullptr) !=
+        SQLITE_OK) {
+        throw std::runtime_error("could not record the shard count");
+    }
+}
+
+// The column pointers stay valid until the next step, which is all the
+// time `RetrieveBuffer::append` needs to copy them into its arena
+static std::string_view column_view(sqlite3_stmt* stmt, int col) {
+    const auto data = static_cast<const char*>(sqlite3_column_blob(stmt, col));
+    return std::string_view(data, sqlite3_column_bytes(stmt, col));
+}
+
+// Append the row of a retrieve query to `buffer`. The scratch strings hold
+// the hex encodings of the binary keys and are meant to be reused.
+static void append_row(sqlite3_stmt* stmt, RetrieveBuffer& buffer,
+                       std::string& hash_scratch, std::string& owner_scratch) {
+    buffer.append(column_key(stmt, 0, hash_scratch),
+                  column_key(stmt, 1, owner_scratch),
+                  sqlite3_column_int64(stmt, 3), sqlite3_column_int64(stmt, 2),
+                  sqlite3_column_int64(stmt, 4), column_view(stmt, 5),
+                  column_view(stmt, 6));
+}
+
+bool Shard::retrieve(const std::string& pubKey, RetrieveBuffer& buffer,
+                     const std::string& lastHash, int num_results) {
+
+    std::string hash_scratch, owner_scratch;
+
+    return retrieve_rows(pubKey, lastHash, num_results, [&](sqlite3_stmt* stmt) {
+        append_row(stmt, buffer, hash_scratch, owner_scratch);
+    });
+}
+
+bool Shard::retrieve_many(const std::vector<RetrieveRequest>& requests,
+                          const std::vector<size_t>& indices,
+                          RetrieveBuffer& buffer,
+                          std::vector<std::pair<size_t, size_t>>& ranges,
+                          int num_results) {
+
+    ReaderLease lease(*this);
+    ReadConnection& reader = *lease;
+
+    // Without a transaction every statement would see the shard as of its
+    // own first step
+    if (!exec_logged(reader.conn, "BEGIN TRANSACTION;")) {
+        return false;
+    }
+
+    std::string hash_scratch, owner_scratch;
+    bool success = true;
+    for (size_t i : indices) {
+        const auto& request = requests[i];
+        ranges[i].first = buffer.size();
+        success = retrieve_rows(reader, request.pub_key, request.last_hash,
+                                num_results, [&](sqlite3_stmt* stmt) {
+                                    append_row(stmt, buffer, hash_scratch,
+                                               owner_scratch);
+                                });
+        ranges[i].second = buffer.size();
+        if (!success) {
+            break;
+        }
+    }
+
+    // Nothing was written, so there is nothing a failed commit could lose
+    if (!exec_logged(reader.conn, "COMMIT;")) {
+        sqlite3_exec(reader.conn, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return false;
+    }
+    return success;
+}
+
+} // namespace arqma
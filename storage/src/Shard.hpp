@@ -0,0 +1,203 @@
+#pragma once
+
+#include "Database.hpp"
+#include "ExpiryWheel.hpp"
+
+#include <thread>
+
+namespace arqma {
+
+/// One sqlite file holding the messages of a subset of the owners, with its
+/// own writer and read connections. `Database` routes every call to the
+/// right shard(s); see there for what the methods do.
+class Shard {
+  public:
+    using DuplicateHandling = Database::DuplicateHandling;
+    using Usage = Database::Usage;
+    using ExpiryStats = Database::ExpiryStats;
+    using RetrieveRequest = Database::RetrieveRequest;
+
+    Shard(const std::string& file_path, size_t num_readers,
+          const StorageProfile& profile);
+    ~Shard();
+
+    bool store(const std::string& hash, const std::string& pubKey,
+               const std::string& bytes, uint64_t ttl, uint64_t timestamp,
+               const std::string& nonce, DuplicateHandling behaviour);
+
+    bool bulk_store(const std::vector<storage::ItemView>& items);
+
+    bool store_batch(const std::vector<storage::ItemView>& items,
+                     std::vector<bool>& inserted);
+
+    bool retrieve(const std::string& key, std::vector<storage::Item>& items,
+                  const std::string& lastHash, int num_results);
+
+    bool retrieve(const std::string& key, RetrieveBuffer& buffer,
+                  const std::string& lastHash, int num_results);
+
+    // Retrieve the messages for `requests[i]` and set `ranges[i]` for every
+    // `i` in `indices`, all on one read connection in one transaction
+    bool retrieve_many(const std::vector<RetrieveRequest>& requests,
+                       const std::vector<size_t>& indices,
+                       RetrieveBuffer& buffer,
+                       std::vector<std::pair<size_t, size_t>>& ranges,
+                       int num_results);
+
+    // Replace the contents of `chunk` with up to `chunk_size` messages
+    // stored after `last_seq` and advance `last_seq` past them
+    bool retrieve_chunk(int64_t& last_seq, size_t chunk_size,
+                        std::vector<storage::Item>& chunk);
+
+    bool get_usage(Usage& usage);
+
+    bool get_owner_usage(const std::string& pubkey, Usage& usage);
+
+    bool retrieve_random(std::mt19937_64& rng, storage::Item& item);
+
+    ExpiryStats get_expiry_stats() const;
+
+    // Delete what expired, for up to a time budget, and return how soon to
+    // call again. Only to be called from one thread at a time.
+    std::chrono::milliseconds clean_up_expired();
+
+    bool retrieve_by_hash(const std::string& msg_hash, storage::Item& item);
+
+    // Set `found[i]` to whether a message with `hashes[i]` is stored
+    bool contains(const std::vector<std::string_view>& hashes,
+                  std::vector<bool>& found);
+
+    // Call `on_hash(hash, expires)` for every unexpired message
+    bool for_each_hash(
+        const std::function<void(const std::string&, uint64_t)>& on_hash);
+
+    // Delete the messages with the given hashes in one transaction
+    bool remove(const std::vector<std::string>& hashes);
+
+    // Append this shard's unexpired messages to the snapshot file at `path`
+    // and add their number to `exported`
+    bool export_snapshot(const std::string& path, uint64_t& exported);
+
+    // Store the unexpired messages of the snapshot file at `path` whose
+    // owner `accept` returns true for (all if empty), ignoring duplicates
+    // and messages with a TTL or timestamp a client couldn't have given
+    // them, and add the number of new ones to `imported`
+    bool import_snapshot(const std::string& path,
+                         const std::function<bool(const std::string&)>& accept,
+                         uint64_t& imported);
+
+    // Number of shards the messages were distributed over when this shard
+    // was last opened (only recorded in the first shard, 1 if never set)
+    size_t get_shard_count();
+    void set_shard_count(size_t count);
+
+  private:
+    struct ReadConnection;
+
+    /// Grants exclusive use of an idle read connection for its lifetime
+    class ReaderLease {
+        Shard& db_;
+        ReadConnection* conn_;
+
+      public:
+        explicit ReaderLease(Shard& db);
+        ~ReaderLease();
+        ReaderLease(const ReaderLease&) = delete;
+        ReaderLease& operator=(const ReaderLease&) = delete;
+
+        ReadConnection* operator->() const { return conn_; }
+        ReadConnection& operator*() const { return *conn_; }
+    };
+
+    sqlite3_stmt* prepare_statement(sqlite3* conn, const std::string& query);
+    void open_and_prepare(const std::string& file_path, size_t num_readers,
+                          const StorageProfile& profile);
+    // Open `checkpoint_conn_` and start checkpointing as often as `profile`
+    // says
+    void start_checkpoints(const StorageProfile& profile);
+    void run_checkpoints(std::chrono::milliseconds interval);
+    void migrate_legacy_table();
+    void migrate_to_binary_keys();
+    int64_t get_next_seq();
+    // Delete up to one chunk of the messages in `due_` and take them out of
+    // it, return the number deleted or -1 on error
+    int delete_due_chunk();
+    // Add the messages stored from `first_seq` on to `expiry_wheel_`. Must
+    // be called with `write_mutex_` held (or before other threads use the
+    // shard).
+    bool add_to_expiry_wheel(int64_t first_seq);
+
+    // Run the client retrieve query, calling `on_row(stmt)` for every row
+    template <typename OnRow>
+    bool retrieve_rows(const std::string& key, const std::string& lastHash,
+                       int num_results, OnRow&& on_row);
+
+    // Same as above on a connection already leased
+    template <typename OnRow>
+    bool retrieve_rows(ReadConnection& reader, const std::string& key,
+                       const std::string& lastHash, int num_results,
+                       OnRow&& on_row);
+
+    // Store `items` in one transaction, ignoring duplicates, and if given
+    // set `inserted` to which of them were new
+    bool store_items(const std::vector<storage::ItemView>& items,
+                     std::vector<bool>* inserted);
+
+    // Insert `items` many rows per statement, set `inserted` to which of
+    // them were new and `seqs` to the seq each was given. Must be called
+    // with `write_mutex_` held and a transaction open.
+    bool insert_locked(const std::vector<storage::ItemView>& items,
+                       std::vector<bool>& inserted,
+                       std::vector<int64_t>& seqs);
+
+    // Must be called with `write_mutex_` held
+    bool store_locked(const std::string& hash, const std::string& pubKey,
+                      const std::string& bytes, uint64_t ttl,
+                      uint64_t timestamp, const std::string& nonce,
+                      DuplicateHandling behaviour);
+
+  private:
+    const std::string file_path_;
+    // The only connection allowed to modify the database
+    sqlite3* db;
+    sqlite3_stmt* save_stmt;
+    sqlite3_stmt* save_or_ignore_stmt;
+    sqlite3_stmt* bulk_insert_stmt;
+    sqlite3_stmt* inserted_seqs_stmt;
+    sqlite3_stmt* delete_seqs_stmt;
+    sqlite3_stmt* delete_by_hash_stmt;
+    std::mutex write_mutex_;
+    // Seq of the next message to insert (guarded by `write_mutex_`)
+    int64_t next_seq_ = 1;
+
+    // Read-only connections (WAL lets them run concurrently with the writer)
+    std::vector<std::unique_ptr<ReadConnection>> readers_;
+    std::vector<ReadConnection*> idle_readers_;
+    std::mutex readers_mutex_;
+    std::condition_variable readers_cv_;
+
+    // Seqs of the stored messages by expiry time. Seqs of messages deleted
+    // otherwise stay in it until they are due, and are ignored then.
+    ExpiryWheel<int64_t> expiry_wheel_;
+    std::mutex wheel_mutex_;
+    // Seqs of expired messages not deleted yet (only used by
+    // `clean_up_expired`)
+    std::vector<int64_t> due_;
+
+    // Only used by `checkpointer_`, if the profile checkpoints in the
+    // background
+    sqlite3* checkpoint_conn_ = nullptr;
+    std::thread checkpointer_;
+    std::mutex checkpoint_mutex_;
+    std::condition_variable checkpoint_cv_;
+    bool stop_checkpoints_ = false;
+
+    // Only written by `clean_up_expired`, read from anywhere
+    std::atomic<uint64_t> total_expired_{0};
+    std::atomic<double> expired_per_sec_{0};
+    std::atomic<uint64_t> expiry_backlog_{0};
+    std::chrono::steady_clock::time_point expiry_period_start_;
+    uint64_t expiry_period_expired_ = 0;
+};
+
+} // namespace arqma
@@ -0,0 +1,208 @@
+#include "channel_encryption.hpp"
+#include "shared_secret_cache.hpp"
+#include "utils.hpp"
+
+#include <boost/test/unit_test.hpp>
+
+#include <sodium.h>
+
+#include <array>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+const std::vector<uint8_t> private_key{
+    114, 19,  233, 130, 59,  240, 42,  209, 251, 142, 29,
+    59,  200, 89,  234, 154, 202, 12,  29,  44,  180, 111,
+    36,  158, 126, 252, 198, 236, 141, 163, 95,  15};
+
+SharedSecretCache::pubkey_t make_pubkey(uint8_t i) {
+    SharedSecretCache::pubkey_t pubkey{};
+    pubkey[0] = i;
+    return pubkey;
+}
+
+SharedSecretCache::secret_t make_secret(uint8_t i) {
+    SharedSecretCache::secret_t secret{};
+    secret.fill(i);
+    return secret;
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(channel_encryption)
+
+BOOST_AUTO_TEST_CASE(it_evicts_least_recently_used_secrets) {
+    SharedSecretCache cache(2);
+    SharedSecretCache::secret_t secret;
+
+    BOOST_CHECK(!cache.get(make_pubkey(1), secret));
+    cache.put(make_pubkey(1), make_secret(1));
+    cache.put(make_pubkey(2), make_secret(2));
+
+    // Makes 2 the least recently used
+    BOOST_REQUIRE(cache.get(make_pubkey(1), secret));
+    BOOST_CHECK(secret == make_secret(1));
+
+    cache.put(make_pubkey(3), make_secret(3));
+    BOOST_CHECK(!cache.get(make_pubkey(2), secret));
+    BOOST_REQUIRE(cache.get(make_pubkey(3), secret));
+    BOOST_CHECK(secret == make_secret(3));
+    BOOST_CHECK(cache.get(make_pubkey(1), secret));
+
+    const auto stats = cache.get_stats();
+    BOOST_CHECK_EQUAL(stats.hits, 3);
+    BOOST_CHECK_EQUAL(stats.misses, 2);
+    BOOST_CHECK_EQUAL(stats.size, 2);
+}
+
+BOOST_AUTO_TEST_CASE(it_caches_nothing_without_capacity) {
+    SharedSecretCache cache(0);
+    SharedSecretCache::secret_t secret;
+
+    cache.put(make_pubkey(1), make_secret(1));
+    BOOST_CHECK(!cache.get(make_pubkey(1), secret));
+    BOOST_CHECK_EQUAL(cache.get_stats().size, 0);
+    BOOST_CHECK_EQUAL(cache.get_stats().misses, 1);
+}
+
+BOOST_AUTO_TEST_CASE(it_derives_each_shared_key_once) {
+    ChannelEncryption<std::string> channel(private_key);
+    const std::string pubKey =
+        "86fe0345719904c47d9d3d24d742d110cab95f9386173057bd59f1c2249da174";
+    const std::string plainText = "params\":{\"pubKey\":"
+                                  "\"0549b42c7600a25ab9800903630a57f157a1a0f771"
+                                  "cac31df559eb13fc5cc0c813\"}}";
+
+    const auto key = channel.get_shared_key(pubKey);
+    const auto ciphertext = channel.encrypt(plainText, key);
+    BOOST_CHECK_EQUAL(channel.decrypt(ciphertext, pubKey), plainText);
+    BOOST_CHECK_EQUAL(channel.decrypt(channel.encrypt(plainText, pubKey), key),
+                      plainText);
+
+    // Same key whether derived or cached, and without a cache
+    ChannelEncryption<std::string> uncached(private_key, 0);
+    BOOST_CHECK(uncached.get_shared_key(pubKey) == key);
+
+    const auto stats = channel.get_cache_stats();
+    BOOST_CHECK_EQUAL(stats.misses, 1);
+    BOOST_CHECK_EQUAL(stats.hits, 2);
+    BOOST_CHECK_EQUAL(stats.size, 1);
+    BOOST_CHECK_EQUAL(uncached.get_cache_stats().size, 0);
+
+    BOOST_CHECK_THROW(channel.get_shared_key(pubKey.substr(2)),
+                      std::runtime_error);
+    BOOST_CHECK_THROW(channel.get_shared_key("zz" + pubKey.substr(2)),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(it_encrypts_into_caller_buffers) {
+    using channel_t = ChannelEncryption<std::string>;
+    channel_t channel(private_key);
+    const auto key = channel.get_shared_key(
+        "86fe0345719904c47d9d3d24d742d110cab95f9386173057bd59f1c2249da174");
+    std::mt19937_64 rng(42);
+
+    // Across the chunks `encrypt_base64` encrypts at a time
+    for (size_t len = 0; len < 7000; len += 1 + rng() % 97) {
+        std::string plainText(len, '\0');
+        for (auto& c : plainText) {
+            c = static_cast<char>(rng());
+        }
+        const auto p = reinterpret_cast<const uint8_t*>(plainText.data());
+
+        std::vector<uint8_t> encrypted(channel_t::encrypted_size(len));
+        BOOST_REQUIRE_EQUAL(channel_t::encrypt(p, len, key, encrypted.data()),
+                            encrypted.size());
+
+        std::vector<uint8_t> decrypted(
+            channel_t::decrypted_size_bound(encrypted.size()));
+        decrypted.resize(channel_t::decrypt(encrypted.data(), encrypted.size(),
+                                            key, decrypted.data()));
+        BOOST_REQUIRE(std::string(decrypted.begin(), decrypted.end()) ==
+                      plainText);
+
+        std::string base64;
+        channel_t::encrypt_base64(plainText, key, base64);
+        BOOST_REQUIRE_EQUAL(base64.size(),
+                            util::base64_encode(std::string(
+                                encrypted.begin(), encrypted.end()))
+                                .size());
+        BOOST_REQUIRE(channel.decrypt(util::base64_decode(base64), key) ==
+                      plainText);
+    }
+
+    // Too short for an IV and a block, or not whole blocks
+    std::vector<uint8_t> out(64);
+    for (size_t len : {0, 16, 40}) {
+        BOOST_CHECK_THROW(channel_t::decrypt(out.data(), len, key, out.data()),
+                          std::runtime_error);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_derives_a_separate_xchacha20_key) {
+    ChannelEncryption<std::string> channel(private_key);
+
+    std::array<uint8_t, 32> client_pubkey, client_key, server_pubkey;
+    crypto_box_keypair(client_pubkey.data(), client_key.data());
+    crypto_scalarmult_base(server_pubkey.data(), private_key.data());
+
+    // As the client derives it
+    std::array<uint8_t, 32> shared, expected;
+    BOOST_REQUIRE(crypto_scalarmult(shared.data(), client_key.data(),
+                                    server_pubkey.data()) == 0);
+    const std::string context = "xchacha20-poly1305";
+    std::string input(shared.begin(), shared.end());
+    input.append(client_pubkey.begin(), client_pubkey.end());
+    input.append(server_pubkey.begin(), server_pubkey.end());
+    input += context;
+    crypto_generichash(expected.data(), expected.size(),
+                       reinterpret_cast<const unsigned char*>(input.data()),
+                       input.size(), NULL, 0);
+
+    const std::string pubKey = util::as_hex(client_pubkey);
+    const auto key = channel.get_shared_key(pubKey, ChannelMode::XChaCha20);
+    BOOST_CHECK(key == expected);
+    BOOST_CHECK(channel.get_shared_key(pubKey) == shared);
+    BOOST_CHECK(channel.get_shared_key(pubKey, ChannelMode::XChaCha20) == key);
+
+    const auto stats = channel.get_cache_stats();
+    BOOST_CHECK_EQUAL(stats.misses, 2);
+    BOOST_CHECK_EQUAL(stats.hits, 1);
+    BOOST_CHECK_EQUAL(stats.size, 2);
+}
+
+BOOST_AUTO_TEST_CASE(it_encrypts_and_authenticates_with_xchacha20) {
+    using channel_t = ChannelEncryption<std::string>;
+    channel_t channel(private_key);
+    const auto key = channel.get_shared_key(
+        "86fe0345719904c47d9d3d24d742d110cab95f9386173057bd59f1c2249da174",
+        ChannelMode::XChaCha20);
+
+    for (size_t len : {0, 1, 200, 5000}) {
+        const std::string plainText(len, 'p');
+        std::string ciphertext, decrypted;
+        channel_t::encrypt_xchacha20(plainText, key, ciphertext);
+        BOOST_REQUIRE_EQUAL(ciphertext.size(), len + 24 + 16);
+        channel_t::decrypt_xchacha20(ciphertext, key, decrypted);
+        BOOST_REQUIRE(decrypted == plainText);
+
+        // Any change to the nonce, ciphertext or tag is detected
+        for (size_t pos : {size_t{0}, 24 + len / 2, ciphertext.size() - 1}) {
+            std::string tampered = ciphertext;
+            tampered[pos] ^= 1;
+            BOOST_CHECK_THROW(
+                channel_t::decrypt_xchacha20(tampered, key, decrypted),
+                std::runtime_error);
+        }
+    }
+
+    std::string decrypted;
+    BOOST_CHECK_THROW(
+        channel_t::decrypt_xchacha20(std::string(39, 'c'), key, decrypted),
+        std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
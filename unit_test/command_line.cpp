@@ -113,6 +113,15 @@ BOOST_AUTO_TEST_CASE(it_returns_default_data_dir) {
     BOOST_CHECK_EQUAL(options.data_dir, "");
 }
 
+BOOST_AUTO_TEST_CASE(it_defaults_to_the_durable_db_profile) {
+    arqma::command_line_parser parser;
+    const char* argv[] = {"httpserver", "0.0.0.0", "80"};
+    BOOST_CHECK_NO_THROW(parser.parse_args(sizeof(argv) / sizeof(char*),
+                                           const_cast<char**>(argv)));
+    const auto options = parser.get_options();
+    BOOST_CHECK_EQUAL(options.db_profile, "durable");
+}
+
 BOOST_AUTO_TEST_CASE(it_parses_log_levels) {
     arqma::command_line_parser parser;
     const char* argv[] = {"httpserver", "0.0.0.0", "80", "--log-level",
@@ -0,0 +1,222 @@
+#include "encoding.hpp"
+#include "utils.hpp"
+
+#include <boost/beast/core/detail/base64.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using util::SimdLevel;
+
+namespace {
+
+// Every level the CPU supports, leaving the best one set when done
+struct simd_levels_t {
+    std::vector<SimdLevel> levels;
+
+    simd_levels_t() {
+        for (auto level :
+             {SimdLevel::Scalar, SimdLevel::SSSE3, SimdLevel::AVX2}) {
+            if (util::set_simd_level(level) == level) {
+                levels.push_back(level);
+            }
+        }
+    }
+
+    ~simd_levels_t() { util::set_simd_level(SimdLevel::AVX2); }
+};
+
+std::string random_bytes(std::mt19937_64& rng, size_t len) {
+    std::string bytes(len, '\0');
+    for (auto& c : bytes) {
+        c = static_cast<char>(rng());
+    }
+    return bytes;
+}
+
+const uint8_t* as_bytes(const std::string& str) {
+    return reinterpret_cast<const uint8_t*>(str.data());
+}
+
+std::string hex_decoded(const std::string& hex, bool lowercase_only,
+                        bool& success) {
+    std::string bytes(hex.size() / 2, '\0');
+    success = util::hex_decode(hex.data(), hex.size(),
+                               reinterpret_cast<uint8_t*>(&bytes[0]),
+                               lowercase_only);
+    return bytes;
+}
+
+std::string base64_decoded(const std::string& base64) {
+    std::string bytes(util::base64_decoded_size(base64.size()), '\0');
+    bytes.resize(util::base64_decode(base64.data(), base64.size(),
+                                     reinterpret_cast<uint8_t*>(&bytes[0])));
+    return bytes;
+}
+
+// What the codecs replace, as reference
+std::string beast_base64_encode(const std::string& bytes) {
+    namespace base64 = boost::beast::detail::base64;
+    std::string dest(base64::encoded_size(bytes.size()), '\0');
+    dest.resize(base64::encode(&dest[0], bytes.data(), bytes.size()));
+    return dest;
+}
+
+std::string beast_base64_decode(const std::string& base64_str) {
+    namespace base64 = boost::beast::detail::base64;
+    // `decoded_size` is too small without padding
+    std::string dest(base64_str.size(), '\0');
+    dest.resize(
+        base64::decode(&dest[0], base64_str.data(), base64_str.size()).first);
+    return dest;
+}
+
+bool is_hex_digit(char c, bool lowercase_only) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+           (!lowercase_only && c >= 'A' && c <= 'F');
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_SUITE(encoding)
+
+BOOST_AUTO_TEST_CASE(it_encodes_and_decodes_hex) {
+    static constexpr char digits[] = "0123456789abcdef";
+    simd_levels_t simd;
+    std::mt19937_64 rng(42);
+
+    for (auto level : simd.levels) {
+        util::set_simd_level(level);
+        for (size_t len = 0; len < 300; ++len) {
+            const std::string bytes = random_bytes(rng, len);
+            std::string expected;
+            for (const char c : bytes) {
+                expected.push_back(digits[static_cast<uint8_t>(c) >> 4]);
+                expected.push_back(digits[c & 0xf]);
+            }
+
+            std::string hex(2 * len, '\0');
+            util::hex_encode(as_bytes(bytes), len, &hex[0]);
+            BOOST_REQUIRE_EQUAL(hex, expected);
+
+            bool success;
+            BOOST_REQUIRE(hex_decoded(hex, true, success) == bytes);
+            BOOST_REQUIRE(success);
+
+            std::string upper = hex;
+            std::transform(upper.begin(), upper.end(), upper.begin(),
+                           ::toupper);
+            BOOST_REQUIRE(hex_decoded(upper, false, success) == bytes);
+            BOOST_REQUIRE(success);
+            hex_decoded(upper, true, success);
+            BOOST_REQUIRE(success == (upper == hex));
+        }
+
+        // Every char in every position of a block for each vector width
+        const std::string hex(130, 'a');
+        for (size_t pos = 0; pos < hex.size(); ++pos) {
+            for (int c = 0; c < 256; ++c) {
+                std::string bad = hex;
+                bad[pos] = static_cast<char>(c);
+                for (const bool lowercase_only : {false, true}) {
+                    bool success;
+                    hex_decoded(bad, lowercase_only, success);
+                    BOOST_REQUIRE_EQUAL(
+                        success, is_hex_digit(bad[pos], lowercase_only));
+                }
+            }
+        }
+
+        bool success;
+        hex_decoded("abc", false, success);
+        BOOST_CHECK(!success);
+    }
+
+    // Invalid digits are still read as 0 by the lenient version
+    BOOST_CHECK_EQUAL(util::hex_to_bytes("0g1f2"), std::string("\x00\x1f", 2));
+    BOOST_CHECK_EQUAL(util::as_hex(std::string("\x01\xab")), "01ab");
+}
+
+BOOST_AUTO_TEST_CASE(it_encodes_and_decodes_base64_as_beast_does) {
+    simd_levels_t simd;
+    std::mt19937_64 rng(42);
+
+    for (auto level : simd.levels) {
+        util::set_simd_level(level);
+        for (size_t len = 0; len < 300; ++len) {
+            const std::string bytes = random_bytes(rng, len);
+
+            std::string base64(util::base64_encoded_size(len), '\0');
+            BOOST_REQUIRE_EQUAL(
+                util::base64_encode(as_bytes(bytes), len, &base64[0]),
+                base64.size());
+            BOOST_REQUIRE_EQUAL(base64, beast_base64_encode(bytes));
+            BOOST_REQUIRE(base64_decoded(base64) == bytes);
+
+            // Unpadded and cut short anywhere
+            const std::string cut = base64.substr(0, rng() % (base64.size() + 1));
+            BOOST_REQUIRE(base64_decoded(cut) == beast_base64_decode(cut));
+        }
+
+        // Decoding stops at the first char that isn't base64, wherever it is
+        const std::string base64 =
+            util::base64_encode(random_bytes(rng, 3 * 40));
+        for (size_t pos = 0; pos < base64.size(); ++pos) {
+            for (int c = 0; c < 256; ++c) {
+                std::string bad = base64;
+                bad[pos] = static_cast<char>(c);
+                BOOST_REQUIRE(base64_decoded(bad) == beast_base64_decode(bad));
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_encodes_and_decodes_base32z) {
+    std::mt19937_64 rng(42);
+
+    const std::string zeros(5, '\0');
+    char buf[64] = {0};
+    BOOST_CHECK_EQUAL(util::base32z_encode(zeros, buf), std::string("yyyyyyyy"));
+    BOOST_CHECK_EQUAL(util::hex_to_base32z("ff"), "9h");
+
+    for (size_t len = 0; len < 40; ++len) {
+        const std::string bytes = random_bytes(rng, len);
+        const auto encoded = util::base32z_encode(bytes, buf);
+        BOOST_REQUIRE(encoded);
+        BOOST_REQUIRE_EQUAL(std::strlen(encoded),
+                            util::base32z_encoded_size(len));
+
+        std::string decoded(len, '\0');
+        BOOST_REQUIRE(util::base32z_decode(std::string(encoded), decoded));
+        BOOST_REQUIRE(decoded == bytes);
+    }
+
+    // Too long to fit
+    char small[8];
+    BOOST_CHECK(!util::base32z_encode(std::string(5, 'x'), small));
+
+    // Every char in every position of a pubkey
+    std::array<uint8_t, 32> key{};
+    const std::string valid = util::base32z_encode(key, buf);
+    for (size_t pos = 0; pos < valid.size(); ++pos) {
+        for (int c = 1; c < 256; ++c) {
+            std::string bad = valid;
+            bad[pos] = static_cast<char>(c);
+            const bool expected =
+                std::string("ybndrfg8ejkmcpqxot1uwisza345h769").find(
+                    static_cast<char>(c)) != std::string::npos;
+            BOOST_REQUIRE_EQUAL(util::base32z_decode(bad, key), expected);
+        }
+    }
+
+    // Wrong length
+    BOOST_CHECK(!util::base32z_decode(valid.substr(1), key));
+    BOOST_CHECK(!util::base32z_decode(valid + "y", key));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
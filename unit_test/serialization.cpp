@@ -1,3 +1,4 @@
+#include "Item.hpp"
 #include "serialization.h"
 #include "service_node.h"
 
@@ -50,4 +51,146 @@ BOOST_AUTO_TEST_CASE(it_serialises_in_batches) {
     const std::vector<std::string> batches = serialize_messages(inputs);
     BOOST_CHECK_EQUAL(batches.size(), 2);
 }
+
+BOOST_AUTO_TEST_CASE(it_deserializes_into_views_of_the_blob) {
+    const std::string pub_key(get_user_pubkey_size(), 'a');
+    const std::string data("da\0ta", 5);
+    const uint64_t timestamp = 12345678;
+    const uint64_t ttl = 3456000;
+    message_t msg{pub_key, data, "hash", ttl, timestamp};
+    message_t other{pub_key, "", "other", ttl + 1, timestamp + 1};
+    const std::vector<std::string> batches =
+        serialize_messages(std::vector<message_t>{msg, other});
+    BOOST_REQUIRE_EQUAL(batches.size(), 1);
+    const std::string& blob = batches[0];
+
+    std::vector<storage::ItemView> views;
+    std::string keys;
+    BOOST_REQUIRE(deserialize_messages(blob, views, keys));
+    BOOST_REQUIRE_EQUAL(views.size(), 2);
+    BOOST_CHECK_EQUAL(views[0].pub_key, pub_key);
+    BOOST_CHECK(views[0].data == data);
+    BOOST_CHECK_EQUAL(views[0].hash, "hash");
+    BOOST_CHECK_EQUAL(views[0].ttl, ttl);
+    BOOST_CHECK_EQUAL(views[0].timestamp, timestamp);
+    BOOST_CHECK_EQUAL(views[0].expiration_timestamp, timestamp + ttl);
+    BOOST_CHECK(views[1].data.empty());
+    BOOST_CHECK_EQUAL(views[1].hash, "other");
+    BOOST_CHECK_EQUAL(views[1].ttl, ttl + 1);
+
+    // Nothing is copied
+    const auto in_blob = [&](std::string_view str) {
+        return str.data() >= blob.data() &&
+               str.data() + str.size() <= blob.data() + blob.size();
+    };
+    BOOST_CHECK(in_blob(views[0].pub_key));
+    BOOST_CHECK(in_blob(views[0].hash));
+    BOOST_CHECK(in_blob(views[0].data));
+    BOOST_CHECK(keys.empty());
+
+    // Same messages as the copying version
+    const auto messages = deserialize_messages(blob);
+    BOOST_REQUIRE_EQUAL(messages.size(), 2);
+    BOOST_CHECK_EQUAL(messages[0].data, data);
+    BOOST_CHECK_EQUAL(messages[1].hash, "other");
+
+    // A truncated blob is rejected as a whole
+    for (size_t len : {size_t(1), pub_key.size() + 3, blob.size() - 1}) {
+        BOOST_CHECK(
+            !deserialize_messages(std::string_view(blob).substr(0, len), views,
+                                  keys));
+        BOOST_CHECK(deserialize_messages(blob.substr(0, len)).empty());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_serializes_and_deserializes_wire_format_v2) {
+    const std::string pub_key(get_user_pubkey_size(), 'b');
+    const std::string hash(128, 'c');
+    const uint64_t timestamp = 12345678;
+    const uint64_t ttl = 3456000;
+    // Keys that aren't lowercase hex are sent as they are
+    message_t msg{pub_key, "data", hash, ttl, timestamp};
+    msg.nonce = "nonce";
+    const std::string not_hex(get_user_pubkey_size(), 'Z');
+    message_t other{not_hex, "", "hash", ttl + 1, timestamp + 1};
+    const std::vector<message_t> inputs{msg, other};
+
+    const auto v1 = serialize_messages(inputs);
+    const auto v2 = serialize_messages(inputs, WireFormat::V2);
+    BOOST_REQUIRE_EQUAL(v1.size(), 1);
+    BOOST_REQUIRE_EQUAL(v2.size(), 1);
+    const std::string& blob = v2[0];
+    BOOST_CHECK_EQUAL(blob[0], char(WireFormat::V2));
+    BOOST_CHECK_LT(blob.size(), v1[0].size());
+
+    std::vector<storage::ItemView> views;
+    std::string keys;
+    BOOST_REQUIRE(deserialize_messages(blob, views, keys));
+    BOOST_REQUIRE_EQUAL(views.size(), 2);
+    BOOST_CHECK_EQUAL(views[0].pub_key, pub_key);
+    BOOST_CHECK_EQUAL(views[0].hash, hash);
+    BOOST_CHECK_EQUAL(views[0].data, "data");
+    BOOST_CHECK_EQUAL(views[0].nonce, "nonce");
+    BOOST_CHECK_EQUAL(views[0].ttl, ttl);
+    BOOST_CHECK_EQUAL(views[0].timestamp, timestamp);
+    BOOST_CHECK_EQUAL(views[0].expiration_timestamp, timestamp + ttl);
+    BOOST_CHECK_EQUAL(views[1].pub_key, not_hex);
+    BOOST_CHECK_EQUAL(views[1].hash, "hash");
+    BOOST_CHECK(views[1].data.empty());
+    BOOST_CHECK(views[1].nonce.empty());
+    BOOST_CHECK_EQUAL(views[1].ttl, ttl + 1);
+    BOOST_CHECK_EQUAL(keys.size(), pub_key.size() + hash.size());
+
+    // Either format is read by the copying version
+    for (const auto& batch : {v1[0], v2[0]}) {
+        const auto messages = deserialize_messages(batch);
+        BOOST_REQUIRE_EQUAL(messages.size(), 2);
+        BOOST_CHECK_EQUAL(messages[0].pub_key, pub_key);
+        BOOST_CHECK_EQUAL(messages[0].hash, hash);
+        BOOST_CHECK_EQUAL(messages[1].pub_key, not_hex);
+        BOOST_CHECK_EQUAL(messages[1].timestamp, timestamp + 1);
+    }
+
+    // A truncated blob is rejected, unless cut between messages
+    for (size_t len = 1; len < blob.size(); ++len) {
+        const bool ok = deserialize_messages(
+            std::string_view(blob).substr(0, len), views, keys);
+        BOOST_CHECK(!ok || views.size() < 2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_hashes_batches_as_it_serializes_them) {
+    const std::string pub_key(get_user_pubkey_size(), 'a');
+    const std::string data(10000, 'x');
+    std::vector<message_t> inputs;
+    for (int i = 0; i < 120; ++i) {
+        inputs.emplace_back(pub_key, data, "hash" + std::to_string(i), 100,
+                            12345678);
+    }
+
+    for (auto format : {WireFormat::V1, WireFormat::V2}) {
+        BatchSerializer serializer(format);
+        std::vector<std::string> batches;
+        std::vector<hash> hashes;
+        for (const auto& msg : inputs) {
+            serializer.add(msg);
+            if (serializer.full()) {
+                batches.emplace_back();
+                hashes.push_back(serializer.finish(batches.back()));
+            }
+        }
+        BOOST_CHECK(!serializer.empty());
+        batches.emplace_back();
+        hashes.push_back(serializer.finish(batches.back()));
+        BOOST_CHECK(serializer.empty());
+
+        // Same batches as serializing them all at once
+        BOOST_CHECK(batches == serialize_messages(inputs, format));
+        BOOST_REQUIRE_EQUAL(batches.size(), 3);
+        for (size_t i = 0; i < batches.size(); ++i) {
+            BOOST_CHECK(hashes[i] == hash_data(batches[i]));
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
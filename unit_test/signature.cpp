@@ -28,6 +28,22 @@ BOOST_AUTO_TEST_CASE(it_generates_hashes) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(it_hashes_incrementally) {
+    using namespace arqma;
+
+    const std::string data = "This is the payload, in pieces";
+    incremental_hasher hasher;
+    for (size_t i = 0; i < data.size(); i += 7) {
+        hasher.update(std::string_view(data).substr(i, 7));
+    }
+    BOOST_CHECK(hasher.finish() == hash_data(data));
+
+    // Starts over once finished
+    hasher.update(data);
+    BOOST_CHECK(hasher.finish() == hash_data(data));
+    BOOST_CHECK(hasher.finish() == hash_data(""));
+}
+
 BOOST_AUTO_TEST_CASE(it_signs_and_verifies) {
     using namespace arqma;
 
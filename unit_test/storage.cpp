@@ -1,9 +1,24 @@
+#include "AsyncDatabase.hpp"
 #include "Database.hpp"
+#include "DuplicateFilter.hpp"
+#include "ExpiryWheel.hpp"
+#include "GroupCommitter.hpp"
+#include "RetrieveCache.hpp"
 #include "utils.hpp"
 
+#include "sqlite3.h"
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <random>
+#include <set>
 #include <string>
+#include <thread>
 
 /// This file fails to link on linux when trying to use std:: for threading and
 /// chrono
@@ -13,6 +28,7 @@
 #include <boost/thread/thread.hpp>
 
 using arqma::storage::Item;
+using arqma::storage::ItemView;
 
 using namespace arqma;
 
@@ -21,21 +37,52 @@ struct StorageRAIIFixture {
         if (boost::filesystem::remove("storage.db")) {
             std::cout << "Pre-test db removal" << std::endl;
         }
+        remove_wal_files();
     }
     ~StorageRAIIFixture() {
         if (boost::filesystem::remove("storage.db")) {
             std::cout << "Post-test db removal" << std::endl;
         }
+        remove_wal_files();
+    }
+
+    // Left behind if a previous run did not close the database cleanly
+    static void remove_wal_files() {
+        boost::filesystem::remove("storage.db-wal");
+        boost::filesystem::remove("storage.db-shm");
+        for (int i = 1; i < MAX_TEST_SHARDS; ++i) {
+            const auto path = "storage-" + std::to_string(i) + ".db";
+            for (const char* suffix : {"", "-wal", "-shm"}) {
+                boost::filesystem::remove(path + suffix);
+            }
+        }
     }
+
+    // Other shards than the first are removed too
+    static constexpr int MAX_TEST_SHARDS = 8;
 };
 
+static std::string test_owner(size_t i) {
+    return std::string(62, '0') + util::as_hex(std::to_string(10 + i));
+}
+
+// Keys of the sizes clients get, the only ones snapshots carry over
+static std::string client_owner(size_t i) {
+    return std::string(get_user_pubkey_size() - 4, '0') +
+           util::as_hex(std::to_string(10 + i));
+}
+
+static std::string client_hash(size_t i) {
+    const std::string tail = util::as_hex(std::to_string(i));
+    return std::string(2 * util::MESSAGE_HASH_SIZE - tail.size(), 'f') + tail;
+}
+
 BOOST_AUTO_TEST_SUITE(storage)
 
 BOOST_AUTO_TEST_CASE(it_creates_the_database_file) {
     StorageRAIIFixture fixture;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
     BOOST_CHECK(boost::filesystem::exists("storage.db"));
 }
 
@@ -49,15 +96,14 @@ BOOST_AUTO_TEST_CASE(it_stores_data_persistently) {
     const uint64_t ttl = 123456;
     const uint64_t timestamp = util::get_time_ms();
     {
-        boost::asio::io_context ioc;
-        Database storage(ioc, ".");
+        Database storage(".");
         BOOST_CHECK(storage.store(hash, pubkey, bytes, ttl, timestamp, nonce));
         // the database is closed when storage goes out of scope
     }
     {
         // re-open the database
         boost::asio::io_context ioc;
-        Database storage(ioc, ".");
+        Database storage(".");
 
         std::vector<Item> items;
         const auto lastHash = "";
@@ -83,8 +129,7 @@ BOOST_AUTO_TEST_CASE(it_returns_false_when_storing_existing_hash) {
     const uint64_t ttl = 123456;
     const uint64_t timestamp = util::get_time_ms();
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     BOOST_CHECK(storage.store(hash, pubkey, bytes, ttl, timestamp, nonce));
     // store using the same hash, FAIL is default behaviour
@@ -103,8 +148,7 @@ BOOST_AUTO_TEST_CASE(
     const uint64_t ttl = 123456;
     const uint64_t timestamp = util::get_time_ms();
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     BOOST_CHECK(storage.store(hash, pubkey, bytes, ttl, timestamp, nonce));
     // store using the same hash
@@ -115,8 +159,7 @@ BOOST_AUTO_TEST_CASE(
 BOOST_AUTO_TEST_CASE(it_only_returns_entries_for_specified_pubkey) {
     StorageRAIIFixture fixture;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     BOOST_CHECK(storage.store("hash0", "mypubkey", "bytesasstring0", 100000,
                               util::get_time_ms(), "nonce"));
@@ -143,8 +186,7 @@ BOOST_AUTO_TEST_CASE(it_only_returns_entries_for_specified_pubkey) {
 BOOST_AUTO_TEST_CASE(it_returns_entries_older_than_lasthash) {
     StorageRAIIFixture fixture;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     const size_t num_entries = 1000;
     for (size_t i = 0; i < num_entries; i++) {
@@ -179,11 +221,12 @@ BOOST_AUTO_TEST_CASE(it_removes_expired_entries) {
 
     boost::asio::io_context ioc;
 
-    Database storage(ioc, ".");
+    Database storage(".");
+    AsyncDatabase async_storage(ioc, storage);
 
-    /// Note: `Database` is not thread safe
-    /// and not meant to be used in this way;
-    /// However, it should be fine for tests
+    /// Note: the cleanup timer runs on `ioc`'s thread (and the cleanup
+    /// itself on a storage thread) while we keep using the database from
+    /// this one
     std::thread t([&]() { ioc.run(); });
 
     BOOST_CHECK(storage.store("hash0", pubkey, "bytesasstring0", 100000,
@@ -196,10 +239,11 @@ BOOST_AUTO_TEST_CASE(it_removes_expired_entries) {
         BOOST_CHECK(storage.retrieve(pubkey, items, lastHash));
         BOOST_CHECK_EQUAL(items.size(), 2);
     }
-    // the timer kicks in every 10 seconds
-    // give 100ms to perform the cleanup
+    // expired messages are deleted on the next tick of the expiry wheel
+    // give a second more to perform the cleanup
     std::cout << "waiting for cleanup timer..." << std::endl;
-    boost::this_thread::sleep_for(boost::chrono::milliseconds(10000 + 100));
+    boost::this_thread::sleep_for(boost::chrono::milliseconds(
+        2 * ExpiryWheel<int64_t>::DEFAULT_TICK_MS));
 
     {
         std::vector<Item> items;
@@ -208,11 +252,137 @@ BOOST_AUTO_TEST_CASE(it_removes_expired_entries) {
         BOOST_CHECK_EQUAL(items.size(), 1);
         BOOST_CHECK_EQUAL(items[0].hash, "hash0");
     }
+    {
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 1);
+        BOOST_CHECK_EQUAL(usage.bytes, strlen("bytesasstring0"));
+        BOOST_CHECK_EQUAL(usage.owners, 1);
+    }
 
     ioc.stop();
     t.join();
 }
 
+BOOST_AUTO_TEST_CASE(it_expires_large_backlogs_in_chunks) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const auto bytes = "bytesasstring";
+    const auto nonce = "nonce";
+    const uint64_t timestamp = util::get_time_ms();
+
+    // Many times the chunk size, so it can't be done in one go
+    const size_t num_expired = 20000;
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+
+    {
+        std::vector<Item> items;
+        for (size_t i = 0; i < num_expired; ++i) {
+            items.push_back({std::to_string(i), pubkey, timestamp, 0,
+                             timestamp, nonce, bytes});
+        }
+        items.push_back({"alive", pubkey, timestamp, 100000,
+                         timestamp + 100000, nonce, bytes});
+        BOOST_CHECK(storage.bulk_store(items));
+    }
+
+    // Cleanup has not started yet: it only runs once an `AsyncDatabase`
+    // drives it
+    BOOST_CHECK_EQUAL(storage.get_expiry_stats().total_expired, 0);
+    AsyncDatabase async_storage(ioc, storage);
+
+    // Writes get to run in between cleanup chunks, and `ioc` is never
+    // held up by them
+    size_t writes = 0;
+    std::function<void()> write = [&]() {
+        async_storage.write([](Database&) { return true; },
+                            [&](bool) {
+                                writes++;
+                                write();
+                            });
+    };
+    write();
+    size_t other_handlers = 0;
+    boost::asio::steady_timer ticker(ioc);
+    std::function<void()> tick = [&]() {
+        other_handlers++;
+        ticker.expires_after(std::chrono::milliseconds(1));
+        ticker.async_wait([&](const boost::system::error_code& ec) {
+            if (!ec)
+                tick();
+        });
+    };
+    tick();
+
+    const auto give_up =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    Database::Usage usage;
+    do {
+        ioc.run_for(std::chrono::milliseconds(10));
+        BOOST_REQUIRE(storage.get_usage(usage));
+    } while (usage.messages > 1 && std::chrono::steady_clock::now() < give_up);
+
+    BOOST_CHECK_EQUAL(usage.messages, 1);
+    BOOST_CHECK_GT(other_handlers, 1);
+    BOOST_CHECK_GT(writes, 1);
+
+    const auto stats = storage.get_expiry_stats();
+    BOOST_CHECK_EQUAL(stats.total_expired, num_expired);
+    BOOST_CHECK_EQUAL(stats.backlog, 0);
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 1);
+    BOOST_CHECK_EQUAL(items[0].hash, "alive");
+}
+
+BOOST_AUTO_TEST_CASE(it_reads_concurrently_with_writes) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const size_t num_readers = 4;
+    const size_t num_entries = 500;
+
+    Database storage(".", num_readers);
+
+    std::atomic<bool> done{false};
+    std::atomic<size_t> failed_reads{0};
+
+    std::vector<std::thread> readers;
+    for (size_t i = 0; i < 2 * num_readers; ++i) {
+        readers.emplace_back([&]() {
+            while (!done) {
+                std::vector<Item> items;
+                if (!storage.retrieve(pubkey, items, "")) {
+                    failed_reads++;
+                }
+                Item item;
+                storage.retrieve_by_hash("hash0", item);
+            }
+        });
+    }
+
+    for (size_t i = 0; i < num_entries; ++i) {
+        const auto hash = std::string("hash") + std::to_string(i);
+        BOOST_CHECK(storage.store(hash, pubkey, "bytesasstring", 100000,
+                                  util::get_time_ms(), "nonce"));
+    }
+
+    done = true;
+    for (auto& t : readers) {
+        t.join();
+    }
+
+    BOOST_CHECK_EQUAL(failed_reads, 0);
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+    BOOST_CHECK_EQUAL(items.size(), num_entries);
+}
+
 BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk) {
     StorageRAIIFixture fixture;
 
@@ -224,8 +394,7 @@ BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk) {
 
     const size_t num_items = 10000;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     // bulk store
     {
@@ -258,8 +427,7 @@ BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk_even_when_overlaps) {
 
     const size_t num_items = 10000;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     // insert existing
     BOOST_CHECK(storage.store("0", pubkey, bytes, ttl, timestamp, nonce));
@@ -284,58 +452,611 @@ BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk_even_when_overlaps) {
     }
 }
 
-BOOST_AUTO_TEST_CASE(bulk_performance_check) {
+BOOST_AUTO_TEST_CASE(it_stores_data_in_bulk_from_views) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".");
+
+    // All the strings live in one buffer, as in a received push batch
+    const std::string body = "mypubkey" "hash0" "hash1" "bytes";
+    const std::string_view view = body;
+    const uint64_t timestamp = util::get_time_ms();
+    const uint64_t ttl = 123456;
+
+    // Default constructed views (no data pointer) are empty strings
+    // rather than NULLs
+    std::vector<ItemView> items;
+    items.push_back({view.substr(8, 5), view.substr(0, 8), timestamp, ttl,
+                     timestamp + ttl, std::string_view(), view.substr(18)});
+    items.push_back({view.substr(13, 5), view.substr(0, 8), timestamp + 1,
+                     ttl, timestamp + 1 + ttl, view.substr(18),
+                     std::string_view()});
+
+    std::vector<bool> inserted;
+    BOOST_REQUIRE(storage.store_batch(items, inserted));
+    BOOST_CHECK(inserted[0] && inserted[1]);
+
+    std::vector<Item> stored;
+    BOOST_REQUIRE(storage.retrieve("mypubkey", stored, ""));
+    BOOST_REQUIRE_EQUAL(stored.size(), 2);
+    BOOST_CHECK_EQUAL(stored[0].hash, "hash0");
+    BOOST_CHECK_EQUAL(stored[0].nonce, "");
+    BOOST_CHECK_EQUAL(stored[0].data, "bytes");
+    BOOST_CHECK_EQUAL(stored[1].hash, "hash1");
+    BOOST_CHECK_EQUAL(stored[1].nonce, "bytes");
+    BOOST_CHECK_EQUAL(stored[1].data, "");
+
+    // Duplicates are found the same way as for `Item`s
+    BOOST_REQUIRE(storage.store_batch(items, inserted));
+    BOOST_CHECK(!inserted[0] && !inserted[1]);
+}
+
+BOOST_AUTO_TEST_CASE(it_group_commits_when_the_batch_is_full) {
+    StorageRAIIFixture fixture;
+
     const auto pubkey = "mypubkey";
     const auto bytes = "bytesasstring";
     const auto nonce = "nonce";
     const uint64_t ttl = 123456;
     const uint64_t timestamp = util::get_time_ms();
 
-    const size_t num_items = 10000;
+    const size_t batch_size = 8;
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    GroupCommitter committer(ioc, storage, batch_size, std::chrono::hours(1));
+
+    std::vector<CommitResult> results;
+
+    for (size_t i = 0; i < batch_size - 1; ++i) {
+        committer.store({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, nonce, bytes},
+                        [&](CommitResult res) { results.push_back(res); });
+    }
+
+    // Nothing is written until the batch is full
+    BOOST_CHECK(results.empty());
+    BOOST_CHECK_EQUAL(committer.pending(), batch_size - 1);
+
+    committer.store({std::to_string(batch_size - 1), pubkey, timestamp, ttl,
+                     timestamp + ttl, nonce, bytes},
+                    [&](CommitResult res) { results.push_back(res); });
+
+    BOOST_CHECK_EQUAL(committer.pending(), 0);
+    BOOST_REQUIRE_EQUAL(results.size(), batch_size);
+    for (const auto res : results) {
+        BOOST_CHECK(res == CommitResult::STORED);
+    }
 
     std::vector<Item> items;
-    for (int i = 0; i < num_items; ++i) {
-        items.push_back({std::to_string(i), pubkey, timestamp, ttl,
-                         timestamp + ttl, nonce, bytes});
+    BOOST_CHECK(storage.retrieve(pubkey, items, ""));
+    BOOST_CHECK_EQUAL(items.size(), batch_size);
+}
+
+BOOST_AUTO_TEST_CASE(it_group_commits_after_the_delay) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const auto bytes = "bytesasstring";
+    const auto nonce = "nonce";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    GroupCommitter committer(ioc, storage, 100, std::chrono::milliseconds(10));
+
+    // Already stored, so the committer must report it as a duplicate
+    BOOST_CHECK(storage.store("0", pubkey, bytes, ttl, timestamp, nonce));
+
+    std::vector<CommitResult> results;
+    for (int i = 0; i < 2; ++i) {
+        committer.store({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, nonce, bytes},
+                        [&](CommitResult res) { results.push_back(res); });
     }
 
-    // bulk store
+    BOOST_CHECK(results.empty());
+
+    // Let the flush timer fire
+    boost::asio::steady_timer stop_timer(ioc, std::chrono::milliseconds(200));
+    stop_timer.async_wait([&](const boost::system::error_code&) { ioc.stop(); });
+    ioc.run();
+
+    BOOST_REQUIRE_EQUAL(results.size(), 2);
+    BOOST_CHECK(results[0] == CommitResult::DUPLICATE);
+    BOOST_CHECK(results[1] == CommitResult::STORED);
+    BOOST_CHECK_EQUAL(committer.pending(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(it_ignores_a_flush_timer_of_an_earlier_batch) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const auto bytes = "bytesasstring";
+    const auto nonce = "nonce";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    GroupCommitter committer(ioc, storage, 2, std::chrono::milliseconds(10));
+
+    const auto store = [&](int i) {
+        committer.store({std::to_string(i), pubkey, timestamp, ttl,
+                         timestamp + ttl, nonce, bytes},
+                        nullptr);
+    };
+
+    // Expires before the flush timer, so both handlers are queued at once
+    // and this one runs first, while the flush handler can't be recalled
+    boost::asio::steady_timer fill_timer(ioc, std::chrono::milliseconds(5));
+    fill_timer.async_wait([&](const boost::system::error_code&) {
+        store(1);
+        BOOST_CHECK_EQUAL(committer.pending(), 0);
+        store(2);
+    });
+
+    store(0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ioc.poll();
+
+    // The new batch waits for its own timer
+    BOOST_CHECK_EQUAL(committer.pending(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(it_runs_storage_work_off_the_io_thread) {
+    StorageRAIIFixture fixture;
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    AsyncDatabase async_storage(ioc, storage);
+
+    const auto io_thread = std::this_thread::get_id();
+    const uint64_t timestamp = util::get_time_ms();
+    const size_t num_batches = 10;
+
+    std::vector<size_t> completed;
+    for (size_t i = 0; i < num_batches; ++i) {
+        std::vector<Item> batch = {{"hash" + std::to_string(i), "mypubkey",
+                                    timestamp, 100000, timestamp + 100000,
+                                    "nonce", "data"}};
+        async_storage.store_batch(std::move(batch), [&, i](bool committed,
+                                                           std::vector<bool>
+                                                               inserted) {
+            BOOST_CHECK(std::this_thread::get_id() == io_thread);
+            BOOST_CHECK(committed);
+            BOOST_CHECK(inserted == std::vector<bool>{true});
+            completed.push_back(i);
+        });
+    }
+
+    std::thread::id storage_thread;
+    size_t seen = 0;
+    async_storage.write(
+        [&](Database& db) {
+            storage_thread = std::this_thread::get_id();
+            std::vector<Item> items;
+            db.retrieve("mypubkey", items, "");
+            return items.size();
+        },
+        [&](size_t count) { seen = count; });
+
+    // Handlers only run on `ioc`
+    BOOST_CHECK(completed.empty());
+    while (seen == 0) {
+        ioc.run_one();
+    }
+
+    // Reads don't wait for writes, but by now they are done
+    bool looked_up = false;
+    async_storage.retrieve_by_hash("hash3", [&](bool found, Item item) {
+        BOOST_CHECK(found);
+        BOOST_CHECK_EQUAL(item.data, "data");
+        looked_up = true;
+    });
+    while (!looked_up) {
+        ioc.run_one();
+    }
+
+    // Writes complete in the order they were submitted, and later writes
+    // see the earlier ones
+    for (size_t i = 0; i < num_batches; ++i) {
+        BOOST_CHECK_EQUAL(completed[i], i);
+    }
+    BOOST_CHECK(storage_thread != io_thread);
+    BOOST_CHECK_EQUAL(seen, num_batches);
+}
+
+BOOST_AUTO_TEST_CASE(it_group_commits_asynchronously) {
+    StorageRAIIFixture fixture;
+
+    const uint64_t timestamp = util::get_time_ms();
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    AsyncDatabase async_storage(ioc, storage);
+    GroupCommitter committer(ioc, async_storage, 2, std::chrono::hours(1));
+
+    std::vector<CommitResult> results;
+    for (const auto hash : {"hash0", "hash1", "hash0"}) {
+        committer.store({hash, "mypubkey", timestamp, 100000,
+                         timestamp + 100000, "nonce", "data"},
+                        [&](CommitResult res) { results.push_back(res); });
+    }
+    committer.flush();
+
+    // Submitted, but not reported until `ioc` gets to it
+    BOOST_CHECK_EQUAL(committer.pending(), 0);
+    BOOST_CHECK(results.empty());
+    while (results.size() < 3) {
+        ioc.run_one();
+    }
+
+    BOOST_CHECK(results[0] == CommitResult::STORED);
+    BOOST_CHECK(results[1] == CommitResult::STORED);
+    BOOST_CHECK(results[2] == CommitResult::DUPLICATE);
+}
+
+BOOST_AUTO_TEST_CASE(it_reports_which_messages_in_a_bulk_store_are_new) {
+    StorageRAIIFixture fixture;
+
+    const uint64_t timestamp = util::get_time_ms();
+    const uint64_t ttl = 100000;
+    const auto make_item = [&](size_t i) {
+        return Item{"hash" + std::to_string(i), test_owner(i % 3),
+                    timestamp,                  ttl,
+                    timestamp + ttl,            "nonce",
+                    "data" + std::to_string(i)};
+    };
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    AsyncDatabase async_storage(ioc, storage);
+
+    // Every third message of a batch long enough for several multi-row
+    // statements is already stored
+    std::vector<Item> old_items, batch;
+    for (size_t i = 0; i < 300; ++i) {
+        if (i % 3 == 0) {
+            old_items.push_back(make_item(i));
+        }
+        batch.push_back(make_item(i));
+    }
+    // And one is repeated within the batch
+    batch.push_back(make_item(1));
+    BOOST_REQUIRE(storage.bulk_store(old_items));
+
+    std::vector<bool> inserted;
+    BOOST_REQUIRE(storage.store_batch(batch, inserted));
+    BOOST_REQUIRE_EQUAL(inserted.size(), batch.size());
+    for (size_t i = 0; i < 300; ++i) {
+        BOOST_CHECK_EQUAL(inserted[i], i % 3 != 0);
+    }
+    BOOST_CHECK(!inserted.back());
+
+    // Every owner's messages are still in the order given
+    for (size_t owner = 0; owner < 3; ++owner) {
+        std::vector<Item> items;
+        BOOST_REQUIRE(storage.retrieve(test_owner(owner), items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), 100);
+        for (size_t j = 0; j < items.size(); ++j) {
+            BOOST_CHECK_EQUAL(items[j].hash, make_item(3 * j + owner).hash);
+        }
+    }
+
+    // The async variant hands back the new messages
+    std::vector<Item> more;
+    for (size_t i = 290; i < 310; ++i) {
+        more.push_back(make_item(i));
+    }
+    bool done = false;
+    async_storage.bulk_store(std::move(more),
+                             [&](bool success, std::vector<Item> new_items) {
+                                 BOOST_CHECK(success);
+                                 BOOST_REQUIRE_EQUAL(new_items.size(), 10);
+                                 BOOST_CHECK_EQUAL(new_items[0].hash,
+                                                   "hash300");
+                                 BOOST_CHECK_EQUAL(new_items[9].hash,
+                                                   "hash309");
+                                 done = true;
+                             });
+    while (!done) {
+        ioc.run_one();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_maintains_usage_counters) {
+    StorageRAIIFixture fixture;
+
+    const auto nonce = "nonce";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
     {
-        StorageRAIIFixture fixture;
-        boost::asio::io_context ioc;
-        Database storage(ioc, ".");
-        const auto start = boost::chrono::steady_clock::now();
-        storage.bulk_store(items);
-        const auto end = boost::chrono::steady_clock::now();
-        const auto diff = end - start;
-        std::cout << "bulk: "
-                  << boost::chrono::duration<double, boost::milli>(diff).count()
-                  << " ms" << std::endl;
+        Database storage(".");
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 0);
+        BOOST_CHECK_EQUAL(usage.bytes, 0);
+        BOOST_CHECK_EQUAL(usage.owners, 0);
+
+        BOOST_CHECK(storage.store("0", "alice", "12345", ttl, timestamp, nonce));
+        BOOST_CHECK(storage.store("1", "alice", "123", ttl, timestamp, nonce));
+        // Duplicates must not be counted
+        BOOST_CHECK(!storage.store("1", "alice", "123", ttl, timestamp, nonce));
+
+        std::vector<Item> items;
+        items.push_back({"1", "alice", timestamp, ttl, timestamp + ttl, nonce,
+                         "123"});
+        items.push_back({"2", "bob", timestamp, ttl, timestamp + ttl, nonce,
+                         "1234567"});
+        BOOST_CHECK(storage.bulk_store(items));
+    }
+
+    // Counters persist with the data
+    boost::asio::io_context ioc;
+    Database storage(".");
+
+    Database::Usage usage;
+    BOOST_CHECK(storage.get_usage(usage));
+    BOOST_CHECK_EQUAL(usage.messages, 3);
+    BOOST_CHECK_EQUAL(usage.bytes, 15);
+    BOOST_CHECK_EQUAL(usage.owners, 2);
+
+    uint64_t count;
+    BOOST_CHECK(storage.get_message_count(count));
+    BOOST_CHECK_EQUAL(count, 3);
+
+    BOOST_CHECK(storage.get_owner_usage("alice", usage));
+    BOOST_CHECK_EQUAL(usage.messages, 2);
+    BOOST_CHECK_EQUAL(usage.bytes, 8);
+
+    BOOST_CHECK(storage.get_owner_usage("carol", usage));
+    BOOST_CHECK_EQUAL(usage.messages, 0);
+    BOOST_CHECK_EQUAL(usage.bytes, 0);
+}
+
+BOOST_AUTO_TEST_CASE(it_migrates_the_legacy_table) {
+    StorageRAIIFixture fixture;
+
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    // The layout used before messages were clustered by owner
+    {
+        sqlite3* db;
+        BOOST_REQUIRE_EQUAL(sqlite3_open("./storage.db", &db), SQLITE_OK);
+        const auto insert = [&](const char* hash, const char* owner,
+                                const char* data) {
+            const std::string query =
+                std::string("INSERT INTO `Data` VALUES ('") + hash + "', '" +
+                owner + "', " + std::to_string(ttl) + ", " +
+                std::to_string(timestamp) + ", " +
+                std::to_string(timestamp + ttl) + ", 'nonce', '" + data +
+                "');";
+            return sqlite3_exec(db, query.c_str(), nullptr, nullptr, nullptr);
+        };
+        BOOST_REQUIRE_EQUAL(
+            sqlite3_exec(db,
+                         "CREATE TABLE `Data`("
+                         "    `Hash` VARCHAR(128) NOT NULL,"
+                         "    `Owner` VARCHAR(256) NOT NULL,"
+                         "    `TTL` INTEGER NOT NULL,"
+                         "    `Timestamp` INTEGER NOT NULL,"
+                         "    `TimeExpires` INTEGER NOT NULL,"
+                         "    `Nonce` VARCHAR(128) NOT NULL,"
+                         "    `Data` BLOB"
+                         ");"
+                         "CREATE UNIQUE INDEX `idx_data_hash` ON `Data` "
+                         "(`Hash`);"
+                         "CREATE INDEX `idx_data_owner` on `Data` ('Owner');",
+                         nullptr, nullptr, nullptr),
+            SQLITE_OK);
+        BOOST_REQUIRE_EQUAL(insert("a0", "alice", "first"), SQLITE_OK);
+        BOOST_REQUIRE_EQUAL(insert("b0", "bob", "other"), SQLITE_OK);
+        BOOST_REQUIRE_EQUAL(insert("a1", "alice", "second"), SQLITE_OK);
+        sqlite3_close(db);
     }
 
-    // single stores
     {
-        StorageRAIIFixture fixture;
-        boost::asio::io_context ioc;
-        Database storage(ioc, ".");
-        const auto start = boost::chrono::steady_clock::now();
-        for (const auto& item : items) {
-            storage.store(item.hash, item.pub_key, item.data, item.ttl,
-                          item.timestamp, item.nonce);
+        Database storage(".");
+
+        // New messages go after the migrated ones
+        BOOST_CHECK(
+            storage.store("a2", "alice", "third", ttl, timestamp, "nonce"));
+
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve("alice", items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), 3);
+        BOOST_CHECK_EQUAL(items[0].hash, "a0");
+        BOOST_CHECK_EQUAL(items[0].data, "first");
+        BOOST_CHECK_EQUAL(items[0].expiration_timestamp, timestamp + ttl);
+        BOOST_CHECK_EQUAL(items[1].hash, "a1");
+        BOOST_CHECK_EQUAL(items[2].hash, "a2");
+
+        items.clear();
+        BOOST_CHECK(storage.retrieve("alice", items, "a0"));
+        BOOST_REQUIRE_EQUAL(items.size(), 2);
+        BOOST_CHECK_EQUAL(items[0].hash, "a1");
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 4);
+        BOOST_CHECK_EQUAL(usage.owners, 2);
+
+        // Duplicates of migrated messages are still rejected
+        BOOST_CHECK(
+            !storage.store("b0", "bob", "other", ttl, timestamp, "nonce"));
+    }
+
+    // The legacy table is gone and reopening doesn't migrate again
+    {
+        sqlite3* db;
+        BOOST_REQUIRE_EQUAL(sqlite3_open("./storage.db", &db), SQLITE_OK);
+        BOOST_CHECK_NE(sqlite3_exec(db, "SELECT * FROM `Data`;", nullptr,
+                                    nullptr, nullptr),
+                       SQLITE_OK);
+        sqlite3_close(db);
+    }
+
+    boost::asio::io_context ioc;
+    Database storage(".");
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve("", items, ""));
+    BOOST_CHECK_EQUAL(items.size(), 4);
+}
+
+BOOST_AUTO_TEST_CASE(it_stores_hex_keys_as_binary) {
+    StorageRAIIFixture fixture;
+
+    const std::string owner(64, 'a');
+    const std::string old_hash = std::string(127, '0') + "1";
+    const std::string new_hash = std::string(127, '0') + "2";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    // Messages with hex text keys, as stored before schema version 1
+    {
+        sqlite3* db;
+        BOOST_REQUIRE_EQUAL(sqlite3_open("./storage.db", &db), SQLITE_OK);
+        const std::string query =
+            "CREATE TABLE `Messages`("
+            "    `Owner` VARCHAR(256) NOT NULL,"
+            "    `Seq` INTEGER NOT NULL,"
+            "    `Hash` VARCHAR(128) NOT NULL,"
+            "    `TTL` INTEGER NOT NULL,"
+            "    `Timestamp` INTEGER NOT NULL,"
+            "    `TimeExpires` INTEGER NOT NULL,"
+            "    `Nonce` VARCHAR(128) NOT NULL,"
+            "    `Data` BLOB,"
+            "    PRIMARY KEY (`Owner`, `Seq`)"
+            ") WITHOUT ROWID;"
+            "INSERT INTO `Messages` VALUES ('" +
+            owner + "', 1, '" + old_hash + "', " + std::to_string(ttl) +
+            ", " + std::to_string(timestamp) + ", " +
+            std::to_string(timestamp + ttl) + ", 'nonce', 'old');";
+        BOOST_REQUIRE_EQUAL(
+            sqlite3_exec(db, query.c_str(), nullptr, nullptr, nullptr),
+            SQLITE_OK);
+        sqlite3_close(db);
+    }
+
+    {
+        Database storage(".");
+
+        BOOST_CHECK(
+            storage.store(new_hash, owner, "new", ttl, timestamp, "nonce"));
+        // Not lowercase hex, so kept as text
+        BOOST_CHECK(storage.store("ABCD", "OWNER", "text", ttl, timestamp,
+                                  "nonce"));
+
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(owner, items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), 2);
+        BOOST_CHECK_EQUAL(items[0].hash, old_hash);
+        BOOST_CHECK_EQUAL(items[0].pub_key, owner);
+        BOOST_CHECK_EQUAL(items[1].hash, new_hash);
+
+        items.clear();
+        BOOST_CHECK(storage.retrieve(owner, items, old_hash));
+        BOOST_REQUIRE_EQUAL(items.size(), 1);
+        BOOST_CHECK_EQUAL(items[0].data, "new");
+
+        RetrieveBuffer buffer;
+        BOOST_CHECK(storage.retrieve(owner, buffer, ""));
+        BOOST_REQUIRE_EQUAL(buffer.size(), 2);
+        BOOST_CHECK_EQUAL(buffer[0].hash, old_hash);
+        BOOST_CHECK_EQUAL(buffer[1].pub_key, owner);
+
+        Item item;
+        BOOST_CHECK(storage.retrieve_by_hash(new_hash, item));
+        BOOST_CHECK(storage.retrieve_by_hash("ABCD", item));
+        BOOST_CHECK_EQUAL(item.pub_key, "OWNER");
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_owner_usage(owner, usage));
+        BOOST_CHECK_EQUAL(usage.messages, 2);
+
+        BOOST_CHECK(
+            !storage.store(old_hash, owner, "dup", ttl, timestamp, "nonce"));
+    }
+
+    sqlite3* db;
+    BOOST_REQUIRE_EQUAL(sqlite3_open("./storage.db", &db), SQLITE_OK);
+    const auto query_int = [&](const char* query) {
+        sqlite3_stmt* stmt;
+        sqlite3_prepare_v2(db, query, -1, &stmt, nullptr);
+        int64_t res = -1;
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            res = sqlite3_column_int64(stmt, 0);
         }
-        const auto end = boost::chrono::steady_clock::now();
-        const auto diff = end - start;
-        std::cout << "singles:"
-                  << boost::chrono::duration<double, boost::milli>(diff).count()
-                  << " ms" << std::endl;
+        sqlite3_finalize(stmt);
+        return res;
+    };
+    BOOST_CHECK_EQUAL(query_int("PRAGMA user_version;"), 1);
+    BOOST_CHECK_EQUAL(query_int("SELECT count(*) FROM `Messages` WHERE "
+                                "typeof(`Hash`) = 'blob' AND "
+                                "length(`Hash`) = 64 AND "
+                                "typeof(`Owner`) = 'blob' AND "
+                                "length(`Owner`) = 32;"),
+                      2);
+    BOOST_CHECK_EQUAL(query_int("SELECT count(*) FROM `Messages` WHERE "
+                                "typeof(`Hash`) = 'text';"),
+                      1);
+    sqlite3_close(db);
+}
+
+BOOST_AUTO_TEST_CASE(it_selects_nothing_at_random_when_empty) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".");
+
+    std::mt19937_64 rng(42);
+    Item item;
+    BOOST_CHECK(!storage.retrieve_random(rng, item));
+}
+
+BOOST_AUTO_TEST_CASE(it_selects_every_message_at_random) {
+    StorageRAIIFixture fixture;
+
+    const auto pubkey = "mypubkey";
+    const auto bytes = "bytesasstring";
+    const auto nonce = "nonce";
+    const uint64_t ttl = 123456;
+    const uint64_t timestamp = util::get_time_ms();
+
+    constexpr size_t num_items = 10;
+    constexpr size_t num_samples = 10000;
+
+    Database storage(".");
+
+    for (size_t i = 0; i < num_items; ++i) {
+        BOOST_CHECK(storage.store(std::to_string(i), pubkey, bytes, ttl,
+                                  timestamp, nonce));
+    }
+
+    std::mt19937_64 rng(42);
+    std::map<std::string, size_t> counts;
+    for (size_t i = 0; i < num_samples; ++i) {
+        Item item;
+        BOOST_REQUIRE(storage.retrieve_random(rng, item));
+        counts[item.hash]++;
+    }
+
+    BOOST_CHECK_EQUAL(counts.size(), num_items);
+    // Expect ~1000 each; the bounds are many standard deviations wide
+    for (const auto& entry : counts) {
+        BOOST_CHECK_GT(entry.second, 800);
+        BOOST_CHECK_LT(entry.second, 1200);
     }
 }
 
 BOOST_AUTO_TEST_CASE(it_checks_the_retrieve_limit_works) {
     StorageRAIIFixture fixture;
 
-    boost::asio::io_context ioc;
-    Database storage(ioc, ".");
+    Database storage(".");
 
     const size_t num_entries = 100;
     for (size_t i = 0; i < num_entries; i++) {
@@ -380,4 +1101,814 @@ BOOST_AUTO_TEST_CASE(it_checks_the_retrieve_limit_works) {
     }
 }
 
+BOOST_AUTO_TEST_CASE(it_retrieves_into_a_reusable_buffer) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".");
+
+    const auto pubkey = "mypubkey";
+    // Embedded zeros and bytes that aren't valid text must survive too
+    const std::string binary("\0\xff\x01" "data", 7);
+    const uint64_t timestamp = util::get_time_ms();
+    for (int i = 0; i < 10; i++) {
+        const auto hash = std::string("hash") + std::to_string(i);
+        storage.store(hash, pubkey, binary + std::to_string(i), 100000 + i,
+                      timestamp + i, "nonce" + std::to_string(i));
+    }
+
+    std::vector<Item> items;
+    BOOST_CHECK(storage.retrieve(pubkey, items, "hash3"));
+    BOOST_REQUIRE_EQUAL(items.size(), 6);
+
+    RetrieveBuffer buffer;
+    BOOST_CHECK(storage.retrieve(pubkey, buffer, "hash3"));
+    BOOST_REQUIRE_EQUAL(buffer.size(), items.size());
+
+    size_t i = 0;
+    for (const auto view : buffer) {
+        BOOST_CHECK_EQUAL(view.hash, items[i].hash);
+        BOOST_CHECK_EQUAL(view.pub_key, items[i].pub_key);
+        BOOST_CHECK_EQUAL(view.timestamp, items[i].timestamp);
+        BOOST_CHECK_EQUAL(view.ttl, items[i].ttl);
+        BOOST_CHECK_EQUAL(view.expiration_timestamp,
+                          items[i].expiration_timestamp);
+        BOOST_CHECK_EQUAL(view.nonce, items[i].nonce);
+        BOOST_CHECK(view.data == items[i].data);
+        i++;
+    }
+    BOOST_CHECK_EQUAL(i, items.size());
+
+    // Subsequent retrieves append until the buffer is cleared
+    BOOST_CHECK(storage.retrieve(pubkey, buffer, "", 2));
+    BOOST_CHECK_EQUAL(buffer.size(), 8);
+    BOOST_CHECK_EQUAL(buffer[6].hash, "hash0");
+
+    buffer.clear();
+    BOOST_CHECK(buffer.empty());
+    BOOST_CHECK(storage.retrieve(pubkey, buffer, "hash8"));
+    BOOST_REQUIRE_EQUAL(buffer.size(), 1);
+    BOOST_CHECK_EQUAL(buffer[0].hash, "hash9");
+    BOOST_CHECK(buffer[0].data == binary + "9");
+}
+
+BOOST_AUTO_TEST_CASE(it_scans_all_messages_in_chunks) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".");
+
+    const size_t num_entries = 25;
+    for (size_t i = 0; i < num_entries; i++) {
+        const auto hash = std::string("hash") + std::to_string(i);
+        storage.store(hash, "pubkey" + std::to_string(i % 3), "data", 100000,
+                      util::get_time_ms(), "nonce");
+    }
+
+    auto cursor = storage.scan(10);
+    std::vector<Item> chunk;
+    std::vector<size_t> chunk_sizes;
+    std::vector<std::string> hashes;
+    while (true) {
+        BOOST_REQUIRE(cursor.next(chunk));
+        if (chunk.empty()) {
+            break;
+        }
+        chunk_sizes.push_back(chunk.size());
+        for (const auto& item : chunk) {
+            hashes.push_back(item.hash);
+        }
+
+        // Messages stored mid-scan after the current position are seen too
+        if (chunk_sizes.size() == 1) {
+            storage.store("late", "pubkey0", "data", 100000,
+                          util::get_time_ms(), "nonce");
+        }
+    }
+
+    std::vector<std::string> expected_hashes;
+    for (size_t i = 0; i < num_entries; i++) {
+        expected_hashes.push_back(std::string("hash") + std::to_string(i));
+    }
+    expected_hashes.push_back("late");
+    BOOST_CHECK_EQUAL_COLLECTIONS(hashes.begin(), hashes.end(),
+                                  expected_hashes.begin(),
+                                  expected_hashes.end());
+
+    const std::vector<size_t> expected_sizes = {10, 10, 6};
+    BOOST_CHECK_EQUAL_COLLECTIONS(chunk_sizes.begin(), chunk_sizes.end(),
+                                  expected_sizes.begin(),
+                                  expected_sizes.end());
+
+    // Exhausted cursors stay exhausted
+    BOOST_CHECK(cursor.next(chunk));
+    BOOST_CHECK(chunk.empty());
+}
+
+BOOST_AUTO_TEST_CASE(it_routes_messages_across_shards) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".", Database::DEFAULT_READER_COUNT, 4);
+    BOOST_CHECK_EQUAL(storage.get_shard_count(), 4);
+    for (int i = 1; i < 4; ++i) {
+        BOOST_CHECK(boost::filesystem::exists("storage-" + std::to_string(i) +
+                                              ".db"));
+    }
+
+    const size_t num_owners = 16;
+    const size_t per_owner = 5;
+    std::vector<Item> batch;
+    for (size_t i = 0; i < num_owners * per_owner; ++i) {
+        batch.push_back({"hash" + std::to_string(i),
+                         test_owner(i % num_owners), util::get_time_ms(),
+                         100000, util::get_time_ms() + 100000, "nonce",
+                         "data"});
+    }
+    // Stored again, so not new
+    batch.push_back(batch.front());
+
+    std::vector<bool> inserted;
+    BOOST_REQUIRE(storage.store_batch(batch, inserted));
+    BOOST_REQUIRE_EQUAL(inserted.size(), batch.size());
+    BOOST_CHECK(std::all_of(inserted.begin(), inserted.end() - 1,
+                            [](bool b) { return b; }));
+    BOOST_CHECK(!inserted.back());
+
+    for (size_t owner = 0; owner < num_owners; ++owner) {
+        std::vector<Item> items;
+        BOOST_REQUIRE(storage.retrieve(test_owner(owner), items, ""));
+        BOOST_REQUIRE_EQUAL(items.size(), per_owner);
+        for (size_t j = 0; j < per_owner; ++j) {
+            BOOST_CHECK_EQUAL(items[j].hash,
+                              "hash" + std::to_string(j * num_owners + owner));
+        }
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_owner_usage(test_owner(owner), usage));
+        BOOST_CHECK_EQUAL(usage.messages, per_owner);
+    }
+
+    Item item;
+    BOOST_CHECK(storage.retrieve_by_hash("hash42", item));
+    BOOST_CHECK_EQUAL(item.pub_key, test_owner(42 % num_owners));
+    BOOST_CHECK(!storage.retrieve_by_hash("nope", item));
+
+    Database::Usage usage;
+    BOOST_CHECK(storage.get_usage(usage));
+    BOOST_CHECK_EQUAL(usage.messages, num_owners * per_owner);
+    BOOST_CHECK_EQUAL(usage.owners, num_owners);
+
+    std::vector<Item> all;
+    BOOST_CHECK(storage.retrieve("", all, ""));
+    BOOST_CHECK_EQUAL(all.size(), num_owners * per_owner);
+
+    size_t scanned = 0;
+    auto cursor = storage.scan(7);
+    std::vector<Item> chunk;
+    while (cursor.next(chunk) && !chunk.empty()) {
+        scanned += chunk.size();
+    }
+    BOOST_CHECK_EQUAL(scanned, num_owners * per_owner);
+
+    // Every shard ends up with some of the owners
+    std::mt19937_64 rng(42);
+    std::set<std::string> picked;
+    for (int i = 0; i < 1000; ++i) {
+        BOOST_REQUIRE(storage.retrieve_random(rng, item));
+        picked.insert(item.hash);
+    }
+    BOOST_CHECK_EQUAL(picked.size(), num_owners * per_owner);
+}
+
+BOOST_AUTO_TEST_CASE(it_retrieves_for_many_pubkeys_at_once) {
+    StorageRAIIFixture fixture;
+
+    Database storage(".", Database::DEFAULT_READER_COUNT, 4);
+
+    const size_t num_owners = 8;
+    const size_t per_owner = 4;
+    std::vector<Item> batch;
+    for (size_t i = 0; i < num_owners * per_owner; ++i) {
+        batch.push_back({"hash" + std::to_string(i),
+                         test_owner(i % num_owners), util::get_time_ms(),
+                         100000, util::get_time_ms() + 100000, "nonce",
+                         "data" + std::to_string(i)});
+    }
+    BOOST_REQUIRE(storage.bulk_store(batch));
+
+    // Every owner, in an order unrelated to the shards, one of them twice,
+    // some after their first message, and one without any
+    std::vector<Database::RetrieveRequest> requests;
+    for (size_t owner = num_owners; owner-- > 0;) {
+        const auto last_hash =
+            owner % 2 ? "hash" + std::to_string(owner) : std::string();
+        requests.push_back({test_owner(owner), last_hash});
+    }
+    requests.push_back({test_owner(3), ""});
+    requests.push_back({test_owner(num_owners), ""});
+
+    RetrieveBuffer buffer;
+    // Whatever is in the buffer already is kept
+    BOOST_REQUIRE(storage.retrieve(test_owner(0), buffer, ""));
+    const size_t offset = buffer.size();
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    BOOST_REQUIRE(storage.retrieve_many(requests, buffer, ranges));
+    BOOST_REQUIRE_EQUAL(ranges.size(), requests.size());
+    BOOST_CHECK_EQUAL(buffer.size(), offset + num_owners * per_owner -
+                                         num_owners / 2 + per_owner);
+
+    for (size_t i = 0; i < requests.size(); ++i) {
+        std::vector<Item> expected;
+        BOOST_REQUIRE(storage.retrieve(requests[i].pub_key, expected,
+                                       requests[i].last_hash));
+        BOOST_REQUIRE_EQUAL(ranges[i].second - ranges[i].first,
+                            expected.size());
+        BOOST_CHECK_GE(ranges[i].first, offset);
+        for (size_t j = 0; j < expected.size(); ++j) {
+            const auto view = buffer[ranges[i].first + j];
+            BOOST_CHECK_EQUAL(view.hash, expected[j].hash);
+            BOOST_CHECK_EQUAL(view.pub_key, expected[j].pub_key);
+            BOOST_CHECK(view.data == expected[j].data);
+        }
+    }
+
+    // The limit applies to each request on its own
+    buffer.clear();
+    BOOST_REQUIRE(storage.retrieve_many(requests, buffer, ranges, 2));
+    for (size_t i = 0; i + 1 < requests.size(); ++i) {
+        BOOST_CHECK_EQUAL(ranges[i].second - ranges[i].first, 2);
+    }
+    BOOST_CHECK_EQUAL(ranges.back().second - ranges.back().first, 0);
+
+    buffer.clear();
+    BOOST_CHECK(storage.retrieve_many({}, buffer, ranges));
+    BOOST_CHECK(ranges.empty());
+    BOOST_CHECK(buffer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(it_redistributes_messages_when_the_shard_count_changes) {
+    StorageRAIIFixture fixture;
+
+    const size_t num_messages = 300;
+    const auto check_all_there = [&](Database& storage) {
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, num_messages);
+        for (size_t i = 0; i < num_messages; ++i) {
+            std::vector<Item> items;
+            BOOST_REQUIRE(storage.retrieve(test_owner(i % 10), items, ""));
+            BOOST_CHECK_EQUAL(items.size(), num_messages / 10);
+        }
+    };
+
+    {
+        Database storage(".");
+        for (size_t i = 0; i < num_messages; ++i) {
+            BOOST_REQUIRE(storage.store("hash" + std::to_string(i),
+                                        test_owner(i % 10), "data", 100000,
+                                        util::get_time_ms(), "nonce"));
+        }
+    }
+    {
+        Database storage(".", Database::DEFAULT_READER_COUNT, 3);
+        check_all_there(storage);
+    }
+    BOOST_CHECK(boost::filesystem::exists("storage-2.db"));
+    {
+        Database storage(".", Database::DEFAULT_READER_COUNT, 2);
+        check_all_there(storage);
+    }
+    BOOST_CHECK(!boost::filesystem::exists("storage-2.db"));
+    {
+        // Back to a single file, as before sharding
+        Database storage(".");
+        check_all_there(storage);
+    }
+    BOOST_CHECK(!boost::filesystem::exists("storage-1.db"));
+}
+
+BOOST_AUTO_TEST_CASE(it_stores_data_under_every_storage_profile) {
+    BOOST_CHECK_EQUAL(StorageProfile::from_name("durable").synchronous,
+                      "FULL");
+    BOOST_CHECK_THROW(StorageProfile::from_name("fast"), std::runtime_error);
+
+    for (const auto& name : {"durable", "balanced", "throughput"}) {
+        StorageRAIIFixture fixture;
+        const auto profile = StorageProfile::from_name(name);
+        BOOST_CHECK_EQUAL(profile.name, name);
+
+        {
+            Database storage(".", Database::DEFAULT_READER_COUNT, 2,
+                             profile);
+            for (size_t i = 0; i < 100; ++i) {
+                BOOST_REQUIRE(storage.store("hash" + std::to_string(i),
+                                            test_owner(i % 4), "data", 100000,
+                                            util::get_time_ms(), "nonce"));
+            }
+            // Long enough for a background checkpoint
+            std::this_thread::sleep_for(profile.checkpoint_interval +
+                                        std::chrono::milliseconds(100));
+            std::vector<Item> items;
+            BOOST_CHECK(storage.retrieve(test_owner(1), items, ""));
+            BOOST_CHECK_EQUAL(items.size(), 25);
+        }
+        Database storage(".", Database::DEFAULT_READER_COUNT, 2,
+                         profile);
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 100);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(it_copies_messages_to_another_node_with_a_snapshot) {
+    StorageRAIIFixture fixture;
+    const std::string replica_dir = "replica";
+    const std::string snapshot = "snapshot.db";
+    boost::filesystem::remove_all(replica_dir);
+    boost::filesystem::create_directory(replica_dir);
+
+    const uint64_t now = util::get_time_ms();
+
+    {
+        Database source(".", Database::DEFAULT_READER_COUNT, 2);
+        for (size_t i = 0; i < 120; ++i) {
+            BOOST_REQUIRE(source.store(client_hash(i), client_owner(i % 6),
+                                       "data", 100000, now, "nonce"));
+        }
+        // Expired, but not cleaned up yet
+        BOOST_REQUIRE(
+            source.store(client_hash(1000), client_owner(0), "data", 10,
+                         now - 1000, "nonce"));
+
+        uint64_t exported;
+        BOOST_REQUIRE(source.export_snapshot(snapshot, exported));
+        BOOST_CHECK_EQUAL(exported, 120);
+    }
+
+    Database replica(replica_dir, Database::DEFAULT_READER_COUNT, 3);
+    // Something we had before, and something we have already
+    BOOST_REQUIRE(replica.store(client_hash(1001), client_owner(0), "data",
+                                100000, now, "nonce"));
+    BOOST_REQUIRE(replica.store(client_hash(1), client_owner(1), "data",
+                                100000, now, "nonce"));
+
+    uint64_t imported;
+    BOOST_REQUIRE(replica.import_snapshot(snapshot, imported));
+    BOOST_CHECK_EQUAL(imported, 119);
+
+    Database::Usage usage;
+    BOOST_REQUIRE(replica.get_usage(usage));
+    BOOST_CHECK_EQUAL(usage.messages, 121);
+    BOOST_CHECK_EQUAL(usage.owners, 6);
+
+    // Imported messages follow ours in the order they were stored, and so
+    // do messages stored later
+    BOOST_REQUIRE(replica.store(client_hash(1002), client_owner(0), "data",
+                                100000, now, "nonce"));
+    std::vector<Item> items;
+    BOOST_REQUIRE(replica.retrieve(client_owner(0), items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 22);
+    BOOST_CHECK_EQUAL(items.front().hash, client_hash(1001));
+    for (size_t j = 0; j < 20; ++j) {
+        BOOST_CHECK_EQUAL(items[j + 1].hash, client_hash(6 * j));
+    }
+    BOOST_CHECK_EQUAL(items.back().hash, client_hash(1002));
+
+    boost::filesystem::remove(snapshot);
+    boost::filesystem::remove_all(replica_dir);
+}
+
+BOOST_AUTO_TEST_CASE(it_only_imports_what_a_client_could_have_stored) {
+    StorageRAIIFixture fixture;
+    const std::string replica_dir = "replica";
+    const std::string snapshot = "snapshot.db";
+    boost::filesystem::remove_all(replica_dir);
+    boost::filesystem::create_directory(replica_dir);
+
+    const uint64_t now = util::get_time_ms();
+    const uint64_t ttl = 100000;
+    {
+        Database source(".");
+        BOOST_REQUIRE(source.store(client_hash(0), client_owner(0), "data",
+                                   ttl, now, "nonce"));
+        uint64_t exported;
+        BOOST_REQUIRE(source.export_snapshot(snapshot, exported));
+    }
+
+    // Copies of it that no client could have stored, far along in rowid
+    const auto exec = [&](const std::string& query) {
+        sqlite3* db;
+        BOOST_REQUIRE_EQUAL(sqlite3_open(snapshot.c_str(), &db), SQLITE_OK);
+        BOOST_REQUIRE_EQUAL(
+            sqlite3_exec(db, query.c_str(), nullptr, nullptr, nullptr),
+            SQLITE_OK);
+        sqlite3_close(db);
+    };
+    int64_t rowid = int64_t{1} << 62;
+    const auto copy = [&](const std::string& hash, uint64_t ttl,
+                          const std::string& timestamp,
+                          const std::string& expires,
+                          const std::string& owner = "`Owner`",
+                          const std::string& data = "`Data`") {
+        exec("INSERT INTO `Messages` (rowid, `Owner`, `Hash`, `TTL`, "
+             "`Timestamp`, `TimeExpires`, `Nonce`, `Data`) SELECT " +
+             std::to_string(rowid++) + ", " + owner + ", " + hash + ", " +
+             std::to_string(ttl) + ", " + timestamp + ", " + expires +
+             ", `Nonce`, " + data + " FROM `Messages` WHERE rowid = 1;");
+    };
+    const auto blob = [](const std::string& hex) { return "X'" + hex + "'"; };
+    const uint64_t too_long = util::MAX_TTL_MS + 1;
+    copy(blob(client_hash(1)), too_long, "`Timestamp`",
+         "`Timestamp` + " + std::to_string(too_long));
+    copy(blob(client_hash(2)), ttl, std::to_string(now + 60000),
+         std::to_string(now + 60000 + ttl));
+    copy(blob(client_hash(3)), ttl, "`Timestamp`",
+         "`Timestamp` + " + std::to_string(util::MAX_TTL_MS * 10));
+    // Keys that would never match the ones we bind
+    copy("'" + client_hash(4) + "'", ttl, "`Timestamp`", "`TimeExpires`");
+    copy(blob(client_hash(5).substr(2)), ttl, "`Timestamp`",
+         "`TimeExpires`");
+    copy(blob(client_hash(6)), ttl, "`Timestamp`", "`TimeExpires`",
+         "'" + client_owner(0) + "'");
+    copy(blob(client_hash(7)), ttl, "`Timestamp`", "`TimeExpires`",
+         blob(client_owner(0) + "00"));
+    // More than a client could store
+    copy(blob(client_hash(8)), ttl, "`Timestamp`", "`TimeExpires`",
+         "`Owner`", "zeroblob(" + std::to_string(util::MAX_MESSAGE_BODY + 1) +
+                        ")");
+
+    Database replica(replica_dir);
+    uint64_t imported;
+    BOOST_REQUIRE(replica.import_snapshot(snapshot, imported));
+    BOOST_CHECK_EQUAL(imported, 1);
+
+    // Seqs follow on from the imported messages, not from their rowids
+    BOOST_REQUIRE(replica.store(client_hash(9), client_owner(0), "data", ttl,
+                                now, "nonce"));
+    std::vector<Item> items;
+    BOOST_REQUIRE(replica.retrieve(client_owner(0), items, ""));
+    BOOST_REQUIRE_EQUAL(items.size(), 2);
+    BOOST_CHECK_EQUAL(items[0].hash, client_hash(0));
+    BOOST_CHECK_EQUAL(items[1].hash, client_hash(9));
+
+    // Anything besides the messages table is refused
+    exec("CREATE VIEW `Everything` AS SELECT * FROM `Messages`;");
+    BOOST_CHECK(!replica.import_snapshot(snapshot, imported));
+    exec("DROP VIEW `Everything`;"
+         "ALTER TABLE `Messages` ADD COLUMN `Extra` INTEGER;");
+    BOOST_CHECK(!replica.import_snapshot(snapshot, imported));
+
+    // Snapshots are only read, so a missing one isn't created either
+    BOOST_CHECK(!replica.import_snapshot("missing.db", imported));
+    BOOST_CHECK(!boost::filesystem::exists("missing.db"));
+
+    boost::filesystem::remove(snapshot);
+    boost::filesystem::remove_all(replica_dir);
+}
+
+BOOST_AUTO_TEST_CASE(it_reports_values_once_they_expire) {
+    ExpiryWheel<int> wheel(0, 1000);
+    std::vector<int> due;
+    const auto advance = [&](uint64_t now_ms) {
+        due.clear();
+        wheel.advance(now_ms, due);
+        std::sort(due.begin(), due.end());
+        return due;
+    };
+
+    wheel.add(1, 500);
+    wheel.add(2, 1000);
+    wheel.add(3, 1001);
+    // In the second, third and last level
+    wheel.add(4, 70 * 1000);
+    wheel.add(5, 5000 * 1000);
+    wheel.add(6, uint64_t(20000000) * 1000);
+    // Beyond the last level
+    wheel.add(7, uint64_t(20000000) * 1000 * 1000);
+    BOOST_CHECK_EQUAL(wheel.size(), 7);
+
+    // Never early, at most a tick late
+    BOOST_CHECK(advance(999).empty());
+    BOOST_CHECK(advance(1000) == std::vector<int>({1, 2}));
+    BOOST_CHECK(advance(1999).empty());
+    BOOST_CHECK(advance(2000) == std::vector<int>({3}));
+    BOOST_CHECK(advance(69999).empty());
+    BOOST_CHECK(advance(70000) == std::vector<int>({4}));
+    BOOST_CHECK(advance(4999999).empty());
+    BOOST_CHECK(advance(5000000) == std::vector<int>({5}));
+    BOOST_CHECK(advance(uint64_t(20000000) * 1000 - 1).empty());
+    BOOST_CHECK(advance(uint64_t(20000000) * 1000) == std::vector<int>({6}));
+    BOOST_CHECK(advance(uint64_t(20000000) * 1000 * 1000) ==
+                std::vector<int>({7}));
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+
+    // Already expired when added
+    wheel.add(8, 0);
+    BOOST_CHECK(advance(uint64_t(20000000) * 1000 * 1000) ==
+                std::vector<int>({8}));
+
+    wheel.add(9, uint64_t(30000000) * 1000 * 1000);
+    wheel.clear();
+    BOOST_CHECK_EQUAL(wheel.size(), 0);
+    BOOST_CHECK(advance(uint64_t(30000000) * 1000 * 1000).empty());
+}
+
+BOOST_AUTO_TEST_CASE(it_filters_hashes_by_expiry_window) {
+    const uint64_t window = 1000;
+    DuplicateFilter filter(DuplicateFilter::DEFAULT_BITS_PER_WINDOW, window);
+
+    filter.add("early", 1500);
+    filter.add("late", 3500);
+    BOOST_CHECK_EQUAL(filter.window_count(), 2);
+    BOOST_CHECK(filter.maybe_contains("early", 1500));
+    BOOST_CHECK(filter.maybe_contains("late", 3500));
+    // Copies expire at the same time, other windows are not looked at
+    BOOST_CHECK(!filter.maybe_contains("early", 3500));
+    BOOST_CHECK(!filter.maybe_contains("other", 1500));
+
+    filter.remove_expired(2000);
+    BOOST_CHECK_EQUAL(filter.window_count(), 1);
+    BOOST_CHECK(!filter.maybe_contains("early", 1500));
+    BOOST_CHECK(filter.maybe_contains("late", 3500));
+
+    filter.clear();
+    BOOST_CHECK_EQUAL(filter.window_count(), 0);
+    BOOST_CHECK(!filter.maybe_contains("late", 3500));
+
+    // Far too small for what's in it, but still never misses one
+    DuplicateFilter tiny(64, window);
+    for (int i = 0; i < 100; ++i) {
+        tiny.add("hash" + std::to_string(i), 1500);
+    }
+    int reported = 0;
+    for (int i = 0; i < 100; ++i) {
+        BOOST_CHECK(tiny.maybe_contains("hash" + std::to_string(i), 1500));
+        reported += tiny.maybe_contains("new" + std::to_string(i), 1500);
+    }
+    BOOST_CHECK_GT(reported, 50);
+}
+
+BOOST_AUTO_TEST_CASE(it_rejects_duplicates_before_storing) {
+    StorageRAIIFixture fixture;
+
+    const auto make_batch = [](size_t first, size_t count) {
+        std::vector<Item> batch;
+        const uint64_t now = util::get_time_ms();
+        for (size_t i = first; i < first + count; ++i) {
+            batch.push_back({"hash" + std::to_string(i), test_owner(i % 5),
+                             now, 100000, now + 100000, "nonce", "data"});
+        }
+        return batch;
+    };
+
+    {
+        Database storage(".", Database::DEFAULT_READER_COUNT, 2);
+        std::vector<bool> inserted;
+        BOOST_REQUIRE(storage.store_batch(make_batch(0, 50), inserted));
+        auto stats = storage.get_duplicate_stats();
+        BOOST_CHECK_EQUAL(stats.checked, 50);
+        BOOST_CHECK_EQUAL(stats.rejected, 0);
+
+        // Half of them stored already
+        BOOST_REQUIRE(storage.store_batch(make_batch(25, 50), inserted));
+        BOOST_REQUIRE_EQUAL(inserted.size(), 50);
+        for (size_t i = 0; i < 50; ++i) {
+            BOOST_CHECK_EQUAL(inserted[i], i >= 25);
+        }
+        stats = storage.get_duplicate_stats();
+        BOOST_CHECK_EQUAL(stats.checked, 100);
+        BOOST_CHECK_EQUAL(stats.rejected, 25);
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 75);
+    }
+    {
+        // The filter is filled from the database when opened
+        Database storage(".", Database::DEFAULT_READER_COUNT, 2);
+        BOOST_REQUIRE(storage.bulk_store(make_batch(0, 80)));
+        const auto stats = storage.get_duplicate_stats();
+        BOOST_CHECK_EQUAL(stats.checked, 80);
+        BOOST_CHECK_EQUAL(stats.rejected, 75);
+
+        Database::Usage usage;
+        BOOST_CHECK(storage.get_usage(usage));
+        BOOST_CHECK_EQUAL(usage.messages, 80);
+        std::vector<Item> items;
+        BOOST_CHECK(storage.retrieve(test_owner(2), items, ""));
+        BOOST_CHECK_EQUAL(items.size(), 16);
+    }
+}
+
+static Item make_cache_item(const std::string& hash, const std::string& owner,
+                            uint64_t expires = UINT64_MAX) {
+    return {hash, owner, 0, expires, expires, "nonce", "data"};
+}
+
+static std::vector<std::string> cached_hashes(RetrieveCache& cache,
+                                              const std::string& owner,
+                                              const std::string& last_hash,
+                                              bool& hit, size_t limit = 10,
+                                              uint64_t now_ms = 0) {
+    RetrieveBuffer buffer;
+    hit = cache.retrieve(owner, last_hash, limit, now_ms, buffer);
+    std::vector<std::string> hashes;
+    for (const auto item : buffer) {
+        hashes.emplace_back(item.hash);
+    }
+    return hashes;
+}
+
+BOOST_AUTO_TEST_CASE(it_answers_polls_from_the_retrieve_cache) {
+    RetrieveCache cache;
+    bool hit;
+
+    // Unknown owners are always a miss
+    cached_hashes(cache, "alice", "", hit);
+    BOOST_CHECK(!hit);
+
+    // Only the newest messages, so polls after them can be answered, but
+    // not a poll for everything
+    cache.fill("alice",
+               {make_cache_item("a1", "alice"), make_cache_item("a2", "alice")},
+               false, cache.version());
+    cached_hashes(cache, "alice", "", hit);
+    BOOST_CHECK(!hit);
+    cached_hashes(cache, "alice", "a0", hit);
+    BOOST_CHECK(!hit);
+    BOOST_CHECK(cached_hashes(cache, "alice", "a2", hit).empty());
+    BOOST_CHECK(hit);
+
+    cache.add(make_cache_item("a3", "alice"));
+    cache.add(make_cache_item("a4", "alice"));
+    // Not cached, so nothing to extend
+    cache.add(make_cache_item("b1", "bob"));
+
+    auto hashes = cached_hashes(cache, "alice", "a1", hit);
+    BOOST_CHECK(hit);
+    std::vector<std::string> expected = {"a2", "a3", "a4"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(hashes.begin(), hashes.end(),
+                                  expected.begin(), expected.end());
+
+    hashes = cached_hashes(cache, "alice", "a1", hit, 2);
+    expected = {"a2", "a3"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(hashes.begin(), hashes.end(),
+                                  expected.begin(), expected.end());
+
+    cached_hashes(cache, "bob", "", hit);
+    BOOST_CHECK(!hit);
+
+    // Owners with no messages at all
+    cache.fill("carol", {}, true, cache.version());
+    BOOST_CHECK(cached_hashes(cache, "carol", "", hit).empty());
+    BOOST_CHECK(hit);
+
+    cache.invalidate("alice");
+    cached_hashes(cache, "alice", "a4", hit);
+    BOOST_CHECK(!hit);
+
+    const auto stats = cache.get_stats();
+    BOOST_CHECK_EQUAL(stats.hits, 4);
+    BOOST_CHECK_EQUAL(stats.misses, 5);
+    BOOST_CHECK_EQUAL(stats.owners, 1);
+    BOOST_CHECK_EQUAL(stats.messages, 0);
+}
+
+BOOST_AUTO_TEST_CASE(it_keeps_the_retrieve_cache_coherent) {
+    RetrieveCache cache;
+    bool hit;
+
+    // A message stored for the owner while the database was being read
+    // might be missing from what was read, so that can't be cached...
+    auto version = cache.version();
+    cache.add(make_cache_item("a0", "alice"));
+    cache.fill("alice", {make_cache_item("a1", "alice")}, true, version);
+    cached_hashes(cache, "alice", "a1", hit);
+    BOOST_CHECK(!hit);
+
+    version = cache.version();
+    cache.invalidate("alice");
+    cache.fill("alice", {make_cache_item("a1", "alice")}, true, version);
+    cached_hashes(cache, "alice", "a1", hit);
+    BOOST_CHECK(!hit);
+
+    version = cache.version();
+    cache.clear();
+    cache.fill("alice", {make_cache_item("a1", "alice")}, true, version);
+    cached_hashes(cache, "alice", "a1", hit);
+    BOOST_CHECK(!hit);
+
+    // ... but messages stored for other owners don't matter
+    version = cache.version();
+    cache.add(make_cache_item("b1", "bob"));
+    cache.invalidate("carol");
+    cache.fill("alice", {make_cache_item("a1", "alice")}, true, version);
+    cached_hashes(cache, "alice", "a1", hit);
+    BOOST_CHECK(hit);
+
+    // Nor do they once too many owners were written to remember them all,
+    // except for fills read before that
+    version = cache.version();
+    for (size_t i = 0; i <= RetrieveCache::MAX_WRITTEN_OWNERS; ++i) {
+        cache.invalidate("owner" + std::to_string(i));
+    }
+    cache.fill("dave", {make_cache_item("d1", "dave")}, true, version);
+    cached_hashes(cache, "dave", "d1", hit);
+    BOOST_CHECK(!hit);
+    version = cache.version();
+    cache.add(make_cache_item("b2", "bob"));
+    cache.fill("dave", {make_cache_item("d1", "dave")}, true, version);
+    cached_hashes(cache, "dave", "d1", hit);
+    BOOST_CHECK(hit);
+    cache.invalidate("dave");
+
+    // ... while one that the read did see is not added twice
+    cache.fill("alice",
+               {make_cache_item("a1", "alice"), make_cache_item("a2", "alice")},
+               true, cache.version());
+    cache.add(make_cache_item("a2", "alice"));
+    auto hashes = cached_hashes(cache, "alice", "", hit);
+    BOOST_CHECK(hit);
+    std::vector<std::string> expected = {"a1", "a2"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(hashes.begin(), hashes.end(),
+                                  expected.begin(), expected.end());
+
+    // Expired messages are never returned
+    cache.fill("alice",
+               {make_cache_item("a1", "alice", 100),
+                make_cache_item("a2", "alice", 200),
+                make_cache_item("a3", "alice", 300)},
+               true, cache.version());
+    hashes = cached_hashes(cache, "alice", "", hit, 10, 200);
+    BOOST_CHECK(hit);
+    expected = {"a3"};
+    BOOST_CHECK_EQUAL_COLLECTIONS(hashes.begin(), hashes.end(),
+                                  expected.begin(), expected.end());
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 1);
+
+    // Only the newest messages are kept for an owner
+    for (size_t i = 0; i < RetrieveCache::MAX_MESSAGES_PER_OWNER; ++i) {
+        cache.add(make_cache_item("n" + std::to_string(i), "alice"));
+    }
+    cached_hashes(cache, "alice", "", hit);
+    BOOST_CHECK(!hit);
+    hashes = cached_hashes(cache, "alice", "n0", hit, 1);
+    BOOST_CHECK(hit);
+    BOOST_REQUIRE_EQUAL(hashes.size(), 1);
+    BOOST_CHECK_EQUAL(hashes[0], "n1");
+    BOOST_CHECK_EQUAL(cache.get_stats().messages,
+                      RetrieveCache::MAX_MESSAGES_PER_OWNER);
+}
+
+BOOST_AUTO_TEST_CASE(it_drops_expired_messages_from_the_retrieve_cache) {
+    RetrieveCache cache;
+
+    cache.fill("alice",
+               {make_cache_item("a1", "alice", 3000),
+                make_cache_item("a2", "alice", 1000),
+                make_cache_item("a3", "alice", 5000)},
+               true, cache.version());
+    cache.fill("bob", {make_cache_item("b1", "bob")}, true, cache.version());
+    cache.add(make_cache_item("a4", "alice", 2000));
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 5);
+
+    cache.remove_expired(999);
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 5);
+    cache.remove_expired(1000);
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 4);
+    cache.remove_expired(3000);
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 2);
+
+    // Reports for an owner that is gone are ignored
+    cache.invalidate("alice");
+    cache.remove_expired(5000);
+    BOOST_CHECK_EQUAL(cache.get_stats().messages, 1);
+    bool hit;
+    const auto hashes = cached_hashes(cache, "bob", "", hit, 10, 5000);
+    BOOST_CHECK(hit);
+    BOOST_CHECK_EQUAL(hashes.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(it_evicts_least_recently_polled_owners) {
+    RetrieveCache cache(4096);
+    bool hit;
+
+    for (int i = 0; i < 100; ++i) {
+        const auto owner = "owner" + std::to_string(i);
+        cache.fill(owner, {make_cache_item("h" + std::to_string(i), owner)},
+                   true, cache.version());
+        // Keep the first owner in use
+        cached_hashes(cache, "owner0", "", hit);
+        BOOST_CHECK(hit);
+    }
+
+    const auto stats = cache.get_stats();
+    BOOST_CHECK_LE(stats.bytes, 4096);
+    BOOST_CHECK_LT(stats.owners, 100);
+    BOOST_CHECK_GT(stats.owners, 1);
+    cached_hashes(cache, "owner1", "", hit);
+    BOOST_CHECK(!hit);
+    cached_hashes(cache, "owner99", "", hit);
+    BOOST_CHECK(hit);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace util {
+
+/// Vector instructions the codecs below may use. The best the CPU supports
+/// is picked on first use; every level gives the same results.
+enum class SimdLevel { Scalar, SSSE3, AVX2 };
+
+SimdLevel simd_level();
+
+// Use at most `level` (and no more than the CPU supports) from now on and
+// return the level used, for tests and benchmarks
+SimdLevel set_simd_level(SimdLevel level);
+
+// Write the `2 * len` lowercase hex digits of `in` to `out`
+void hex_encode(const uint8_t* in, size_t len, char* out);
+
+// Write the `len / 2` bytes encoded by the `len` hex digits `in` to `out`.
+// Return false if `len` is odd or `in` has anything but hex digits (or
+// uppercase ones if `lowercase_only`), `out` is undefined then.
+bool hex_decode(const char* in, size_t len, uint8_t* out,
+                bool lowercase_only = false);
+
+constexpr size_t base64_encoded_size(size_t len) { return (len + 2) / 3 * 4; }
+
+// Enough for any `len` characters
+constexpr size_t base64_decoded_size(size_t len) { return (len + 3) / 4 * 3; }
+
+// Write the padded base64 of `in` to `out`, return its size
+size_t base64_encode(const uint8_t* in, size_t len, char* out);
+
+// Decode the base64 `in` up to its padding or the first character that
+// isn't base64 (as beast does), return the number of bytes written
+size_t base64_decode(const char* in, size_t len, uint8_t* out);
+
+constexpr size_t base32z_encoded_size(size_t len) { return (len * 8 + 4) / 5; }
+
+// Write the (unpadded) z-base-32 of `in` to `out`
+void base32z_encode(const uint8_t* in, size_t len, char* out);
+
+// Decode the z-base-32 `in` into exactly `out_len` bytes. Return false if
+// `len` is not the encoded size of that or `in` isn't z-base-32.
+bool base32z_decode(const char* in, size_t len, uint8_t* out, size_t out_len);
+
+} // namespace util
@@ -1,15 +1,36 @@
 #pragma once
 
+#include "encoding.hpp"
+
 #include <algorithm>
 #include <random>
 #include <stdint.h>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 #include <array>
 
 namespace util {
 
+// Time to live bounds `validateTTL` enforces, in milliseconds
+constexpr uint64_t MIN_TTL_MS = 10 * 1000;
+constexpr uint64_t MAX_TTL_MS = 96 * 60 * 60 * 1000;
+// How far in the future `validateTimestamp` accepts timestamps
+constexpr uint64_t TIMESTAMP_TOLERANCE_MS = 10000;
+
+// Largest message body a client can store, in bytes.
+// Note: on the client side the limit is different
+// as it is not encrypted/encoded there yet.
+// The choice is somewhat arbitrary but it roughly
+// corresponds to the client-side limit of 2000 chars
+// of unencrypted message body in our experiments
+// (rounded up)
+constexpr size_t MAX_MESSAGE_BODY = 3100;
+// Bytes of the SHA512 digest that identifies a message (hex encoded in the
+// API)
+constexpr size_t MESSAGE_HASH_SIZE = 64;
+
 bool validateTTL(uint64_t ttlInt);
 // Convert ttl string into uint64_t, return bool for success/fail
 bool parseTTL(const std::string& ttlString, uint64_t& ttl);
@@ -22,118 +43,42 @@ bool parseTimestamp(const std::string& timestampString, const uint64_t ttl,
 // Get current time in milliseconds
 uint64_t get_time_ms();
 
-// adapted from Arqmanet llarp/encode.hpp
-// from  https://en.wikipedia.org/wiki/Base32#z-base-32
-static const char zbase32_alpha[] = {'y', 'b', 'n', 'd', 'r', 'f', 'g', '8',
-                                     'e', 'j', 'k', 'm', 'c', 'p', 'q', 'x',
-                                     'o', 't', '1', 'u', 'w', 'i', 's', 'z',
-                                     'a', '3', '4', '5', 'h', '7', '6', '9'};
-
-static const std::unordered_map<char, uint8_t> zbase32_reverse_alpha = {
-    {'y', 0},  {'b', 1},  {'n', 2},  {'d', 3},  {'r', 4},  {'f', 5},  {'g', 6},
-    {'8', 7},  {'e', 8},  {'j', 9},  {'k', 10}, {'m', 11}, {'c', 12}, {'p', 13},
-    {'q', 14}, {'x', 15}, {'o', 16}, {'t', 17}, {'1', 18}, {'u', 19}, {'w', 20},
-    {'i', 21}, {'s', 22}, {'z', 23}, {'a', 24}, {'3', 25}, {'4', 26}, {'5', 27},
-    {'h', 28}, {'7', 29}, {'6', 30}, {'9', 31}};
-
 std::string base64_decode(std::string const& data);
 std::string base64_encode(std::string const& s);
 
-/// adapted from i2pd
+// Write the z-base-32 of `value` to `stack` with a terminating null, return
+// it or nullptr if it doesn't fit
 template <typename Container, typename stack_t>
 const char* base32z_encode(const Container& value, stack_t& stack) {
-    size_t ret = 0, pos = 1;
-    uint32_t bits = 8, tmp = value[0];
-    size_t len = value.size();
-    while (ret < sizeof(stack) && (bits > 0 || pos < len)) {
-        if (bits < 5) {
-            if (pos < len) {
-                tmp <<= 8;
-                tmp |= value[pos] & 0xFF;
-                pos++;
-                bits += 8;
-            } else // last byte
-            {
-                tmp <<= (5 - bits);
-                bits = 5;
-            }
-        }
-
-        bits -= 5;
-        int ind = (tmp >> bits) & 0x1F;
-        if (ret < sizeof(stack)) {
-            stack[ret] = zbase32_alpha[ind];
-            ret++;
-        } else
-            return nullptr;
+    const size_t size = base32z_encoded_size(value.size());
+    if (size >= sizeof(stack)) {
+        return nullptr;
     }
+    base32z_encode(reinterpret_cast<const uint8_t*>(value.data()),
+                   value.size(), &stack[0]);
+    stack[size] = '\0';
     return &stack[0];
 }
 
-template <int a, int b>
-static size_t decode_size(size_t sz) {
-    auto d = div(sz, a);
-    if (d.rem)
-        d.quot++;
-    return b * d.quot;
-}
-
-static size_t base32_decode_size(size_t sz) { return decode_size<5, 8>(sz); }
-
+// Decode the z-base-32 `stack` into all of `value`
 template <typename Stack, typename V>
 bool base32z_decode(const Stack& stack, V& value) {
-    int tmp = 0, bits = 0;
-    size_t ret = 0;
-    size_t len = base32_decode_size(value.size());
-    size_t outLen = value.size();
-    for (size_t i = 0; i < len; i++) {
-        char ch = stack[i];
-        if (ch) {
-            auto itr = zbase32_reverse_alpha.find(ch);
-            if (itr == zbase32_reverse_alpha.end())
-                return false;
-            ch = itr->second;
-        } else {
-            return ret == outLen;
-        }
-        tmp |= ch;
-        bits += 5;
-        if (bits >= 8) {
-            if (ret >= outLen)
-                return false;
-            value[ret] = tmp >> (bits - 8);
-            bits -= 8;
-            ret++;
-        }
-        tmp <<= 5;
-    }
-    return true;
+    const std::string_view str(stack);
+    return base32z_decode(str.data(), str.size(),
+                          reinterpret_cast<uint8_t*>(value.data()),
+                          value.size());
 }
 
 std::string hex_to_base32z(const std::string& src);
 
 std::string hex_to_bytes(const std::string &hex);
 
-template <typename It>
-std::string as_hex(It begin, It end) {
-  constexpr std::array<char, 16> lut{{'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'}};
-  std::string hex;
-  using std::distance;
-  hex.reserve(distance(begin, end) * 2);
-  while (begin != end) {
-    char c = *begin;
-    hex += lut[(c & 0xf0) >> 4];
-    hex += lut[c & 0x0f];
-    ++begin;
-  }
-  return hex;
-}
-
-template <typename String>
-inline std::string as_hex(const String &s) {
-  using std::begin;
-  using std::end;
-  return as_hex(begin(s), end(s));
+template <typename Container>
+std::string as_hex(const Container& bytes) {
+    std::string hex(2 * bytes.size(), '\0');
+    hex_encode(reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size(),
+               &hex[0]);
+    return hex;
 }
 
 uint64_t uniform_distribution_portable(uint64_t n);
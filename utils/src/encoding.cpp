@@ -0,0 +1,586 @@
+#include "encoding.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UTIL_X86_SIMD
+#include <immintrin.h>
+#define TARGET_SSSE3 __attribute__((target("ssse3")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace util {
+
+namespace {
+
+constexpr char HEX_ALPHA[] = "0123456789abcdef";
+
+constexpr char BASE64_ALPHA[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// https://en.wikipedia.org/wiki/Base32#z-base-32
+constexpr char ZBASE32_ALPHA[] = "ybndrfg8ejkmcpqxot1uwisza345h769";
+
+// Value of every char in `alphabet`, -1 for the others
+template <size_t N>
+constexpr std::array<int8_t, 256> reverse_table(const char (&alphabet)[N]) {
+    std::array<int8_t, 256> table{};
+    for (auto& value : table) {
+        value = -1;
+    }
+    for (size_t i = 0; i + 1 < N; ++i) {
+        table[static_cast<uint8_t>(alphabet[i])] = static_cast<int8_t>(i);
+    }
+    return table;
+}
+
+constexpr auto BASE64_REVERSE = reverse_table(BASE64_ALPHA);
+constexpr auto ZBASE32_REVERSE = reverse_table(ZBASE32_ALPHA);
+
+SimdLevel detect_simd_level() {
+#ifdef UTIL_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return SimdLevel::SSSE3;
+    }
+#endif
+    return SimdLevel::Scalar;
+}
+
+SimdLevel supported_simd_level() {
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+std::atomic<SimdLevel>& active_simd_level() {
+    static std::atomic<SimdLevel> level{supported_simd_level()};
+    return level;
+}
+
+// The scalar versions do everything the vector ones (which only handle
+// whole blocks of valid input) leave over
+
+void hex_encode_scalar(const uint8_t* in, size_t len, char* out) {
+    for (size_t i = 0; i < len; ++i) {
+        out[2 * i] = HEX_ALPHA[in[i] >> 4];
+        out[2 * i + 1] = HEX_ALPHA[in[i] & 0xf];
+    }
+}
+
+int hex_nibble(char c, bool lowercase_only) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (!lowercase_only && c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool hex_decode_scalar(const char* in, size_t len, uint8_t* out,
+                       bool lowercase_only) {
+    for (size_t i = 0; i < len; i += 2) {
+        const int high = hex_nibble(in[i], lowercase_only);
+        const int low = hex_nibble(in[i + 1], lowercase_only);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        out[i / 2] = static_cast<uint8_t>(high << 4 | low);
+    }
+    return true;
+}
+
+size_t base64_encode_scalar(const uint8_t* in, size_t len, char* out) {
+    char* const start = out;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        const uint32_t group = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        *out++ = BASE64_ALPHA[group >> 18];
+        *out++ = BASE64_ALPHA[group >> 12 & 0x3f];
+        *out++ = BASE64_ALPHA[group >> 6 & 0x3f];
+        *out++ = BASE64_ALPHA[group & 0x3f];
+    }
+    if (i < len) {
+        const bool two = i + 1 < len;
+        const uint32_t group = in[i] << 16 | (two ? in[i + 1] << 8 : 0);
+        *out++ = BASE64_ALPHA[group >> 18];
+        *out++ = BASE64_ALPHA[group >> 12 & 0x3f];
+        *out++ = two ? BASE64_ALPHA[group >> 6 & 0x3f] : '=';
+        *out++ = '=';
+    }
+    return out - start;
+}
+
+size_t base64_decode_scalar(const char* in, size_t len, uint8_t* out) {
+    uint8_t* const start = out;
+    uint32_t group = 0;
+    int chars = 0;
+    for (size_t i = 0; i < len; ++i) {
+        // Padding stops it like any other character
+        const int8_t value = BASE64_REVERSE[static_cast<uint8_t>(in[i])];
+        if (value < 0) {
+            break;
+        }
+        group = group << 6 | value;
+        if (++chars == 4) {
+            *out++ = static_cast<uint8_t>(group >> 16);
+            *out++ = static_cast<uint8_t>(group >> 8);
+            *out++ = static_cast<uint8_t>(group);
+            group = 0;
+            chars = 0;
+        }
+    }
+    // A partial group of n characters gives n - 1 bytes
+    if (chars >= 2) {
+        group <<= 6 * (4 - chars);
+        *out++ = static_cast<uint8_t>(group >> 16);
+        if (chars == 3) {
+            *out++ = static_cast<uint8_t>(group >> 8);
+        }
+    }
+    return out - start;
+}
+
+#ifdef UTIL_X86_SIMD
+
+// Each returns how much of `in` it handled
+
+TARGET_SSSE3 size_t hex_encode_ssse3(const uint8_t* in, size_t len,
+                                     char* out) {
+    const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i*>(HEX_ALPHA));
+    const __m128i low_mask = _mm_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        const __m128i bytes =
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        const __m128i high = _mm_shuffle_epi8(
+            lut, _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask));
+        const __m128i low = _mm_shuffle_epi8(lut, _mm_and_si128(bytes, low_mask));
+        auto dest = reinterpret_cast<__m128i*>(out + 2 * i);
+        _mm_storeu_si128(dest, _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128(dest + 1, _mm_unpackhi_epi8(high, low));
+    }
+    return i;
+}
+
+TARGET_AVX2 size_t hex_encode_avx2(const uint8_t* in, size_t len, char* out) {
+    const __m256i lut = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(HEX_ALPHA)));
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        const __m256i bytes =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i high = _mm256_shuffle_epi8(
+            lut, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_mask));
+        const __m256i low =
+            _mm256_shuffle_epi8(lut, _mm256_and_si256(bytes, low_mask));
+        // Interleaving works within 128-bit lanes, so the halves come out
+        // as bytes 0-7, 16-23 and 8-15, 24-31
+        const __m256i first = _mm256_unpacklo_epi8(high, low);
+        const __m256i second = _mm256_unpackhi_epi8(high, low);
+        auto dest = reinterpret_cast<__m256i*>(out + 2 * i);
+        _mm256_storeu_si256(dest, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256(dest + 1,
+                            _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    return i;
+}
+
+// Nibble values of 16 hex digits, and whether they all are
+TARGET_SSSE3 __m128i hex_nibbles_ssse3(__m128i chars, bool lowercase_only,
+                                       int& valid_mask) {
+    const __m128i digit = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+    const __m128i is_digit =
+        _mm_cmpeq_epi8(_mm_subs_epu8(digit, _mm_set1_epi8(9)), _mm_setzero_si128());
+    const __m128i letters =
+        lowercase_only ? chars : _mm_or_si128(chars, _mm_set1_epi8(0x20));
+    const __m128i letter = _mm_sub_epi8(letters, _mm_set1_epi8('a'));
+    const __m128i is_letter = _mm_cmpeq_epi8(
+        _mm_subs_epu8(letter, _mm_set1_epi8(5)), _mm_setzero_si128());
+    valid_mask = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+    return _mm_or_si128(
+        _mm_and_si128(is_digit, digit),
+        _mm_and_si128(is_letter, _mm_add_epi8(letter, _mm_set1_epi8(10))));
+}
+
+TARGET_SSSE3 size_t hex_decode_ssse3(const char* in, size_t len, uint8_t* out,
+                                     bool lowercase_only) {
+    // Pairs of nibbles to bytes: high * 16 + low
+    const __m128i weights = _mm_set1_epi16(0x0110);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        int valid_first, valid_second;
+        const __m128i first = hex_nibbles_ssse3(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)),
+            lowercase_only, valid_first);
+        const __m128i second = hex_nibbles_ssse3(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 16)),
+            lowercase_only, valid_second);
+        if ((valid_first & valid_second) != 0xffff) {
+            break;
+        }
+        const __m128i bytes =
+            _mm_packus_epi16(_mm_maddubs_epi16(first, weights),
+                             _mm_maddubs_epi16(second, weights));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i / 2), bytes);
+    }
+    return i;
+}
+
+TARGET_AVX2 __m256i hex_nibbles_avx2(__m256i chars, bool lowercase_only,
+                                     uint32_t& valid_mask) {
+    const __m256i digit = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+    const __m256i is_digit = _mm256_cmpeq_epi8(
+        _mm256_subs_epu8(digit, _mm256_set1_epi8(9)), _mm256_setzero_si256());
+    const __m256i letters =
+        lowercase_only ? chars : _mm256_or_si256(chars, _mm256_set1_epi8(0x20));
+    const __m256i letter = _mm256_sub_epi8(letters, _mm256_set1_epi8('a'));
+    const __m256i is_letter = _mm256_cmpeq_epi8(
+        _mm256_subs_epu8(letter, _mm256_set1_epi8(5)), _mm256_setzero_si256());
+    valid_mask = static_cast<uint32_t>(
+        _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)));
+    return _mm256_or_si256(
+        _mm256_and_si256(is_digit, digit),
+        _mm256_and_si256(is_letter,
+                         _mm256_add_epi8(letter, _mm256_set1_epi8(10))));
+}
+
+TARGET_AVX2 size_t hex_decode_avx2(const char* in, size_t len, uint8_t* out,
+                                   bool lowercase_only) {
+    const __m256i weights = _mm256_set1_epi16(0x0110);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint32_t valid_first, valid_second;
+        const __m256i first = hex_nibbles_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)),
+            lowercase_only, valid_first);
+        const __m256i second = hex_nibbles_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i + 32)),
+            lowercase_only, valid_second);
+        if ((valid_first & valid_second) != 0xffffffff) {
+            break;
+        }
+        // Packing works within 128-bit lanes, which leaves the quarters in
+        // the order 0, 2, 1, 3
+        const __m256i bytes =
+            _mm256_packus_epi16(_mm256_maddubs_epi16(first, weights),
+                                _mm256_maddubs_epi16(second, weights));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i / 2),
+                            _mm256_permute4x64_epi64(bytes, 0xd8));
+    }
+    return i;
+}
+
+// Base64 of the 12 bytes at the front of `bytes`, after Muła and Lemire,
+// "Faster Base64 Encoding and Decoding Using AVX2 Instructions"
+TARGET_SSSE3 __m128i base64_encode_block_ssse3(__m128i bytes) {
+    // Every 3 bytes to a 32-bit lane as bytes 1, 0, 2, 1
+    const __m128i in = _mm_shuffle_epi8(
+        bytes, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+    // And the 4 sextets in it to a byte each
+    const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+    const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+    const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+    const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+    const __m128i sextets = _mm_or_si128(t1, t3);
+
+    // Offset to the character for each range of sextets: 0-25 to 13, 26-51
+    // to 0, 52-61 to 1-10, 62 to 11 and 63 to 12
+    __m128i range = _mm_subs_epu8(sextets, _mm_set1_epi8(51));
+    const __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(26), sextets);
+    range = _mm_or_si128(range, _mm_and_si128(upper, _mm_set1_epi8(13)));
+    const __m128i offsets = _mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    return _mm_add_epi8(sextets, _mm_shuffle_epi8(offsets, range));
+}
+
+TARGET_SSSE3 size_t base64_encode_ssse3(const uint8_t* in, size_t len,
+                                        char* out) {
+    size_t i = 0;
+    // 16 bytes are loaded for every 12 encoded
+    for (; i + 16 <= len; i += 12) {
+        const __m128i chars = base64_encode_block_ssse3(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i / 3 * 4), chars);
+    }
+    return i;
+}
+
+TARGET_AVX2 __m256i base64_encode_block_avx2(__m256i bytes) {
+    const __m256i in = _mm256_shuffle_epi8(
+        bytes, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0,
+                               1, 10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2,
+                               0, 1));
+    const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    const __m256i sextets = _mm256_or_si256(t1, t3);
+
+    __m256i range = _mm256_subs_epu8(sextets, _mm256_set1_epi8(51));
+    const __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), sextets);
+    range = _mm256_or_si256(range, _mm256_and_si256(upper, _mm256_set1_epi8(13)));
+    const __m256i offsets = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+    return _mm256_add_epi8(sextets, _mm256_shuffle_epi8(offsets, range));
+}
+
+TARGET_AVX2 size_t base64_encode_avx2(const uint8_t* in, size_t len,
+                                      char* out) {
+    size_t i = 0;
+    // 12 bytes per 128-bit lane, 28 are loaded for every 24 encoded
+    for (; i + 28 <= len; i += 24) {
+        const __m256i bytes = _mm256_inserti128_si256(
+            _mm256_castsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 12)), 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i / 3 * 4),
+                            base64_encode_block_avx2(bytes));
+    }
+    return i;
+}
+
+// Which of `chars` are from `first` to `last` (none above 0x7f are)
+TARGET_SSSE3 __m128i in_range_ssse3(__m128i chars, char first, char last) {
+    return _mm_and_si128(_mm_cmpgt_epi8(chars, _mm_set1_epi8(first - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(last + 1), chars));
+}
+
+// Sextets of 16 base64 characters, and whether they all are (padding
+// included, which is left to the scalar version)
+TARGET_SSSE3 __m128i base64_sextets_ssse3(__m128i chars, int& valid_mask) {
+    const __m128i upper = in_range_ssse3(chars, 'A', 'Z');
+    const __m128i lower = in_range_ssse3(chars, 'a', 'z');
+    const __m128i digit = in_range_ssse3(chars, '0', '9');
+    const __m128i plus = _mm_cmpeq_epi8(chars, _mm_set1_epi8('+'));
+    const __m128i slash = _mm_cmpeq_epi8(chars, _mm_set1_epi8('/'));
+    valid_mask = _mm_movemask_epi8(_mm_or_si128(
+        _mm_or_si128(_mm_or_si128(upper, lower), _mm_or_si128(digit, plus)),
+        slash));
+
+    __m128i offset = _mm_and_si128(upper, _mm_set1_epi8(-'A'));
+    offset = _mm_or_si128(offset, _mm_and_si128(lower, _mm_set1_epi8(26 - 'a')));
+    offset = _mm_or_si128(offset, _mm_and_si128(digit, _mm_set1_epi8(52 - '0')));
+    offset = _mm_or_si128(offset, _mm_and_si128(plus, _mm_set1_epi8(62 - '+')));
+    offset = _mm_or_si128(offset, _mm_and_si128(slash, _mm_set1_epi8(63 - '/')));
+    return _mm_add_epi8(chars, offset);
+}
+
+TARGET_SSSE3 size_t base64_decode_ssse3(const char* in, size_t len,
+                                        uint8_t* out) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int valid;
+        const __m128i sextets = base64_sextets_ssse3(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)), valid);
+        if (valid != 0xffff) {
+            break;
+        }
+        // The 4 sextets of every 32-bit lane to its low 24 bits, then their
+        // bytes in order to the front
+        const __m128i pairs =
+            _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+        const __m128i groups = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        const __m128i bytes = _mm_shuffle_epi8(
+            groups,
+            _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        uint8_t* dest = out + i / 4 * 3;
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest), bytes);
+        const uint32_t rest = _mm_cvtsi128_si32(_mm_srli_si128(bytes, 8));
+        std::memcpy(dest + 8, &rest, 4);
+    }
+    return i;
+}
+
+TARGET_AVX2 __m256i in_range_avx2(__m256i chars, char first, char last) {
+    return _mm256_and_si256(
+        _mm256_cmpgt_epi8(chars, _mm256_set1_epi8(first - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8(last + 1), chars));
+}
+
+TARGET_AVX2 __m256i base64_sextets_avx2(__m256i chars, uint32_t& valid_mask) {
+    const __m256i upper = in_range_avx2(chars, 'A', 'Z');
+    const __m256i lower = in_range_avx2(chars, 'a', 'z');
+    const __m256i digit = in_range_avx2(chars, '0', '9');
+    const __m256i plus = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('+'));
+    const __m256i slash = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('/'));
+    valid_mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_or_si256(_mm256_or_si256(upper, lower),
+                        _mm256_or_si256(digit, plus)),
+        slash)));
+
+    __m256i offset = _mm256_and_si256(upper, _mm256_set1_epi8(-'A'));
+    offset = _mm256_or_si256(
+        offset, _mm256_and_si256(lower, _mm256_set1_epi8(26 - 'a')));
+    offset = _mm256_or_si256(
+        offset, _mm256_and_si256(digit, _mm256_set1_epi8(52 - '0')));
+    offset = _mm256_or_si256(
+        offset, _mm256_and_si256(plus, _mm256_set1_epi8(62 - '+')));
+    offset = _mm256_or_si256(
+        offset, _mm256_and_si256(slash, _mm256_set1_epi8(63 - '/')));
+    return _mm256_add_epi8(chars, offset);
+}
+
+TARGET_AVX2 size_t base64_decode_avx2(const char* in, size_t len,
+                                      uint8_t* out) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint32_t valid;
+        const __m256i sextets = base64_sextets_avx2(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i)),
+            valid);
+        if (valid != 0xffffffff) {
+            break;
+        }
+        const __m256i pairs =
+            _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+        const __m256i groups =
+            _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        // 12 bytes at the front of each 128-bit lane, then all 24 together
+        const __m256i lanes = _mm256_shuffle_epi8(
+            groups, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1,
+                                     -1, -1, -1, 2, 1, 0, 6, 5, 4, 10, 9, 8,
+                                     14, 13, 12, -1, -1, -1, -1));
+        const __m256i bytes = _mm256_permutevar8x32_epi32(
+            lanes, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+        uint8_t* dest = out + i / 4 * 3;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest),
+                         _mm256_castsi256_si128(bytes));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + 16),
+                         _mm256_extracti128_si256(bytes, 1));
+    }
+    return i;
+}
+
+#endif
+
+} // namespace
+
+SimdLevel simd_level() {
+    return active_simd_level().load(std::memory_order_relaxed);
+}
+
+SimdLevel set_simd_level(SimdLevel level) {
+    if (level > supported_simd_level()) {
+        level = supported_simd_level();
+    }
+    active_simd_level().store(level, std::memory_order_relaxed);
+    return level;
+}
+
+void hex_encode(const uint8_t* in, size_t len, char* out) {
+    size_t done = 0;
+#ifdef UTIL_X86_SIMD
+    const SimdLevel level = simd_level();
+    if (level >= SimdLevel::AVX2) {
+        done += hex_encode_avx2(in, len, out);
+    }
+    if (level >= SimdLevel::SSSE3) {
+        done += hex_encode_ssse3(in + done, len - done, out + 2 * done);
+    }
+#endif
+    hex_encode_scalar(in + done, len - done, out + 2 * done);
+}
+
+bool hex_decode(const char* in, size_t len, uint8_t* out,
+                bool lowercase_only) {
+    if (len % 2 != 0) {
+        return false;
+    }
+    size_t done = 0;
+#ifdef UTIL_X86_SIMD
+    const SimdLevel level = simd_level();
+    if (level >= SimdLevel::AVX2) {
+        done += hex_decode_avx2(in, len, out, lowercase_only);
+    }
+    if (level >= SimdLevel::SSSE3) {
+        done += hex_decode_ssse3(in + done, len - done, out + done / 2,
+                                 lowercase_only);
+    }
+#endif
+    return hex_decode_scalar(in + done, len - done, out + done / 2,
+                             lowercase_only);
+}
+
+size_t base64_encode(const uint8_t* in, size_t len, char* out) {
+    size_t done = 0;
+#ifdef UTIL_X86_SIMD
+    const SimdLevel level = simd_level();
+    if (level >= SimdLevel::AVX2) {
+        done += base64_encode_avx2(in, len, out);
+    }
+    if (level >= SimdLevel::SSSE3) {
+        done += base64_encode_ssse3(in + done, len - done, out + done / 3 * 4);
+    }
+#endif
+    return done / 3 * 4 +
+           base64_encode_scalar(in + done, len - done, out + done / 3 * 4);
+}
+
+size_t base64_decode(const char* in, size_t len, uint8_t* out) {
+    size_t done = 0;
+#ifdef UTIL_X86_SIMD
+    const SimdLevel level = simd_level();
+    if (level >= SimdLevel::AVX2) {
+        done += base64_decode_avx2(in, len, out);
+    }
+    if (level >= SimdLevel::SSSE3) {
+        done += base64_decode_ssse3(in + done, len - done, out + done / 4 * 3);
+    }
+#endif
+    return done / 4 * 3 +
+           base64_decode_scalar(in + done, len - done, out + done / 4 * 3);
+}
+
+// Keys are too short for vectors to pay off, a table lookup per character
+// is what matters
+
+void base32z_encode(const uint8_t* in, size_t len, char* out) {
+    uint32_t bits = 0;
+    int num_bits = 0;
+    for (size_t i = 0; i < len; ++i) {
+        bits = bits << 8 | in[i];
+        num_bits += 8;
+        while (num_bits >= 5) {
+            num_bits -= 5;
+            *out++ = ZBASE32_ALPHA[bits >> num_bits & 0x1f];
+        }
+    }
+    if (num_bits > 0) {
+        *out++ = ZBASE32_ALPHA[bits << (5 - num_bits) & 0x1f];
+    }
+}
+
+bool base32z_decode(const char* in, size_t len, uint8_t* out, size_t out_len) {
+    if (len != base32z_encoded_size(out_len)) {
+        return false;
+    }
+    uint32_t bits = 0;
+    int num_bits = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const int8_t value = ZBASE32_REVERSE[static_cast<uint8_t>(in[i])];
+        if (value < 0) {
+            return false;
+        }
+        bits = bits << 5 | value;
+        num_bits += 5;
+        if (num_bits >= 8) {
+            num_bits -= 8;
+            *out++ = static_cast<uint8_t>(bits >> num_bits);
+        }
+    }
+    return true;
+}
+
+} // namespace util
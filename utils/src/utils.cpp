@@ -1,6 +1,5 @@
 #include "utils.hpp"
 
-#include <boost/beast/core/detail/base64.hpp>
 #include <chrono>
 
 #ifndef _WIN32
@@ -27,65 +26,45 @@ constexpr uint8_t hexpair_to_byte(const char& hi, const char& lo) {
 }
 
 std::string hex_to_bytes(const std::string &hex) {
-  std::string result;
-  result.reserve(hex.size() / 2);
-  for (size_t i = 0, end = hex.size() & ~1; i < end; i += 2)
-    result.push_back(hexpair_to_byte(hex[i], hex[i+1]));
+  std::string result(hex.size() / 2, '\0');
+  auto out = reinterpret_cast<uint8_t*>(&result[0]);
+  if (!hex_decode(hex.data(), hex.size() & ~size_t(1), out)) {
+    // Anything but hex digits has always been read as 0
+    for (size_t i = 0; i < result.size(); ++i)
+      out[i] = hexpair_to_byte(hex[2 * i], hex[2 * i + 1]);
+  }
   return result;
 }
 
 std::string hex_to_base32z(const std::string& src) {
-    // decode to binary
-    std::vector<uint8_t> bin;
     // odd sized is invalid
     if (src.size() & 1)
         return "";
-    {
-        auto itr = src.begin();
-        while (itr != src.end()) {
-            const char hi = *itr;
-            ++itr;
-            const char lo = *itr;
-            ++itr;
-            bin.emplace_back(hexpair_to_byte(hi, lo));
-        }
-    }
-    // encode to base32z
-    char buf[64] = {0};
-    std::string result;
-    if (char const* dest = base32z_encode(bin, buf))
-        result = dest;
-
+    const std::string bin = hex_to_bytes(src);
+    std::string result(base32z_encoded_size(bin.size()), '\0');
+    base32z_encode(reinterpret_cast<const uint8_t*>(bin.data()), bin.size(),
+                   &result[0]);
     return result;
 }
 
-namespace base64 = boost::beast::detail::base64;
-
-// base64 stuff was copied from boost 1.66 sources
 std::string base64_decode(std::string const& data) {
-    std::string dest;
-    dest.resize(base64::decoded_size(data.size()));
-    auto const result = base64::decode(&dest[0], data.data(), data.size());
-    dest.resize(result.first);
-    return dest;
-}
-
-static std::string base64_encode(std::uint8_t const* data, std::size_t len) {
-    std::string dest;
-    dest.resize(base64::encoded_size(len));
-    dest.resize(base64::encode(&dest[0], data, len));
+    std::string dest(base64_decoded_size(data.size()), '\0');
+    dest.resize(base64_decode(data.data(), data.size(),
+                              reinterpret_cast<uint8_t*>(&dest[0])));
     return dest;
 }
 
 std::string base64_encode(std::string const& s) {
-    return base64_encode(reinterpret_cast<std::uint8_t const*>(s.data()),
-                         s.size());
+    std::string dest(base64_encoded_size(s.size()), '\0');
+    base64_encode(reinterpret_cast<const uint8_t*>(s.data()), s.size(),
+                  &dest[0]);
+    return dest;
 }
 
 bool validateTimestamp(uint64_t timestamp, uint64_t ttl) {
     const uint64_t cur_time = get_time_ms();
     // Timestamp must not be in the future (with some tolerance)
-    if (timestamp > cur_time + 10000)
+    if (timestamp > cur_time + TIMESTAMP_TOLERANCE_MS)
         return false;
 
     // Don't need to worry about overflow for several hundred million years
@@ -111,7 +90,7 @@ bool parseTimestamp(const std::string& timestampString, const uint64_t ttl,
 
 bool validateTTL(uint64_t ttlInt) {
     // Minimum time to live of 10 seconds, maximum of 4 days
-    return (ttlInt >= 10 * 1000 && ttlInt <= 96 * 60 * 60 * 1000);
+    return (ttlInt >= MIN_TTL_MS && ttlInt <= MAX_TTL_MS);
 }
 
 bool parseTTL(const std::string& ttlString, uint64_t& ttl) {